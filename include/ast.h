@@ -0,0 +1,126 @@
+#ifndef _AX_AST_H_
+#define _AX_AST_H_
+
+#include "intern.h"
+#include "lex.h"
+#include "types.h"
+
+#include <stdio.h>
+
+#define AST_NONE 0 // Index 0 is reserved for the root node, so it's never a child
+#define AST_MAX_DEPTH 1000 // Deepest tree accepted, the passes recurse on the nodes
+
+typedef u32 NodeIndex;
+
+typedef enum AstKind {
+	AST_ROOT, // lhs..rhs: Declarations range
+
+	// Declarations
+	AST_PACKAGE,   // lhs: Name
+	AST_USE,       // lhs: Path name, rhs: Alias name
+	AST_FN_DECL,   // lhs: Name, rhs: extra[Prototype, Body]
+	AST_GLOBAL,    // lhs..rhs: Bindings range
+	AST_PROTOTYPE, // lhs: extra[ParamsStart, ParamsEnd], rhs: Return type
+	AST_PARAM,     // lhs: Name, rhs: extra[Type, Default]
+
+	// Types
+	AST_TYPE_PRIM,  // op: TypeStorage
+	AST_TYPE_PTR,   // lhs: Element type
+	AST_TYPE_ARRAY, // lhs: Length, rhs: Element type
+	AST_TYPE_FN,    // lhs: Prototype
+
+	// Literals
+	AST_INT,    // lhs: Low bits, rhs: High bits, op: TypeStorage
+	AST_FLOAT,  // lhs: Low bits, rhs: High bits
+	AST_RUNE,   // lhs: Codepoint
+	AST_STRING, // lhs: Interned string
+	AST_BOOL,   // lhs: Value
+	AST_VOID,
+	AST_ARRAY, // lhs..rhs: Members range
+
+	// Expressions
+	AST_IDENT,   // lhs: Name
+	AST_BINARY,  // op: TokenKind, lhs: Left, rhs: Right
+	AST_UNARY,   // op: TokenKind, lhs: Operand
+	AST_CAST,    // lhs: Expr, rhs: Type
+	AST_CALL,    // lhs: Callee, rhs: extra[ArgsStart, ArgsEnd]
+	AST_BLOCK,   // lhs..rhs: Expressions range
+	AST_ASSIGN,  // op: TokenKind, lhs: Target, rhs: Value
+	AST_IF,      // lhs: Condition, rhs: extra[Then, Else]
+	AST_FOR,     // lhs: extra[InitStart, InitEnd, Condition, Post], rhs: Body
+	AST_BINDING, // lhs: Name, rhs: extra[Type, Init]
+
+	AST_KIND_COUNT,
+} AstKind;
+
+typedef enum AstFlag {
+	AST_FLAG_PUB = 0x01,
+	AST_FLAG_MUT = 0x02,
+} AstFlag;
+
+/*!
+ * AST node, all fields are indices (never pointers) so the whole tree can be
+ * moved, copied or written to disk as is. The meaning of lhs/rhs depends on the
+ * node kind (see AstKind). Lists of children are stored as contiguous ranges in
+ * the extra array.
+ */
+typedef struct AstNode {
+	u8 kind;
+	u8 op;
+	u16 flags;
+	u32 lhs;
+	u32 rhs;
+} AstNode;
+
+typedef struct Ast {
+	AstNode *nodes;
+	SourceLoc *locs;
+	u32 nodelen;
+	u32 nodesize;
+
+	u32 *extra;
+	u32 extralen;
+	u32 extrasize;
+
+	Interner names;         // Identifiers and string literals
+	SourceManager *sources; // Where the locations are decoded
+} Ast;
+
+void ast_init(Ast *ast, SourceManager *sources);
+void ast_free(Ast *ast);
+
+NodeIndex ast_add_node(Ast *ast, AstKind kind, SourceLoc loc, u32 lhs, u32 rhs);
+
+/*!
+ * Append values to the extra array
+ *
+ * @return Index in the extra array of the first value appended
+ */
+u32 ast_add_extra(Ast *ast, const u32 *values, usize count);
+
+/*!
+ * Append the nodes, extra data and names of a tree built separately, with
+ * their indices renumbered. The root node of src is not copied, so its
+ * declarations must be added to the root of ast by the caller.
+ *
+ * @return Offset to add to the node indices of src to get their index in ast
+ */
+NodeIndex ast_append(Ast *ast, const Ast *src);
+
+/*!
+ * Write the full name of a qualified identifier, its first segment expanded
+ * with the use declarations of the unit: with "use std::fmt" the name
+ * "fmt::println" is "std::fmt::println".
+ *
+ * @return false if the name isn't qualified or doesn't fit in the buffer
+ */
+bool ast_full_name(const Ast *ast, NodeIndex ident, char *buf, usize size);
+
+/*!
+ * Print tree starting at the provided node, used for debugging
+ */
+void ast_dump(const Ast *ast, NodeIndex node, FILE *out);
+
+const char *ast_kind2str(AstKind kind);
+
+#endif
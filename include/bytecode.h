@@ -0,0 +1,292 @@
+#ifndef _AX_BYTECODE_H_
+#define _AX_BYTECODE_H_
+
+#include "intern.h"
+#include "types.h"
+
+#include <stdio.h>
+
+/*!
+ * Register value, integers are always normalized to the width of their type
+ * (sign or zero extended) so comparisons and casts can use the full word.
+ */
+typedef union Value {
+	i64 i;
+	u64 u;
+	f64 d;
+	f32 f;
+} Value;
+
+// Machine types, bools are stored as u8, runes as u32 and strings as the u32
+// ID of the string in Program.strings
+typedef enum VmType {
+	VM_I8,
+	VM_I16,
+	VM_I32,
+	VM_I64,
+	VM_U8,
+	VM_U16,
+	VM_U32,
+	VM_U64,
+	VM_F32,
+	VM_F64,
+	VM_TYPE_COUNT,
+} VmType;
+
+#define VM_INT_OPS(X, T)                                                                 \
+	X(ADD_##T) X(SUB_##T) X(MUL_##T) X(DIV_##T) X(MOD_##T) X(NEG_##T) X(EQ_##T)          \
+	X(NE_##T) X(LT_##T) X(LE_##T) X(AND_##T) X(OR_##T) X(XOR_##T) X(SHL_##T)            \
+	X(SHR_##T) X(BNOT_##T)
+
+#define VM_FLOAT_OPS(X, T)                                                               \
+	X(ADD_##T) X(SUB_##T) X(MUL_##T) X(DIV_##T) X(MOD_##T) X(NEG_##T) X(EQ_##T)          \
+	X(NE_##T) X(LT_##T) X(LE_##T)
+
+/*!
+ * Instructions are 32-bit words: the opcode in the low byte followed by the
+ * operands A, B and C, or A and the 16-bit Bx, or the 24-bit Ax. Jump offsets
+ * are signed and relative to the next instruction.
+ *
+ *  MOV A B        R[A] = R[B]
+ *  LOADI A sBx    R[A] = sBx
+ *  LOADK A Bx     R[A] = K[Bx]
+ *  LOADKX A       R[A] = K[next word]
+ *  GGET A Bx      R[A] = G[Bx]
+ *  GSET A Bx      G[Bx] = R[A]
+ *  JMP sAx        pc += sAx
+ *  JMPF A sBx     if !R[A] then pc += sBx
+ *  JMPT A sBx     if R[A] then pc += sBx
+ *  CALL A Bx      R[A] = Functions[Bx](R[A], R[A + 1], ...)
+ *  CALLN A B C    Natives[B](R[A], ..., R[A + C - 1]), next word is the index
+ *                 of the argument types in Program.sigs, or of the first
+ *                 segment in Program.fmts for NATIVE_PRINTLN_FMT
+ *  RET A          return R[A]
+ *  RET0           return
+ *  NOT A B        R[A] = !R[B]
+ *  CAST A B C     R[A] = R[B] converted, C is from * VM_TYPE_COUNT + to
+ *  <OP>_<T> A B C R[A] = R[B] <OP> R[C] with machine type T, NEG and BNOT
+ *                 only use B. GT and GE are LT and LE with swapped operands.
+ */
+#define VM_OPCODES(X)                                                                    \
+	X(NOP)                                                                               \
+	X(MOV)                                                                               \
+	X(LOADI)                                                                             \
+	X(LOADK)                                                                             \
+	X(LOADKX)                                                                            \
+	X(GGET)                                                                              \
+	X(GSET)                                                                              \
+	X(JMP)                                                                               \
+	X(JMPF)                                                                              \
+	X(JMPT)                                                                              \
+	X(CALL)                                                                              \
+	X(CALLN)                                                                             \
+	X(RET)                                                                               \
+	X(RET0)                                                                              \
+	X(NOT)                                                                               \
+	X(CAST)                                                                              \
+	VM_INT_OPS(X, I8)                                                                    \
+	VM_INT_OPS(X, I16)                                                                   \
+	VM_INT_OPS(X, I32)                                                                   \
+	VM_INT_OPS(X, I64)                                                                   \
+	VM_INT_OPS(X, U8)                                                                    \
+	VM_INT_OPS(X, U16)                                                                   \
+	VM_INT_OPS(X, U32)                                                                   \
+	VM_INT_OPS(X, U64)                                                                   \
+	VM_FLOAT_OPS(X, F32)                                                                 \
+	VM_FLOAT_OPS(X, F64)
+
+#define VM_OPCODE_ENUM(name) OP_##name,
+
+typedef enum Opcode {
+	VM_OPCODES(VM_OPCODE_ENUM)
+	OP_COUNT,
+} Opcode;
+
+// Typed operations, in the order of VM_INT_OPS and VM_FLOAT_OPS
+typedef enum VmArith {
+	ARITH_ADD,
+	ARITH_SUB,
+	ARITH_MUL,
+	ARITH_DIV,
+	ARITH_MOD,
+	ARITH_NEG,
+	ARITH_EQ,
+	ARITH_NE,
+	ARITH_LT,
+	ARITH_LE,
+	ARITH_FLOAT_COUNT,
+	ARITH_AND = ARITH_FLOAT_COUNT,
+	ARITH_OR,
+	ARITH_XOR,
+	ARITH_SHL,
+	ARITH_SHR,
+	ARITH_BNOT,
+	ARITH_INT_COUNT,
+} VmArith;
+
+#define INS_ABC(op, a, b, c) ((u32)(op) | (u32)(a) << 8 | (u32)(b) << 16 | (u32)(c) << 24)
+#define INS_ABX(op, a, bx)   ((u32)(op) | (u32)(a) << 8 | (u32)(u16)(bx) << 16)
+#define INS_AX(op, ax)       ((u32)(op) | (u32)(ax) << 8)
+
+#define INS_OP(ins)  ((ins) & 0xFF)
+#define INS_A(ins)   ((ins) >> 8 & 0xFF)
+#define INS_B(ins)   ((ins) >> 16 & 0xFF)
+#define INS_C(ins)   ((ins) >> 24)
+#define INS_BX(ins)  ((ins) >> 16)
+#define INS_SBX(ins) ((i32)(ins) >> 16)
+#define INS_SAX(ins) ((i32)(ins) >> 8)
+
+#define VM_MAX_REGS 256
+#define VM_SBX_MIN  (-32768)
+#define VM_SBX_MAX  32767
+#define VM_SAX_MIN  (-8388608)
+#define VM_SAX_MAX  8388607
+
+typedef enum VmNative {
+	NATIVE_PRINTLN,     // std::fmt::println
+	NATIVE_PRINTLN_FMT, // std::fmt::println with a constant format, parsed already
+	NATIVE_COUNT,
+} VmNative;
+
+typedef enum VmFmtConv {
+	FMT_END, // Last segment, only text
+	FMT_BOOL,
+	FMT_STRING,
+	FMT_RUNE,
+	FMT_F32,
+	FMT_F64,
+	FMT_INT,  // Signed decimal
+	FMT_UINT, // Unsigned decimal
+	FMT_HEX,  // Lowercase hexadecimal of the bits of the storage
+	FMT_HEX_UPPER,
+} VmFmtConv;
+
+/*!
+ * Piece of a format string split at compile time: the text before a
+ * placeholder (escapes resolved) and the conversion of its argument. The
+ * last segment of a format ends the line.
+ */
+typedef struct VmFmtSegment {
+	u32 text;   // Interned in Program.strings
+	u8 conv;    // VmFmtConv
+	u8 storage; // TypeStorage of the argument
+} VmFmtSegment;
+
+typedef struct VmFunc {
+	u32 name;  // Interned in Program.strings
+	u32 start; // Offset of the first instruction
+	u32 len;
+	u8 params;
+	u16 regs; // Registers used, including parameters
+	u8 ret;   // TypeStorage
+} VmFunc;
+
+/*!
+ * Compiled program, all functions share the code, constants and strings.
+ */
+typedef struct Program {
+	u32 *code;
+	u32 codelen;
+	u32 codesize;
+
+	Value *consts;
+	u32 constlen;
+	u32 constsize;
+
+	Value *globals; // Initial values of mutable globals
+	u32 globallen;
+	u32 globalsize;
+
+	u8 *sigs; // TypeStorage of native call arguments, preceded by their count
+	u32 siglen;
+	u32 sigsize;
+
+	VmFmtSegment *fmts; // Segments of formats, each ended by FMT_END
+	u32 fmtlen;
+	u32 fmtsize;
+
+	VmFunc *funcs;
+	u32 funclen;
+	u32 funcsize;
+	u32 main; // Index of the entry function
+
+	Interner strings;
+} Program;
+
+void program_init(Program *prog);
+void program_free(Program *prog);
+
+u32 program_emit(Program *prog, u32 ins);
+u32 program_add_const(Program *prog, Value value);
+
+/*!
+ * Add native call argument types
+ *
+ * @return Index of the count in the sigs array
+ */
+u32 program_add_sig(Program *prog, const u8 *types, u8 count);
+
+/*!
+ * Add the segments of a format, the last one must be FMT_END
+ *
+ * @return Index of the first segment in the fmts array
+ */
+u32 program_add_fmt(Program *prog, const VmFmtSegment *segments, u32 count);
+
+/*!
+ * Conversion of a formatted value, spec is 'x', 'X' or '\0'
+ *
+ * @return FMT_END for a hexadecimal format of a non-integer
+ */
+VmFmtConv vm_fmt_conv(TypeStorage storage, char spec);
+
+/*!
+ * Return opcode of a typed operation
+ *
+ * @return OP_NOP if the operation isn't defined for the type
+ */
+Opcode vm_arith_op(VmType type, VmArith arith);
+
+/*!
+ * Integer bits sign or zero extended from the width of the type
+ */
+static inline Value vm_norm_int(u64 bits, VmType type) {
+	switch (type) {
+	case VM_I8:
+		return (Value) { .i = (i8)bits };
+	case VM_I16:
+		return (Value) { .i = (i16)bits };
+	case VM_I32:
+		return (Value) { .i = (i32)bits };
+	case VM_U8:
+		return (Value) { .u = (u8)bits };
+	case VM_U16:
+		return (Value) { .u = (u16)bits };
+	case VM_U32:
+		return (Value) { .u = (u32)bits };
+	default:
+		return (Value) { .u = bits };
+	}
+}
+
+/*!
+ * Convert a register value, floats saturate to the integer range and NaN is
+ * zero
+ */
+Value vm_cast(Value value, VmType from, VmType to);
+
+/*!
+ * Evaluate a typed operation like the interpreter does, used to fold constants
+ *
+ * @return false if it's an integer division by zero, a runtime error
+ */
+bool vm_arith(VmType type, VmArith arith, Value a, Value b, Value *out);
+
+/*!
+ * Print disassembled program, used for debugging
+ */
+void program_dump(const Program *prog, FILE *out);
+
+const char *vm_op2str(Opcode op);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef _AX_CACHE_H_
+#define _AX_CACHE_H_
+
+#include "intern.h"
+#include "lex.h"
+#include "types.h"
+
+#include <stdbool.h>
+
+typedef struct CacheEntry {
+	char *path; // NULL if the file isn't cached
+	u64 lastuse;
+
+	// Identity of the cached contents
+	i64 mtime; // Nanoseconds
+	u64 size;
+	u64 inode;
+	u64 hash;
+
+	u32 file; // In the source manager, 0 if the contents aren't loaded
+	usize len;
+
+	// Scanned on the first request needing them, up to the first lexer error.
+	// The last token is TK_EOF, or on errors tokens[tokenlen] is TK_ERROR.
+	bool lexed;
+	Token *tokens;
+	u32 tokenlen;
+	char *lexerror;
+
+	// Result of the last check, owned by the user of the cache
+	bool checked;
+	bool checkok;
+	char *diag;
+	usize diaglen;
+} CacheEntry;
+
+/*!
+ * Source files kept in memory per path, with their tokens and diagnostics.
+ *
+ * A cached file is stat()ed on every cache_get(): if its mtime, size and
+ * inode are unchanged the entry is used as is, otherwise the file is read
+ * again and its tokens and diagnostics are only dropped if the content hash
+ * changed.
+ */
+typedef struct SourceCache {
+	Interner paths;        // Path -> Index in entries
+	SourceManager sources; // Contents of the cached files
+	CacheEntry *entries;
+	u32 entrysize;
+	u32 cached;
+	u64 clock; // Entries used since it was last incremented aren't evicted
+
+	u64 hits;    // Unchanged files
+	u64 reloads; // Files read again with the same contents
+	u64 misses;  // Files read with new contents
+} SourceCache;
+
+void cache_init(SourceCache *cache);
+void cache_free(SourceCache *cache);
+
+/*!
+ * Get the entry of a file, reading it if it changed since it was cached
+ *
+ * @return NULL and sets errno if the file can't be read, it's dropped from the
+ *         cache
+ */
+CacheEntry *cache_get(SourceCache *cache, const char *path);
+
+/*!
+ * Scan the tokens of the entry, if they aren't already
+ */
+void cache_lex(SourceCache *cache, CacheEntry *e);
+
+/*!
+ * Parse the file, resolve its names and evaluate its constants, printing the
+ * diagnostics to stderr like the command line does
+ *
+ * @return false if there are errors
+ */
+bool cache_check(SourceCache *cache, CacheEntry *e);
+
+/*!
+ * Drop the least recently used files until max are left, except the ones
+ * used since the clock was last incremented
+ */
+void cache_evict(SourceCache *cache, u32 max);
+
+#endif
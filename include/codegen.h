@@ -0,0 +1,25 @@
+#ifndef _AX_CODEGEN_H_
+#define _AX_CODEGEN_H_
+
+#include "bytecode.h"
+#include "ir.h"
+#include "types.h"
+
+#include <stdbool.h>
+
+/*!
+ * Generate the bytecode of a function from its SSA form.
+ *
+ * Blocks are laid out in reverse postorder, each value gets one register for
+ * its whole live range with a linear scan, and phis become parallel moves at
+ * the end of the predecessors. Critical edges into blocks with phis are split
+ * first, so the function is modified.
+ *
+ * @param[in]  index Index of the function in prog->funcs
+ * @param[out] error Reason of the failure, a static string
+ *
+ * @return false if the function doesn't fit in the register or jump limits
+ */
+bool codegen_func(Program *prog, IrFunc *f, u32 index, const char **error);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _AX_COMPILE_H_
+#define _AX_COMPILE_H_
+
+#include "ast.h"
+#include "bytecode.h"
+#include "consteval.h"
+#include "opt.h"
+#include "typetab.h"
+#include "types.h"
+
+/*!
+ * Compile a resolved unit to bytecode.
+ *
+ * Functions are lowered to SSA form (see ir.h), optimized by the enabled
+ * passes and then translated to bytecode. Only primitive types are supported
+ * for now: arrays, pointers and function values are reported as errors.
+ * Untyped literals default to i32 and f64.
+ *
+ * @param[in] decls  From resolve_unit()
+ * @param[in] types  Types of the compilation, shared with consts
+ * @param[in] consts Evaluated constants of the unit, folded into the code
+ * @param[in] path   File name used in error messages
+ * @param[in] passes Optimizations run on each function, with their statistics
+ *
+ * @return false if the unit can't be compiled, errors are printed to stderr
+ */
+bool compile_unit(
+	Program *prog, const Ast *ast, const NodeIndex *decls, TypeTable *types,
+	const ConstEval *consts, const char *path, PassManager *passes
+);
+
+#endif
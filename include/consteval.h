@@ -0,0 +1,101 @@
+#ifndef _AX_CONSTEVAL_H_
+#define _AX_CONSTEVAL_H_
+
+#include "ast.h"
+#include "typetab.h"
+#include "types.h"
+
+#include <stdio.h>
+
+/*!
+ * Compile-time value. Integers (including runes and bools) are stored as sign
+ * and magnitude so untyped constants cover both the i64 and u64 ranges.
+ */
+typedef struct ConstValue {
+	u8 storage; // TypeStorage, TYPE_ARRAY for array literals
+	bool neg;
+	union {
+		u64 mag;
+		f64 fval;
+		u32 str; // Interned string
+		struct {
+			u32 start; // Index of the first element
+			u32 count;
+		} array;
+	};
+} ConstValue;
+
+/*!
+ * Constant expression evaluator.
+ *
+ * Every binding whose value is known at compile time is evaluated once, the
+ * constants it uses are evaluated first on demand, so globals can be declared
+ * in any order. Operations on constants are evaluated wherever they are, also
+ * in function bodies, and the backends use their values.
+ *
+ * The same rules apply to every constant operation:
+ * - Arithmetic is checked against the range of its type, overflows and
+ *   non-finite floats are compile errors; wrapping only happens with "as".
+ *   Operations on runtime values wrap instead, in the VM, the IR folding and
+ *   the C backend alike.
+ * - An untyped operand takes the type of the other operand, an untyped integer
+ *   next to an untyped float is a float. Any other operands of different types
+ *   are errors.
+ */
+typedef struct ConstEval {
+	const Ast *ast;
+	const NodeIndex *decls; // From resolve_unit()
+	TypeTable *types;       // Types of the compilation, shared with the backends
+	const char *path;
+	bool ok;
+
+	u32 *slots; // Binding or operation node -> Index in values or evaluation mark
+	u32 depth;  // Nesting of the expression being evaluated
+
+	ConstValue *values;
+	u32 valuelen;
+	u32 valuesize;
+
+	ConstValue *elems; // Elements of constant arrays
+	u32 elemlen;
+	u32 elemsize;
+} ConstEval;
+
+void consteval_init(
+	ConstEval *ev, const Ast *ast, const NodeIndex *decls, TypeTable *types,
+	const char *path
+);
+void consteval_free(ConstEval *ev);
+
+/*!
+ * Evaluate all global initializers, which must be constant, and every
+ * immutable local binding with a constant initializer.
+ *
+ * @return false if an error was found, errors are printed to stderr
+ */
+bool consteval_unit(ConstEval *ev);
+
+/*!
+ * Value of an evaluated binding, or of an operation on constants
+ *
+ * @return NULL if the node isn't a constant
+ */
+const ConstValue *consteval_get(const ConstEval *ev, NodeIndex binding);
+
+static inline const ConstValue *consteval_elems(
+	const ConstEval *ev, const ConstValue *v
+) {
+	return ev->elems + v->array.start;
+}
+
+/*!
+ * Whether an integer value is in the range of an integer type
+ */
+bool const_fits(const ConstValue *value, TypeStorage storage);
+
+/*!
+ * Print value as a literal, used for debugging
+ */
+void const_print(const ConstEval *ev, const ConstValue *value, FILE *out);
+
+#endif
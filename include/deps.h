@@ -0,0 +1,65 @@
+#ifndef _AX_DEPS_H_
+#define _AX_DEPS_H_
+
+#include "intern.h"
+#include "source.h"
+#include "types.h"
+
+#include <stdio.h>
+
+typedef struct DepsNode {
+	u32 name;   // Interned package name
+	char *path; // First file declaring the package, NULL if external
+
+	u32 *uses; // Node indices of the packages used
+	u32 uselen;
+	u32 usesize;
+} DepsNode;
+
+/*!
+ * Package dependency graph built from the PackageDecl/UseDecl prologue of
+ * each file. Files without a PackageDecl are a package named by their path,
+ * which no UseDecl can name, and used packages without any file are external.
+ */
+typedef struct DepsGraph {
+	Interner names;
+
+	DepsNode *nodes;
+	u32 nodelen;
+	u32 nodesize;
+
+	u32 *lookup; // Name ID -> Node index + 1
+	u32 lookupsize;
+} DepsGraph;
+
+void deps_init(DepsGraph *graph);
+void deps_free(DepsGraph *graph);
+
+/*!
+ * Lex the package and use declarations at the start of the file and add them
+ * to the graph, the rest of the file is never read.
+ *
+ * @param[in] path Path of the source file
+ *
+ * @return false if the file can't be opened or the prologue is malformed
+ */
+bool deps_scan(DepsGraph *graph, SourceManager *sources, const char *path);
+
+/*!
+ * Same as deps_scan() for a file already in the source manager, under the path
+ * it was registered with
+ */
+bool deps_scan_source(DepsGraph *graph, SourceManager *sources, u32 file);
+
+/*!
+ * Sort the packages so each one comes after all packages it uses
+ *
+ * @param[out] order Node indices in build order, must hold nodelen entries
+ *
+ * @return false if there is a cycle, which is reported to STDERR
+ */
+bool deps_sort(const DepsGraph *graph, u32 *order);
+
+void deps_print(const DepsGraph *graph, const u32 *order, FILE *out);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _AX_EMITC_H_
+#define _AX_EMITC_H_
+
+#include "ast.h"
+#include "consteval.h"
+#include "typetab.h"
+#include "types.h"
+
+#include <stdio.h>
+
+/*!
+ * Translate a resolved unit to a C17 translation unit.
+ *
+ * Fixed-width types map to <stdint.h> types, arrays to structs wrapping a C
+ * array (or a pointer and a length when they have no length, like []rune
+ * strings) so they can be copied, and function types to function pointers.
+ * Integer arithmetic wraps like in the bytecode VM. Calls to std::fmt::println
+ * are expanded to printf() calls, their format strings are checked here.
+ *
+ * @param[in] decls  From resolve_unit()
+ * @param[in] types  Types of the compilation, shared with consts
+ * @param[in] consts Evaluated constants, used for initializers and folded operations
+ * @param[in] path   File name used in error messages
+ *
+ * @return false if the unit can't be translated, nothing is written then and
+ *         errors are printed to stderr
+ */
+bool emitc_unit(
+	const Ast *ast, const NodeIndex *decls, TypeTable *types, const ConstEval *consts,
+	const char *path, FILE *out
+);
+
+#endif
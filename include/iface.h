@@ -0,0 +1,118 @@
+#ifndef _AX_IFACE_H_
+#define _AX_IFACE_H_
+
+#include "ast.h"
+#include "typetab.h"
+#include "types.h"
+
+#include <stdbool.h>
+
+#define IFACE_MAGIC   0x49505841 // "AXPI"
+#define IFACE_VERSION 1
+
+typedef enum IfaceKind {
+	IFACE_FN,    // Function declaration
+	IFACE_CONST, // Constant global
+	IFACE_MUT,   // Mutable global
+} IfaceKind;
+
+typedef struct IfaceHeader {
+	u32 magic;
+	u32 version;
+	u64 hash;    // FNV-1a of the sources, in the order they were given
+	u32 package; // Pool offset of the full package name
+	u32 typecount;
+	u32 paramcount;
+	u32 declcount;
+	u32 poolsize;
+	u32 reserved;
+} IfaceHeader;
+
+/*!
+ * Entry of the type table, a copy of the TypeEntry of the same ID
+ */
+typedef struct IfaceType {
+	u8 storage; // TypeStorage
+	u8 reserved[3];
+	u32 elem;
+	u32 data;
+	u32 count;
+} IfaceType;
+
+typedef struct IfaceDecl {
+	u32 name; // Pool offset
+	u32 type; // Index in the type table, TYPE_ID_NONE if it needs type checking
+	u8 kind;  // IfaceKind
+	u8 reserved[3];
+} IfaceDecl;
+
+/*!
+ * Public interface of a package, mapped read-only from its file.
+ *
+ * The file is the header, the type table hash-consed while building it (the
+ * IDs are the ones of a TypeTable), the parameter types of its functions, the
+ * pub declarations sorted by name and a pool of NUL-terminated strings, every
+ * section at an offset multiple of 8. All integers are in the host byte
+ * order, so using a package only maps its interface and binary searches it,
+ * its sources are never read.
+ */
+typedef struct Iface {
+	void *map;
+	usize size;
+
+	const IfaceHeader *header;
+	const IfaceType *types;
+	const u32 *params;
+	const IfaceDecl *decls;
+	const char *pool;
+} Iface;
+
+/*!
+ * Map an interface file
+ *
+ * @return false if it doesn't exist or isn't a valid interface of this version
+ */
+bool iface_open(Iface *iface, const char *path);
+void iface_close(Iface *iface);
+
+static inline const char *iface_str(const Iface *iface, u32 offset) {
+	return iface->pool + offset;
+}
+
+/*!
+ * Find a pub declaration of the package
+ *
+ * @return NULL if there is none with this name
+ */
+const IfaceDecl *iface_find(const Iface *iface, const char *name);
+
+/*!
+ * Write the interface of the package made of the files to path.
+ *
+ * The files must all declare the same package, or have no PackageDecl and the
+ * same name. Nothing is parsed nor written if the interface at path was built
+ * from files with the same content hash.
+ *
+ * @param[in] types Types of the compilation, all of them are written
+ *
+ * @return false if a file can't be read or parsed, or the interface couldn't
+ *         be written
+ */
+bool iface_build(
+	const char *path, const char *const *files, u32 count, TypeTable *types
+);
+
+/*!
+ * Check the qualified names of a resolved unit against the interfaces of the
+ * packages it uses, found in dir as the package name with "::" replaced by
+ * "." and the extension .axi. Packages without an interface are external and
+ * their names aren't checked.
+ *
+ * @param[in] path File name used in error messages
+ *
+ * @return false if a name isn't a pub declaration of its package, errors are
+ *         printed to stderr
+ */
+bool iface_check_uses(const Ast *ast, const char *path, const char *dir);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef _AX_INDEX_H_
+#define _AX_INDEX_H_
+
+#include "types.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define INDEX_MAGIC   0x58495841 // "AXIX"
+#define INDEX_VERSION 1
+
+typedef enum IndexKind {
+	INDEX_FN,    // Function declaration
+	INDEX_CONST, // Constant global
+	INDEX_MUT,   // Mutable global
+	INDEX_USE,   // Package used, named by its full path
+} IndexKind;
+
+typedef struct IndexHeader {
+	u32 magic;
+	u32 version;
+	u32 filecount;
+	u32 entrycount;
+	u32 poolsize;
+	u32 reserved;
+} IndexHeader;
+
+typedef struct IndexFile {
+	u32 path;    // Pool offset
+	u32 package; // Pool offset, the file name stem if it has no PackageDecl
+	i64 mtime;   // Nanoseconds
+	u64 size;
+} IndexFile;
+
+typedef struct IndexEntry {
+	u32 name; // Pool offset
+	u32 file; // Index in the file table
+	u32 lineno;
+	u32 colno;
+	u8 kind;  // IndexKind
+	u8 flags; // AST_FLAG_PUB
+	u16 reserved;
+} IndexEntry;
+
+/*!
+ * Project-wide index of the top-level declarations and use declarations,
+ * mapped read-only from its file.
+ *
+ * The file is the header, the file table, the entries sorted by name (then
+ * file and position) and a pool of NUL-terminated strings, every section at
+ * an offset multiple of 8. All integers are in the host byte order, and the
+ * file is only ever read through the mapping, so a lookup is a binary search
+ * touching a few pages.
+ */
+typedef struct Index {
+	void *map;
+	usize size;
+
+	const IndexHeader *header;
+	const IndexFile *files;
+	const IndexEntry *entries;
+	const char *pool;
+} Index;
+
+/*!
+ * Map an index file
+ *
+ * @return false if it doesn't exist or isn't a valid index of this version
+ */
+bool index_open(Index *index, const char *path);
+void index_close(Index *index);
+
+static inline const char *index_str(const Index *index, u32 offset) {
+	return index->pool + offset;
+}
+
+/*!
+ * Find the entries named name
+ *
+ * @param[out] count Number of entries, they follow the one returned
+ *
+ * @return The first entry, NULL if there is none
+ */
+const IndexEntry *index_find(const Index *index, const char *name, u32 *count);
+
+/*!
+ * Print the entries matching a name, one per line with their location. A
+ * qualified name pkg::name also matches the declarations of name in the files
+ * of package pkg.
+ *
+ * @return false if nothing matches
+ */
+bool index_lookup(const Index *index, const char *name, FILE *out);
+
+/*!
+ * Write the index of the files to path, replacing it atomically.
+ *
+ * Files listed in the previous index at path with the same mtime and size
+ * keep their entries without being read, the others are read in batches and
+ * parsed. Files with syntax errors are reported and left out of the index.
+ *
+ * @return false if a file couldn't be indexed or the index couldn't be written
+ */
+bool index_build(const char *path, const char *const *files, u32 count);
+
+#endif
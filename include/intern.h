@@ -0,0 +1,51 @@
+#ifndef _AX_INTERN_H_
+#define _AX_INTERN_H_
+
+#include "types.h"
+
+#define INTERN_NONE 0 // ID reserved for "no name"
+
+/*!
+ * String interning table.
+ *
+ * Every distinct byte string is stored once in a contiguous pool and is
+ * referenced by a 32-bit ID, so names can be compared with a single integer
+ * compare. Strings may contain NUL bytes; they are always NUL-terminated in the
+ * pool for convenience.
+ */
+typedef struct Interner {
+	char *pool;
+	usize poollen;
+	usize poolsize;
+
+	u32 *offsets; // ID -> Offset in pool
+	u32 *lens;    // ID -> String length
+	u32 count;
+	u32 capacity;
+
+	u32 *table; // Open addressed hash table of IDs
+	u32 tablesize;
+} Interner;
+
+void intern_init(Interner *in);
+void intern_free(Interner *in);
+
+/*!
+ * Intern a string and return its ID
+ *
+ * @param[in] str String to be interned, doesn't need to be NUL-terminated
+ * @param[in] len Length of the string in bytes
+ *
+ * @return Non-zero ID of the interned string
+ */
+u32 intern(Interner *in, const char *str, usize len);
+
+/*!
+ * Return interned string from an ID
+ *
+ * NOTE: The returned pointer is invalidated by the next call to intern()
+ */
+const char *intern_str(const Interner *in, u32 id);
+usize intern_len(const Interner *in, u32 id);
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef _AX_IR_H_
+#define _AX_IR_H_
+
+#include "bytecode.h"
+#include "types.h"
+
+#include <stdio.h>
+
+#define IR_NONE     0          // Instruction 0 is reserved, so it's never a value
+#define IR_NO_BLOCK UINT32_MAX // Unused successor
+#define IR_VOID     VM_TYPE_COUNT
+
+typedef u32 IrRef;
+
+/*!
+ * Operations, values are the index of the instruction defining them. Ranges
+ * (a..b) are indices in the extra array.
+ */
+typedef enum IrOp {
+	IR_NOP,   // Removed instruction
+	IR_CONST, // a: Index in consts
+	IR_PARAM, // a: Parameter index, always in the entry block
+	IR_COPY,  // a: Value, replaced by it when the uses are rewritten
+	IR_PHI,   // a..b: One value per predecessor, in the order of preds
+	IR_ARITH, // aux: VmArith, a: Left, b: Right (unused by NEG and BNOT)
+	IR_NOT,   // a: Operand
+	IR_CAST,  // aux: From * VM_TYPE_COUNT + To, a: Operand
+	IR_GGET,  // a: Global index
+	IR_GSET,  // a: Global index, b: Value
+	IR_CALL,  // aux: Function index, a..b: Arguments
+	IR_CALLN, // aux: VmNative, a..b: Signature index then arguments
+
+	// Terminators, the last instruction of every block
+	IR_JMP, // Jump to succ[0]
+	IR_BR,  // a: Condition, jump to succ[0] if true, otherwise to succ[1]
+	IR_RET, // a: Value, IR_NONE in void functions
+
+	IR_OP_COUNT,
+} IrOp;
+
+/*!
+ * Instruction, its type is the machine type of the operation: comparisons
+ * have the type of their operands and produce a VM_U8, instructions without a
+ * value are IR_VOID.
+ */
+typedef struct IrInst {
+	u8 op;
+	u8 type;
+	u16 aux;
+	u32 block; // Block containing the instruction
+	u32 a;
+	u32 b;
+} IrInst;
+
+typedef struct IrBlock {
+	IrRef *insts; // Phis first, the terminator last
+	u32 len;
+	u32 size;
+
+	u32 *preds;
+	u32 predlen;
+	u32 predsize;
+	u32 succ[2];
+
+	// Computed by ir_dominators()
+	u32 idom;  // IR_NO_BLOCK for the entry and unreachable blocks
+	u32 order; // Index in the reverse postorder, UINT32_MAX if unreachable
+} IrBlock;
+
+/*!
+ * Function in SSA form, lowered from the AST and optimized before bytecode is
+ * generated. Block 0 is the entry. Everything is stored in arrays and refers
+ * to other parts by index, like the AST.
+ */
+typedef struct IrFunc {
+	IrInst *insts;
+	u32 instlen;
+	u32 instsize;
+
+	u32 *extra;
+	u32 extralen;
+	u32 extrasize;
+
+	Value *consts;
+	u32 constlen;
+	u32 constsize;
+
+	IrBlock *blocks;
+	u32 blocklen;
+	u32 blocksize;
+
+	u32 *rpo; // Reachable blocks in reverse postorder, from ir_dominators()
+	u32 rpolen;
+
+	u32 params;
+	u8 ret; // VmType or IR_VOID
+} IrFunc;
+
+void ir_init(IrFunc *f);
+void ir_free(IrFunc *f);
+
+u32 ir_add_block(IrFunc *f);
+
+/*!
+ * Append an instruction to a block, which must not be terminated yet
+ */
+IrRef ir_add(IrFunc *f, u32 block, IrOp op, u8 type, u16 aux, u32 a, u32 b);
+
+/*!
+ * Insert an instruction before the terminator of a block
+ */
+IrRef ir_insert(IrFunc *f, u32 block, IrOp op, u8 type, u16 aux, u32 a, u32 b);
+
+IrRef ir_const(IrFunc *f, u32 block, VmType type, Value value);
+
+/*!
+ * Replace an instruction with a constant, in place
+ */
+void ir_set_const(IrFunc *f, IrRef ref, VmType type, Value value);
+
+/*!
+ * @return Index in the extra array of the first value appended
+ */
+u32 ir_add_extra(IrFunc *f, const u32 *values, u32 count);
+
+/*!
+ * Add a phi at the start of a block, with one operand per predecessor
+ */
+IrRef ir_phi(IrFunc *f, u32 block, VmType type, const IrRef *values);
+
+void ir_jump(IrFunc *f, u32 block, u32 target);
+void ir_branch(IrFunc *f, u32 block, IrRef cond, u32 then, u32 other);
+void ir_ret(IrFunc *f, u32 block, IrRef value);
+
+static inline bool ir_terminated(const IrFunc *f, u32 block) {
+	const IrBlock *b = &f->blocks[block];
+	return b->len > 0 && f->insts[b->insts[b->len - 1]].op >= IR_JMP;
+}
+
+static inline const Value *ir_const_value(const IrFunc *f, IrRef ref) {
+	return &f->consts[f->insts[ref].a];
+}
+
+/*!
+ * Whether an instruction can be removed or moved when its value is unused:
+ * no side effect and no possible runtime error.
+ */
+bool ir_is_pure(const IrFunc *f, IrRef ref);
+
+/*!
+ * Value operands of an instruction, they're contiguous in the instruction or
+ * in the extra array
+ *
+ * @return Pointer to the first operand, only valid until the function grows
+ */
+u32 *ir_operands(IrFunc *f, IrRef ref, u32 *count);
+
+/*!
+ * Replace the operands defined by IR_COPY with their source and remove the
+ * copies
+ */
+void ir_resolve_copies(IrFunc *f);
+
+/*!
+ * Remove an instruction from its block, it becomes an IR_NOP
+ */
+void ir_remove(IrFunc *f, IrRef ref);
+
+/*!
+ * Move an instruction before the terminator of another block
+ */
+void ir_move(IrFunc *f, IrRef ref, u32 block);
+
+/*!
+ * Remove the edge from pred to block, with the operands of its phis
+ */
+void ir_remove_edge(IrFunc *f, u32 pred, u32 block);
+
+/*!
+ * Insert an empty block on the edge from pred to block
+ *
+ * @return The new block, it takes the place of pred in the phis of block
+ */
+u32 ir_split_edge(IrFunc *f, u32 pred, u32 block);
+
+/*!
+ * Number the reachable blocks in reverse postorder and compute their
+ * immediate dominators. Unreachable blocks are emptied and disconnected.
+ */
+void ir_dominators(IrFunc *f);
+
+/*!
+ * Whether block a dominates block b, from the last ir_dominators()
+ */
+bool ir_dominates(const IrFunc *f, u32 a, u32 b);
+
+/*!
+ * Print the function, used for debugging
+ */
+void ir_dump(const IrFunc *f, const char *name, FILE *out);
+
+const char *ir_op2str(IrOp op);
+
+// Phi read in a block before it was sealed
+typedef struct IrPending {
+	u32 block;
+	u32 var;
+	IrRef phi;
+} IrPending;
+
+/*!
+ * SSA construction for variables assigned in several blocks, with the
+ * algorithm of Braun et al. "Simple and Efficient Construction of Static
+ * Single Assignment Form": the definition of a variable is looked up through
+ * the predecessors when read, phis are only added where definitions merge.
+ *
+ * A block is sealed once all its predecessors are known, reads in unsealed
+ * blocks (loop headers) add incomplete phis completed when they're sealed.
+ */
+typedef struct IrBuilder {
+	IrFunc *func;
+
+	u64 *keys; // Variable << 32 | Block, 0 if the slot is empty
+	IrRef *defs;
+	u32 keylen;
+	u32 keysize;
+
+	bool *sealed;
+	u32 sealedsize;
+
+	IrPending *pending;
+	u32 pendinglen;
+	u32 pendingsize;
+} IrBuilder;
+
+void ir_builder_init(IrBuilder *b, IrFunc *f);
+void ir_builder_free(IrBuilder *b);
+
+/*!
+ * @param[in] var Variable ID, never 0
+ */
+void ir_write_var(IrBuilder *b, u32 var, u32 block, IrRef value);
+
+/*!
+ * @param[in] type Type of the variable, unassigned variables read as zero
+ */
+IrRef ir_read_var(IrBuilder *b, u32 var, u32 block, VmType type);
+
+void ir_seal(IrBuilder *b, u32 block);
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _AX_JIT_H_
+#define _AX_JIT_H_
+
+#include "bytecode.h"
+
+#include <stdbool.h>
+
+#define JIT_THRESHOLD 1000 // Default calls or loop iterations before compiling
+
+/*!
+ * Call back into the VM from compiled code, for what the templates don't do
+ * themselves. pc is the word after the opcode of the instruction, base the
+ * registers of the function.
+ *
+ * @return 0, or 1 after printing a runtime error
+ */
+typedef int (*JitHook)(void *vm, Value *base, const u32 *pc);
+
+typedef struct JitHooks {
+	JitHook call;     // CALL
+	JitHook native;   // CALLN
+	JitHook div_zero; // Integer division by zero, only reports it
+} JitHooks;
+
+typedef struct JitFunc {
+	u8 *code;     // Machine code mapped read-only and executable, NULL if none
+	usize size;   // Bytes mapped
+	u32 *entries; // Offset in code of each instruction
+	u32 count;    // Calls and loop iterations until the threshold
+	bool failed;  // Not compiled, it stays interpreted
+} JitFunc;
+
+/*!
+ * Template JIT compiling hot bytecode functions to x86-64.
+ *
+ * Each instruction is translated on its own by a template working on the
+ * register window in memory, so compiled and interpreted functions call each
+ * other freely and a loop can switch to compiled code at its header. Results
+ * are always stored, but the last registers used stay cached in host
+ * registers until a jump target or a call. The code is written before its
+ * pages are made executable, they are never writable and executable at once.
+ *
+ * Only x86-64 Linux is supported, elsewhere nothing is compiled.
+ */
+typedef struct Jit {
+	const Program *prog;
+	const JitHooks *hooks;
+	void *vm;        // Passed to the hooks
+	Value *globals;  // Read and written by GGET and GSET
+	u32 threshold;
+
+	JitFunc *funcs; // One per function of the program
+	u32 compiled;
+	usize codesize;
+} Jit;
+
+void jit_init(
+	Jit *jit, const Program *prog, Value *globals, u32 threshold, const JitHooks *hooks,
+	void *vm
+);
+void jit_free(Jit *jit);
+
+/*!
+ * Compile a function, once
+ *
+ * @return false if an instruction isn't supported or the code couldn't be
+ *         mapped, it's interpreted then
+ */
+bool jit_compile(Jit *jit, u32 func);
+
+/*!
+ * Count a call or a loop iteration of a function, it's compiled when the
+ * count reaches the threshold
+ *
+ * @return true if the function is compiled
+ */
+static inline bool jit_tick(Jit *jit, u32 func) {
+	JitFunc *f = &jit->funcs[func];
+	if (f->code != NULL) {
+		return true;
+	} else if (f->failed) {
+		return false;
+	}
+
+	f->count += 1;
+	return f->count >= jit->threshold && jit_compile(jit, func);
+}
+
+/*!
+ * Run a compiled function until it returns, its result is stored in base[0]
+ * like with RET
+ *
+ * @param[in] pc Where to start, the first instruction if NULL, otherwise it
+ *               must be the target of a jump
+ *
+ * @return 0, or 1 on a runtime error
+ */
+int jit_run(const Jit *jit, u32 func, Value *base, const u32 *pc);
+
+#endif
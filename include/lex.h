@@ -1,8 +1,11 @@
 #ifndef _AX_LEX_H_
 #define _AX_LEX_H_
 
+#include "source.h"
 #include "types.h"
+#include "util.h"
 
+#include <setjmp.h>
 #include <stdio.h>
 
 typedef enum TokenKind {
@@ -10,6 +13,7 @@ typedef enum TokenKind {
 	TK_AS,
 	TK_BOOL,
 	TK_CONST,
+	TK_ELSE,
 	TK_F32,
 	TK_F64,
 	TK_FALSE,
@@ -86,21 +90,33 @@ typedef enum TokenKind {
 	// Misc.
 	TK_NONE,
 	TK_EOF,
+	TK_ERROR, // Only returned when LexState.recover is set
 } TokenKind;
 
-typedef struct Location {
-	int lineno;
-	int colno;
-} Location;
+typedef enum TokenFlag {
+	TOK_DECODED = 0x01, // The value of the literal replaced its source text
+	TOK_ESCAPES = 0x02, // String literal with escape sequences
+	TOK_OWNED = 0x04,   // The decoded string was allocated, freed by lex_release()
+} TokenFlag;
 
+/*!
+ * Scanned token.
+ *
+ * Literals are only validated while scanning: until one of the tok_*_value()
+ * functions decodes them they hold their source text, so the file must stay
+ * loaded. Runes are small enough to be decoded right away.
+ */
 typedef struct Token {
 	TokenKind kind;
-	Location loc;
-	TypeStorage storage;
+	SourceLoc loc;
+	u8 storage; // TypeStorage of literals, TYPE_INT for every integer
+	u8 flags;   // TokenFlag
+	u32 len;    // Bytes of a literal in the source, with its quotes
 
 	// Data
 	union {
-		char *ident; // Identifier name
+		char *ident;      // Identifier name
+		const char *text; // Source of a literal that isn't decoded
 		i64 ival;
 		u64 uval;
 		f64 fval;
@@ -108,25 +124,116 @@ typedef struct Token {
 
 		struct {
 			usize len;
-			char *ptr;
+			const char *ptr; // Not NUL-terminated
 		} str;
 	};
 } Token;
 
+// Maximum number of tokens that can be peeked ahead, must be a power of two
+#define LEX_LOOKAHEAD 8
+
 typedef struct LexState {
 	FILE *file;
-	Location loc;
+	SourceManager *sources;
+	const char *data; // Contents of the file, where literals point to
+	SourceLoc base; // Location of the start of the file
+	usize offset;   // Bytes read from the file
+	usize here;     // Offset of the last character read, where errors are
+	Allocator alloc;
+
+	// By default errors are printed and terminate the process, when recover is
+	// set lex_scan() returns TK_ERROR and the message is stored in error.
+	bool recover;
+	jmp_buf *env;
+	char error[128];
 
 	u32 stack[2];
 	usize buflen;
 	usize bufsize;
 	char *buf;
+
+	// Ring buffer of scanned tokens used by lex_peek() and lex_advance()
+	Token ring[LEX_LOOKAHEAD];
+	u32 ringhead;
+	u32 ringlen;
 } LexState;
 
-void lex_init(LexState *lex, FILE *file);
+/*!
+ * Initialize the lexer state to scan a file of the source manager, it must
+ * stay loaded until lex_close()
+ *
+ * @param[in] alloc Allocator used for the lexer buffers and the token data,
+ *                  if NULL the default allocator is used
+ *
+ * @return false if the lexer buffers could not be allocated
+ */
+bool lex_init(LexState *lex, SourceManager *sources, u32 file, const Allocator *alloc);
 void lex_close(LexState *lex);
 
 TokenKind lex_scan(LexState *lex, Token *tok);
 const char *lex_tok2str(TokenKind tok);
 
+/*!
+ * Scan the rest of the file into an array, the last token is TK_EOF, or
+ * TK_ERROR if recover is set and a token couldn't be scanned
+ *
+ * @param[out] len Number of tokens, including the last one
+ *
+ * @return Tokens allocated with xcalloc(tag), their data with the lexer's
+ *         allocator
+ */
+Token *lex_scan_all(LexState *lex, MemTag tag, u32 *len);
+
+/*!
+ * Return the n-th token after the current one, without consuming it
+ *
+ * Tokens are scanned on demand and kept in a fixed size ring buffer, so peeking
+ * never scans the same token twice. The identifier of a peeked token may be
+ * taken by setting its pointer to NULL, otherwise it's freed when the token is
+ * consumed.
+ *
+ * @param[in] n Distance from the current token, must be less than LEX_LOOKAHEAD
+ */
+Token *lex_peek(LexState *lex, usize n);
+
+/*!
+ * Consume the current token
+ */
+void lex_advance(LexState *lex);
+
+/*!
+ * Free the identifier or string owned by the token
+ */
+void lex_release(LexState *lex, Token *tok);
+
+/*!
+ * Decode an integer literal, the value is cached in the token
+ *
+ * @return false if it doesn't fit in 64 bits
+ */
+bool tok_int_value(Token *tok, u64 *out);
+
+/*!
+ * Decode a float literal, the value is cached in the token
+ *
+ * @param[in] alloc Allocator of the lexer which scanned the token
+ *
+ * @return false with errno set to ERANGE if it overflows f64 (values too small
+ *         round to zero), or ENOMEM if its digits couldn't be copied
+ */
+bool tok_float_value(Token *tok, const Allocator *alloc, f64 *out);
+
+/*!
+ * Decode a string literal, the value is cached in the token
+ *
+ * Strings without escape sequences point into the source, the others are
+ * allocated with the allocator of the lexer which scanned the token and owned
+ * by the token.
+ *
+ * @param[out] len Bytes of the string
+ *
+ * @return The string, not NUL-terminated, or NULL if it couldn't be allocated
+ */
+const char *tok_string_value(Token *tok, const Allocator *alloc, usize *len);
+
 #endif
@@ -0,0 +1,81 @@
+#ifndef _AX_LOADER_H_
+#define _AX_LOADER_H_
+
+#include "types.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#define LOADER_DEPTH 64 // Files being read or waiting to be used at the same time
+
+typedef struct SourceFile {
+	const char *path;
+	char *data; // NUL-terminated contents, NULL if the file couldn't be read
+	usize len;
+	int error; // errno of the operation that failed
+	bool done;
+} SourceFile;
+
+typedef struct LoaderBuffer {
+	char *data;
+	usize size;
+} LoaderBuffer;
+
+typedef enum LoaderBackend {
+	LOADER_URING,   // Batched openat/statx/read through io_uring
+	LOADER_THREADS, // Threads doing open/fstat/pread
+} LoaderBackend;
+
+/*!
+ * Loader of many source files, with many reads in flight.
+ *
+ * Up to LOADER_DEPTH files after the oldest one not released are loaded in
+ * the background, each into one of LOADER_DEPTH buffers reused by the files.
+ * They are loaded through io_uring when the kernel supports it, so the open
+ * and read of a batch of files take a single system call. Otherwise a pool
+ * of threads does the same with blocking calls. Either way the I/O overlaps
+ * with the work done on the files already loaded.
+ */
+typedef struct Loader {
+	LoaderBackend backend;
+	SourceFile *files;
+	u32 count;
+	u32 next;  // Next file to start loading
+	u32 limit; // Files before it may be loaded, it moves with loader_release()
+
+	LoaderBuffer buffers[LOADER_DEPTH]; // File i is read into buffers[i % LOADER_DEPTH]
+
+	struct LoaderRing *ring; // LOADER_URING
+
+	// LOADER_THREADS
+	pthread_t *threads;
+	u32 threadlen;
+	pthread_mutex_t lock;
+	pthread_cond_t changed; // A file was loaded or the limit moved
+	bool stop;
+} Loader;
+
+/*!
+ * Start loading the files
+ *
+ * @param[in] paths Paths of the files, must outlive the loader
+ * @param[in] uring Whether to try io_uring before falling back to threads
+ */
+void loader_init(Loader *loader, const char *const *paths, u32 count, bool uring);
+void loader_free(Loader *loader);
+
+/*!
+ * Wait for a file to be loaded, files must be requested in order and the ones
+ * LOADER_DEPTH before must have been released
+ *
+ * @return The loaded file, its data is NULL and error is set if it couldn't be
+ *         read; it's valid until loader_release()
+ */
+const SourceFile *loader_get(Loader *loader, u32 index);
+
+/*!
+ * Give back the buffer of a file returned by loader_get(), in order
+ */
+void loader_release(Loader *loader, u32 index);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef _AX_MEMSTATS_H_
+#define _AX_MEMSTATS_H_
+
+#include "util.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define MEM_BUCKETS 24 // Power of two size classes, the last one is unbounded
+
+typedef struct MemCounters {
+	atomic_size_t live;
+	atomic_size_t peak;
+	atomic_size_t total; // Bytes requested, including reallocations
+	atomic_size_t allocs;
+	atomic_size_t reallocs;
+	atomic_size_t frees;
+	atomic_size_t histogram[MEM_BUCKETS];
+} MemCounters;
+
+/*!
+ * Allocation counters of each tag, zero initialized and updated atomically by
+ * the allocator of mem_stats_allocator()
+ */
+typedef struct MemStats {
+	MemCounters tags[MEM_TAG_COUNT];
+	MemCounters all;
+} MemStats;
+
+/*!
+ * Allocator counting into stats, each block carries a header with its size and
+ * tag. Install it with mem_set_allocator() before the first allocation.
+ */
+Allocator mem_stats_allocator(MemStats *stats);
+
+/*!
+ * Print live bytes, peak bytes, allocation counts and size histograms of each
+ * tag.
+ */
+void mem_stats_print(const MemStats *stats, FILE *out);
+
+#endif
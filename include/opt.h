@@ -0,0 +1,66 @@
+#ifndef _AX_OPT_H_
+#define _AX_OPT_H_
+
+#include "ir.h"
+#include "types.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*!
+ * Optimization passes on the SSA form, they always run in this order
+ */
+typedef enum OptPass {
+	PASS_FOLD, // Constant folding, branches on constants and trivial phis
+	PASS_CSE,  // Common subexpressions dominated by the same expression
+	PASS_LICM, // Loop invariant code motion to the preheaders
+	PASS_DCE,  // Unused values without side effects
+	PASS_COUNT,
+} OptPass;
+
+#define PASS_ALL ((1u << PASS_COUNT) - 1)
+
+typedef struct PassStats {
+	u64 ns;      // Time spent in the pass
+	u32 runs;    // Functions it ran on
+	u32 changes; // Instructions removed, replaced or moved
+} PassStats;
+
+/*!
+ * Runs the enabled passes on each function and measures them
+ */
+typedef struct PassManager {
+	u32 enabled; // Bit per OptPass
+	FILE *dump;  // Optimized functions are printed there if not NULL
+
+	PassStats stats[PASS_COUNT];
+	u32 funcs;
+	u64 before; // Instructions of the functions as lowered
+	u64 after;  // Instructions left by the passes
+} PassManager;
+
+/*!
+ * Enable every pass
+ */
+void opt_init(PassManager *pm);
+
+/*!
+ * Enable the passes of a comma separated list of names, "none" disables all
+ *
+ * @return false if a name is unknown
+ */
+bool opt_parse(PassManager *pm, const char *list);
+
+/*!
+ * Optimize a function, its copies must have been resolved
+ */
+void opt_run(PassManager *pm, IrFunc *f, const char *name);
+
+/*!
+ * Print the time and changes of each pass
+ */
+void opt_print_stats(const PassManager *pm, FILE *out);
+
+const char *opt_pass2str(OptPass pass);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef _AX_PARSE_H_
+#define _AX_PARSE_H_
+
+#include "ast.h"
+#include "lex.h"
+
+#define PARSE_ERROR_MAX 128 // Size of syntax error messages
+
+/*!
+ * Parse a whole package unit from the lexer into the AST
+ *
+ * The root node (index 0) of the AST holds the range of top-level declarations.
+ * Syntax errors are reported to STDERR and terminate the process.
+ */
+void parse_unit(LexState *lex, Ast *ast);
+
+/*!
+ * Parse a whole package unit like parse_unit(), using up to jobs threads
+ *
+ * The file is scanned first, then a pass matching brackets on the tokens splits
+ * the top-level declarations into batches, which are parsed into separate trees
+ * by the threads and appended in order. The result is the same tree (with the
+ * same indices) parse_unit() builds. Small files are parsed on the calling
+ * thread.
+ */
+void parse_unit_parallel(LexState *lex, Ast *ast, u32 jobs);
+
+/*!
+ * Parse a whole package unit like parse_unit(), scanning on another thread
+ *
+ * The lexer thread pushes tokens into a ring the parser consumes, so on two
+ * cores the time is close to the longest of the two instead of their sum. The
+ * result and the errors reported are the same as parse_unit().
+ */
+void parse_unit_pipelined(LexState *lex, Ast *ast);
+
+/*!
+ * Parse a whole package unit from scanned tokens, without terminating the
+ * process on syntax errors
+ *
+ * @param[in]  tokens The last one must be TK_EOF, only their literals are
+ *                    written, when they are decoded
+ * @param[in]  alloc  Allocator of the lexer which scanned the tokens, if NULL
+ *                    the default allocator
+ * @param[out] error  Message of the syntax error, must hold PARSE_ERROR_MAX
+ *                    bytes
+ *
+ * @return false on a syntax error, the AST is incomplete then but must still
+ *         be freed
+ */
+bool parse_tokens(
+	Token *tokens, u32 len, const Allocator *alloc, Ast *ast, char *error
+);
+
+#endif
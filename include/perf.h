@@ -0,0 +1,47 @@
+#ifndef _AX_PERF_H_
+#define _AX_PERF_H_
+
+#include "types.h"
+
+#include <stdio.h>
+
+typedef enum PerfCounter {
+	PERF_INSTRUCTIONS,
+	PERF_CYCLES,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_COUNTER_COUNT,
+} PerfCounter;
+
+/*!
+ * Hardware performance counters of the calling thread, read through Linux
+ * perf_event_open(2). Counters the kernel or the CPU doesn't provide are left
+ * closed and reported as unavailable.
+ */
+typedef struct PerfCounters {
+	int fds[PERF_COUNTER_COUNT]; // -1 if unavailable
+	u64 values[PERF_COUNTER_COUNT];
+	u64 elapsed; // Wall time in nanoseconds
+	u64 start;
+} PerfCounters;
+
+/*!
+ * Open the counters, they are stopped until perf_start() is called
+ *
+ * @return false if no counter is available, timing still works in that case
+ */
+bool perf_open(PerfCounters *perf);
+void perf_close(PerfCounters *perf);
+
+/*!
+ * Start or stop counting, values are accumulated between calls
+ */
+void perf_start(PerfCounters *perf);
+void perf_stop(PerfCounters *perf);
+
+/*!
+ * Print counter values, IPC and misses per KB of processed source
+ */
+void perf_report(const PerfCounters *perf, const char *phase, usize bytes, FILE *out);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef _AX_RESOLVE_H_
+#define _AX_RESOLVE_H_
+
+#include "ast.h"
+#include "types.h"
+
+/*!
+ * Resolve every identifier of a parsed unit to its declaration.
+ *
+ * Package-level functions and globals are visible in the whole unit, other
+ * bindings from their declaration to the end of the enclosing block. Qualified
+ * names (pkg::name) belong to other packages and are left unresolved.
+ *
+ * @param[in]  path  File name used in error messages
+ * @param[out] decls Declaring node of each AST_IDENT, AST_NONE if unresolved;
+ *                   must have room for ast->nodelen entries
+ *
+ * @return false if a name is undefined, redeclared in the same scope or a
+ *         constant is assigned, errors are printed to stderr
+ */
+bool resolve_unit(const Ast *ast, const char *path, NodeIndex *decls);
+
+#endif
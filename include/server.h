@@ -0,0 +1,35 @@
+#ifndef _AX_SERVER_H_
+#define _AX_SERVER_H_
+
+/*!
+ * Compile server answering requests on a Unix socket from an in-memory cache.
+ *
+ * Sources, their tokens and their diagnostics are kept in a SourceCache, files
+ * are checked for changes on every request naming them.
+ *
+ * Requests are lines of words separated by spaces (so paths can't contain
+ * spaces), a client can send many on a connection:
+ *
+ *     tokens <file.ax>       Tokens of the file, one per line
+ *     check <file.ax>        Lexer, parser, name and constant errors
+ *     deps <file.ax>...      Package dependency graph, like --deps
+ *     stats                  Cache statistics
+ *     quit                   Stop the server
+ *
+ * Each response is a line "ok <outlen> <errlen>" or "fail <outlen> <errlen>",
+ * followed by outlen bytes of output and errlen bytes of diagnostics: what the
+ * command line would write to stdout and stderr, fail meaning it would exit
+ * with an error.
+ */
+
+/*!
+ * Serve requests until the quit request or SIGINT/SIGTERM
+ *
+ * @param[in] path Path of the socket, it's replaced if it exists and removed
+ *                 on exit
+ *
+ * @return EXIT_FAILURE if the socket couldn't be set up, EXIT_SUCCESS otherwise
+ */
+int server_run(const char *path);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef _AX_SOURCE_H_
+#define _AX_SOURCE_H_
+
+#include "types.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+
+typedef u32 SourceLoc;
+
+#define SOURCE_NONE 0 // No location, never in a file range
+
+/*!
+ * Line and column of a location, columns count code points from 1 and tabs
+ * count as 4
+ */
+typedef struct Location {
+	int lineno;
+	int colno;
+} Location;
+
+/*!
+ * Source manager owning the buffers of the source files of a build.
+ *
+ * Each file gets a contiguous range of one 32-bit offset space, one byte
+ * longer than the file for its end, so a location is a single SourceLoc for
+ * the whole build and knows its file. Lines and columns are only computed
+ * when a location is decoded, from a table of line starts built on the first
+ * decode in the file.
+ *
+ * The ranges of removed files are merged with the free ranges next to them
+ * and reused, with their IDs, by the next files fitting in them, so a process
+ * reloading files keeps a bounded space. Locations and IDs of a removed file
+ * must not be used anymore.
+ *
+ * Functions can be called from any thread.
+ */
+typedef struct SourceManager {
+	Allocator alloc;
+	pthread_mutex_t lock;
+
+	struct SourceBuffer *files; // ID - 1 -> File, sorted by base
+	u32 filelen;
+	u32 filesize;
+	u32 holes; // Free ranges before the end
+	u64 next;  // Base of the next file appended
+} SourceManager;
+
+/*!
+ * @param[in] alloc Allocator of the buffers and tables, if NULL the default
+ *                  allocator is used
+ */
+void source_init(SourceManager *sm, const Allocator *alloc);
+
+/*!
+ * Free every buffer and the manager
+ */
+void source_free(SourceManager *sm);
+
+/*!
+ * Register a source buffer
+ *
+ * @param[in] data  Contents, taken by the manager if owned (they must then be
+ *                  len + 1 bytes from its allocator), otherwise they must stay
+ *                  valid until source_remove()
+ *
+ * @return ID of the file, 0 with errno set to ENOMEM if it couldn't be
+ *         allocated or EOVERFLOW if no range of locations is large enough, an
+ *         owned buffer is freed then
+ */
+u32 source_add(SourceManager *sm, const char *path, char *data, usize len, bool owned);
+
+/*!
+ * Read a file into a new buffer owned by the manager
+ *
+ * @return ID of the file, 0 with errno set if it couldn't be read or added
+ */
+u32 source_load(SourceManager *sm, const char *path);
+
+/*!
+ * Free the buffer of a file and its range of locations
+ */
+void source_remove(SourceManager *sm, u32 file);
+
+const char *source_path(SourceManager *sm, u32 file);
+const char *source_data(SourceManager *sm, u32 file, usize *len);
+
+/*!
+ * Location of the byte at offset in the file, offset can be its length
+ */
+SourceLoc source_loc(SourceManager *sm, u32 file, usize offset);
+
+/*!
+ * Line and column of a location
+ *
+ * @param[out] file ID of the file of the location, can be NULL
+ *
+ * @return Location 0:0 (and file 0) if the location isn't in a registered
+ *         file or its lines couldn't be allocated
+ */
+Location source_decode(SourceManager *sm, SourceLoc loc, u32 *file);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef _AX_SYMTAB_H_
+#define _AX_SYMTAB_H_
+
+#include "ast.h"
+#include "types.h"
+
+#define SYM_NONE 0 // Index reserved for "not found"
+
+typedef struct Symbol {
+	u32 name;       // Interned name
+	NodeIndex decl; // Declaring node
+	u32 shadowed;   // Symbol previously visible with the same name
+} Symbol;
+
+/*!
+ * Scoped symbol table.
+ *
+ * A single open addressed hash maps each name to its innermost visible
+ * symbol, and the symbols array is the undo log: entering a scope saves its
+ * length and leaving it pops the symbols declared since, restoring the ones
+ * they shadowed. No memory is allocated per scope.
+ */
+typedef struct SymbolTable {
+	Symbol *syms;
+	u32 symlen;
+	u32 symsize;
+
+	u32 *scopes; // Symbols length when each scope was entered
+	u32 scopelen;
+	u32 scopesize;
+
+	u32 *keys;   // Names, INTERN_NONE if the slot is empty
+	u32 *values; // Name -> Innermost symbol, SYM_NONE if out of scope
+	u32 keylen;
+	u32 tablesize;
+} SymbolTable;
+
+void symtab_init(SymbolTable *tab);
+void symtab_free(SymbolTable *tab);
+
+void symtab_enter(SymbolTable *tab);
+void symtab_exit(SymbolTable *tab);
+
+/*!
+ * Declare a name in the innermost scope
+ *
+ * @return Index of the new symbol, SYM_NONE if the name is already declared
+ *         in the same scope
+ */
+u32 symtab_declare(SymbolTable *tab, u32 name, NodeIndex decl);
+
+/*!
+ * Find the innermost visible symbol with a name
+ *
+ * @return Index of the symbol, SYM_NONE if not declared
+ */
+u32 symtab_lookup(const SymbolTable *tab, u32 name);
+
+static inline const Symbol *symtab_get(const SymbolTable *tab, u32 sym) {
+	return &tab->syms[sym];
+}
+
+#endif
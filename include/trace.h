@@ -0,0 +1,66 @@
+#ifndef _AX_TRACE_H_
+#define _AX_TRACE_H_
+
+#include "types.h"
+
+#include <stdbool.h>
+
+/*!
+ * Timeline tracing in the Chrome trace-event format (viewable in Perfetto or
+ * chrome://tracing).
+ *
+ * Events are appended to a buffer owned by the calling thread, so recording
+ * doesn't take locks. When tracing is disabled the macros only check a flag.
+ */
+
+extern bool trace_enabled;
+
+#define TRACE_BEGIN(name)                 \
+	do {                                  \
+		if (trace_enabled) {              \
+			trace_event('B', name, NULL); \
+		}                                 \
+	} while (0)
+
+#define TRACE_BEGIN_DETAIL(name, detail)    \
+	do {                                    \
+		if (trace_enabled) {                \
+			trace_event('B', name, detail); \
+		}                                   \
+	} while (0)
+
+#define TRACE_END(name)                   \
+	do {                                  \
+		if (trace_enabled) {              \
+			trace_event('E', name, NULL); \
+		}                                 \
+	} while (0)
+
+/*!
+ * Start recording events, must be called before any other thread is started
+ */
+void trace_enable(void);
+
+/*!
+ * Record an event on the calling thread's buffer
+ *
+ * @param[in] phase  'B' to begin or 'E' to end a duration
+ * @param[in] name   Event name, must outlive the trace
+ * @param[in] detail Optional argument shown with the event, copied
+ */
+void trace_event(char phase, const char *name, const char *detail);
+
+/*!
+ * Set the name of the calling thread in the trace, must outlive the trace
+ */
+void trace_thread_name(const char *name);
+
+/*!
+ * Write all recorded events as JSON and free the buffers, must be called after
+ * all traced threads have finished.
+ *
+ * @return false if the file couldn't be written
+ */
+bool trace_write(const char *path);
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef _AX_TYPETAB_H_
+#define _AX_TYPETAB_H_
+
+#include "ast.h"
+#include "types.h"
+
+#include <stdio.h>
+
+#define TYPE_ID_NONE 0 // ID reserved for "no type"
+
+#define TYPE_LEN_NONE UINT32_MAX // Length of arrays declared without one
+
+typedef u32 TypeId;
+
+/*!
+ * Type table entry, the meaning of the fields depends on the storage:
+ *  - TYPE_POINTER: elem is the pointee
+ *  - TYPE_ARRAY: elem is the element type, data is the length
+ *  - TYPE_FUNC: elem is the return type, params[data..data + count] the
+ *    parameter types
+ */
+typedef struct TypeEntry {
+	u8 storage; // TypeStorage
+	u32 elem;
+	u32 data;
+	u32 count;
+} TypeEntry;
+
+/*!
+ * Hash-consed type table.
+ *
+ * Every type is constructed through this table, which stores each distinct
+ * type once and references it by a 32-bit ID, so two types are equal if and
+ * only if their IDs are. Primitives and compile constants are always present
+ * and their ID is the TypeStorage value plus one.
+ */
+typedef struct TypeTable {
+	TypeEntry *types;
+	u32 len;
+	u32 size;
+
+	u32 *params; // Parameter types of all functions
+	u32 paramlen;
+	u32 paramsize;
+
+	u32 *table; // Open addressed hash table of IDs
+	u32 tablesize;
+} TypeTable;
+
+void typetab_init(TypeTable *tab);
+void typetab_free(TypeTable *tab);
+
+/*!
+ * Return the ID of a primitive or compile constant type
+ */
+TypeId type_prim(TypeStorage storage);
+
+TypeId type_pointer(TypeTable *tab, TypeId elem);
+
+/*!
+ * @param[in] len Number of elements, TYPE_LEN_NONE if not specified
+ */
+TypeId type_array(TypeTable *tab, TypeId elem, u32 len);
+
+/*!
+ * @param[in] params Parameter types, copied into the table
+ */
+TypeId type_func(TypeTable *tab, TypeId ret, const TypeId *params, u32 count);
+
+/*!
+ * Build the type described by an AST type node (AST_TYPE_*)
+ *
+ * @return TYPE_ID_NONE if an array length isn't an integer literal
+ */
+TypeId type_from_ast(TypeTable *tab, const Ast *ast, NodeIndex node);
+
+static inline const TypeEntry *type_get(const TypeTable *tab, TypeId id) {
+	return &tab->types[id];
+}
+
+static inline const TypeId *type_params(const TypeTable *tab, TypeId id) {
+	return tab->params + tab->types[id].data;
+}
+
+/*!
+ * Name of a primitive or compile constant type
+ */
+const char *type_storage2str(TypeStorage storage);
+
+/*!
+ * Print type with the language syntax, used for debugging
+ */
+void type_print(const TypeTable *tab, TypeId id, FILE *out);
+
+#endif
@@ -29,4 +29,25 @@ const char *u8_decode(const char *str, u32 *rune);
  */
 usize u8_encode(char *str, u32 c);
 
+#define U8_ID_START    0x01 // Can start an identifier
+#define U8_ID_CONTINUE 0x02 // Can continue an identifier
+#define U8_DIGIT       0x04 // Decimal digit
+
+extern const u8 u8_ascii_class[0x80];
+
+/*!
+ * Return whether the character has the UAX #31 property (XID_Start or
+ * XID_Continue), only used for non-ASCII characters
+ */
+bool u8_xid_start(u32 c);
+bool u8_xid_continue(u32 c);
+
+static inline bool u8_is_id_start(u32 c) {
+	return c <= 0x7f ? (u8_ascii_class[c] & U8_ID_START) != 0 : u8_xid_start(c);
+}
+
+static inline bool u8_is_id_continue(u32 c) {
+	return c <= 0x7f ? (u8_ascii_class[c] & U8_ID_CONTINUE) != 0 : u8_xid_continue(c);
+}
+
 #endif
@@ -31,9 +31,77 @@ enum LogLevel {
  */
 void log_message(int level, const char *file, int line, const char *fmt, ...);
 
-void *xcalloc(size_t count, size_t size);
-void *xrealloc(void *ptr, size_t size);
-char *xstrndup(const char *str, size_t len);
+/*!
+ * Call-site tags used for allocation accounting
+ */
+typedef enum MemTag {
+	MEM_MISC,
+	MEM_LEX_BUFFER, // Lexer scratch buffer
+	MEM_LEX_IDENT,  // Identifier names
+	MEM_LEX_STRING, // String literals
+	MEM_INTERN,     // Interned names table and pool
+	MEM_AST,        // AST nodes and extra data
+	MEM_PARSE,      // Parser scratch lists
+	MEM_DEPS,       // Dependency graph
+	MEM_TRACE,      // Trace event buffers
+	MEM_TYPES,      // Type table
+	MEM_SYMBOLS,    // Symbol table and name resolution
+	MEM_CONSTS,     // Constant values
+	MEM_VM,         // Bytecode and interpreter stack
+	MEM_EMIT,       // Generated C source
+	MEM_SOURCE,     // Source manager and files loaded in batches
+	MEM_CACHE,      // Cached sources and tokens
+	MEM_SERVER,     // Compile server connections
+	MEM_INDEX,      // Symbol index being built
+	MEM_IR,         // SSA functions and optimization passes
+	MEM_IFACE,      // Package interface being built or checked
+	MEM_JIT,        // Machine code of hot functions being compiled
+	MEM_TAG_COUNT,
+} MemTag;
+
+/*!
+ * Memory allocator interface, every function receives the user context.
+ * Functions may return NULL on failure. Memory from alloc() must be zeroed,
+ * the tag tells what the memory is used for and can be ignored.
+ */
+typedef struct Allocator {
+	void *(*alloc)(void *ctx, size_t size, MemTag tag);
+	void *(*realloc)(void *ctx, void *ptr, size_t oldsize, size_t newsize);
+	void (*free)(void *ctx, void *ptr, size_t size);
+	void *ctx;
+} Allocator;
+
+/*!
+ * Allocator behind mem_alloc(), mem_realloc() and mem_free()
+ */
+extern const Allocator default_allocator;
+
+/*!
+ * Allocate zeroed memory, returns NULL on failure
+ *
+ * Memory from mem_alloc() and the x* functions must be released with mem_free()
+ * or xfree(), never with free(). The tag of mem_realloc() is used when ptr is NULL.
+ */
+void *mem_alloc(MemTag tag, size_t size);
+void *mem_realloc(MemTag tag, void *ptr, size_t size);
+void mem_free(void *ptr);
+
+/*!
+ * Replace the allocator behind mem_*(), NULL restores the C library one.
+ *
+ * Must be called before the first allocation and before other threads start,
+ * blocks are released by the allocator that made them. mem_realloc() and
+ * mem_free() don't know the size of the block and pass 0.
+ */
+void mem_set_allocator(const Allocator *alloc);
+
+/*!
+ * Same as mem_* functions, but abort on failure
+ */
+void *xcalloc(MemTag tag, size_t count, size_t size);
+void *xrealloc(MemTag tag, void *ptr, size_t size);
+char *xstrndup(MemTag tag, const char *str, size_t len);
+void xfree(void *ptr);
 
 FILE *xfopen(const char *filename, const char *modes);
 
@@ -0,0 +1,26 @@
+#ifndef _AX_VM_H_
+#define _AX_VM_H_
+
+#include "bytecode.h"
+
+#include <stdio.h>
+
+#define VM_JIT_OFF UINT32_MAX
+
+/*!
+ * Run the entry function of a program.
+ *
+ * Each call gets a window of registers on a shared stack, starting at the
+ * register of its first argument. Runtime errors (division by zero, stack
+ * overflow, bad format strings) stop the program.
+ *
+ * @param[in] out Output of std::fmt::println
+ * @param[in] jit Calls or loop iterations of a function after which it's
+ *                compiled to machine code (see jit.h), VM_JIT_OFF to only
+ *                interpret
+ *
+ * @return 0 on success, 1 on runtime errors, which are printed to stderr
+ */
+int vm_run(const Program *prog, FILE *out, u32 jit);
+
+#endif
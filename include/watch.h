@@ -0,0 +1,28 @@
+#ifndef _AX_WATCH_H_
+#define _AX_WATCH_H_
+
+/*!
+ * Check every .ax file under a directory, then check them again as they're
+ * saved.
+ *
+ * Directories are watched with inotify, including the ones created later;
+ * names starting with '.' are skipped. Events are handled once none came for
+ * WATCH_SETTLE_MS, so a burst of saves is one batch. Files stay in a
+ * SourceCache with their tokens, so a batch only reads the files it names and
+ * only lexes and checks the ones whose contents changed.
+ *
+ * Diagnostics are written to stderr like the command line does, followed by a
+ * summary of the batch.
+ */
+
+#define WATCH_SETTLE_MS 30
+
+/*!
+ * Watch until SIGINT/SIGTERM
+ *
+ * @return EXIT_FAILURE if the directory couldn't be watched, EXIT_SUCCESS
+ *         otherwise
+ */
+int watch_run(const char *dir);
+
+#endif
@@ -0,0 +1,400 @@
+#include "ast.h"
+
+#include "util.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+
+static const char *kinds[] = {
+	[AST_ROOT] = "Root",
+	[AST_PACKAGE] = "Package",
+	[AST_USE] = "Use",
+	[AST_FN_DECL] = "FnDecl",
+	[AST_GLOBAL] = "Global",
+	[AST_PROTOTYPE] = "Prototype",
+	[AST_PARAM] = "Param",
+	[AST_TYPE_PRIM] = "TypePrim",
+	[AST_TYPE_PTR] = "TypePtr",
+	[AST_TYPE_ARRAY] = "TypeArray",
+	[AST_TYPE_FN] = "TypeFn",
+	[AST_INT] = "Int",
+	[AST_FLOAT] = "Float",
+	[AST_RUNE] = "Rune",
+	[AST_STRING] = "String",
+	[AST_BOOL] = "Bool",
+	[AST_VOID] = "Void",
+	[AST_ARRAY] = "Array",
+	[AST_IDENT] = "Ident",
+	[AST_BINARY] = "Binary",
+	[AST_UNARY] = "Unary",
+	[AST_CAST] = "Cast",
+	[AST_CALL] = "Call",
+	[AST_BLOCK] = "Block",
+	[AST_ASSIGN] = "Assign",
+	[AST_IF] = "If",
+	[AST_FOR] = "For",
+	[AST_BINDING] = "Binding",
+};
+
+static_assert(
+	sizeof(kinds) / sizeof(const char *) == AST_KIND_COUNT,
+	"Kinds array doesn't have the same size of AstKind Enum."
+);
+
+static const char *primitives[] = {
+	[TYPE_BOOL] = "bool", [TYPE_F32] = "f32", [TYPE_F64] = "f64", [TYPE_I16] = "i16",
+	[TYPE_I32] = "i32",   [TYPE_I64] = "i64", [TYPE_I8] = "i8",   [TYPE_U16] = "u16",
+	[TYPE_U32] = "u32",   [TYPE_U64] = "u64", [TYPE_U8] = "u8",   [TYPE_VOID] = "void",
+	[TYPE_RUNE] = "rune",
+};
+
+void ast_init(Ast *ast, SourceManager *sources) {
+	memset(ast, 0, sizeof(Ast));
+	ast->sources = sources;
+
+	ast->nodesize = 256;
+	ast->nodes = xcalloc(MEM_AST, ast->nodesize, sizeof(AstNode));
+	ast->locs = xcalloc(MEM_AST, ast->nodesize, sizeof(SourceLoc));
+	ast->nodelen = 1; // Reserve the root node
+
+	ast->extrasize = 256;
+	ast->extra = xcalloc(MEM_AST, ast->extrasize, sizeof(u32));
+
+	intern_init(&ast->names);
+}
+
+void ast_free(Ast *ast) {
+	xfree(ast->nodes);
+	xfree(ast->locs);
+	xfree(ast->extra);
+	intern_free(&ast->names);
+	memset(ast, 0, sizeof(Ast));
+}
+
+NodeIndex ast_add_node(Ast *ast, AstKind kind, SourceLoc loc, u32 lhs, u32 rhs) {
+	if (ast->nodelen == ast->nodesize) {
+		ast->nodesize *= 2;
+		ast->nodes = xrealloc(MEM_AST, ast->nodes, ast->nodesize * sizeof(AstNode));
+		ast->locs = xrealloc(MEM_AST, ast->locs, ast->nodesize * sizeof(SourceLoc));
+	}
+
+	NodeIndex index = ast->nodelen;
+	ast->nodelen += 1;
+
+	ast->nodes[index] = (AstNode) { .kind = (u8)kind, .lhs = lhs, .rhs = rhs };
+	ast->locs[index] = loc;
+	return index;
+}
+
+u32 ast_add_extra(Ast *ast, const u32 *values, usize count) {
+	while (ast->extralen + count > ast->extrasize) {
+		ast->extrasize *= 2;
+		ast->extra = xrealloc(MEM_AST, ast->extra, ast->extrasize * sizeof(u32));
+	}
+
+	u32 index = ast->extralen;
+	memcpy(ast->extra + ast->extralen, values, count * sizeof(u32));
+	ast->extralen += (u32)count;
+	return index;
+}
+
+// Offsets applied by ast_append() to the indices of the appended tree
+typedef struct AstRemap {
+	u32 *extra;
+	u32 nodes;
+	u32 extraoff;
+} AstRemap;
+
+static inline u32 remap_node(const AstRemap *r, u32 node) {
+	return node == AST_NONE ? AST_NONE : node + r->nodes;
+}
+
+static void remap_range(const AstRemap *r, u32 start, u32 end) {
+	for (u32 i = start; i < end; i += 1) {
+		r->extra[i] = remap_node(r, r->extra[i]);
+	}
+}
+
+// Fix the indices of an extra[start, end] pair and of the nodes it delimits
+static void remap_list(const AstRemap *r, u32 pair) {
+	r->extra[pair] += r->extraoff;
+	r->extra[pair + 1] += r->extraoff;
+	remap_range(r, r->extra[pair], r->extra[pair + 1]);
+}
+
+NodeIndex ast_append(Ast *ast, const Ast *src) {
+	u32 count = src->nodelen - 1; // Without the root
+	while (ast->nodelen + count > ast->nodesize) {
+		ast->nodesize *= 2;
+		ast->nodes = xrealloc(MEM_AST, ast->nodes, ast->nodesize * sizeof(AstNode));
+		ast->locs = xrealloc(MEM_AST, ast->locs, ast->nodesize * sizeof(SourceLoc));
+	}
+
+	NodeIndex first = ast->nodelen;
+	memcpy(ast->nodes + first, src->nodes + 1, count * sizeof(AstNode));
+	memcpy(ast->locs + first, src->locs + 1, count * sizeof(SourceLoc));
+	ast->nodelen += count;
+
+	u32 *names = xcalloc(MEM_AST, src->names.count, sizeof(u32));
+	for (u32 id = 1; id < src->names.count; id += 1) {
+		const char *str = intern_str(&src->names, id);
+		names[id] = intern(&ast->names, str, intern_len(&src->names, id));
+	}
+
+	AstRemap r = {
+		.extraoff = ast_add_extra(ast, src->extra, src->extralen),
+		.nodes = first - 1,
+	};
+	r.extra = ast->extra;
+
+	for (NodeIndex i = first; i < ast->nodelen; i += 1) {
+		AstNode *n = &ast->nodes[i];
+
+		switch ((AstKind)n->kind) {
+		case AST_ROOT:
+		case AST_TYPE_PRIM:
+		case AST_INT:
+		case AST_FLOAT:
+		case AST_RUNE:
+		case AST_BOOL:
+		case AST_VOID:
+			break;
+		case AST_PACKAGE:
+		case AST_STRING:
+		case AST_IDENT:
+			n->lhs = names[n->lhs];
+			break;
+		case AST_USE:
+			n->lhs = names[n->lhs];
+			n->rhs = names[n->rhs];
+			break;
+		case AST_FN_DECL:
+		case AST_PARAM:
+		case AST_BINDING:
+			n->lhs = names[n->lhs];
+			n->rhs += r.extraoff;
+			remap_range(&r, n->rhs, n->rhs + 2);
+			break;
+		case AST_GLOBAL:
+		case AST_ARRAY:
+		case AST_BLOCK:
+			n->lhs += r.extraoff;
+			n->rhs += r.extraoff;
+			remap_range(&r, n->lhs, n->rhs);
+			break;
+		case AST_PROTOTYPE:
+			n->lhs += r.extraoff;
+			remap_list(&r, n->lhs);
+			n->rhs = remap_node(&r, n->rhs);
+			break;
+		case AST_TYPE_PTR:
+		case AST_TYPE_FN:
+		case AST_UNARY:
+			n->lhs = remap_node(&r, n->lhs);
+			break;
+		case AST_TYPE_ARRAY:
+		case AST_BINARY:
+		case AST_CAST:
+		case AST_ASSIGN:
+			n->lhs = remap_node(&r, n->lhs);
+			n->rhs = remap_node(&r, n->rhs);
+			break;
+		case AST_CALL:
+			n->lhs = remap_node(&r, n->lhs);
+			n->rhs += r.extraoff;
+			remap_list(&r, n->rhs);
+			break;
+		case AST_IF:
+			n->lhs = remap_node(&r, n->lhs);
+			n->rhs += r.extraoff;
+			remap_range(&r, n->rhs, n->rhs + 2);
+			break;
+		case AST_FOR:
+			n->lhs += r.extraoff;
+			remap_list(&r, n->lhs);
+			remap_range(&r, n->lhs + 2, n->lhs + 4);
+			n->rhs = remap_node(&r, n->rhs);
+			break;
+		case AST_KIND_COUNT:
+			assert(false);
+		}
+	}
+
+	xfree(names);
+	return first - 1;
+}
+
+static void dump_range(const Ast *ast, u32 start, u32 end, int depth, FILE *out);
+
+static void dump_node(const Ast *ast, NodeIndex index, int depth, FILE *out) {
+	if (index == AST_NONE && depth > 0) {
+		return;
+	}
+
+	const AstNode *node = &ast->nodes[index];
+	const u32 *extra = ast->extra;
+
+	fprintf(out, "%*s%s", depth * 2, "", kinds[node->kind]);
+	if ((node->flags & AST_FLAG_PUB) > 0) {
+		fprintf(out, " pub");
+	}
+	if ((node->flags & AST_FLAG_MUT) > 0) {
+		fprintf(out, " mut");
+	}
+
+	switch ((AstKind)node->kind) {
+	case AST_ROOT:
+	case AST_GLOBAL:
+	case AST_ARRAY:
+	case AST_BLOCK:
+		fprintf(out, "\n");
+		dump_range(ast, node->lhs, node->rhs, depth + 1, out);
+		break;
+	case AST_PACKAGE:
+	case AST_IDENT:
+		fprintf(out, " %s\n", intern_str(&ast->names, node->lhs));
+		break;
+	case AST_USE:
+		fprintf(out, " %s", intern_str(&ast->names, node->lhs));
+		if (node->rhs != INTERN_NONE) {
+			fprintf(out, " as %s", intern_str(&ast->names, node->rhs));
+		}
+		fprintf(out, "\n");
+		break;
+	case AST_FN_DECL:
+		fprintf(out, " %s\n", intern_str(&ast->names, node->lhs));
+		dump_node(ast, extra[node->rhs], depth + 1, out);
+		dump_node(ast, extra[node->rhs + 1], depth + 1, out);
+		break;
+	case AST_PROTOTYPE:
+		fprintf(out, "\n");
+		dump_range(ast, extra[node->lhs], extra[node->lhs + 1], depth + 1, out);
+		dump_node(ast, node->rhs, depth + 1, out);
+		break;
+	case AST_PARAM:
+	case AST_BINDING:
+		fprintf(out, " %s\n", intern_str(&ast->names, node->lhs));
+		dump_node(ast, extra[node->rhs], depth + 1, out);
+		dump_node(ast, extra[node->rhs + 1], depth + 1, out);
+		break;
+	case AST_TYPE_PRIM:
+		fprintf(out, " %s\n", primitives[node->op]);
+		break;
+	case AST_TYPE_PTR:
+	case AST_TYPE_FN:
+		fprintf(out, "\n");
+		dump_node(ast, node->lhs, depth + 1, out);
+		break;
+	case AST_TYPE_ARRAY:
+	case AST_CAST:
+		fprintf(out, "\n");
+		dump_node(ast, node->lhs, depth + 1, out);
+		dump_node(ast, node->rhs, depth + 1, out);
+		break;
+	case AST_INT:
+		fprintf(out, " %" PRIu64 "\n", (u64)node->rhs << 32 | node->lhs);
+		break;
+	case AST_FLOAT: {
+		u64 bits = (u64)node->rhs << 32 | node->lhs;
+		f64 value;
+		memcpy(&value, &bits, sizeof(f64));
+		fprintf(out, " %g\n", value);
+	} break;
+	case AST_RUNE:
+		fprintf(out, " U+%04" PRIX32 "\n", node->lhs);
+		break;
+	case AST_STRING:
+		fprintf(out, " \"%s\"\n", intern_str(&ast->names, node->lhs));
+		break;
+	case AST_BOOL:
+		fprintf(out, " %s\n", node->lhs ? "true" : "false");
+		break;
+	case AST_VOID:
+		fprintf(out, "\n");
+		break;
+	case AST_BINARY:
+	case AST_ASSIGN:
+		fprintf(out, " %s\n", lex_tok2str((TokenKind)node->op));
+		dump_node(ast, node->lhs, depth + 1, out);
+		dump_node(ast, node->rhs, depth + 1, out);
+		break;
+	case AST_UNARY:
+		fprintf(out, " %s\n", lex_tok2str((TokenKind)node->op));
+		dump_node(ast, node->lhs, depth + 1, out);
+		break;
+	case AST_CALL:
+		fprintf(out, "\n");
+		dump_node(ast, node->lhs, depth + 1, out);
+		dump_range(ast, extra[node->rhs], extra[node->rhs + 1], depth + 1, out);
+		break;
+	case AST_IF:
+		fprintf(out, "\n");
+		dump_node(ast, node->lhs, depth + 1, out);
+		dump_node(ast, extra[node->rhs], depth + 1, out);
+		dump_node(ast, extra[node->rhs + 1], depth + 1, out);
+		break;
+	case AST_FOR:
+		fprintf(out, "\n");
+		dump_range(ast, extra[node->lhs], extra[node->lhs + 1], depth + 1, out);
+		dump_node(ast, extra[node->lhs + 2], depth + 1, out);
+		dump_node(ast, extra[node->lhs + 3], depth + 1, out);
+		dump_node(ast, node->rhs, depth + 1, out);
+		break;
+	case AST_KIND_COUNT:
+		assert(0); // UNREACHABLE
+	}
+}
+
+static void dump_range(const Ast *ast, u32 start, u32 end, int depth, FILE *out) {
+	for (u32 i = start; i < end; i += 1) {
+		dump_node(ast, ast->extra[i], depth, out);
+	}
+}
+
+void ast_dump(const Ast *ast, NodeIndex node, FILE *out) {
+	dump_node(ast, node, 0, out);
+}
+
+const char *ast_kind2str(AstKind kind) {
+	assert(kind < AST_KIND_COUNT);
+	return kinds[kind];
+}
+
+bool ast_full_name(const Ast *ast, NodeIndex ident, char *buf, usize size) {
+	const char *name = intern_str(&ast->names, ast->nodes[ident].lhs);
+	const char *sep = strstr(name, "::");
+	if (sep == NULL) {
+		return false;
+	}
+
+	usize prefix = (usize)(sep - name);
+	int len = snprintf(buf, size, "%s", name);
+
+	const AstNode *root = &ast->nodes[0];
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		const AstNode *use = &ast->nodes[ast->extra[i]];
+		if (use->kind != AST_USE) {
+			continue;
+		}
+
+		// Without an alias a package is named by the last segment of its path
+		const char *path = intern_str(&ast->names, use->lhs);
+		const char *alias = path;
+		if (use->rhs != INTERN_NONE) {
+			alias = intern_str(&ast->names, use->rhs);
+		} else {
+			for (const char *p = strstr(path, "::"); p != NULL; p = strstr(p, "::")) {
+				p += 2;
+				alias = p;
+			}
+		}
+
+		if (strlen(alias) == prefix && strncmp(alias, name, prefix) == 0) {
+			len = snprintf(buf, size, "%s%s", path, sep);
+			break;
+		}
+	}
+
+	return len >= 0 && (usize)len < size;
+}
@@ -0,0 +1,103 @@
+#include "ast.h"
+#include "lex.h"
+#include "parse.h"
+#include "perf.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Lexer and parser throughput benchmark, sources are read once into memory so
+// only the compiler phases are measured.
+
+static usize bench_lex(SourceManager *sources, u32 file, PerfCounters *perf) {
+	LexState lex;
+	lex_init(&lex, sources, file, NULL);
+
+	usize count = 0;
+	Token tok = { 0 };
+
+	perf_start(perf);
+	while (lex_scan(&lex, &tok) != TK_EOF) {
+		lex_release(&lex, &tok);
+		count += 1;
+	}
+	perf_stop(perf);
+
+	lex_close(&lex);
+	return count;
+}
+
+static void bench_parse(SourceManager *sources, u32 file, PerfCounters *perf) {
+	LexState lex;
+	lex_init(&lex, sources, file, NULL);
+
+	Ast ast;
+	ast_init(&ast, sources);
+
+	perf_start(perf);
+	parse_unit(&lex, &ast);
+	perf_stop(perf);
+
+	ast_free(&ast);
+	lex_close(&lex);
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = 100;
+	int first = 1;
+
+	if (first < argc && strncmp(argv[first], "--iterations=", 13) == 0) {
+		iterations = atoi(argv[first] + 13);
+		first += 1;
+	}
+
+	if (first >= argc || iterations <= 0) {
+		log_fatal("Usage: %s [--iterations=N] <file.ax>...", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	PerfCounters lex_perf;
+	PerfCounters parse_perf;
+	if (!perf_open(&lex_perf)) {
+		log_warn("Hardware counters unavailable, reporting time only");
+	}
+	perf_open(&parse_perf);
+
+	SourceManager sources;
+	source_init(&sources, NULL);
+
+	usize bytes = 0;
+	usize tokens = 0;
+	for (int i = first; i < argc; i += 1) {
+		u32 file = source_load(&sources, argv[i]);
+		if (file == 0) {
+			log_error("Failed to open file: %s: %s", argv[i], strerror(errno));
+			perf_close(&lex_perf);
+			perf_close(&parse_perf);
+			source_free(&sources);
+			return EXIT_FAILURE;
+		}
+
+		usize len;
+		source_data(&sources, file, &len);
+		for (int j = 0; j < iterations; j += 1) {
+			tokens += bench_lex(&sources, file, &lex_perf);
+			bench_parse(&sources, file, &parse_perf);
+			bytes += len;
+		}
+
+		source_remove(&sources, file);
+	}
+
+	printf("%zu tokens, %d iterations\n", tokens / iterations, iterations);
+	perf_report(&lex_perf, "lex", bytes, stdout);
+	perf_report(&parse_perf, "lex+parse", bytes, stdout);
+
+	perf_close(&lex_perf);
+	perf_close(&parse_perf);
+	source_free(&sources);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,393 @@
+#include "bytecode.h"
+
+#include "util.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+
+#define VM_OPCODE_NAME(name) [OP_##name] = #name,
+
+static const char *opcodes[] = { VM_OPCODES(VM_OPCODE_NAME) };
+
+static_assert(
+	sizeof(opcodes) / sizeof(const char *) == OP_COUNT,
+	"Opcodes array doesn't have the same size of Opcode Enum."
+);
+
+static_assert(OP_COUNT <= 256, "Opcodes must fit in a byte.");
+
+static_assert(
+	OP_ADD_I16 - OP_ADD_I8 == ARITH_INT_COUNT
+		&& OP_ADD_F64 - OP_ADD_F32 == ARITH_FLOAT_COUNT,
+	"Typed opcodes must follow the VmArith order."
+);
+
+void program_init(Program *prog) {
+	memset(prog, 0, sizeof(Program));
+
+	prog->codesize = 1024;
+	prog->code = xcalloc(MEM_VM, prog->codesize, sizeof(u32));
+
+	prog->constsize = 64;
+	prog->consts = xcalloc(MEM_VM, prog->constsize, sizeof(Value));
+
+	prog->globalsize = 16;
+	prog->globals = xcalloc(MEM_VM, prog->globalsize, sizeof(Value));
+
+	prog->sigsize = 64;
+	prog->sigs = xcalloc(MEM_VM, prog->sigsize, sizeof(u8));
+
+	prog->fmtsize = 16;
+	prog->fmts = xcalloc(MEM_VM, prog->fmtsize, sizeof(VmFmtSegment));
+
+	prog->funcsize = 16;
+	prog->funcs = xcalloc(MEM_VM, prog->funcsize, sizeof(VmFunc));
+
+	intern_init(&prog->strings);
+}
+
+void program_free(Program *prog) {
+	xfree(prog->code);
+	xfree(prog->consts);
+	xfree(prog->globals);
+	xfree(prog->sigs);
+	xfree(prog->fmts);
+	xfree(prog->funcs);
+	intern_free(&prog->strings);
+	memset(prog, 0, sizeof(Program));
+}
+
+u32 program_emit(Program *prog, u32 ins) {
+	if (prog->codelen == prog->codesize) {
+		prog->codesize *= 2;
+		prog->code = xrealloc(MEM_VM, prog->code, prog->codesize * sizeof(u32));
+	}
+
+	prog->code[prog->codelen] = ins;
+	prog->codelen += 1;
+	return prog->codelen - 1;
+}
+
+u32 program_add_const(Program *prog, Value value) {
+	if (prog->constlen == prog->constsize) {
+		prog->constsize *= 2;
+		prog->consts = xrealloc(MEM_VM, prog->consts, prog->constsize * sizeof(Value));
+	}
+
+	prog->consts[prog->constlen] = value;
+	prog->constlen += 1;
+	return prog->constlen - 1;
+}
+
+u32 program_add_sig(Program *prog, const u8 *types, u8 count) {
+	while (prog->siglen + count + 1 > prog->sigsize) {
+		prog->sigsize *= 2;
+		prog->sigs = xrealloc(MEM_VM, prog->sigs, prog->sigsize);
+	}
+
+	u32 index = prog->siglen;
+	prog->sigs[index] = count;
+	memcpy(prog->sigs + index + 1, types, count);
+	prog->siglen += count + 1;
+	return index;
+}
+
+u32 program_add_fmt(Program *prog, const VmFmtSegment *segments, u32 count) {
+	while (prog->fmtlen + count > prog->fmtsize) {
+		prog->fmtsize *= 2;
+		prog->fmts = xrealloc(MEM_VM, prog->fmts, prog->fmtsize * sizeof(VmFmtSegment));
+	}
+
+	u32 index = prog->fmtlen;
+	memcpy(prog->fmts + index, segments, count * sizeof(VmFmtSegment));
+	prog->fmtlen += count;
+	return index;
+}
+
+VmFmtConv vm_fmt_conv(TypeStorage storage, char spec) {
+	switch (storage) {
+	case TYPE_BOOL:
+		return spec == '\0' ? FMT_BOOL : FMT_END;
+	case TYPE_STRING:
+		return spec == '\0' ? FMT_STRING : FMT_END;
+	case TYPE_RUNE:
+		return spec == '\0' ? FMT_RUNE : FMT_END;
+	case TYPE_F32:
+		return spec == '\0' ? FMT_F32 : FMT_END;
+	case TYPE_F64:
+		return spec == '\0' ? FMT_F64 : FMT_END;
+	default:
+		break;
+	}
+
+	bool sign = storage == TYPE_I8 || storage == TYPE_I16 || storage == TYPE_I32
+	         || storage == TYPE_I64;
+	return spec == 'x' ? FMT_HEX
+	     : spec == 'X' ? FMT_HEX_UPPER
+	     : sign        ? FMT_INT
+	                   : FMT_UINT;
+}
+
+Opcode vm_arith_op(VmType type, VmArith arith) {
+	if (type >= VM_F32) {
+		if (arith >= ARITH_FLOAT_COUNT) {
+			return OP_NOP;
+		}
+		return OP_ADD_F32 + (type - VM_F32) * ARITH_FLOAT_COUNT + arith;
+	}
+
+	return OP_ADD_I8 + type * ARITH_INT_COUNT + arith;
+}
+
+// Saturating conversion, NaN is zero
+static Value float_to_int(f64 value, VmType to) {
+	static const f64 limits[] = {
+		128.0, 32768.0, 2147483648.0, 9223372036854775808.0,
+		256.0, 65536.0, 4294967296.0, 18446744073709551616.0,
+	};
+	static const i64 mins[] = { INT8_MIN, INT16_MIN, INT32_MIN, INT64_MIN };
+	static const u64 maxs[] = {
+		INT8_MAX, INT16_MAX, INT32_MAX, INT64_MAX,
+		UINT8_MAX, UINT16_MAX, UINT32_MAX, UINT64_MAX,
+	};
+
+	if (isnan(value)) {
+		return (Value) { .u = 0 };
+	} else if (value >= limits[to]) {
+		return (Value) { .u = maxs[to] };
+	} else if (to <= VM_I64 && value <= -limits[to]) {
+		return (Value) { .i = mins[to] };
+	} else if (to <= VM_I64) {
+		return (Value) { .i = (i64)value };
+	}
+
+	return value <= 0.0 ? (Value) { .u = 0 } : (Value) { .u = (u64)value };
+}
+
+Value vm_cast(Value value, VmType from, VmType to) {
+	if (from >= VM_F32) {
+		f64 x = from == VM_F32 ? value.f : value.d;
+		if (to == VM_F32) {
+			return (Value) { .f = (f32)x };
+		} else if (to == VM_F64) {
+			return (Value) { .d = x };
+		}
+		return float_to_int(x, to);
+	}
+
+	bool sign = from <= VM_I64;
+	if (to == VM_F32) {
+		return (Value) { .f = sign ? (f32)value.i : (f32)value.u };
+	} else if (to == VM_F64) {
+		return (Value) { .d = sign ? (f64)value.i : (f64)value.u };
+	}
+	return vm_norm_int(value.u, to);
+}
+
+static Value float_arith(VmType type, VmArith arith, Value a, Value b) {
+	f64 x = type == VM_F32 ? a.f : a.d;
+	f64 y = type == VM_F32 ? b.f : b.d;
+
+	switch (arith) {
+	case ARITH_EQ:
+		return (Value) { .u = x == y };
+	case ARITH_NE:
+		return (Value) { .u = x != y };
+	case ARITH_LT:
+		return (Value) { .u = x < y };
+	case ARITH_LE:
+		return (Value) { .u = x <= y };
+	default:
+		break;
+	}
+
+	// f32 operations are rounded to f32 like in the interpreter
+	if (type == VM_F32) {
+		switch (arith) {
+		case ARITH_ADD:
+			return (Value) { .f = a.f + b.f };
+		case ARITH_SUB:
+			return (Value) { .f = a.f - b.f };
+		case ARITH_MUL:
+			return (Value) { .f = a.f * b.f };
+		case ARITH_DIV:
+			return (Value) { .f = a.f / b.f };
+		case ARITH_MOD:
+			return (Value) { .f = fmodf(a.f, b.f) };
+		default: // ARITH_NEG
+			return (Value) { .f = -a.f };
+		}
+	}
+
+	switch (arith) {
+	case ARITH_ADD:
+		return (Value) { .d = x + y };
+	case ARITH_SUB:
+		return (Value) { .d = x - y };
+	case ARITH_MUL:
+		return (Value) { .d = x * y };
+	case ARITH_DIV:
+		return (Value) { .d = x / y };
+	case ARITH_MOD:
+		return (Value) { .d = fmod(x, y) };
+	default: // ARITH_NEG
+		return (Value) { .d = -x };
+	}
+}
+
+bool vm_arith(VmType type, VmArith arith, Value a, Value b, Value *out) {
+	if (type >= VM_F32) {
+		*out = float_arith(type, arith, a, b);
+		return true;
+	}
+
+	bool sign = type <= VM_I64;
+	u64 bits = (u64)8 << (type % 4);
+	u64 shift = b.u & (bits - 1);
+
+	switch (arith) {
+	case ARITH_ADD:
+		*out = vm_norm_int(a.u + b.u, type);
+		break;
+	case ARITH_SUB:
+		*out = vm_norm_int(a.u - b.u, type);
+		break;
+	case ARITH_MUL:
+		*out = vm_norm_int(a.u * b.u, type);
+		break;
+	case ARITH_DIV:
+		if (b.u == 0) {
+			return false;
+		} else if (sign) {
+			*out = b.i == -1 ? vm_norm_int(0 - a.u, type)
+			                  : vm_norm_int((u64)(a.i / b.i), type);
+		} else {
+			*out = (Value) { .u = a.u / b.u };
+		}
+		break;
+	case ARITH_MOD:
+		if (b.u == 0) {
+			return false;
+		} else if (sign) {
+			*out = (Value) { .i = b.i == -1 ? 0 : a.i % b.i };
+		} else {
+			*out = (Value) { .u = a.u % b.u };
+		}
+		break;
+	case ARITH_NEG:
+		*out = vm_norm_int(0 - a.u, type);
+		break;
+	case ARITH_EQ:
+		*out = (Value) { .u = a.u == b.u };
+		break;
+	case ARITH_NE:
+		*out = (Value) { .u = a.u != b.u };
+		break;
+	case ARITH_LT:
+		*out = (Value) { .u = sign ? a.i < b.i : a.u < b.u };
+		break;
+	case ARITH_LE:
+		*out = (Value) { .u = sign ? a.i <= b.i : a.u <= b.u };
+		break;
+	case ARITH_AND:
+		*out = (Value) { .u = a.u & b.u };
+		break;
+	case ARITH_OR:
+		*out = (Value) { .u = a.u | b.u };
+		break;
+	case ARITH_XOR:
+		*out = (Value) { .u = a.u ^ b.u };
+		break;
+	case ARITH_SHL:
+		*out = vm_norm_int(a.u << shift, type);
+		break;
+	case ARITH_SHR:
+		*out = sign ? (Value) { .i = a.i >> shift } : (Value) { .u = a.u >> shift };
+		break;
+	default: // ARITH_BNOT
+		*out = vm_norm_int(~a.u, type);
+		break;
+	}
+	return true;
+}
+
+const char *vm_op2str(Opcode op) {
+	return opcodes[op];
+}
+
+void program_dump(const Program *prog, FILE *out) {
+	for (u32 f = 0; f < prog->funclen; f += 1) {
+		const VmFunc *func = &prog->funcs[f];
+		fprintf(
+			out, "fn %s: %u params, %u registers\n",
+			intern_str(&prog->strings, func->name), func->params, func->regs
+		);
+
+		for (u32 pc = func->start; pc < func->start + func->len; pc += 1) {
+			u32 ins = prog->code[pc];
+			Opcode op = (Opcode)INS_OP(ins);
+			fprintf(out, "%6u  %-8s", pc, opcodes[op]);
+
+			switch (op) {
+			case OP_NOP:
+			case OP_RET0:
+				break;
+			case OP_RET:
+			case OP_LOADKX:
+				fprintf(out, " r%u", INS_A(ins));
+				if (op == OP_LOADKX) {
+					pc += 1;
+					fprintf(out, ", k%u", prog->code[pc]);
+				}
+				break;
+			case OP_LOADI:
+				fprintf(out, " r%u, %d", INS_A(ins), INS_SBX(ins));
+				break;
+			case OP_LOADK:
+				fprintf(
+					out, " r%u, k%u ; 0x%" PRIx64, INS_A(ins), INS_BX(ins),
+					prog->consts[INS_BX(ins)].u
+				);
+				break;
+			case OP_GGET:
+			case OP_GSET:
+				fprintf(out, " r%u, g%u", INS_A(ins), INS_BX(ins));
+				break;
+			case OP_JMP:
+				fprintf(out, " -> %d", (i32)pc + 1 + INS_SAX(ins));
+				break;
+			case OP_JMPF:
+			case OP_JMPT:
+				fprintf(out, " r%u -> %d", INS_A(ins), (i32)pc + 1 + INS_SBX(ins));
+				break;
+			case OP_CALL:
+				fprintf(
+					out, " r%u, %s", INS_A(ins),
+					intern_str(&prog->strings, prog->funcs[INS_BX(ins)].name)
+				);
+				break;
+			case OP_CALLN:
+				fprintf(out, " r%u, native%u, %u", INS_A(ins), INS_B(ins), INS_C(ins));
+				pc += 1;
+				break;
+			case OP_MOV:
+			case OP_NOT:
+				fprintf(out, " r%u, r%u", INS_A(ins), INS_B(ins));
+				break;
+			case OP_CAST:
+				fprintf(
+					out, " r%u, r%u, %u -> %u", INS_A(ins), INS_B(ins),
+					INS_C(ins) / VM_TYPE_COUNT, INS_C(ins) % VM_TYPE_COUNT
+				);
+				break;
+			default:
+				fprintf(out, " r%u, r%u, r%u", INS_A(ins), INS_B(ins), INS_C(ins));
+				break;
+			}
+
+			fprintf(out, "\n");
+		}
+	}
+}
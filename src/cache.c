@@ -0,0 +1,223 @@
+#include "cache.h"
+
+#include "ast.h"
+#include "consteval.h"
+#include "parse.h"
+#include "resolve.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static u64 hash_contents(const char *data, usize len) {
+	u64 hash = 14695981039346656037u; // FNV-1a
+	for (usize i = 0; i < len; i += 1) {
+		hash ^= (u8)data[i];
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+static void entry_clear(SourceCache *cache, CacheEntry *e) {
+	// Token data comes from the default allocator, like lex_release() frees it
+	for (u32 i = 0; i < e->tokenlen; i += 1) {
+		Token *tok = &e->tokens[i];
+		if (tok->kind == TK_IDENTIFIER) {
+			xfree(tok->ident);
+		} else if (tok->kind == TK_CCONST && (tok->flags & TOK_OWNED) != 0) {
+			xfree((char *)tok->str.ptr);
+		}
+	}
+	xfree(e->tokens);
+	xfree(e->lexerror);
+	xfree(e->diag);
+	if (e->file != 0) {
+		source_remove(&cache->sources, e->file);
+	}
+
+	e->file = 0;
+	e->len = 0;
+	e->lexed = false;
+	e->tokens = NULL;
+	e->tokenlen = 0;
+	e->lexerror = NULL;
+	e->checked = false;
+	e->diag = NULL;
+	e->diaglen = 0;
+}
+
+static void entry_drop(SourceCache *cache, CacheEntry *e) {
+	entry_clear(cache, e);
+	xfree(e->path);
+	e->path = NULL;
+	cache->cached -= 1;
+}
+
+void cache_init(SourceCache *cache) {
+	memset(cache, 0, sizeof(SourceCache));
+	intern_init(&cache->paths);
+	source_init(&cache->sources, NULL);
+	cache->entrysize = 64;
+	cache->entries = xcalloc(MEM_CACHE, cache->entrysize, sizeof(CacheEntry));
+}
+
+void cache_free(SourceCache *cache) {
+	for (u32 i = 0; i < cache->entrysize; i += 1) {
+		if (cache->entries[i].path != NULL) {
+			entry_drop(cache, &cache->entries[i]);
+		}
+	}
+	xfree(cache->entries);
+	source_free(&cache->sources);
+	intern_free(&cache->paths);
+}
+
+CacheEntry *cache_get(SourceCache *cache, const char *path) {
+	u32 id = intern(&cache->paths, path, strlen(path));
+	if (id >= cache->entrysize) {
+		u32 size = cache->entrysize * 2 > id ? cache->entrysize * 2 : id + 1;
+		cache->entries = xrealloc(MEM_CACHE, cache->entries, size * sizeof(CacheEntry));
+		memset(
+			&cache->entries[cache->entrysize], 0,
+			(size - cache->entrysize) * sizeof(CacheEntry)
+		);
+		cache->entrysize = size;
+	}
+	CacheEntry *e = &cache->entries[id];
+
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		int error = errno;
+		if (e->path != NULL) {
+			entry_drop(cache, e);
+		}
+		errno = error;
+		return NULL;
+	}
+
+	i64 mtime = (i64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	e->lastuse = cache->clock;
+	if (e->path != NULL && e->mtime == mtime && e->size == (u64)st.st_size
+	    && e->inode == (u64)st.st_ino) {
+		cache->hits += 1;
+		return e;
+	}
+
+	u32 file = source_load(&cache->sources, path);
+	if (file == 0) {
+		int error = errno;
+		if (e->path != NULL) {
+			entry_drop(cache, e);
+		}
+		errno = error;
+		return NULL;
+	}
+
+	e->mtime = mtime;
+	e->size = (u64)st.st_size;
+	e->inode = (u64)st.st_ino;
+
+	// Touched or rewritten with the same contents, the tokens are still valid
+	usize len;
+	const char *data = source_data(&cache->sources, file, &len);
+	u64 hash = hash_contents(data, len);
+	if (e->path != NULL && e->hash == hash && e->len == len) {
+		source_remove(&cache->sources, file);
+		cache->reloads += 1;
+		return e;
+	}
+
+	if (e->path == NULL) {
+		e->path = xstrndup(MEM_CACHE, path, strlen(path));
+		cache->cached += 1;
+	}
+	entry_clear(cache, e);
+	e->file = file;
+	e->len = len;
+	e->hash = hash;
+	cache->misses += 1;
+	return e;
+}
+
+void cache_lex(SourceCache *cache, CacheEntry *e) {
+	if (e->lexed) {
+		return;
+	}
+	e->lexed = true;
+
+	LexState lex;
+	if (!lex_init(&lex, &cache->sources, e->file, NULL)) {
+		e->lexerror = xstrndup(MEM_CACHE, "1:1 Out of memory", 32);
+		return;
+	}
+	lex.recover = true;
+
+	e->tokens = lex_scan_all(&lex, MEM_CACHE, &e->tokenlen);
+	if (e->tokens[e->tokenlen - 1].kind == TK_ERROR) {
+		e->lexerror = xstrndup(MEM_CACHE, lex.error, sizeof(lex.error));
+		e->tokenlen -= 1;
+	}
+
+	lex_close(&lex);
+}
+
+bool cache_check(SourceCache *cache, CacheEntry *e) {
+	cache_lex(cache, e);
+
+	Ast ast;
+	ast_init(&ast, &cache->sources);
+
+	// The command line reports the first error in the file, so a syntax error
+	// before the token the lexer failed on wins
+	char error[PARSE_ERROR_MAX];
+	u32 len = e->lexerror != NULL ? e->tokenlen + 1 : e->tokenlen;
+	bool ok = parse_tokens(e->tokens, len, NULL, &ast, error);
+	if (e->lexerror != NULL) {
+		char loc[32];
+		SourceLoc at = e->tokens[e->tokenlen].loc;
+		Location errloc = source_decode(&cache->sources, at, NULL);
+		snprintf(loc, sizeof(loc), "%d:%d ", errloc.lineno, errloc.colno);
+
+		bool before = !ok && strncmp(error, loc, strlen(loc)) != 0;
+		fprintf(stderr, "%s:%s\n", e->path, before ? error : e->lexerror);
+		ok = false;
+	} else if (!ok) {
+		fprintf(stderr, "%s:%s\n", e->path, error);
+	} else {
+		NodeIndex *decls = xcalloc(MEM_SYMBOLS, ast.nodelen, sizeof(NodeIndex));
+		ok = resolve_unit(&ast, e->path, decls);
+		if (ok) {
+			TypeTable types;
+			typetab_init(&types);
+			ConstEval consts;
+			consteval_init(&consts, &ast, decls, &types, e->path);
+			ok = consteval_unit(&consts);
+			consteval_free(&consts);
+			typetab_free(&types);
+		}
+		xfree(decls);
+	}
+
+	ast_free(&ast);
+	return ok;
+}
+
+void cache_evict(SourceCache *cache, u32 max) {
+	while (cache->cached > max) {
+		CacheEntry *oldest = NULL;
+		for (u32 i = 0; i < cache->entrysize; i += 1) {
+			CacheEntry *e = &cache->entries[i];
+			if (e->path != NULL && e->lastuse < cache->clock
+			    && (oldest == NULL || e->lastuse < oldest->lastuse)) {
+				oldest = e;
+			}
+		}
+
+		if (oldest == NULL) {
+			break;
+		}
+		entry_drop(cache, oldest);
+	}
+}
@@ -0,0 +1,594 @@
+#include "codegen.h"
+
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Move {
+	u32 dst;
+	u32 src;
+} Move;
+
+// Jump to patch once the blocks are placed
+typedef struct Jump {
+	u32 at;
+	u32 block;
+} Jump;
+
+typedef struct Codegen {
+	Program *prog;
+	IrFunc *f;
+	const char *error;
+
+	// Positions: two per instruction (operands are read at the first one and
+	// the result written at the second) and two per block boundary
+	u32 *from; // Block -> Position of its start, where its phis are defined
+	u32 *to;   // Block -> Position of its end, where the phi moves happen
+	u32 *pos;  // Instruction -> Position
+
+	u64 *livein; // Block -> Bitset of the values live at its start
+	u32 words;   // Bitset size
+
+	u32 *start; // Value -> Live range, a single interval covering all uses
+	u32 *end;
+	u32 *reg; // Value -> Register
+	u32 regs; // Registers used, including the temporary ones
+
+	u32 *code; // Block -> Offset of its first instruction
+	Jump *jumps;
+	u32 jumplen;
+	u32 jumpsize;
+} Codegen;
+
+static bool has_phis(const IrFunc *f, u32 block) {
+	const IrBlock *b = &f->blocks[block];
+	return b->len > 0 && f->insts[b->insts[0]].op == IR_PHI;
+}
+
+// Moves for the phis happen at the end of the predecessors, so the ones with
+// another successor need a block of their own
+static void split_critical_edges(IrFunc *f) {
+	ir_dominators(f);
+
+	bool split = false;
+	u32 len = f->blocklen;
+	for (u32 i = 0; i < len; i += 1) {
+		if (f->blocks[i].order == UINT32_MAX || f->blocks[i].succ[1] == IR_NO_BLOCK) {
+			continue;
+		}
+
+		for (u32 j = 0; j < 2; j += 1) {
+			u32 succ = f->blocks[i].succ[j];
+			if (has_phis(f, succ)) {
+				ir_split_edge(f, i, succ);
+				split = true;
+			}
+		}
+	}
+
+	if (split) {
+		ir_dominators(f);
+	}
+}
+
+static u32 pred_index(const IrFunc *f, u32 block, u32 pred) {
+	const IrBlock *b = &f->blocks[block];
+	u32 i = 0;
+	while (b->preds[i] != pred) {
+		i += 1;
+	}
+	return i;
+}
+
+static bool has_value(const IrFunc *f, IrRef ref) {
+	return f->insts[ref].type != IR_VOID;
+}
+
+static void set_bit(u64 *set, u32 bit) {
+	set[bit / 64] |= (u64)1 << (bit % 64);
+}
+
+static void clear_bit(u64 *set, u32 bit) {
+	set[bit / 64] &= ~((u64)1 << (bit % 64));
+}
+
+// Values live at the end of a block, with the operands of the successor phis
+static void live_out(const Codegen *g, u32 block, u64 *live) {
+	const IrFunc *f = g->f;
+	memset(live, 0, g->words * sizeof(u64));
+
+	for (u32 i = 0; i < 2; i += 1) {
+		u32 succ = f->blocks[block].succ[i];
+		if (succ == IR_NO_BLOCK) {
+			continue;
+		}
+
+		const u64 *in = &g->livein[(usize)succ * g->words];
+		for (u32 j = 0; j < g->words; j += 1) {
+			live[j] |= in[j];
+		}
+
+		const IrBlock *s = &f->blocks[succ];
+		u32 index = pred_index(f, succ, block);
+		for (u32 j = 0; j < s->len && f->insts[s->insts[j]].op == IR_PHI; j += 1) {
+			set_bit(live, f->extra[f->insts[s->insts[j]].a + index]);
+		}
+	}
+}
+
+static void compute_liveness(Codegen *g) {
+	IrFunc *f = g->f;
+	u64 *live = xcalloc(MEM_IR, g->words, sizeof(u64));
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (u32 i = f->rpolen; i > 0; i -= 1) {
+			u32 block = f->rpo[i - 1];
+			const IrBlock *b = &f->blocks[block];
+			live_out(g, block, live);
+
+			for (u32 j = b->len; j > 0; j -= 1) {
+				IrRef ref = b->insts[j - 1];
+				clear_bit(live, ref);
+				if (f->insts[ref].op == IR_PHI) {
+					continue; // Its operands are live in the predecessors
+				}
+
+				u32 count;
+				const u32 *operands = ir_operands(f, ref, &count);
+				for (u32 k = 0; k < count; k += 1) {
+					set_bit(live, operands[k]);
+				}
+			}
+
+			u64 *in = &g->livein[(usize)block * g->words];
+			if (memcmp(in, live, g->words * sizeof(u64)) != 0) {
+				memcpy(in, live, g->words * sizeof(u64));
+				changed = true;
+			}
+		}
+	}
+
+	xfree(live);
+}
+
+static void extend(Codegen *g, IrRef ref, u32 pos) {
+	g->start[ref] = pos < g->start[ref] ? pos : g->start[ref];
+	g->end[ref] = pos > g->end[ref] ? pos : g->end[ref];
+}
+
+static void extend_set(Codegen *g, const u64 *set, u32 pos) {
+	for (u32 i = 0; i < g->words; i += 1) {
+		u64 bits = set[i];
+		while (bits != 0) {
+			extend(g, i * 64 + (u32)__builtin_ctzll(bits), pos);
+			bits &= bits - 1;
+		}
+	}
+}
+
+static void build_intervals(Codegen *g) {
+	IrFunc *f = g->f;
+	u32 pos = 0;
+	for (u32 i = 0; i < f->rpolen; i += 1) {
+		const IrBlock *b = &f->blocks[f->rpo[i]];
+		g->from[f->rpo[i]] = pos;
+		pos += 2;
+		for (u32 j = 0; j < b->len; j += 1) {
+			IrRef ref = b->insts[j];
+			g->pos[ref] = f->insts[ref].op == IR_PHI ? g->from[f->rpo[i]] : pos;
+			pos += f->insts[ref].op == IR_PHI ? 0 : 2;
+		}
+		g->to[f->rpo[i]] = pos;
+		pos += 2;
+	}
+
+	compute_liveness(g);
+
+	u64 *live = xcalloc(MEM_IR, g->words, sizeof(u64));
+	for (u32 i = 0; i < f->rpolen; i += 1) {
+		u32 block = f->rpo[i];
+		const IrBlock *b = &f->blocks[block];
+
+		live_out(g, block, live);
+		extend_set(g, live, g->to[block]);
+		extend_set(g, &g->livein[(usize)block * g->words], g->from[block]);
+
+		for (u32 j = 0; j < b->len; j += 1) {
+			IrRef ref = b->insts[j];
+			if (f->insts[ref].op == IR_PHI) {
+				extend(g, ref, g->from[block]);
+				continue;
+			} else if (f->insts[ref].op == IR_PARAM) {
+				extend(g, ref, 0); // Passed in the first registers
+			}
+
+			if (has_value(f, ref)) {
+				extend(g, ref, g->pos[ref] + 1);
+			}
+
+			u32 count;
+			const u32 *operands = ir_operands(f, ref, &count);
+			for (u32 k = 0; k < count; k += 1) {
+				extend(g, operands[k], g->pos[ref]);
+			}
+		}
+	}
+	xfree(live);
+}
+
+static bool is_used(const Codegen *g, IrRef ref) {
+	return g->end[ref] > g->start[ref];
+}
+
+static int compare_u64(const void *a, const void *b) {
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Linear scan, the lowest free register is taken so few are used
+static bool allocate_registers(Codegen *g) {
+	IrFunc *f = g->f;
+	u64 *order = xcalloc(MEM_IR, f->instlen, sizeof(u64)); // Start << 32 | Value
+	u32 len = 0;
+	for (u32 i = 0; i < f->rpolen; i += 1) {
+		const IrBlock *b = &f->blocks[f->rpo[i]];
+		for (u32 j = 0; j < b->len; j += 1) {
+			if (has_value(f, b->insts[j])) {
+				order[len] = (u64)g->start[b->insts[j]] << 32 | b->insts[j];
+				len += 1;
+			}
+		}
+	}
+	qsort(order, len, sizeof(u64), compare_u64);
+
+	IrRef *active = xcalloc(MEM_IR, VM_MAX_REGS, sizeof(IrRef));
+	u32 activelen = 0;
+	bool taken[VM_MAX_REGS] = { false };
+	bool ok = true;
+
+	for (u32 i = 0; i < len && ok; i += 1) {
+		IrRef ref = (IrRef)order[i];
+		for (u32 j = 0; j < activelen;) {
+			if (g->end[active[j]] < g->start[ref]) {
+				taken[g->reg[active[j]]] = false;
+				activelen -= 1;
+				active[j] = active[activelen];
+			} else {
+				j += 1;
+			}
+		}
+
+		u32 reg = 0;
+		if (f->insts[ref].op == IR_PARAM) {
+			reg = f->insts[ref].a < VM_MAX_REGS ? f->insts[ref].a : VM_MAX_REGS;
+		} else {
+			while (reg < VM_MAX_REGS && taken[reg]) {
+				reg += 1;
+			}
+		}
+
+		if (reg == VM_MAX_REGS) {
+			ok = false;
+			break;
+		}
+
+		g->reg[ref] = reg;
+		g->regs = reg + 1 > g->regs ? reg + 1 : g->regs;
+		taken[reg] = true;
+		active[activelen] = ref;
+		activelen += 1;
+	}
+
+	xfree(order);
+	xfree(active);
+	return ok;
+}
+
+static void emit(Codegen *g, u32 ins) {
+	program_emit(g->prog, ins);
+}
+
+static void use_reg(Codegen *g, u32 reg) {
+	if (reg >= VM_MAX_REGS) {
+		g->error = "Function uses more than 256 registers";
+	} else if (reg + 1 > g->regs) {
+		g->regs = reg + 1;
+	}
+}
+
+static void emit_value(Codegen *g, u32 dst, Value value, VmType type) {
+	bool small = false;
+	if (type == VM_F32) {
+		u32 bits;
+		memcpy(&bits, &value.f, sizeof(u32));
+		small = bits == 0; // Not -0.0
+		value = small ? (Value) { .u = 0 } : value;
+	} else if (type == VM_F64) {
+		small = value.u == 0;
+	} else if (type <= VM_I64) {
+		small = value.i >= VM_SBX_MIN && value.i <= VM_SBX_MAX;
+	} else {
+		small = value.u <= VM_SBX_MAX;
+	}
+
+	// All zero bits are zero for every type
+	if (small) {
+		emit(g, INS_ABX(OP_LOADI, dst, (i32)value.i));
+		return;
+	}
+
+	u32 k = program_add_const(g->prog, value);
+	if (k <= UINT16_MAX) {
+		emit(g, INS_ABX(OP_LOADK, dst, k));
+	} else {
+		emit(g, INS_ABX(OP_LOADKX, dst, 0));
+		emit(g, k);
+	}
+}
+
+// Parallel moves, a cycle is broken by saving one of its sources in scratch
+static void emit_moves(Codegen *g, Move *moves, u32 len, u32 scratch) {
+	for (u32 i = 0; i < len;) {
+		if (moves[i].dst == moves[i].src) {
+			len -= 1;
+			moves[i] = moves[len];
+		} else {
+			i += 1;
+		}
+	}
+
+	while (len > 0) {
+		// A move whose destination isn't read by the others can be done first
+		u32 ready = len;
+		for (u32 i = 0; i < len && ready == len; i += 1) {
+			ready = i;
+			for (u32 j = 0; j < len; j += 1) {
+				if (moves[j].src == moves[i].dst) {
+					ready = len;
+					break;
+				}
+			}
+		}
+
+		if (ready == len) {
+			u32 src = moves[0].src;
+			use_reg(g, scratch);
+			emit(g, INS_ABC(OP_MOV, scratch, src, 0));
+			for (u32 i = 0; i < len; i += 1) {
+				moves[i].src = moves[i].src == src ? scratch : moves[i].src;
+			}
+			continue;
+		}
+
+		emit(g, INS_ABC(OP_MOV, moves[ready].dst, moves[ready].src, 0));
+		len -= 1;
+		moves[ready] = moves[len];
+	}
+}
+
+// First register free during a call, the callee may overwrite all the others
+static u32 call_base(const Codegen *g, IrRef call) {
+	const IrFunc *f = g->f;
+	u32 pos = g->pos[call];
+	u32 base = 0;
+	for (u32 i = 0; i < f->rpolen; i += 1) {
+		const IrBlock *b = &f->blocks[f->rpo[i]];
+		for (u32 j = 0; j < b->len; j += 1) {
+			IrRef ref = b->insts[j];
+			if (has_value(f, ref) && g->start[ref] <= pos && g->end[ref] > pos
+			    && g->reg[ref] + 1 > base) {
+				base = g->reg[ref] + 1;
+			}
+		}
+	}
+	return base;
+}
+
+static void emit_call(Codegen *g, IrRef ref) {
+	IrFunc *f = g->f;
+	const IrInst *inst = &f->insts[ref];
+	u32 base = call_base(g, ref);
+
+	u32 count;
+	const u32 *operands = ir_operands(f, ref, &count);
+	Move *moves = xcalloc(MEM_IR, count + 1, sizeof(Move));
+	for (u32 i = 0; i < count; i += 1) {
+		moves[i] = (Move) { .dst = base + i, .src = g->reg[operands[i]] };
+	}
+
+	use_reg(g, base + (count > 0 ? count - 1 : 0));
+	emit_moves(g, moves, count, g->regs > base + count ? g->regs : base + count);
+	xfree(moves);
+
+	if (inst->op == IR_CALLN) {
+		emit(g, INS_ABC(OP_CALLN, base, inst->aux, count));
+		emit(g, f->extra[inst->a]);
+	} else {
+		emit(g, INS_ABX(OP_CALL, base, inst->aux));
+		if (has_value(f, ref) && is_used(g, ref) && g->reg[ref] != base) {
+			emit(g, INS_ABC(OP_MOV, g->reg[ref], base, 0));
+		}
+	}
+}
+
+static void emit_phi_moves(Codegen *g, u32 block) {
+	IrFunc *f = g->f;
+	u32 succ = f->blocks[block].succ[0];
+	if (!has_phis(f, succ)) {
+		return;
+	}
+
+	const IrBlock *s = &f->blocks[succ];
+	u32 index = pred_index(f, succ, block);
+	Move *moves = xcalloc(MEM_IR, s->len, sizeof(Move));
+	u32 len = 0;
+	for (u32 i = 0; i < s->len && f->insts[s->insts[i]].op == IR_PHI; i += 1) {
+		IrRef phi = s->insts[i];
+		if (is_used(g, phi)) {
+			IrRef value = f->extra[f->insts[phi].a + index];
+			moves[len] = (Move) { .dst = g->reg[phi], .src = g->reg[value] };
+			len += 1;
+		}
+	}
+
+	emit_moves(g, moves, len, g->regs);
+	xfree(moves);
+}
+
+static void emit_jump(Codegen *g, Opcode op, u32 reg, u32 block) {
+	if (g->jumplen == g->jumpsize) {
+		g->jumpsize = g->jumpsize == 0 ? 16 : g->jumpsize * 2;
+		g->jumps = xrealloc(MEM_IR, g->jumps, g->jumpsize * sizeof(Jump));
+	}
+
+	g->jumps[g->jumplen] = (Jump) { .at = g->prog->codelen, .block = block };
+	g->jumplen += 1;
+	emit(g, op == OP_JMP ? INS_AX(op, 0) : INS_ABX(op, reg, 0));
+}
+
+static void emit_inst(Codegen *g, IrRef ref, u32 next) {
+	IrFunc *f = g->f;
+	const IrInst *inst = &f->insts[ref];
+	const IrBlock *b = &f->blocks[inst->block];
+	u32 dst = g->reg[ref];
+
+	// Unused values left by disabled passes
+	IrOp op = (IrOp)inst->op;
+	if ((ir_is_pure(f, ref) || op == IR_GGET) && !is_used(g, ref)) {
+		return;
+	}
+
+	switch (op) {
+	case IR_CONST:
+		emit_value(g, dst, *ir_const_value(f, ref), (VmType)inst->type);
+		break;
+	case IR_ARITH: {
+		bool unary = inst->aux == ARITH_NEG || inst->aux == ARITH_BNOT;
+		Opcode arith = vm_arith_op((VmType)inst->type, (VmArith)inst->aux);
+		emit(g, INS_ABC(arith, dst, g->reg[inst->a], unary ? 0 : g->reg[inst->b]));
+		break;
+	}
+	case IR_NOT:
+		emit(g, INS_ABC(OP_NOT, dst, g->reg[inst->a], 0));
+		break;
+	case IR_CAST:
+		emit(g, INS_ABC(OP_CAST, dst, g->reg[inst->a], inst->aux));
+		break;
+	case IR_GGET:
+		emit(g, INS_ABX(OP_GGET, dst, inst->a));
+		break;
+	case IR_GSET:
+		emit(g, INS_ABX(OP_GSET, g->reg[inst->b], inst->a));
+		break;
+	case IR_CALL:
+	case IR_CALLN:
+		emit_call(g, ref);
+		break;
+	case IR_JMP:
+		emit_phi_moves(g, inst->block);
+		if (b->succ[0] != next) {
+			emit_jump(g, OP_JMP, 0, b->succ[0]);
+		}
+		break;
+	case IR_BR:
+		if (b->succ[0] == next) {
+			emit_jump(g, OP_JMPF, g->reg[inst->a], b->succ[1]);
+		} else if (b->succ[1] == next) {
+			emit_jump(g, OP_JMPT, g->reg[inst->a], b->succ[0]);
+		} else {
+			emit_jump(g, OP_JMPF, g->reg[inst->a], b->succ[1]);
+			emit_jump(g, OP_JMP, 0, b->succ[0]);
+		}
+		break;
+	case IR_RET:
+		if (inst->a == IR_NONE) {
+			emit(g, INS_AX(OP_RET0, 0));
+		} else {
+			emit(g, INS_ABC(OP_RET, g->reg[inst->a], 0, 0));
+		}
+		break;
+	default: // IR_PARAM and IR_PHI
+		break;
+	}
+}
+
+static void patch_jumps(Codegen *g) {
+	for (u32 i = 0; i < g->jumplen; i += 1) {
+		u32 *ins = &g->prog->code[g->jumps[i].at];
+		i64 offset = (i64)g->code[g->jumps[i].block] - (g->jumps[i].at + 1);
+
+		if (INS_OP(*ins) == OP_JMP) {
+			if (offset < VM_SAX_MIN || offset > VM_SAX_MAX) {
+				g->error = "Jump is too long";
+			}
+			*ins = INS_AX(OP_JMP, (u32)offset & 0xFFFFFF);
+		} else {
+			if (offset < VM_SBX_MIN || offset > VM_SBX_MAX) {
+				g->error = "Jump is too long";
+			}
+			*ins = INS_ABX(INS_OP(*ins), INS_A(*ins), (i32)offset);
+		}
+	}
+}
+
+bool codegen_func(Program *prog, IrFunc *f, u32 index, const char **error) {
+	split_critical_edges(f);
+
+	Codegen g = {
+		.prog = prog,
+		.f = f,
+		.words = (f->instlen + 63) / 64,
+		.regs = f->params,
+	};
+	g.from = xcalloc(MEM_IR, f->blocklen, sizeof(u32));
+	g.to = xcalloc(MEM_IR, f->blocklen, sizeof(u32));
+	g.code = xcalloc(MEM_IR, f->blocklen, sizeof(u32));
+	g.pos = xcalloc(MEM_IR, f->instlen, sizeof(u32));
+	g.livein = xcalloc(MEM_IR, (usize)f->blocklen * g.words, sizeof(u64));
+	g.start = xcalloc(MEM_IR, f->instlen, sizeof(u32));
+	g.end = xcalloc(MEM_IR, f->instlen, sizeof(u32));
+	g.reg = xcalloc(MEM_IR, f->instlen, sizeof(u32));
+	memset(g.start, 0xFF, f->instlen * sizeof(u32));
+	memset(g.reg, 0xFF, f->instlen * sizeof(u32));
+
+	build_intervals(&g);
+	if (!allocate_registers(&g)) {
+		g.error = "Function uses more than 256 registers";
+	}
+
+	VmFunc *func = &prog->funcs[index];
+	func->start = prog->codelen;
+	for (u32 i = 0; i < f->rpolen && g.error == NULL; i += 1) {
+		u32 block = f->rpo[i];
+		u32 next = i + 1 < f->rpolen ? f->rpo[i + 1] : IR_NO_BLOCK;
+		const IrBlock *b = &f->blocks[block];
+
+		g.code[block] = prog->codelen;
+		for (u32 j = 0; j < b->len; j += 1) {
+			emit_inst(&g, b->insts[j], next);
+		}
+	}
+
+	if (g.error == NULL) {
+		patch_jumps(&g);
+	}
+	func->len = prog->codelen - func->start;
+	func->regs = (u16)g.regs;
+
+	xfree(g.from);
+	xfree(g.to);
+	xfree(g.code);
+	xfree(g.pos);
+	xfree(g.livein);
+	xfree(g.start);
+	xfree(g.end);
+	xfree(g.reg);
+	xfree(g.jumps);
+
+	*error = g.error;
+	return g.error == NULL;
+}
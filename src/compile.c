@@ -0,0 +1,1383 @@
+#include "compile.h"
+
+#include "codegen.h"
+#include "ir.h"
+#include "lex.h"
+#include "typetab.h"
+#include "util.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+#define TYPE_UNKNOWN 0xFF
+
+// Slots of declarations: function index + 1, global index with SLOT_GLOBAL set
+// or SLOT_LOCAL for the variables of the IR builder, keyed by the declaration
+#define SLOT_EMPTY  0
+#define SLOT_LOCAL  0x40000000u
+#define SLOT_GLOBAL 0x80000000u
+
+typedef struct Compiler {
+	Program *prog;
+	const Ast *ast;
+	const NodeIndex *decls;
+	TypeTable *types;
+	const ConstEval *consts;
+	const char *path;
+	bool ok;
+
+	u8 *nodetypes; // Node -> TypeStorage of expressions and declarations
+	u32 *slots;    // Declaration node -> Local, function or global
+	TypeId runes;  // []rune
+
+	PassManager *passes;
+	IrFunc *func; // Function being lowered
+	IrBuilder builder;
+	u32 block; // Block the instructions are appended to
+} Compiler;
+
+static const char *natives[NATIVE_COUNT] = {
+	[NATIVE_PRINTLN] = "std::fmt::println",
+};
+
+static void push_error(Compiler *c, NodeIndex node, const char *fmt, ...) {
+	Location loc = source_decode(c->ast->sources, c->ast->locs[node], NULL);
+	fprintf(stderr, "%s:%d:%d ", c->path, loc.lineno, loc.colno);
+
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+
+	fprintf(stderr, "\n");
+	c->ok = false;
+}
+
+static const char *name_str(const Compiler *c, u32 name) {
+	return intern_str(&c->ast->names, name);
+}
+
+static bool is_int(TypeStorage storage) {
+	switch (storage) {
+	case TYPE_I8:
+	case TYPE_I16:
+	case TYPE_I32:
+	case TYPE_I64:
+	case TYPE_U8:
+	case TYPE_U16:
+	case TYPE_U32:
+	case TYPE_U64:
+	case TYPE_INT:
+	case TYPE_RUNE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool is_float(TypeStorage storage) {
+	return storage == TYPE_F32 || storage == TYPE_F64 || storage == TYPE_FLOAT;
+}
+
+static bool is_untyped(TypeStorage storage) {
+	return storage == TYPE_INT || storage == TYPE_FLOAT;
+}
+
+static bool vm_type(TypeStorage storage, VmType *out) {
+	switch (storage) {
+	case TYPE_I8:
+		*out = VM_I8;
+		return true;
+	case TYPE_I16:
+		*out = VM_I16;
+		return true;
+	case TYPE_I32:
+		*out = VM_I32;
+		return true;
+	case TYPE_I64:
+		*out = VM_I64;
+		return true;
+	case TYPE_BOOL:
+	case TYPE_U8:
+		*out = VM_U8;
+		return true;
+	case TYPE_U16:
+		*out = VM_U16;
+		return true;
+	case TYPE_U32:
+	case TYPE_RUNE:
+	case TYPE_STRING:
+		*out = VM_U32;
+		return true;
+	case TYPE_U64:
+		*out = VM_U64;
+		return true;
+	case TYPE_F32:
+		*out = VM_F32;
+		return true;
+	case TYPE_F64:
+		*out = VM_F64;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Type of untyped constants where the context doesn't give one
+static TypeStorage concrete(TypeStorage storage, TypeStorage hint) {
+	if (storage == TYPE_INT) {
+		bool typed = (is_int(hint) || is_float(hint)) && !is_untyped(hint);
+		return typed ? hint : TYPE_I32;
+	} else if (storage == TYPE_FLOAT) {
+		return hint == TYPE_F32 ? TYPE_F32 : TYPE_F64;
+	}
+	return storage;
+}
+
+// Common type of binary operands, same rules as the constant evaluator
+static bool unify_types(TypeStorage a, TypeStorage b, TypeStorage *out) {
+	if (a == b) {
+		*out = a;
+	} else if (is_untyped(a) && (!is_untyped(b) || b == TYPE_FLOAT)) {
+		*out = b;
+		return a == TYPE_INT ? is_int(b) || is_float(b) : is_float(b);
+	} else if (is_untyped(b)) {
+		*out = a;
+		return b == TYPE_INT ? is_int(a) || is_float(a) : is_float(a);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static bool expect_type(Compiler *c, NodeIndex node, TypeStorage got, TypeStorage want) {
+	if (got != want) {
+		push_error(
+			c, node, "Mismatched types %s and %s", type_storage2str(got),
+			type_storage2str(want)
+		);
+		return false;
+	}
+	return true;
+}
+
+// Machine type of a value, unsupported types were reported where checked
+static VmType machine_type(TypeStorage storage) {
+	VmType type = VM_I32;
+	vm_type(storage, &type);
+	return type;
+}
+
+static IrRef emit(Compiler *c, IrOp op, u8 type, u16 aux, u32 a, u32 b) {
+	return ir_add(c->func, c->block, op, type, aux, a, b);
+}
+
+static IrRef emit_value(Compiler *c, Value value, VmType type) {
+	return ir_const(c->func, c->block, type, value);
+}
+
+// Convert a compile-time value to a register value of the storage type
+static bool const_to_value(
+	Compiler *c, NodeIndex node, const ConstValue *v, TypeStorage storage, Value *out
+) {
+	TypeStorage from = (TypeStorage)v->storage;
+	VmType type;
+
+	if (!vm_type(storage, &type) || from == TYPE_ARRAY) {
+		push_error(
+			c, node, "Values of type %s are not supported by the bytecode compiler",
+			type_storage2str(from == TYPE_ARRAY ? TYPE_ARRAY : storage)
+		);
+		return false;
+	}
+
+	if ((is_int(from) || from == TYPE_BOOL) && is_float(storage)) {
+		if (from != TYPE_INT) {
+			return expect_type(c, node, from, storage);
+		}
+
+		f64 value = v->neg ? -(f64)v->mag : (f64)v->mag;
+		*out = storage == TYPE_F32 ? (Value) { .f = (f32)value } : (Value) { .d = value };
+	} else if (is_int(from) || from == TYPE_BOOL) {
+		if (from != storage && (from != TYPE_INT || !is_int(storage))) {
+			return expect_type(c, node, from, storage);
+		} else if (storage != TYPE_BOOL && !const_fits(v, storage)) {
+			push_error(c, node, "Constant overflows %s", type_storage2str(storage));
+			return false;
+		}
+
+		*out = vm_norm_int(v->neg ? 0 - v->mag : v->mag, type);
+	} else if (is_float(from)) {
+		if (!is_float(storage) || (from != storage && from != TYPE_FLOAT)) {
+			return expect_type(c, node, from, storage);
+		}
+		*out = storage == TYPE_F32 ? (Value) { .f = (f32)v->fval }
+		                           : (Value) { .d = v->fval };
+	} else {
+		if (storage != TYPE_STRING) {
+			return expect_type(c, node, from, storage);
+		}
+
+		const char *str = name_str(c, v->str);
+		*out = (Value) { .u = intern(&c->prog->strings, str, strlen(str)) };
+	}
+
+	return true;
+}
+
+static void load_const(
+	Compiler *c, NodeIndex node, const ConstValue *v, TypeStorage storage, IrRef *out
+) {
+	Value value;
+	VmType type;
+	if (const_to_value(c, node, v, storage, &value) && out != NULL
+	    && vm_type(storage, &type)) {
+		*out = emit_value(c, value, type);
+	}
+}
+
+// Literal value, with an optional minus sign folded in
+static ConstValue literal_value(const Compiler *c, NodeIndex node, bool neg) {
+	const AstNode *n = &c->ast->nodes[node];
+	ConstValue v = { 0 };
+
+	switch ((AstKind)n->kind) {
+	case AST_INT:
+		v.storage = TYPE_INT;
+		v.mag = (u64)n->rhs << 32 | n->lhs;
+		v.neg = neg && v.mag != 0;
+		break;
+	case AST_FLOAT: {
+		u64 bits = (u64)n->rhs << 32 | n->lhs;
+		v.storage = TYPE_FLOAT;
+		memcpy(&v.fval, &bits, sizeof(f64));
+		v.fval = neg ? -v.fval : v.fval;
+		break;
+	}
+	case AST_RUNE:
+		v.storage = TYPE_RUNE;
+		v.mag = n->lhs;
+		break;
+	case AST_BOOL:
+		v.storage = TYPE_BOOL;
+		v.mag = n->lhs;
+		break;
+	default:
+		v.storage = TYPE_STRING;
+		v.str = n->lhs;
+		break;
+	}
+
+	return v;
+}
+
+// Storage of a type node, strings are the only supported arrays
+static TypeStorage type_storage(Compiler *c, NodeIndex type) {
+	TypeId id = type_from_ast(c->types, c->ast, type);
+	if (id == TYPE_ID_NONE) {
+		return TYPE_ARRAY; // Length that isn't a literal
+	}
+
+	return id == c->runes ? TYPE_STRING : (TypeStorage)type_get(c->types, id)->storage;
+}
+
+static TypeStorage expr_type(Compiler *c, NodeIndex node);
+
+static TypeStorage decl_type(Compiler *c, NodeIndex decl) {
+	if (c->nodetypes[decl] != TYPE_UNKNOWN) {
+		return (TypeStorage)c->nodetypes[decl];
+	}
+
+	const Ast *ast = c->ast;
+	const AstNode *n = &ast->nodes[decl];
+	c->nodetypes[decl] = TYPE_VOID; // Cycles were reported by the constant evaluator
+
+	TypeStorage storage = TYPE_VOID;
+	if (n->kind == AST_FN_DECL) {
+		storage = TYPE_FUNC;
+	} else {
+		NodeIndex type = ast->extra[n->rhs];
+		NodeIndex init = ast->extra[n->rhs + 1];
+
+		const ConstValue *value = consteval_get(c->consts, decl);
+		if (type != AST_NONE) {
+			storage = type_storage(c, type);
+		} else if (value != NULL && (n->flags & AST_FLAG_MUT) == 0) {
+			storage = (TypeStorage)value->storage; // Untyped constants stay untyped
+		} else if (init != AST_NONE) {
+			storage = concrete(expr_type(c, init), TYPE_VOID);
+		}
+	}
+
+	c->nodetypes[decl] = (u8)storage;
+	return storage;
+}
+
+static NodeIndex callee_decl(Compiler *c, NodeIndex call) {
+	NodeIndex callee = c->ast->nodes[call].lhs;
+	return c->ast->nodes[callee].kind == AST_IDENT ? c->decls[callee] : AST_NONE;
+}
+
+// Natural type of an expression, TYPE_INT and TYPE_FLOAT for untyped constants
+static TypeStorage expr_type(Compiler *c, NodeIndex node) {
+	if (c->nodetypes[node] != TYPE_UNKNOWN) {
+		return (TypeStorage)c->nodetypes[node];
+	}
+
+	const Ast *ast = c->ast;
+	const AstNode *n = &ast->nodes[node];
+	TypeStorage storage = TYPE_VOID;
+
+	switch ((AstKind)n->kind) {
+	case AST_INT:
+		storage = TYPE_INT;
+		break;
+	case AST_FLOAT:
+		storage = TYPE_FLOAT;
+		break;
+	case AST_RUNE:
+		storage = TYPE_RUNE;
+		break;
+	case AST_BOOL:
+		storage = TYPE_BOOL;
+		break;
+	case AST_STRING:
+		storage = TYPE_STRING;
+		break;
+	case AST_ARRAY:
+		storage = TYPE_ARRAY;
+		break;
+	case AST_IDENT:
+		if (c->decls[node] != AST_NONE) {
+			storage = decl_type(c, c->decls[node]);
+		}
+		break;
+	case AST_UNARY:
+		storage = n->op == TK_LNOT ? TYPE_BOOL
+		        : n->op == TK_BAND ? TYPE_POINTER
+		        : n->op == TK_STAR ? TYPE_VOID
+		                           : expr_type(c, n->lhs);
+		break;
+	case AST_BINARY:
+		switch ((TokenKind)n->op) {
+		case TK_LEQUAL_EQ:
+		case TK_LNOT_EQ:
+		case TK_LESS:
+		case TK_LESS_EQ:
+		case TK_GREATER:
+		case TK_GREATER_EQ:
+		case TK_LAND:
+		case TK_LOR:
+			storage = TYPE_BOOL;
+			break;
+		case TK_SHIFTL:
+		case TK_SHIFTR:
+			storage = expr_type(c, n->lhs);
+			break;
+		default:
+			if (!unify_types(expr_type(c, n->lhs), expr_type(c, n->rhs), &storage)) {
+				storage = TYPE_VOID;
+			}
+			break;
+		}
+		break;
+	case AST_CAST:
+		storage = type_storage(c, n->rhs);
+		break;
+	case AST_CALL: {
+		NodeIndex decl = callee_decl(c, node);
+		if (decl != AST_NONE && ast->nodes[decl].kind == AST_FN_DECL) {
+			NodeIndex proto = ast->extra[ast->nodes[decl].rhs];
+			NodeIndex ret = ast->nodes[proto].rhs;
+			storage = ret == AST_NONE ? TYPE_VOID : type_storage(c, ret);
+		}
+		break;
+	}
+	case AST_BLOCK:
+		if (n->rhs > n->lhs) {
+			NodeIndex last = ast->extra[n->rhs - 1];
+			if (ast->nodes[last].kind != AST_BINDING) {
+				storage = expr_type(c, last);
+			}
+		}
+		break;
+	case AST_IF: {
+		NodeIndex then = ast->extra[n->rhs];
+		NodeIndex other = ast->extra[n->rhs + 1];
+		if (other != AST_NONE
+		    && !unify_types(expr_type(c, then), expr_type(c, other), &storage)) {
+			storage = TYPE_VOID;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	c->nodetypes[node] = (u8)storage;
+	return storage;
+}
+
+static TypeStorage compile_expr(
+	Compiler *c, NodeIndex node, TypeStorage hint, IrRef *out
+);
+
+// Value of an expression of the given type
+static IrRef operand(Compiler *c, NodeIndex node, TypeStorage storage) {
+	IrRef value = IR_NONE;
+	expect_type(c, node, compile_expr(c, node, storage, &value), storage);
+	return value;
+}
+
+static TypeStorage compile_ident(
+	Compiler *c, NodeIndex node, TypeStorage hint, IrRef *out
+) {
+	NodeIndex decl = c->decls[node];
+	if (decl == AST_NONE) {
+		push_error(
+			c, node, "'%s' is not supported by the bytecode compiler",
+			name_str(c, c->ast->nodes[node].lhs)
+		);
+		return TYPE_VOID;
+	}
+
+	const AstNode *d = &c->ast->nodes[decl];
+	if (d->kind == AST_FN_DECL) {
+		push_error(c, node, "Function values are not supported by the bytecode compiler");
+		return TYPE_FUNC;
+	}
+
+	TypeStorage storage = decl_type(c, decl);
+	const ConstValue *value = consteval_get(c->consts, decl);
+	if (value != NULL && (d->flags & AST_FLAG_MUT) == 0) {
+		storage = concrete(storage, hint);
+		load_const(c, node, value, storage, out);
+		return storage;
+	}
+
+	u32 slot = c->slots[decl];
+	if (out == NULL || slot == SLOT_EMPTY) {
+		return storage;
+	} else if ((slot & SLOT_GLOBAL) != 0) {
+		*out = emit(c, IR_GGET, machine_type(storage), 0, slot & ~SLOT_GLOBAL, 0);
+	} else {
+		*out = ir_read_var(&c->builder, decl, c->block, machine_type(storage));
+	}
+	return storage;
+}
+
+static bool arith_op(TokenKind op, VmArith *out) {
+	switch (op) {
+	case TK_PLUS:
+	case TK_PLUS_EQ:
+		*out = ARITH_ADD;
+		return true;
+	case TK_MINUS:
+	case TK_MINUS_EQ:
+		*out = ARITH_SUB;
+		return true;
+	case TK_STAR:
+	case TK_STAR_EQ:
+		*out = ARITH_MUL;
+		return true;
+	case TK_SLASH:
+	case TK_SLASH_EQ:
+		*out = ARITH_DIV;
+		return true;
+	case TK_MOD:
+	case TK_MOD_EQ:
+		*out = ARITH_MOD;
+		return true;
+	case TK_BAND:
+	case TK_BAND_EQ:
+		*out = ARITH_AND;
+		return true;
+	case TK_BOR:
+	case TK_BOR_EQ:
+		*out = ARITH_OR;
+		return true;
+	case TK_BXOR:
+	case TK_BXOR_EQ:
+		*out = ARITH_XOR;
+		return true;
+	case TK_SHIFTL:
+	case TK_SHIFTL_EQ:
+		*out = ARITH_SHL;
+		return true;
+	case TK_SHIFTR:
+	case TK_SHIFTR_EQ:
+		*out = ARITH_SHR;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Typed opcode, bools and strings only support equality
+static Opcode typed_op(Compiler *c, NodeIndex node, TypeStorage storage, VmArith arith) {
+	VmType type;
+	bool numeric = is_int(storage) || is_float(storage);
+	bool equality = arith == ARITH_EQ || arith == ARITH_NE;
+
+	Opcode op = OP_NOP;
+	if (vm_type(storage, &type) && (numeric || equality)) {
+		op = vm_arith_op(type, arith);
+	}
+
+	if (op == OP_NOP) {
+		push_error(
+			c, node, "Invalid operation on type %s", type_storage2str(storage)
+		);
+	}
+	return op;
+}
+
+// Both operands are evaluated in a block of their own, the result merges the
+// left one (which decided) with the right one
+static TypeStorage compile_logical(Compiler *c, NodeIndex node, IrRef *out) {
+	const AstNode *n = &c->ast->nodes[node];
+	IrFunc *f = c->func;
+
+	IrRef lhs = operand(c, n->lhs, TYPE_BOOL);
+	u32 rhsblock = ir_add_block(f);
+	u32 join = ir_add_block(f);
+	if (n->op == TK_LAND) {
+		ir_branch(f, c->block, lhs, rhsblock, join);
+	} else {
+		ir_branch(f, c->block, lhs, join, rhsblock);
+	}
+
+	ir_seal(&c->builder, rhsblock);
+	c->block = rhsblock;
+	IrRef rhs = operand(c, n->rhs, TYPE_BOOL);
+	ir_jump(f, c->block, join);
+
+	ir_seal(&c->builder, join);
+	c->block = join;
+	if (out != NULL) {
+		IrRef values[2] = { lhs, rhs };
+		*out = ir_phi(f, join, VM_U8, values);
+	}
+	return TYPE_BOOL;
+}
+
+static TypeStorage compile_binary(
+	Compiler *c, NodeIndex node, TypeStorage hint, IrRef *out
+) {
+	const AstNode *n = &c->ast->nodes[node];
+	TokenKind tok = (TokenKind)n->op;
+	if (tok == TK_LAND || tok == TK_LOR) {
+		return compile_logical(c, node, out);
+	}
+
+	TypeStorage lt = expr_type(c, n->lhs);
+	TypeStorage rt = expr_type(c, n->rhs);
+	NodeIndex lhs = n->lhs;
+	NodeIndex rhs = n->rhs;
+
+	TypeStorage storage;
+	TypeStorage result;
+	VmArith arith;
+
+	if (tok == TK_SHIFTL || tok == TK_SHIFTR) {
+		storage = concrete(lt, hint);
+		result = storage;
+		arith = tok == TK_SHIFTL ? ARITH_SHL : ARITH_SHR;
+		if (!is_int(rt)) {
+			push_error(c, n->rhs, "Shift amount must be an integer");
+			return result;
+		}
+	} else if (!unify_types(lt, rt, &storage)) {
+		push_error(
+			c, node, "Mismatched types %s and %s", type_storage2str(lt),
+			type_storage2str(rt)
+		);
+		return TYPE_VOID;
+	} else if (arith_op(tok, &arith)) {
+		storage = concrete(storage, hint);
+		result = storage;
+	} else {
+		storage = concrete(storage, TYPE_VOID);
+		result = TYPE_BOOL;
+		switch (tok) {
+		case TK_LEQUAL_EQ:
+			arith = ARITH_EQ;
+			break;
+		case TK_LNOT_EQ:
+			arith = ARITH_NE;
+			break;
+		case TK_LESS:
+			arith = ARITH_LT;
+			break;
+		case TK_LESS_EQ:
+			arith = ARITH_LE;
+			break;
+		case TK_GREATER:
+			arith = ARITH_LT;
+			lhs = n->rhs;
+			rhs = n->lhs;
+			break;
+		default: // TK_GREATER_EQ
+			arith = ARITH_LE;
+			lhs = n->rhs;
+			rhs = n->lhs;
+			break;
+		}
+	}
+
+	if (typed_op(c, node, storage, arith) == OP_NOP) {
+		return result;
+	}
+
+	IrRef a = operand(c, lhs, storage);
+	IrRef b = arith == ARITH_SHL || arith == ARITH_SHR
+	        ? operand(c, rhs, concrete(rt, storage))
+	        : operand(c, rhs, storage);
+
+	if (out != NULL) {
+		*out = emit(c, IR_ARITH, machine_type(storage), arith, a, b);
+	}
+	return result;
+}
+
+static TypeStorage compile_unary(
+	Compiler *c, NodeIndex node, TypeStorage hint, IrRef *out
+) {
+	const AstNode *n = &c->ast->nodes[node];
+	const AstNode *operand_node = &c->ast->nodes[n->lhs];
+	if (n->op == TK_MINUS
+	    && (operand_node->kind == AST_INT || operand_node->kind == AST_FLOAT)) {
+		ConstValue value = literal_value(c, n->lhs, true);
+		TypeStorage storage = concrete((TypeStorage)value.storage, hint);
+		load_const(c, node, &value, storage, out);
+		return storage;
+	} else if (n->op == TK_STAR || n->op == TK_BAND) {
+		push_error(c, node, "Pointers are not supported by the bytecode compiler");
+		return TYPE_VOID;
+	}
+
+	TypeStorage storage = n->op == TK_LNOT ? TYPE_BOOL
+	                                        : concrete(expr_type(c, n->lhs), hint);
+	Opcode op = OP_NOT;
+	if (n->op == TK_MINUS) {
+		op = typed_op(c, node, storage, ARITH_NEG);
+	} else if (n->op == TK_BNOT) {
+		op = is_int(storage) ? typed_op(c, node, storage, ARITH_BNOT) : OP_NOP;
+		if (op == OP_NOP && is_float(storage)) {
+			push_error(
+				c, node, "Invalid operation on type %s", type_storage2str(storage)
+			);
+		}
+	}
+
+	if (op == OP_NOP) {
+		return storage;
+	}
+
+	IrRef src = operand(c, n->lhs, storage);
+	if (out == NULL) {
+		return storage;
+	} else if (op == OP_NOT) {
+		*out = emit(c, IR_NOT, VM_U8, 0, src, 0);
+	} else {
+		VmArith arith = n->op == TK_MINUS ? ARITH_NEG : ARITH_BNOT;
+		*out = emit(c, IR_ARITH, machine_type(storage), arith, src, 0);
+	}
+	return storage;
+}
+
+// Value of a literal, a negated literal or a folded constant
+static bool const_operand(Compiler *c, NodeIndex node, ConstValue *out) {
+	const AstNode *n = &c->ast->nodes[node];
+	const AstNode *operand_node = &c->ast->nodes[n->lhs];
+
+	if (n->kind >= AST_INT && n->kind <= AST_BOOL) {
+		*out = literal_value(c, node, false);
+		return true;
+	} else if (n->kind == AST_UNARY && n->op == TK_MINUS
+	           && (operand_node->kind == AST_INT || operand_node->kind == AST_FLOAT)) {
+		*out = literal_value(c, n->lhs, true);
+		return true;
+	} else if (n->kind == AST_IDENT && c->decls[node] != AST_NONE) {
+		NodeIndex decl = c->decls[node];
+		const ConstValue *value = consteval_get(c->consts, decl);
+		if (value != NULL && (c->ast->nodes[decl].flags & AST_FLAG_MUT) == 0) {
+			*out = *value;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static TypeStorage compile_cast(Compiler *c, NodeIndex node, IrRef *out) {
+	const AstNode *n = &c->ast->nodes[node];
+	TypeStorage to = type_storage(c, n->rhs);
+	TypeStorage from = expr_type(c, n->lhs);
+
+	// Untyped integer constants wrap to the width of the target, like in the
+	// constant evaluator
+	VmType vf, vt;
+	ConstValue value;
+	if (from == TYPE_INT && is_int(to) && const_operand(c, n->lhs, &value)) {
+		if (out != NULL && vm_type(to, &vt)) {
+			u64 bits = value.neg ? 0 - value.mag : value.mag;
+			*out = emit_value(c, vm_norm_int(bits, vt), vt);
+		}
+		return to;
+	}
+
+	// Other untyped constants are converted at run time from their widest type
+	from = from == TYPE_INT ? TYPE_I64 : from == TYPE_FLOAT ? TYPE_F64 : from;
+
+	bool valid = vm_type(from, &vf) && vm_type(to, &vt) && from != TYPE_STRING
+	          && to != TYPE_STRING && (to != TYPE_BOOL || from == TYPE_BOOL);
+	if (!valid) {
+		push_error(
+			c, node, "Invalid cast from %s to %s", type_storage2str(from),
+			type_storage2str(to)
+		);
+		return to;
+	}
+
+	IrRef src = operand(c, n->lhs, from);
+	if (out != NULL) {
+		*out = vf != vt ? emit(c, IR_CAST, vt, (u16)(vf * VM_TYPE_COUNT + vt), src, 0)
+		                : src;
+	}
+	return to;
+}
+
+static VmNative native_lookup(Compiler *c, NodeIndex ident) {
+	char name[256];
+	if (!ast_full_name(c->ast, ident, name, sizeof(name))) {
+		return NATIVE_COUNT;
+	}
+
+	for (u32 i = 0; i < NATIVE_COUNT; i += 1) {
+		if (natives[i] != NULL && strcmp(name, natives[i]) == 0) {
+			return (VmNative)i;
+		}
+	}
+	return NATIVE_COUNT;
+}
+
+// Text of a format string known at compile time, NULL otherwise
+static const char *const_format(Compiler *c, NodeIndex node) {
+	const AstNode *n = &c->ast->nodes[node];
+	ConstValue value;
+	if (n->kind == AST_STRING) {
+		return name_str(c, n->lhs);
+	} else if (const_operand(c, node, &value) && value.storage == TYPE_STRING) {
+		return name_str(c, value.str);
+	}
+	return NULL;
+}
+
+// Split a format into the text between placeholders and their conversions,
+// with the same rules the VM applies to formats only known at run time
+static bool compile_fmt(
+	Compiler *c, NodeIndex node, const char *fmt, const u8 *types, u32 count, u32 *out
+) {
+	usize len = strlen(fmt);
+	VmFmtSegment *segments = xcalloc(MEM_VM, len / 2 + 1, sizeof(VmFmtSegment));
+	char *text = xcalloc(MEM_VM, len + 1, sizeof(char));
+	usize textlen = 0;
+	u32 segmentlen = 0;
+	const char *error = NULL;
+
+	for (usize i = 0; i < len; i += 1) {
+		if (fmt[i] != '{' && fmt[i] != '}') {
+			text[textlen] = fmt[i];
+			textlen += 1;
+			continue;
+		} else if (i + 1 < len && fmt[i + 1] == fmt[i]) {
+			text[textlen] = fmt[i];
+			textlen += 1;
+			i += 1;
+			continue;
+		} else if (fmt[i] == '}') {
+			error = "Unmatched '}' in format string";
+			break;
+		}
+
+		char spec = '\0';
+		bool hex = i + 2 < len && (fmt[i + 1] == 'x' || fmt[i + 1] == 'X');
+		if (hex && fmt[i + 2] == '}') {
+			spec = fmt[i + 1];
+			i += 2;
+		} else if (i + 1 < len && fmt[i + 1] == '}') {
+			i += 1;
+		} else {
+			error = "Invalid format specifier";
+			break;
+		}
+
+		if (segmentlen == count) {
+			error = "Missing format argument";
+			break;
+		}
+
+		VmFmtConv conv = vm_fmt_conv((TypeStorage)types[segmentlen], spec);
+		if (conv == FMT_END) {
+			error = "Hexadecimal format of a non-integer";
+			break;
+		}
+
+		segments[segmentlen] = (VmFmtSegment) {
+			.text = intern(&c->prog->strings, text, textlen),
+			.conv = (u8)conv,
+			.storage = types[segmentlen],
+		};
+		segmentlen += 1;
+		textlen = 0;
+	}
+
+	if (error == NULL && segmentlen != count) {
+		error = "Too many format arguments";
+	}
+
+	if (error == NULL) {
+		text[textlen] = '\n';
+		segments[segmentlen] = (VmFmtSegment) {
+			.text = intern(&c->prog->strings, text, textlen + 1),
+			.conv = FMT_END,
+		};
+		*out = program_add_fmt(c->prog, segments, segmentlen + 1);
+	} else {
+		push_error(c, node, "%s", error);
+	}
+
+	xfree(text);
+	xfree(segments);
+	return error == NULL;
+}
+
+static TypeStorage compile_native_call(Compiler *c, NodeIndex node, VmNative native) {
+	const Ast *ast = c->ast;
+	const AstNode *n = &ast->nodes[node];
+	u32 start = ast->extra[n->rhs];
+	u32 end = ast->extra[n->rhs + 1];
+
+	if (end - start > UINT8_MAX) {
+		push_error(c, node, "Too many arguments");
+		return TYPE_VOID;
+	} else if (native == NATIVE_PRINTLN
+	           && (end == start || expr_type(c, ast->extra[start]) != TYPE_STRING)) {
+		push_error(c, node, "The first argument of println must be a format string");
+		return TYPE_VOID;
+	}
+
+	// Constant formats are split now, only the placeholders are passed then
+	const char *fmt = NULL;
+	if (native == NATIVE_PRINTLN) {
+		fmt = const_format(c, ast->extra[start]);
+	}
+	u32 skip = fmt != NULL ? 1 : 0;
+
+	// The signature or the format comes first, then the arguments
+	u8 types[UINT8_MAX];
+	IrRef values[UINT8_MAX + 1];
+	for (u32 i = start + skip; i < end; i += 1) {
+		NodeIndex arg = ast->extra[i];
+		TypeStorage storage = concrete(expr_type(c, arg), TYPE_VOID);
+
+		VmType type;
+		if (!vm_type(storage, &type)) {
+			push_error(
+				c, arg, "Cannot format values of type %s", type_storage2str(storage)
+			);
+		}
+		types[i - start - skip] = (u8)storage;
+		values[i - start - skip + 1] = operand(c, arg, storage);
+	}
+
+	u32 count = end - start - skip;
+	if (fmt == NULL) {
+		values[0] = program_add_sig(c->prog, types, (u8)count);
+	} else if (compile_fmt(c, node, fmt, types, count, &values[0])) {
+		native = NATIVE_PRINTLN_FMT;
+	} else {
+		return TYPE_VOID;
+	}
+
+	u32 first = ir_add_extra(c->func, values, count + 1);
+	emit(c, IR_CALLN, IR_VOID, native, first, first + count + 1);
+	return TYPE_VOID;
+}
+
+static TypeStorage compile_call(Compiler *c, NodeIndex node, IrRef *out) {
+	const Ast *ast = c->ast;
+	const AstNode *n = &ast->nodes[node];
+	NodeIndex decl = callee_decl(c, node);
+
+	if (decl == AST_NONE && ast->nodes[n->lhs].kind == AST_IDENT) {
+		VmNative native = native_lookup(c, n->lhs);
+		if (native != NATIVE_COUNT) {
+			return compile_native_call(c, node, native);
+		}
+	}
+
+	if (decl == AST_NONE || ast->nodes[decl].kind != AST_FN_DECL) {
+		push_error(c, node, "Only functions can be called by the bytecode compiler");
+		return TYPE_VOID;
+	}
+
+	NodeIndex proto = ast->extra[ast->nodes[decl].rhs];
+	const AstNode *p = &ast->nodes[proto];
+	u32 pstart = ast->extra[p->lhs];
+	u32 pend = ast->extra[p->lhs + 1];
+	u32 astart = ast->extra[n->rhs];
+	u32 aend = ast->extra[n->rhs + 1];
+
+	if (aend - astart > pend - pstart) {
+		push_error(
+			c, node, "Too many arguments to '%s'", name_str(c, ast->nodes[decl].lhs)
+		);
+		return TYPE_VOID;
+	}
+
+	IrRef *args = xcalloc(MEM_IR, pend - pstart + 1, sizeof(IrRef));
+	for (u32 i = 0; i < pend - pstart; i += 1) {
+		NodeIndex param = ast->extra[pstart + i];
+		NodeIndex arg = astart + i < aend ? ast->extra[astart + i]
+		                                  : ast->extra[ast->nodes[param].rhs + 1];
+		if (arg == AST_NONE) {
+			push_error(
+				c, node, "Missing argument '%s'", name_str(c, ast->nodes[param].lhs)
+			);
+			continue;
+		}
+
+		args[i] = operand(c, arg, decl_type(c, param));
+	}
+
+	TypeStorage ret = expr_type(c, node);
+	VmType type;
+	u8 value = vm_type(ret, &type) ? (u8)type : IR_VOID;
+	u32 first = ir_add_extra(c->func, args, pend - pstart);
+	xfree(args);
+
+	u16 index = (u16)(c->slots[decl] - 1);
+	IrRef call = emit(c, IR_CALL, value, index, first, first + pend - pstart);
+	if (out != NULL && value != IR_VOID) {
+		*out = call;
+	}
+	return ret;
+}
+
+static void compile_binding(Compiler *c, NodeIndex node) {
+	const AstNode *n = &c->ast->nodes[node];
+	TypeStorage storage = decl_type(c, node);
+	NodeIndex init = c->ast->extra[n->rhs + 1];
+
+	if ((n->flags & AST_FLAG_MUT) == 0 && consteval_get(c->consts, node) != NULL) {
+		return; // Folded into its uses
+	}
+
+	VmType type;
+	if (!vm_type(storage, &type)) {
+		push_error(
+			c, node, "Values of type %s are not supported by the bytecode compiler",
+			type_storage2str(storage)
+		);
+		return;
+	}
+
+	IrRef value = init == AST_NONE ? emit_value(c, (Value) { .u = 0 }, type)
+	                               : operand(c, init, storage);
+	ir_write_var(&c->builder, node, c->block, value);
+	c->slots[node] = SLOT_LOCAL;
+}
+
+static TypeStorage compile_block(
+	Compiler *c, NodeIndex node, TypeStorage hint, IrRef *out
+) {
+	const Ast *ast = c->ast;
+	const AstNode *n = &ast->nodes[node];
+	TypeStorage storage = TYPE_VOID;
+
+	for (u32 i = n->lhs; i < n->rhs; i += 1) {
+		NodeIndex stmt = ast->extra[i];
+		if (ast->nodes[stmt].kind == AST_BINDING) {
+			compile_binding(c, stmt);
+			storage = TYPE_VOID;
+			continue;
+		}
+
+		bool last = i + 1 == n->rhs;
+		storage = compile_expr(c, stmt, last ? hint : TYPE_VOID, last ? out : NULL);
+	}
+
+	return storage;
+}
+
+static TypeStorage compile_if(Compiler *c, NodeIndex node, TypeStorage hint, IrRef *out) {
+	const Ast *ast = c->ast;
+	const AstNode *n = &ast->nodes[node];
+	NodeIndex then = ast->extra[n->rhs];
+	NodeIndex other = ast->extra[n->rhs + 1];
+	IrFunc *f = c->func;
+
+	bool value = out != NULL && other != AST_NONE;
+	TypeStorage storage = value ? concrete(expr_type(c, node), hint) : TYPE_VOID;
+
+	IrRef cond = operand(c, n->lhs, TYPE_BOOL);
+	u32 thenblock = ir_add_block(f);
+	u32 elseblock = other != AST_NONE ? ir_add_block(f) : IR_NO_BLOCK;
+	u32 join = ir_add_block(f);
+	ir_branch(f, c->block, cond, thenblock, other != AST_NONE ? elseblock : join);
+
+	IrRef values[2] = { IR_NONE, IR_NONE };
+	ir_seal(&c->builder, thenblock);
+	c->block = thenblock;
+	TypeStorage got = compile_expr(c, then, storage, value ? &values[0] : NULL);
+	if (value) {
+		expect_type(c, then, got, storage);
+	}
+	ir_jump(f, c->block, join);
+
+	if (other != AST_NONE) {
+		ir_seal(&c->builder, elseblock);
+		c->block = elseblock;
+		got = compile_expr(c, other, storage, value ? &values[1] : NULL);
+		if (value) {
+			expect_type(c, other, got, storage);
+		}
+		ir_jump(f, c->block, join);
+	}
+
+	ir_seal(&c->builder, join);
+	c->block = join;
+	if (value && storage != TYPE_VOID) {
+		*out = ir_phi(f, join, machine_type(storage), values);
+	}
+	return storage;
+}
+
+// The header is sealed once the body jumped back to it, the variables read
+// meanwhile get phis completed then
+static TypeStorage compile_for(Compiler *c, NodeIndex node) {
+	const Ast *ast = c->ast;
+	const AstNode *n = &ast->nodes[node];
+	u32 initstart = ast->extra[n->lhs];
+	u32 initend = ast->extra[n->lhs + 1];
+	NodeIndex cond = ast->extra[n->lhs + 2];
+	NodeIndex post = ast->extra[n->lhs + 3];
+	IrFunc *f = c->func;
+
+	for (u32 i = initstart; i < initend; i += 1) {
+		NodeIndex init = ast->extra[i];
+		if (ast->nodes[init].kind == AST_BINDING) {
+			compile_binding(c, init);
+		} else {
+			compile_expr(c, init, TYPE_VOID, NULL);
+		}
+	}
+
+	u32 header = ir_add_block(f);
+	u32 exit = ir_add_block(f);
+	ir_jump(f, c->block, header);
+	c->block = header;
+
+	if (cond != AST_NONE) {
+		IrRef value = operand(c, cond, TYPE_BOOL);
+		u32 body = ir_add_block(f);
+		ir_branch(f, c->block, value, body, exit);
+		ir_seal(&c->builder, body);
+		c->block = body;
+	}
+
+	compile_expr(c, n->rhs, TYPE_VOID, NULL);
+	if (post != AST_NONE) {
+		compile_expr(c, post, TYPE_VOID, NULL);
+	}
+	ir_jump(f, c->block, header);
+
+	// Without a condition the exit can't be reached
+	ir_seal(&c->builder, header);
+	ir_seal(&c->builder, exit);
+	c->block = exit;
+	return TYPE_VOID;
+}
+
+static TypeStorage compile_assign(Compiler *c, NodeIndex node) {
+	const Ast *ast = c->ast;
+	const AstNode *n = &ast->nodes[node];
+	NodeIndex decl = ast->nodes[n->lhs].kind == AST_IDENT ? c->decls[n->lhs] : AST_NONE;
+	u32 slot = decl != AST_NONE ? c->slots[decl] : SLOT_EMPTY;
+
+	if ((slot & (SLOT_LOCAL | SLOT_GLOBAL)) == 0) {
+		push_error(c, node, "Only variables can be assigned by the bytecode compiler");
+		return TYPE_VOID;
+	}
+
+	TypeStorage storage = decl_type(c, decl);
+	VmType type = machine_type(storage);
+	bool global = (slot & SLOT_GLOBAL) != 0;
+
+	VmArith arith;
+	IrRef value;
+	if (!arith_op((TokenKind)n->op, &arith)) {
+		value = operand(c, n->rhs, storage);
+	} else {
+		if (typed_op(c, node, storage, arith) == OP_NOP) {
+			return TYPE_VOID;
+		}
+
+		TypeStorage rt = storage;
+		if (arith == ARITH_SHL || arith == ARITH_SHR) {
+			rt = concrete(expr_type(c, n->rhs), storage);
+			if (!is_int(rt)) {
+				push_error(c, n->rhs, "Shift amount must be an integer");
+				return TYPE_VOID;
+			}
+		}
+
+		// The variable is read after the right side, which may assign it
+		IrRef rhs = operand(c, n->rhs, rt);
+		IrRef lhs = global ? emit(c, IR_GGET, type, 0, slot & ~SLOT_GLOBAL, 0)
+		                   : ir_read_var(&c->builder, decl, c->block, type);
+		value = emit(c, IR_ARITH, type, arith, lhs, rhs);
+	}
+
+	if (global) {
+		emit(c, IR_GSET, IR_VOID, 0, slot & ~SLOT_GLOBAL, value);
+	} else {
+		ir_write_var(&c->builder, decl, c->block, value);
+	}
+	return TYPE_VOID;
+}
+
+static TypeStorage compile_expr(
+	Compiler *c, NodeIndex node, TypeStorage hint, IrRef *out
+) {
+	const AstNode *n = &c->ast->nodes[node];
+	if (out != NULL) {
+		*out = IR_NONE;
+	}
+
+	// Operations on constants were evaluated, with their overflow checks
+	const ConstValue *folded = consteval_get(c->consts, node);
+	if (folded != NULL && n->kind != AST_BINDING) {
+		TypeStorage storage = concrete((TypeStorage)folded->storage, hint);
+		load_const(c, node, folded, storage, out);
+		return storage;
+	}
+
+	switch ((AstKind)n->kind) {
+	case AST_INT:
+	case AST_FLOAT:
+	case AST_RUNE:
+	case AST_BOOL:
+	case AST_STRING: {
+		ConstValue value = literal_value(c, node, false);
+		TypeStorage storage = concrete((TypeStorage)value.storage, hint);
+		load_const(c, node, &value, storage, out);
+		return storage;
+	}
+	case AST_VOID:
+		return TYPE_VOID;
+	case AST_IDENT:
+		return compile_ident(c, node, hint, out);
+	case AST_UNARY:
+		return compile_unary(c, node, hint, out);
+	case AST_BINARY:
+		return compile_binary(c, node, hint, out);
+	case AST_CAST:
+		return compile_cast(c, node, out);
+	case AST_CALL:
+		return compile_call(c, node, out);
+	case AST_BLOCK:
+		return compile_block(c, node, hint, out);
+	case AST_IF:
+		return compile_if(c, node, hint, out);
+	case AST_FOR:
+		return compile_for(c, node);
+	case AST_ASSIGN:
+		return compile_assign(c, node);
+	case AST_BINDING:
+		compile_binding(c, node);
+		return TYPE_VOID;
+	default:
+		push_error(
+			c, node, "%s is not supported by the bytecode compiler",
+			ast_kind2str((AstKind)n->kind)
+		);
+		return TYPE_VOID;
+	}
+}
+
+// Lower the body to SSA form, then optimize it and generate its bytecode
+static void compile_fn(Compiler *c, NodeIndex decl) {
+	const Ast *ast = c->ast;
+	const AstNode *n = &ast->nodes[decl];
+	NodeIndex proto = ast->extra[n->rhs];
+	NodeIndex body = ast->extra[n->rhs + 1];
+	const AstNode *p = &ast->nodes[proto];
+	u32 pstart = ast->extra[p->lhs];
+	u32 pend = ast->extra[p->lhs + 1];
+
+	u32 index = c->slots[decl] - 1;
+	VmFunc *func = &c->prog->funcs[index];
+	func->params = (u8)(pend - pstart);
+	func->ret = (u8)(p->rhs == AST_NONE ? TYPE_VOID : type_storage(c, p->rhs));
+	TypeStorage ret = (TypeStorage)func->ret;
+
+	IrFunc f;
+	ir_init(&f);
+	ir_builder_init(&c->builder, &f);
+	c->func = &f;
+	c->block = ir_add_block(&f);
+	ir_seal(&c->builder, c->block);
+
+	VmType type;
+	f.params = pend - pstart;
+	f.ret = vm_type(ret, &type) ? (u8)type : IR_VOID;
+
+	for (u32 i = pstart; i < pend; i += 1) {
+		NodeIndex param = ast->extra[i];
+		TypeStorage storage = decl_type(c, param);
+		if (!vm_type(storage, &type)) {
+			push_error(
+				c, param, "Values of type %s are not supported by the bytecode compiler",
+				type_storage2str(storage)
+			);
+		}
+
+		IrRef value = emit(c, IR_PARAM, machine_type(storage), 0, i - pstart, 0);
+		ir_write_var(&c->builder, param, c->block, value);
+		c->slots[param] = SLOT_LOCAL;
+	}
+
+	if (ret == TYPE_VOID) {
+		compile_expr(c, body, TYPE_VOID, NULL);
+		ir_ret(&f, c->block, IR_NONE);
+	} else if (!vm_type(ret, &type)) {
+		push_error(
+			c, proto, "Values of type %s are not supported by the bytecode compiler",
+			type_storage2str(ret)
+		);
+	} else {
+		ir_ret(&f, c->block, operand(c, body, ret));
+	}
+	ir_builder_free(&c->builder);
+
+	// Nothing is generated once there are errors, they're only reported
+	const char *name = name_str(c, n->lhs);
+	const char *error = NULL;
+	if (c->ok) {
+		ir_resolve_copies(&f);
+		opt_run(c->passes, &f, name);
+		if (!codegen_func(c->prog, &f, index, &error)) {
+			push_error(c, decl, "%s", error);
+		}
+	}
+
+	ir_free(&f);
+	c->func = NULL;
+}
+
+// Assign indices to functions and mutable globals, so they can be used before
+// being compiled
+static void declare_unit(Compiler *c) {
+	const Ast *ast = c->ast;
+	const AstNode *root = &ast->nodes[0];
+	Program *prog = c->prog;
+
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		NodeIndex decl = ast->extra[i];
+		const AstNode *n = &ast->nodes[decl];
+
+		if (n->kind == AST_FN_DECL) {
+			if (prog->funclen == prog->funcsize) {
+				prog->funcsize *= 2;
+				prog->funcs
+					= xrealloc(MEM_VM, prog->funcs, prog->funcsize * sizeof(VmFunc));
+			}
+
+			const char *name = name_str(c, n->lhs);
+			prog->funcs[prog->funclen] = (VmFunc) {
+				.name = intern(&prog->strings, name, strlen(name)),
+			};
+			prog->funclen += 1;
+			c->slots[decl] = prog->funclen;
+			continue;
+		} else if (n->kind != AST_GLOBAL) {
+			continue;
+		}
+
+		for (u32 j = n->lhs; j < n->rhs; j += 1) {
+			NodeIndex binding = ast->extra[j];
+			const ConstValue *value = consteval_get(c->consts, binding);
+			if ((ast->nodes[binding].flags & AST_FLAG_MUT) == 0 || value == NULL) {
+				continue;
+			}
+
+			Value initial;
+			TypeStorage storage = decl_type(c, binding);
+			if (!const_to_value(c, binding, value, storage, &initial)) {
+				continue;
+			} else if (prog->globallen == prog->globalsize) {
+				prog->globalsize *= 2;
+				prog->globals
+					= xrealloc(MEM_VM, prog->globals, prog->globalsize * sizeof(Value));
+			}
+
+			prog->globals[prog->globallen] = initial;
+			c->slots[binding] = prog->globallen | SLOT_GLOBAL;
+			prog->globallen += 1;
+		}
+	}
+}
+
+bool compile_unit(
+	Program *prog, const Ast *ast, const NodeIndex *decls, TypeTable *types,
+	const ConstEval *consts, const char *path, PassManager *passes
+) {
+	Compiler c = {
+		.prog = prog,
+		.ast = ast,
+		.decls = decls,
+		.types = types,
+		.consts = consts,
+		.path = path,
+		.ok = true,
+		.passes = passes,
+	};
+
+	c.nodetypes = xcalloc(MEM_VM, ast->nodelen, sizeof(u8));
+	memset(c.nodetypes, TYPE_UNKNOWN, ast->nodelen);
+	c.slots = xcalloc(MEM_VM, ast->nodelen, sizeof(u32));
+	c.runes = type_array(types, type_prim(TYPE_RUNE), TYPE_LEN_NONE);
+
+	declare_unit(&c);
+
+	bool found = false;
+	const AstNode *root = &ast->nodes[0];
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		NodeIndex decl = ast->extra[i];
+		if (ast->nodes[decl].kind != AST_FN_DECL) {
+			continue;
+		}
+
+		compile_fn(&c, decl);
+		if (strcmp(name_str(&c, ast->nodes[decl].lhs), "main") == 0) {
+			prog->main = c.slots[decl] - 1;
+			found = true;
+
+			if (prog->funcs[prog->main].params != 0) {
+				push_error(&c, decl, "'main' must not have parameters");
+			}
+		}
+	}
+
+	if (!found) {
+		fprintf(stderr, "%s: No 'main' function\n", path);
+		c.ok = false;
+	}
+
+	xfree(c.nodetypes);
+	xfree(c.slots);
+	return c.ok;
+}
@@ -0,0 +1,1000 @@
+#include "consteval.h"
+
+#include "lex.h"
+#include "typetab.h"
+#include "util.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+
+// Binding evaluation marks, any other slot is an index in the values array
+#define SLOT_EMPTY     0
+#define SLOT_PENDING   UINT32_MAX // Being evaluated, seen again only in cycles
+#define SLOT_NOT_CONST (UINT32_MAX - 1)
+#define SLOT_ERROR     (UINT32_MAX - 2)
+
+// Smallest magnitude rounded to infinity as f32, FLT_MAX plus half an ulp
+#define F32_OVERFLOW ((f64)FLT_MAX + 0x1p103)
+
+typedef enum EvalStatus {
+	EVAL_OK,
+	EVAL_NOT_CONST, // Known at runtime only, not an error
+	EVAL_ERROR,     // Already reported
+} EvalStatus;
+
+static EvalStatus push_error(ConstEval *ev, NodeIndex node, const char *fmt, ...) {
+	Location loc = source_decode(ev->ast->sources, ev->ast->locs[node], NULL);
+	fprintf(stderr, "%s:%d:%d ", ev->path, loc.lineno, loc.colno);
+
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+
+	fprintf(stderr, "\n");
+	ev->ok = false;
+	return EVAL_ERROR;
+}
+
+static bool is_int(TypeStorage storage) {
+	switch (storage) {
+	case TYPE_I8:
+	case TYPE_I16:
+	case TYPE_I32:
+	case TYPE_I64:
+	case TYPE_U8:
+	case TYPE_U16:
+	case TYPE_U32:
+	case TYPE_U64:
+	case TYPE_INT:
+	case TYPE_RUNE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool is_float(TypeStorage storage) {
+	return storage == TYPE_F32 || storage == TYPE_F64 || storage == TYPE_FLOAT;
+}
+
+static bool is_untyped(TypeStorage storage) {
+	return storage == TYPE_INT || storage == TYPE_FLOAT;
+}
+
+static bool is_signed(TypeStorage storage) {
+	switch (storage) {
+	case TYPE_I8:
+	case TYPE_I16:
+	case TYPE_I32:
+	case TYPE_I64:
+	case TYPE_INT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static u32 int_bits(TypeStorage storage) {
+	switch (storage) {
+	case TYPE_I8:
+	case TYPE_U8:
+		return 8;
+	case TYPE_I16:
+	case TYPE_U16:
+		return 16;
+	case TYPE_I32:
+	case TYPE_U32:
+	case TYPE_RUNE:
+		return 32;
+	default:
+		return 64;
+	}
+}
+
+static ConstValue make_int(TypeStorage storage, bool neg, u64 mag) {
+	return (ConstValue) { .storage = (u8)storage, .neg = neg && mag != 0, .mag = mag };
+}
+
+static ConstValue make_float(TypeStorage storage, f64 value) {
+	if (storage == TYPE_F32) {
+		value = (f32)value;
+	}
+	return (ConstValue) { .storage = (u8)storage, .fval = value };
+}
+
+static bool in_range(const ConstValue *v) {
+	TypeStorage storage = (TypeStorage)v->storage;
+	u32 bits = int_bits(storage);
+
+	if (storage == TYPE_INT) {
+		return true; // Any magnitude, overflows are found by the operations
+	} else if (storage == TYPE_RUNE) {
+		return !v->neg && v->mag <= 0x10FFFF;
+	} else if (is_signed(storage)) {
+		u64 limit = (u64)1 << (bits - 1);
+		return v->neg ? v->mag <= limit : v->mag < limit;
+	}
+
+	return !v->neg && (bits == 64 || v->mag < (u64)1 << bits);
+}
+
+static EvalStatus check_range(ConstEval *ev, NodeIndex node, const ConstValue *v) {
+	if (!in_range(v)) {
+		return push_error(
+			ev, node, "Constant overflows %s", type_storage2str((TypeStorage)v->storage)
+		);
+	}
+	return EVAL_OK;
+}
+
+// Store a float result, which must be finite and fit in the type
+static EvalStatus check_float(
+	ConstEval *ev, NodeIndex node, TypeStorage storage, f64 value, ConstValue *out
+) {
+	if (!isfinite(value) || (storage == TYPE_F32 && fabs(value) >= F32_OVERFLOW)) {
+		return push_error(ev, node, "Constant overflows %s", type_storage2str(storage));
+	}
+
+	*out = make_float(storage, value);
+	return EVAL_OK;
+}
+
+static f64 int_to_float(const ConstValue *v) {
+	return v->neg ? -(f64)v->mag : (f64)v->mag;
+}
+
+// Integers as 65-bit two's complement, hi is the sign extension (0 or ~0)
+static void to_twos(const ConstValue *v, u64 *lo, u64 *hi) {
+	*lo = v->neg ? ~v->mag + 1 : v->mag;
+	*hi = v->neg ? UINT64_MAX : 0;
+}
+
+static bool from_twos(TypeStorage storage, u64 lo, u64 hi, ConstValue *out) {
+	if (hi == 0) {
+		*out = make_int(storage, false, lo);
+		return true;
+	}
+
+	*out = make_int(storage, true, ~lo + 1);
+	return lo != 0; // -2^64 doesn't fit
+}
+
+static int int_compare(const ConstValue *a, const ConstValue *b) {
+	if (a->neg != b->neg) {
+		return a->neg ? -1 : 1;
+	}
+
+	int cmp = a->mag < b->mag ? -1 : a->mag > b->mag;
+	return a->neg ? -cmp : cmp;
+}
+
+static bool int_add(ConstValue a, ConstValue b, ConstValue *out) {
+	if (a.neg == b.neg) {
+		*out = make_int((TypeStorage)a.storage, a.neg, a.mag + b.mag);
+		return out->mag >= a.mag;
+	}
+
+	if (a.mag >= b.mag) {
+		*out = make_int((TypeStorage)a.storage, a.neg, a.mag - b.mag);
+	} else {
+		*out = make_int((TypeStorage)a.storage, b.neg, b.mag - a.mag);
+	}
+	return true;
+}
+
+// Implicit conversion, only untyped constants are converted
+static EvalStatus convert(ConstEval *ev, NodeIndex node, ConstValue *v, TypeStorage to) {
+	TypeStorage from = (TypeStorage)v->storage;
+	if (from == to) {
+		return EVAL_OK;
+	}
+
+	if (from == TYPE_INT && is_int(to)) {
+		v->storage = (u8)to;
+		return check_range(ev, node, v);
+	} else if (from == TYPE_INT && is_float(to)) {
+		return check_float(ev, node, to, int_to_float(v), v);
+	} else if (from == TYPE_FLOAT && is_float(to)) {
+		return check_float(ev, node, to, v->fval, v);
+	}
+
+	return push_error(
+		ev, node, "Cannot convert %s to %s", type_storage2str(from),
+		type_storage2str(to)
+	);
+}
+
+// Convert untyped operands to the type of the other one
+static EvalStatus unify(ConstEval *ev, NodeIndex node, ConstValue *a, ConstValue *b) {
+	TypeStorage sa = (TypeStorage)a->storage;
+	TypeStorage sb = (TypeStorage)b->storage;
+
+	if (sa == sb) {
+		return EVAL_OK;
+	} else if (is_untyped(sa) && (!is_untyped(sb) || sb == TYPE_FLOAT)) {
+		return convert(ev, node, a, sb);
+	} else if (is_untyped(sb)) {
+		return convert(ev, node, b, sa);
+	}
+
+	return push_error(
+		ev, node, "Mismatched types %s and %s", type_storage2str(sa),
+		type_storage2str(sb)
+	);
+}
+
+// Float to integer conversion, saturated like at runtime and NaN is zero
+static ConstValue saturate(f64 value, TypeStorage to) {
+	bool sign = is_signed(to);
+	u32 bits = int_bits(to) - (sign ? 1 : 0);
+	u64 max = bits == 64 ? UINT64_MAX : ((u64)1 << bits) - 1;
+	f64 limit = ldexp(1.0, (int)bits);
+
+	if (isnan(value) || (value < 0 && !sign)) {
+		return make_int(to, false, 0);
+	} else if (value >= limit) {
+		return make_int(to, false, max);
+	} else if (value <= -limit) {
+		return make_int(to, true, max + 1);
+	}
+	return make_int(to, value < 0, (u64)fabs(trunc(value)));
+}
+
+// Explicit "as" conversion, integers wrap to the width of the target and
+// floats saturate
+static EvalStatus cast(ConstEval *ev, NodeIndex node, ConstValue *v, TypeStorage to) {
+	TypeStorage from = (TypeStorage)v->storage;
+
+	if (from == to) {
+		return EVAL_OK;
+	} else if ((is_int(from) || from == TYPE_BOOL) && is_float(to)) {
+		return check_float(ev, node, to, int_to_float(v), v);
+	} else if (is_float(from) && is_float(to)) {
+		return check_float(ev, node, to, v->fval, v);
+	} else if (is_float(from) && is_int(to)) {
+		*v = saturate(v->fval, to);
+		return check_range(ev, node, v);
+	} else if ((is_int(from) || from == TYPE_BOOL) && is_int(to)) {
+		u64 lo, hi;
+		to_twos(v, &lo, &hi);
+
+		u32 bits = int_bits(to);
+		if (to == TYPE_INT || to == TYPE_RUNE) {
+			*v = make_int(to, v->neg, v->mag);
+			return check_range(ev, node, v);
+		} else if (bits < 64) {
+			lo &= ((u64)1 << bits) - 1;
+			hi = is_signed(to) && (lo >> (bits - 1)) != 0 ? UINT64_MAX : 0;
+			lo |= hi << bits;
+		} else {
+			hi = is_signed(to) && (lo >> 63) != 0 ? UINT64_MAX : 0;
+		}
+
+		from_twos(to, lo, hi, v);
+		return EVAL_OK;
+	}
+
+	return push_error(
+		ev, node, "Invalid cast from %s to %s", type_storage2str(from),
+		type_storage2str(to)
+	);
+}
+
+// Primitive named by a type node, composite types have no constant conversions
+static bool prim_type(ConstEval *ev, NodeIndex type, TypeStorage *out) {
+	TypeId id = type_from_ast(ev->types, ev->ast, type);
+	if (id == TYPE_ID_NONE) {
+		return false;
+	}
+
+	*out = (TypeStorage)type_get(ev->types, id)->storage;
+	return *out != TYPE_FUNC && *out != TYPE_POINTER && *out != TYPE_ARRAY;
+}
+
+static EvalStatus eval(ConstEval *ev, NodeIndex node, ConstValue *out);
+
+// Store the result of a binding or an operation in its slot
+static EvalStatus remember(
+	ConstEval *ev, NodeIndex node, EvalStatus status, const ConstValue *value
+) {
+	if (status != EVAL_OK) {
+		ev->slots[node] = status == EVAL_NOT_CONST ? SLOT_NOT_CONST : SLOT_ERROR;
+		return status;
+	}
+
+	if (ev->valuelen == ev->valuesize) {
+		ev->valuesize *= 2;
+		ev->values = xrealloc(MEM_CONSTS, ev->values, ev->valuesize * sizeof(ConstValue));
+	}
+
+	ev->values[ev->valuelen] = *value;
+	ev->slots[node] = ev->valuelen;
+	ev->valuelen += 1;
+	return EVAL_OK;
+}
+
+static EvalStatus eval_binding(ConstEval *ev, NodeIndex binding, bool global) {
+	const Ast *ast = ev->ast;
+	const AstNode *n = &ast->nodes[binding];
+
+	switch (ev->slots[binding]) {
+	case SLOT_EMPTY:
+		break;
+	case SLOT_PENDING:
+		return push_error(
+			ev, binding, "'%s' is defined in terms of itself",
+			intern_str(&ast->names, n->lhs)
+		);
+	case SLOT_NOT_CONST:
+		return EVAL_NOT_CONST;
+	case SLOT_ERROR:
+		return EVAL_ERROR;
+	default:
+		return EVAL_OK;
+	}
+
+	ev->slots[binding] = SLOT_PENDING;
+
+	NodeIndex type = ast->extra[n->rhs];
+	NodeIndex init = ast->extra[n->rhs + 1];
+
+	ConstValue value;
+	TypeStorage storage;
+	EvalStatus status = init == AST_NONE ? EVAL_NOT_CONST : eval(ev, init, &value);
+	if (status == EVAL_OK && type != AST_NONE && prim_type(ev, type, &storage)) {
+		status = convert(ev, init, &value, storage);
+	}
+
+	if (status == EVAL_NOT_CONST && global) {
+		status = push_error(
+			ev, binding, "Initializer of '%s' is not constant",
+			intern_str(&ast->names, n->lhs)
+		);
+	}
+
+	return remember(ev, binding, status, &value);
+}
+
+static EvalStatus eval_array(ConstEval *ev, NodeIndex node, ConstValue *out) {
+	const AstNode *n = &ev->ast->nodes[node];
+	u32 count = n->rhs - n->lhs;
+
+	// Nested arrays append their elements first, so collect them apart
+	ConstValue *elems = xcalloc(MEM_CONSTS, count + 1, sizeof(ConstValue));
+
+	EvalStatus status = EVAL_OK;
+	for (u32 i = 0; i < count && status == EVAL_OK; i += 1) {
+		status = eval(ev, ev->ast->extra[n->lhs + i], &elems[i]);
+	}
+
+	if (status == EVAL_OK) {
+		while (ev->elemlen + count > ev->elemsize) {
+			ev->elemsize *= 2;
+			ev->elems
+				= xrealloc(MEM_CONSTS, ev->elems, ev->elemsize * sizeof(ConstValue));
+		}
+
+		memcpy(ev->elems + ev->elemlen, elems, count * sizeof(ConstValue));
+		*out = (ConstValue) { .storage = TYPE_ARRAY };
+		out->array.start = ev->elemlen;
+		out->array.count = count;
+		ev->elemlen += count;
+	}
+
+	xfree(elems);
+	return status;
+}
+
+static EvalStatus eval_unary(ConstEval *ev, NodeIndex node, ConstValue *out) {
+	const AstNode *n = &ev->ast->nodes[node];
+	if (n->op == TK_STAR || n->op == TK_BAND) {
+		return EVAL_NOT_CONST;
+	}
+
+	EvalStatus status = eval(ev, n->lhs, out);
+	if (status != EVAL_OK) {
+		return status;
+	}
+
+	TypeStorage storage = (TypeStorage)out->storage;
+	switch (n->op) {
+	case TK_MINUS:
+		if (is_float(storage)) {
+			out->fval = -out->fval;
+			return EVAL_OK;
+		} else if (is_int(storage)) {
+			*out = make_int(storage, !out->neg, out->mag);
+			return check_range(ev, node, out);
+		}
+		break;
+	case TK_BNOT:
+		if (is_int(storage) && storage != TYPE_RUNE) {
+			if (!is_signed(storage)) {
+				u64 max = int_bits(storage) == 64 ? UINT64_MAX
+				                                  : ((u64)1 << int_bits(storage)) - 1;
+				out->mag = max - out->mag;
+				return EVAL_OK;
+			}
+
+			u64 lo, hi;
+			to_twos(out, &lo, &hi);
+			if (!from_twos(storage, ~lo, ~hi, out)) {
+				return push_error(
+					ev, node, "Constant overflows %s", type_storage2str(storage)
+				);
+			}
+			return check_range(ev, node, out);
+		}
+		break;
+	case TK_LNOT:
+		if (storage == TYPE_BOOL) {
+			out->mag = !out->mag;
+			return EVAL_OK;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return push_error(
+		ev, node, "Invalid operand to '%s': %s", lex_tok2str((TokenKind)n->op),
+		type_storage2str(storage)
+	);
+}
+
+static EvalStatus eval_shift(
+	ConstEval *ev, NodeIndex node, ConstValue *a, ConstValue *b
+) {
+	TokenKind op = (TokenKind)ev->ast->nodes[node].op;
+	if (!is_int((TypeStorage)a->storage) || !is_int((TypeStorage)b->storage)) {
+		return push_error(ev, node, "Invalid operands to '%s'", lex_tok2str(op));
+	} else if (b->neg) {
+		return push_error(ev, node, "Negative shift amount");
+	}
+
+	u64 n = b->mag;
+	if (op == TK_SHIFTL) {
+		if (a->mag != 0 && (n >= 64 || a->mag > UINT64_MAX >> n)) {
+			TypeStorage storage = (TypeStorage)a->storage;
+			return push_error(
+				ev, node, "Constant overflows %s", type_storage2str(storage)
+			);
+		}
+		a->mag = n >= 64 ? 0 : a->mag << n;
+		return check_range(ev, node, a);
+	}
+
+	// Arithmetic shift, negative values round towards negative infinity
+	if (n >= 64) {
+		a->mag = a->neg ? 1 : 0;
+	} else if (a->neg) {
+		a->mag = ((a->mag - 1) >> n) + 1;
+	} else {
+		a->mag >>= n;
+	}
+	return EVAL_OK;
+}
+
+static EvalStatus eval_compare(
+	TokenKind op, const ConstValue *a, const ConstValue *b, ConstValue *out
+) {
+	TypeStorage storage = (TypeStorage)a->storage;
+
+	int cmp;
+	if (is_float(storage)) {
+		if (a->fval != a->fval || b->fval != b->fval) { // NaN is unordered
+			*out = make_int(TYPE_BOOL, false, op == TK_LNOT_EQ);
+			return EVAL_OK;
+		}
+		cmp = a->fval < b->fval ? -1 : a->fval > b->fval;
+	} else if (storage == TYPE_STRING) {
+		if (op != TK_LEQUAL_EQ && op != TK_LNOT_EQ) {
+			return EVAL_ERROR;
+		}
+		cmp = a->str != b->str; // Interned, so equal strings have the same ID
+	} else if (is_int(storage) || storage == TYPE_BOOL) {
+		cmp = int_compare(a, b);
+	} else {
+		return EVAL_ERROR;
+	}
+
+	bool result;
+	switch (op) {
+	case TK_LEQUAL_EQ:
+		result = cmp == 0;
+		break;
+	case TK_LNOT_EQ:
+		result = cmp != 0;
+		break;
+	case TK_LESS:
+		result = cmp < 0;
+		break;
+	case TK_LESS_EQ:
+		result = cmp <= 0;
+		break;
+	case TK_GREATER:
+		result = cmp > 0;
+		break;
+	default:
+		result = cmp >= 0;
+		break;
+	}
+
+	*out = make_int(TYPE_BOOL, false, result);
+	return EVAL_OK;
+}
+
+static EvalStatus eval_int_binary(
+	ConstEval *ev, NodeIndex node, ConstValue a, ConstValue b, ConstValue *out
+) {
+	TokenKind op = (TokenKind)ev->ast->nodes[node].op;
+	TypeStorage storage = (TypeStorage)a.storage;
+	bool ok = true;
+
+	switch (op) {
+	case TK_PLUS:
+		ok = int_add(a, b, out);
+		break;
+	case TK_MINUS:
+		b.neg = !b.neg && b.mag != 0;
+		ok = int_add(a, b, out);
+		break;
+	case TK_STAR:
+		ok = a.mag == 0 || b.mag <= UINT64_MAX / a.mag;
+		*out = make_int(storage, a.neg != b.neg, a.mag * b.mag);
+		break;
+	case TK_SLASH:
+	case TK_MOD:
+		if (b.mag == 0) {
+			return push_error(ev, node, "Division by zero");
+		}
+
+		// Truncated division, the remainder has the sign of the dividend
+		if (op == TK_SLASH) {
+			*out = make_int(storage, a.neg != b.neg, a.mag / b.mag);
+		} else {
+			*out = make_int(storage, a.neg, a.mag % b.mag);
+		}
+		break;
+	case TK_BAND:
+	case TK_BOR:
+	case TK_BXOR: {
+		u64 alo, ahi, blo, bhi;
+		to_twos(&a, &alo, &ahi);
+		to_twos(&b, &blo, &bhi);
+
+		if (op == TK_BAND) {
+			ok = from_twos(storage, alo & blo, ahi & bhi, out);
+		} else if (op == TK_BOR) {
+			ok = from_twos(storage, alo | blo, ahi | bhi, out);
+		} else {
+			ok = from_twos(storage, alo ^ blo, ahi ^ bhi, out);
+		}
+	} break;
+	default:
+		return push_error(ev, node, "Invalid operands to '%s'", lex_tok2str(op));
+	}
+
+	if (!ok) {
+		return push_error(ev, node, "Constant overflows %s", type_storage2str(storage));
+	}
+	return check_range(ev, node, out);
+}
+
+static EvalStatus eval_float_binary(
+	ConstEval *ev, NodeIndex node, ConstValue a, ConstValue b, ConstValue *out
+) {
+	TokenKind op = (TokenKind)ev->ast->nodes[node].op;
+	TypeStorage storage = (TypeStorage)a.storage;
+
+	switch (op) {
+	case TK_PLUS:
+		return check_float(ev, node, storage, a.fval + b.fval, out);
+	case TK_MINUS:
+		return check_float(ev, node, storage, a.fval - b.fval, out);
+	case TK_STAR:
+		return check_float(ev, node, storage, a.fval * b.fval, out);
+	case TK_SLASH:
+	case TK_MOD:
+		if (b.fval == 0) {
+			return push_error(ev, node, "Division by zero");
+		}
+
+		f64 value = op == TK_SLASH ? a.fval / b.fval : fmod(a.fval, b.fval);
+		return check_float(ev, node, storage, value, out);
+	default:
+		return push_error(ev, node, "Invalid operands to '%s'", lex_tok2str(op));
+	}
+}
+
+static EvalStatus eval_binary(ConstEval *ev, NodeIndex node, ConstValue *out) {
+	const AstNode *n = &ev->ast->nodes[node];
+	TokenKind op = (TokenKind)n->op;
+
+	ConstValue a, b;
+	EvalStatus status = eval(ev, n->lhs, &a);
+	EvalStatus rstatus = eval(ev, n->rhs, &b);
+	if (status == EVAL_OK || rstatus == EVAL_ERROR) {
+		status = rstatus;
+	}
+	if (status != EVAL_OK) {
+		return status;
+	}
+
+	if (op == TK_SHIFTL || op == TK_SHIFTR) {
+		status = eval_shift(ev, node, &a, &b);
+		*out = a;
+		return status;
+	}
+
+	status = unify(ev, node, &a, &b);
+	if (status != EVAL_OK) {
+		return status;
+	}
+
+	TypeStorage storage = (TypeStorage)a.storage;
+	switch (op) {
+	case TK_LAND:
+	case TK_LOR:
+		if (storage != TYPE_BOOL) {
+			break;
+		}
+		bool value = op == TK_LAND ? a.mag && b.mag : a.mag || b.mag;
+		*out = make_int(TYPE_BOOL, false, value);
+		return EVAL_OK;
+	case TK_LEQUAL_EQ:
+	case TK_LNOT_EQ:
+	case TK_LESS:
+	case TK_LESS_EQ:
+	case TK_GREATER:
+	case TK_GREATER_EQ:
+		if (eval_compare(op, &a, &b, out) != EVAL_OK) {
+			break;
+		}
+		return EVAL_OK;
+	default:
+		if (is_int(storage)) {
+			return eval_int_binary(ev, node, a, b, out);
+		} else if (is_float(storage)) {
+			return eval_float_binary(ev, node, a, b, out);
+		} else if (storage == TYPE_BOOL && op == TK_BAND) {
+			*out = make_int(TYPE_BOOL, false, a.mag & b.mag);
+			return EVAL_OK;
+		} else if (storage == TYPE_BOOL && op == TK_BOR) {
+			*out = make_int(TYPE_BOOL, false, a.mag | b.mag);
+			return EVAL_OK;
+		} else if (storage == TYPE_BOOL && op == TK_BXOR) {
+			*out = make_int(TYPE_BOOL, false, a.mag ^ b.mag);
+			return EVAL_OK;
+		}
+		break;
+	}
+
+	return push_error(
+		ev, node, "Invalid operands to '%s': %s", lex_tok2str(op),
+		type_storage2str(storage)
+	);
+}
+
+static EvalStatus eval_node(ConstEval *ev, NodeIndex node, ConstValue *out) {
+	const Ast *ast = ev->ast;
+	const AstNode *n = &ast->nodes[node];
+
+	switch ((AstKind)n->kind) {
+	case AST_INT:
+		// The lexer marks literals over INT64_MAX as u64, they're still untyped
+		*out = make_int(TYPE_INT, false, (u64)n->rhs << 32 | n->lhs);
+		return EVAL_OK;
+	case AST_FLOAT: {
+		u64 bits = (u64)n->rhs << 32 | n->lhs;
+		*out = (ConstValue) { .storage = TYPE_FLOAT };
+		memcpy(&out->fval, &bits, sizeof(f64));
+		return EVAL_OK;
+	}
+	case AST_RUNE:
+		*out = make_int(TYPE_RUNE, false, n->lhs);
+		return EVAL_OK;
+	case AST_BOOL:
+		*out = make_int(TYPE_BOOL, false, n->lhs);
+		return EVAL_OK;
+	case AST_STRING:
+		*out = (ConstValue) { .storage = TYPE_STRING, .str = n->lhs };
+		return EVAL_OK;
+	case AST_ARRAY:
+		return eval_array(ev, node, out);
+	case AST_IDENT: {
+		NodeIndex decl = ev->decls[node];
+		const AstNode *d = &ast->nodes[decl];
+		if (decl == AST_NONE || d->kind != AST_BINDING
+		    || (d->flags & AST_FLAG_MUT) != 0) {
+			return EVAL_NOT_CONST;
+		}
+
+		EvalStatus status = eval_binding(ev, decl, false);
+		if (status == EVAL_OK) {
+			*out = ev->values[ev->slots[decl]];
+		}
+		return status;
+	}
+	case AST_UNARY:
+		return eval_unary(ev, node, out);
+	case AST_BINARY:
+		return eval_binary(ev, node, out);
+	case AST_CAST: {
+		TypeStorage to;
+		if (!prim_type(ev, n->rhs, &to)) {
+			return EVAL_NOT_CONST;
+		}
+
+		EvalStatus status = eval(ev, n->lhs, out);
+		return status == EVAL_OK ? cast(ev, node, out, to) : status;
+	}
+	default:
+		return EVAL_NOT_CONST;
+	}
+}
+
+static bool is_operation(const AstNode *n) {
+	return n->kind == AST_UNARY || n->kind == AST_BINARY || n->kind == AST_CAST;
+}
+
+// Operations are memoized like bindings, so each one is evaluated and reported
+// once however many enclosing expressions are evaluated
+static EvalStatus eval(ConstEval *ev, NodeIndex node, ConstValue *out) {
+	bool memo = is_operation(&ev->ast->nodes[node]);
+	switch (memo ? ev->slots[node] : SLOT_EMPTY) {
+	case SLOT_EMPTY:
+		break;
+	case SLOT_NOT_CONST:
+		return EVAL_NOT_CONST;
+	case SLOT_ERROR:
+		return EVAL_ERROR;
+	default:
+		*out = ev->values[ev->slots[node]];
+		return EVAL_OK;
+	}
+
+	// Trees from the parser are never deeper, others may be built by hand
+	if (ev->depth >= AST_MAX_DEPTH) {
+		return push_error(ev, node, "Expression nested too deeply");
+	}
+
+	ev->depth += 1;
+	EvalStatus status = eval_node(ev, node, out);
+	ev->depth -= 1;
+
+	return memo ? remember(ev, node, status, out) : status;
+}
+
+void consteval_init(
+	ConstEval *ev, const Ast *ast, const NodeIndex *decls, TypeTable *types,
+	const char *path
+) {
+	memset(ev, 0, sizeof(ConstEval));
+	ev->ast = ast;
+	ev->decls = decls;
+	ev->types = types;
+	ev->path = path;
+	ev->ok = true;
+
+	ev->slots = xcalloc(MEM_CONSTS, ast->nodelen, sizeof(u32));
+
+	ev->valuesize = 64;
+	ev->values = xcalloc(MEM_CONSTS, ev->valuesize, sizeof(ConstValue));
+	ev->valuelen = 1; // Index 0 is SLOT_EMPTY
+
+	ev->elemsize = 64;
+	ev->elems = xcalloc(MEM_CONSTS, ev->elemsize, sizeof(ConstValue));
+}
+
+void consteval_free(ConstEval *ev) {
+	xfree(ev->slots);
+	xfree(ev->values);
+	xfree(ev->elems);
+	memset(ev, 0, sizeof(ConstEval));
+}
+
+// Global bindings used by an expression, as indices in the globals list
+static void collect_uses(
+	const ConstEval *ev, NodeIndex node, const u32 *globals, u32 **uses, u32 *len,
+	u32 *size
+) {
+	if (node == AST_NONE) {
+		return;
+	}
+
+	const Ast *ast = ev->ast;
+	const AstNode *n = &ast->nodes[node];
+
+	switch ((AstKind)n->kind) {
+	case AST_IDENT:
+		if (globals[ev->decls[node]] != 0) {
+			if (*len == *size) {
+				*size *= 2;
+				*uses = xrealloc(MEM_CONSTS, *uses, *size * sizeof(u32));
+			}
+			(*uses)[*len] = globals[ev->decls[node]] - 1;
+			*len += 1;
+		}
+		break;
+	case AST_BINARY:
+		collect_uses(ev, n->lhs, globals, uses, len, size);
+		collect_uses(ev, n->rhs, globals, uses, len, size);
+		break;
+	case AST_UNARY:
+	case AST_CAST:
+		collect_uses(ev, n->lhs, globals, uses, len, size);
+		break;
+	case AST_ARRAY:
+		for (u32 i = n->lhs; i < n->rhs; i += 1) {
+			collect_uses(ev, ast->extra[i], globals, uses, len, size);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+// Order global bindings so each one comes after the constants it uses. Doing
+// this apart keeps the evaluation recursion as deep as a single initializer,
+// generated tables can have very long chains of constants.
+static u32 sort_globals(const ConstEval *ev, NodeIndex *order) {
+	const Ast *ast = ev->ast;
+	const AstNode *root = &ast->nodes[0];
+
+	// Binding node -> Index in order + 1, only immutable globals can be used
+	u32 *globals = xcalloc(MEM_CONSTS, ast->nodelen, sizeof(u32));
+	u32 count = 0;
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		const AstNode *decl = &ast->nodes[ast->extra[i]];
+		if (decl->kind != AST_GLOBAL) {
+			continue;
+		}
+
+		for (u32 j = decl->lhs; j < decl->rhs; j += 1) {
+			order[count] = ast->extra[j];
+			count += 1;
+			if ((decl->flags & AST_FLAG_MUT) == 0) {
+				globals[ast->extra[j]] = count;
+			}
+		}
+	}
+
+	// Uses of each global in CSR layout
+	u32 *offsets = xcalloc(MEM_CONSTS, count + 1, sizeof(u32));
+	u32 usesize = 64;
+	u32 uselen = 0;
+	u32 *uses = xcalloc(MEM_CONSTS, usesize, sizeof(u32));
+	for (u32 i = 0; i < count; i += 1) {
+		offsets[i] = uselen;
+		NodeIndex init = ast->extra[ast->nodes[order[i]].rhs + 1];
+		collect_uses(ev, init, globals, &uses, &uselen, &usesize);
+	}
+	offsets[count] = uselen;
+
+	// Iterative depth-first search, bindings are added after all their uses.
+	// Cycles are skipped here and reported by the evaluation.
+	u8 *state = xcalloc(MEM_CONSTS, count + 1, sizeof(u8)); // 1: Visiting, 2: Done
+	u32 *stack = xcalloc(MEM_CONSTS, count + 1, sizeof(u32));
+	u32 *cursor = xcalloc(MEM_CONSTS, count + 1, sizeof(u32));
+	u32 *sorted = xcalloc(MEM_CONSTS, count + 1, sizeof(u32));
+	u32 len = 0;
+
+	for (u32 i = 0; i < count; i += 1) {
+		if (state[i] != 0) {
+			continue;
+		}
+
+		u32 top = 0;
+		stack[top] = i;
+		cursor[i] = offsets[i];
+		state[i] = 1;
+
+		for (;;) {
+			u32 node = stack[top];
+			if (cursor[node] < offsets[node + 1]) {
+				u32 dep = uses[cursor[node]];
+				cursor[node] += 1;
+
+				if (state[dep] == 0) {
+					top += 1;
+					stack[top] = dep;
+					cursor[dep] = offsets[dep];
+					state[dep] = 1;
+				}
+				continue;
+			}
+
+			state[node] = 2;
+			sorted[len] = order[node];
+			len += 1;
+
+			if (top == 0) {
+				break;
+			}
+			top -= 1;
+		}
+	}
+
+	memcpy(order, sorted, count * sizeof(NodeIndex));
+
+	xfree(globals);
+	xfree(offsets);
+	xfree(uses);
+	xfree(state);
+	xfree(stack);
+	xfree(cursor);
+	xfree(sorted);
+	return count;
+}
+
+bool consteval_unit(ConstEval *ev) {
+	const Ast *ast = ev->ast;
+
+	// Initializers of globals must be constant
+	NodeIndex *order = xcalloc(MEM_CONSTS, ast->nodelen, sizeof(NodeIndex));
+	u32 count = sort_globals(ev, order);
+	for (u32 i = 0; i < count; i += 1) {
+		eval_binding(ev, order[i], true);
+	}
+	xfree(order);
+
+	// A local binding is always after the ones it uses in the nodes array, its
+	// initializer is added before it. Operations on constants anywhere else are
+	// checked the same way, so they overflow in function bodies like in
+	// bindings, and the backends use their values.
+	for (NodeIndex node = 1; node < ast->nodelen; node += 1) {
+		const AstNode *n = &ast->nodes[node];
+		if (n->kind == AST_BINDING && (n->flags & AST_FLAG_MUT) == 0) {
+			eval_binding(ev, node, false);
+		} else if (is_operation(n)) {
+			ConstValue value;
+			eval(ev, node, &value);
+		}
+	}
+
+	return ev->ok;
+}
+
+const ConstValue *consteval_get(const ConstEval *ev, NodeIndex binding) {
+	u32 slot = ev->slots[binding];
+	if (slot == SLOT_EMPTY || slot >= SLOT_ERROR) {
+		return NULL;
+	}
+	return &ev->values[slot];
+}
+
+bool const_fits(const ConstValue *value, TypeStorage storage) {
+	ConstValue v = *value;
+	v.storage = (u8)storage;
+	return in_range(&v);
+}
+
+void const_print(const ConstEval *ev, const ConstValue *value, FILE *out) {
+	TypeStorage storage = (TypeStorage)value->storage;
+
+	if (storage == TYPE_ARRAY) {
+		fprintf(out, "[");
+		for (u32 i = 0; i < value->array.count; i += 1) {
+			fprintf(out, i == 0 ? "" : ", ");
+			const_print(ev, &consteval_elems(ev, value)[i], out);
+		}
+		fprintf(out, "]");
+	} else if (storage == TYPE_STRING) {
+		fprintf(out, "\"%s\"", intern_str(&ev->ast->names, value->str));
+	} else if (storage == TYPE_BOOL) {
+		fprintf(out, value->mag ? "true" : "false");
+	} else if (storage == TYPE_RUNE) {
+		fprintf(out, "U+%04llX", (unsigned long long)value->mag);
+	} else if (is_float(storage)) {
+		fprintf(out, "%g %s", value->fval, type_storage2str(storage));
+	} else {
+		fprintf(
+			out, "%s%llu %s", value->neg ? "-" : "", (unsigned long long)value->mag,
+			type_storage2str(storage)
+		);
+	}
+}
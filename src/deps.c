@@ -0,0 +1,352 @@
+#include "deps.h"
+
+#include "lex.h"
+#include "trace.h"
+#include "util.h"
+
+#include <string.h>
+
+typedef struct PathBuffer {
+	char *buf;
+	usize len;
+	usize size;
+} PathBuffer;
+
+static void path_append(PathBuffer *path, const char *s, usize len) {
+	if (path->buf == NULL) {
+		path->size = 64;
+		path->buf = xcalloc(MEM_DEPS, path->size, sizeof(char));
+	}
+
+	while (path->len + len + 1 > path->size) {
+		path->size *= 2;
+		path->buf = xrealloc(MEM_DEPS, path->buf, path->size);
+	}
+
+	memcpy(path->buf + path->len, s, len);
+	path->len += len;
+}
+
+static u32 get_node(DepsGraph *graph, u32 name) {
+	if (name >= graph->lookupsize) {
+		u32 size = graph->lookupsize;
+		while (name >= size) {
+			size *= 2;
+		}
+
+		graph->lookup = xrealloc(MEM_DEPS, graph->lookup, size * sizeof(u32));
+		memset(
+			graph->lookup + graph->lookupsize, 0, (size - graph->lookupsize) * sizeof(u32)
+		);
+		graph->lookupsize = size;
+	}
+
+	if (graph->lookup[name] != 0) {
+		return graph->lookup[name] - 1;
+	}
+
+	if (graph->nodelen == graph->nodesize) {
+		graph->nodesize *= 2;
+		graph->nodes
+			= xrealloc(MEM_DEPS, graph->nodes, graph->nodesize * sizeof(DepsNode));
+	}
+
+	u32 node = graph->nodelen;
+	graph->nodelen += 1;
+	graph->nodes[node] = (DepsNode) { .name = name };
+	graph->lookup[name] = node + 1;
+	return node;
+}
+
+static void add_use(DepsGraph *graph, u32 node, u32 dep) {
+	DepsNode *n = &graph->nodes[node];
+	for (u32 i = 0; i < n->uselen; i += 1) {
+		if (n->uses[i] == dep) {
+			return;
+		}
+	}
+
+	if (n->uses == NULL) {
+		n->usesize = 4;
+		n->uses = xcalloc(MEM_DEPS, n->usesize, sizeof(u32));
+	} else if (n->uselen == n->usesize) {
+		n->usesize *= 2;
+		n->uses = xrealloc(MEM_DEPS, n->uses, n->usesize * sizeof(u32));
+	}
+
+	n->uses[n->uselen] = dep;
+	n->uselen += 1;
+}
+
+void deps_init(DepsGraph *graph) {
+	memset(graph, 0, sizeof(DepsGraph));
+	intern_init(&graph->names);
+
+	graph->nodesize = 64;
+	graph->nodes = xcalloc(MEM_DEPS, graph->nodesize, sizeof(DepsNode));
+
+	graph->lookupsize = 128;
+	graph->lookup = xcalloc(MEM_DEPS, graph->lookupsize, sizeof(u32));
+}
+
+void deps_free(DepsGraph *graph) {
+	for (u32 i = 0; i < graph->nodelen; i += 1) {
+		xfree(graph->nodes[i].uses);
+		xfree(graph->nodes[i].path);
+	}
+
+	xfree(graph->nodes);
+	xfree(graph->lookup);
+	intern_free(&graph->names);
+	memset(graph, 0, sizeof(DepsGraph));
+}
+
+// Add the package declared by the file and the packages it uses, stop at the
+// first token which isn't part of PackageDecl or UseDecl.
+static bool scan_prologue(DepsGraph *graph, LexState *lex, const char *path) {
+	Token *tok = lex_peek(lex, 0);
+
+	// PackageDecl <- "package" Name ";"
+	u32 package = INTERN_NONE;
+	if (tok->kind == TK_PACKAGE) {
+		lex_advance(lex);
+
+		tok = lex_peek(lex, 0);
+		if (tok->kind != TK_IDENTIFIER || lex_peek(lex, 1)->kind != TK_SEMICOLON) {
+			return false;
+		}
+
+		package = intern(&graph->names, tok->ident, strlen(tok->ident));
+		lex_advance(lex);
+		lex_advance(lex);
+	} else {
+		// The file is its own package, files sharing a name are still distinct
+		package = intern(&graph->names, path, strlen(path));
+	}
+
+	u32 node = get_node(graph, package);
+	if (graph->nodes[node].path == NULL) {
+		graph->nodes[node].path = xstrndup(MEM_DEPS, path, strlen(path));
+	}
+
+	PathBuffer use = { 0 };
+	bool ok = true;
+
+	// UseDecl <- "pub"? "use" Identifier ("as" Name)? ";"
+	while (ok) {
+		if (lex_peek(lex, 0)->kind == TK_PUB && lex_peek(lex, 1)->kind == TK_USE) {
+			lex_advance(lex);
+		}
+
+		if (lex_peek(lex, 0)->kind != TK_USE) {
+			break; // End of the prologue
+		}
+		lex_advance(lex);
+
+		use.len = 0;
+		while (ok) {
+			tok = lex_peek(lex, 0);
+			if (tok->kind != TK_IDENTIFIER) {
+				ok = false;
+				break;
+			}
+
+			path_append(&use, tok->ident, strlen(tok->ident));
+			lex_advance(lex);
+
+			if (lex_peek(lex, 0)->kind != TK_COLON2) {
+				break;
+			}
+
+			path_append(&use, "::", 2);
+			lex_advance(lex);
+		}
+
+		if (ok && lex_peek(lex, 0)->kind == TK_AS) {
+			if (lex_peek(lex, 1)->kind != TK_IDENTIFIER) {
+				lex_advance(lex);
+				ok = false;
+				break;
+			}
+
+			lex_advance(lex);
+			lex_advance(lex);
+		}
+
+		if (!ok || lex_peek(lex, 0)->kind != TK_SEMICOLON) {
+			ok = false;
+			break;
+		}
+		lex_advance(lex);
+
+		u32 dep = get_node(graph, intern(&graph->names, use.buf, use.len));
+		add_use(graph, node, dep);
+	}
+
+	xfree(use.buf);
+	return ok;
+}
+
+static bool scan_file(
+	DepsGraph *graph, SourceManager *sources, const char *path, u32 file
+) {
+	LexState lex;
+	if (!lex_init(&lex, sources, file, NULL)) {
+		log_error("Failed to initialize lexer for file: %s", path);
+		return false;
+	}
+	lex.recover = true; // Report lexer errors like malformed prologues, not exit
+
+	TRACE_BEGIN("lex_prologue");
+	bool ok = scan_prologue(graph, &lex, path);
+	TRACE_END("lex_prologue");
+
+	const Token *tok = lex_peek(&lex, 0);
+	if (!ok && tok->kind == TK_ERROR) {
+		log_error("%s:%s", path, lex.error);
+	} else if (!ok) {
+		Location loc = source_decode(sources, tok->loc, NULL);
+		log_error("%s:%d:%d: Malformed package prologue", path, loc.lineno, loc.colno);
+	}
+
+	TRACE_BEGIN("lex_close");
+	lex_close(&lex);
+	TRACE_END("lex_close");
+
+	return ok;
+}
+
+bool deps_scan(DepsGraph *graph, SourceManager *sources, const char *path) {
+	TRACE_BEGIN_DETAIL("deps_scan", path);
+
+	TRACE_BEGIN("open");
+	u32 file = source_load(sources, path);
+	TRACE_END("open");
+
+	if (file == 0) {
+		log_error("Failed to open file: %s", path);
+		TRACE_END("deps_scan");
+		return false;
+	}
+
+	bool ok = scan_file(graph, sources, path, file);
+	source_remove(sources, file);
+	TRACE_END("deps_scan");
+	return ok;
+}
+
+bool deps_scan_source(DepsGraph *graph, SourceManager *sources, u32 file) {
+	const char *path = source_path(sources, file);
+	TRACE_BEGIN_DETAIL("deps_scan", path);
+
+	bool ok = scan_file(graph, sources, path, file);
+	TRACE_END("deps_scan");
+	return ok;
+}
+
+bool deps_sort(const DepsGraph *graph, u32 *order) {
+	u32 count = graph->nodelen;
+	u32 *pending = xcalloc(MEM_DEPS, count, sizeof(u32)); // Uses not yet ordered
+	u32 *offsets = xcalloc(MEM_DEPS, count + 1, sizeof(u32));
+
+	// Build the reversed edges (package -> packages using it) in CSR layout
+	for (u32 i = 0; i < count; i += 1) {
+		pending[i] = graph->nodes[i].uselen;
+		for (u32 j = 0; j < graph->nodes[i].uselen; j += 1) {
+			offsets[graph->nodes[i].uses[j] + 1] += 1;
+		}
+	}
+	for (u32 i = 0; i < count; i += 1) {
+		offsets[i + 1] += offsets[i];
+	}
+
+	u32 *users = xcalloc(MEM_DEPS, offsets[count] + 1, sizeof(u32));
+	u32 *fill = xcalloc(MEM_DEPS, count, sizeof(u32));
+	for (u32 i = 0; i < count; i += 1) {
+		for (u32 j = 0; j < graph->nodes[i].uselen; j += 1) {
+			u32 dep = graph->nodes[i].uses[j];
+			users[offsets[dep] + fill[dep]] = i;
+			fill[dep] += 1;
+		}
+	}
+
+	// Kahn's algorithm, the order array doubles as the queue
+	u32 len = 0;
+	for (u32 i = 0; i < count; i += 1) {
+		if (pending[i] == 0) {
+			order[len] = i;
+			len += 1;
+		}
+	}
+
+	for (u32 head = 0; head < len; head += 1) {
+		u32 node = order[head];
+		for (u32 i = offsets[node]; i < offsets[node + 1]; i += 1) {
+			pending[users[i]] -= 1;
+			if (pending[users[i]] == 0) {
+				order[len] = users[i];
+				len += 1;
+			}
+		}
+	}
+
+	bool ok = len == count;
+	if (!ok) {
+		// Every package left has a pending use which is also left, so following
+		// them must end in a cycle.
+		u32 node = 0;
+		while (pending[node] == 0) {
+			node += 1;
+		}
+
+		memset(fill, 0, count * sizeof(u32)); // Reused as visited marks
+		while (fill[node] == 0) {
+			fill[node] = 1;
+			for (u32 i = 0; i < graph->nodes[node].uselen; i += 1) {
+				u32 dep = graph->nodes[node].uses[i];
+				if (pending[dep] > 0) {
+					node = dep;
+					break;
+				}
+			}
+		}
+
+		const Interner *names = &graph->names;
+		fprintf(
+			stderr, "Dependency cycle: %s", intern_str(names, graph->nodes[node].name)
+		);
+
+		u32 start = node;
+		do {
+			for (u32 i = 0; i < graph->nodes[node].uselen; i += 1) {
+				u32 dep = graph->nodes[node].uses[i];
+				if (pending[dep] > 0) {
+					node = dep;
+					break;
+				}
+			}
+			fprintf(stderr, " -> %s", intern_str(names, graph->nodes[node].name));
+		} while (node != start);
+		fprintf(stderr, "\n");
+	}
+
+	xfree(pending);
+	xfree(offsets);
+	xfree(users);
+	xfree(fill);
+	return ok;
+}
+
+void deps_print(const DepsGraph *graph, const u32 *order, FILE *out) {
+	for (u32 i = 0; i < graph->nodelen; i += 1) {
+		const DepsNode *node = &graph->nodes[order[i]];
+
+		fprintf(out, "%s:", intern_str(&graph->names, node->name));
+		for (u32 j = 0; j < node->uselen; j += 1) {
+			const DepsNode *dep = &graph->nodes[node->uses[j]];
+			fprintf(out, " %s", intern_str(&graph->names, dep->name));
+		}
+
+		fprintf(out, node->path == NULL ? " (external)\n" : "\n");
+	}
+}
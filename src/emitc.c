@@ -0,0 +1,2055 @@
+#include "emitc.h"
+
+#include "lex.h"
+#include "typetab.h"
+#include "utf8.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+
+typedef struct CBuf {
+	char *data; // Always NUL-terminated
+	usize len;
+	usize size;
+} CBuf;
+
+// Runtime helpers for operations without a direct C equivalent
+typedef enum Helper {
+	HELPER_DIV,   // Division trapping on zero, wrapping on -1
+	HELPER_REM,   // Remainder trapping on zero
+	HELPER_CAST,  // Saturating float to integer conversion
+	HELPER_COUNT,
+} Helper;
+
+typedef struct Emitter {
+	const Ast *ast;
+	const NodeIndex *decls;
+	TypeTable *types;
+	const ConstEval *consts;
+	const char *path;
+	bool ok;
+
+	TypeId *nodetypes; // Node -> Type of the expression or declaration
+	u8 *flags;         // Node -> EmitFlag
+	u8 *declared;      // TypeId -> Whether its typedef was emitted
+	u32 declaredsize;
+	u32 *strings; // Interned string -> Index of its rune array + 1
+	u32 strcount;
+	u32 tempcount;
+	TypeId runes; // []rune
+
+	bool helpers[HELPER_COUNT][TYPE_VOID]; // Whether a helper was emitted for a type
+	CBuf typedefs; // Type definitions and string data
+	CBuf helperdefs;
+	CBuf globals;  // Prototypes and global variables
+	CBuf funcs;
+	CBuf *out; // Where statements are emitted
+	u32 indent;
+} Emitter;
+
+typedef enum EmitFlag {
+	EMIT_GLOBAL = 0x01,  // Global binding or function, named with the ax_ prefix
+	EMIT_USED = 0x02,    // Binding or parameter referenced at least once
+	EMIT_INLINE = 0x04,  // Untyped constant, its value is written at every use
+	EMIT_ADDRESS = 0x08, // Binding whose address is taken, never emitted const
+	EMIT_FOLDED = 0x10,  // Operand of an operation on constants, never written
+} EmitFlag;
+
+// Target of statements whose value is the result of the function
+static const char return_target[] = "return";
+
+static const char *prim_names[] = {
+	[TYPE_BOOL] = "bool",    [TYPE_F32] = "float",     [TYPE_F64] = "double",
+	[TYPE_I16] = "int16_t",  [TYPE_I32] = "int32_t",   [TYPE_I64] = "int64_t",
+	[TYPE_I8] = "int8_t",    [TYPE_U16] = "uint16_t",  [TYPE_U32] = "uint32_t",
+	[TYPE_U64] = "uint64_t", [TYPE_U8] = "uint8_t",    [TYPE_VOID] = "void",
+	[TYPE_RUNE] = "uint32_t",
+};
+
+static const char prelude[] = "#include <inttypes.h>\n"
+                              "#include <math.h>\n"
+                              "#include <stdbool.h>\n"
+                              "#include <stdint.h>\n"
+                              "#include <stdio.h>\n"
+                              "#include <stdlib.h>\n";
+
+// Helpers are static inline so the unused ones don't cause warnings
+static const char runtime[]
+	= "static inline void ax_trap(const char *msg) {\n"
+	  "\tfflush(stdout);\n"
+	  "\tfprintf(stderr, \"runtime error: %s\\n\", msg);\n"
+	  "\texit(1);\n"
+	  "}\n"
+	  "\n"
+	  "static inline void ax_print_rune(uint32_t rune) {\n"
+	  "\tchar buf[4];\n"
+	  "\tint len = rune < 0x80 ? 1 : rune < 0x800 ? 2 : rune < 0x10000 ? 3 : 4;\n"
+	  "\tstatic const unsigned char first[] = { 0, 0, 0xC0, 0xE0, 0xF0 };\n"
+	  "\tfor (int i = len - 1; i > 0; i -= 1) {\n"
+	  "\t\tbuf[i] = (char)(0x80 | (rune & 0x3F));\n"
+	  "\t\trune >>= 6;\n"
+	  "\t}\n"
+	  "\tbuf[0] = (char)(rune | first[len]);\n"
+	  "\tfwrite(buf, 1, (size_t)len, stdout);\n"
+	  "}\n"
+	  "\n"
+	  "static inline void ax_print_runes(const uint32_t *runes, uint64_t len) {\n"
+	  "\tfor (uint64_t i = 0; i < len; i += 1) {\n"
+	  "\t\tax_print_rune(runes[i]);\n"
+	  "\t}\n"
+	  "}\n";
+
+static void buf_init(CBuf *b) {
+	b->size = 1024;
+	b->len = 0;
+	b->data = xcalloc(MEM_EMIT, b->size, sizeof(char));
+}
+
+static void buf_free(CBuf *b) {
+	xfree(b->data);
+}
+
+static void buf_vprintf(CBuf *b, const char *fmt, va_list args) {
+	va_list copy;
+	va_copy(copy, args);
+	int len = vsnprintf(b->data + b->len, b->size - b->len, fmt, copy);
+	va_end(copy);
+
+	if (len < 0) {
+		return;
+	} else if ((usize)len >= b->size - b->len) {
+		while (b->len + (usize)len + 1 > b->size) {
+			b->size *= 2;
+		}
+		b->data = xrealloc(MEM_EMIT, b->data, b->size);
+		vsnprintf(b->data + b->len, b->size - b->len, fmt, args);
+	}
+
+	b->len += (usize)len;
+}
+
+static void buf_printf(CBuf *b, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	buf_vprintf(b, fmt, args);
+	va_end(args);
+}
+
+static void buf_clear(CBuf *b) {
+	b->len = 0;
+	b->data[0] = '\0';
+}
+
+// Write an indented statement line to the current output
+static void line(Emitter *e, const char *fmt, ...) {
+	for (u32 i = 0; i < e->indent; i += 1) {
+		buf_printf(e->out, "\t");
+	}
+
+	va_list args;
+	va_start(args, fmt);
+	buf_vprintf(e->out, fmt, args);
+	va_end(args);
+
+	buf_printf(e->out, "\n");
+}
+
+static void push_error(Emitter *e, NodeIndex node, const char *fmt, ...) {
+	Location loc = source_decode(e->ast->sources, e->ast->locs[node], NULL);
+	fprintf(stderr, "%s:%d:%d ", e->path, loc.lineno, loc.colno);
+
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+
+	fprintf(stderr, "\n");
+	e->ok = false;
+}
+
+static const char *name_str(const Emitter *e, u32 name) {
+	return intern_str(&e->ast->names, name);
+}
+
+static bool is_int(TypeStorage storage) {
+	switch (storage) {
+	case TYPE_I8:
+	case TYPE_I16:
+	case TYPE_I32:
+	case TYPE_I64:
+	case TYPE_U8:
+	case TYPE_U16:
+	case TYPE_U32:
+	case TYPE_U64:
+	case TYPE_INT:
+	case TYPE_RUNE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool is_float(TypeStorage storage) {
+	return storage == TYPE_F32 || storage == TYPE_F64 || storage == TYPE_FLOAT;
+}
+
+static bool is_untyped(TypeStorage storage) {
+	return storage == TYPE_INT || storage == TYPE_FLOAT;
+}
+
+static bool is_signed(TypeStorage storage) {
+	return storage == TYPE_I8 || storage == TYPE_I16 || storage == TYPE_I32
+	    || storage == TYPE_I64;
+}
+
+static u32 int_bits(TypeStorage storage) {
+	switch (storage) {
+	case TYPE_I8:
+	case TYPE_U8:
+		return 8;
+	case TYPE_I16:
+	case TYPE_U16:
+		return 16;
+	case TYPE_I32:
+	case TYPE_U32:
+	case TYPE_RUNE:
+		return 32;
+	default:
+		return 64;
+	}
+}
+
+static TypeStorage storage_of(const Emitter *e, TypeId type) {
+	return (TypeStorage)type_get(e->types, type)->storage;
+}
+
+static const char *type_name(const Emitter *e, TypeId type) {
+	return type == TYPE_ID_NONE ? "void" : type_storage2str(storage_of(e, type));
+}
+
+static bool expect_type(Emitter *e, NodeIndex node, TypeId got, TypeId want) {
+	if (want != TYPE_ID_NONE && got != want) {
+		push_error(
+			e, node, "Mismatched types %s and %s", type_name(e, got), type_name(e, want)
+		);
+		return false;
+	}
+	return true;
+}
+
+// Type of untyped constants where the context doesn't give one
+static TypeId concrete(Emitter *e, TypeId type, TypeId hint) {
+	TypeStorage storage = storage_of(e, type);
+	TypeStorage want = hint == TYPE_ID_NONE ? TYPE_VOID : storage_of(e, hint);
+
+	if (storage == TYPE_INT) {
+		bool typed = (is_int(want) || is_float(want)) && !is_untyped(want);
+		return typed ? hint : type_prim(TYPE_I32);
+	} else if (storage == TYPE_FLOAT) {
+		return want == TYPE_F32 ? hint : type_prim(TYPE_F64);
+	} else if (storage == TYPE_STRING) {
+		return e->runes;
+	}
+	return type;
+}
+
+// Common type of binary operands, same rules as the constant evaluator
+static bool unify_types(Emitter *e, TypeId a, TypeId b, TypeId *out) {
+	TypeStorage sa = storage_of(e, a);
+	TypeStorage sb = storage_of(e, b);
+
+	if (a == b) {
+		*out = a;
+	} else if (sa == TYPE_STRING && b == e->runes) {
+		*out = b;
+	} else if (sb == TYPE_STRING && a == e->runes) {
+		*out = a;
+	} else if (is_untyped(sa) && (!is_untyped(sb) || sb == TYPE_FLOAT)) {
+		*out = b;
+		return sa == TYPE_INT ? is_int(sb) || is_float(sb) : is_float(sb);
+	} else if (is_untyped(sb)) {
+		*out = a;
+		return sb == TYPE_INT ? is_int(sa) || is_float(sa) : is_float(sa);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static TypeId type_of_ast(Emitter *e, NodeIndex node) {
+	if (node == AST_NONE) {
+		return type_prim(TYPE_VOID);
+	}
+
+	TypeId type = type_from_ast(e->types, e->ast, node);
+	if (type == TYPE_ID_NONE) {
+		push_error(e, node, "Array lengths must be integer literals");
+		return type_prim(TYPE_VOID);
+	}
+	return type;
+}
+
+static TypeId fn_type(Emitter *e, NodeIndex proto) {
+	const Ast *ast = e->ast;
+	const AstNode *p = &ast->nodes[proto];
+	u32 start = ast->extra[p->lhs];
+	u32 count = ast->extra[p->lhs + 1] - start;
+
+	TypeId *params = xcalloc(MEM_EMIT, count + 1, sizeof(TypeId));
+	for (u32 i = 0; i < count; i += 1) {
+		const AstNode *param = &ast->nodes[ast->extra[start + i]];
+		params[i] = type_of_ast(e, ast->extra[param->rhs]);
+	}
+
+	TypeId type = type_func(e->types, type_of_ast(e, p->rhs), params, count);
+	xfree(params);
+	return type;
+}
+
+static TypeId expr_type(Emitter *e, NodeIndex node);
+
+static TypeId decl_type(Emitter *e, NodeIndex decl) {
+	if (e->nodetypes[decl] != TYPE_ID_NONE) {
+		return e->nodetypes[decl];
+	}
+
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[decl];
+	e->nodetypes[decl] = type_prim(TYPE_VOID); // Cycles were already reported
+
+	TypeId type;
+	if (n->kind == AST_FN_DECL) {
+		type = fn_type(e, ast->extra[n->rhs]);
+	} else if (ast->extra[n->rhs] != AST_NONE) {
+		type = type_of_ast(e, ast->extra[n->rhs]);
+	} else if ((e->flags[decl] & EMIT_INLINE) != 0) {
+		type = type_prim((TypeStorage)consteval_get(e->consts, decl)->storage);
+	} else if (ast->extra[n->rhs + 1] != AST_NONE) {
+		type = concrete(e, expr_type(e, ast->extra[n->rhs + 1]), TYPE_ID_NONE);
+	} else {
+		type = type_prim(TYPE_VOID);
+	}
+
+	e->nodetypes[decl] = type;
+	return type;
+}
+
+// Natural type of an expression, untyped constants have TYPE_INT, TYPE_FLOAT
+// or TYPE_STRING
+static TypeId expr_type(Emitter *e, NodeIndex node) {
+	if (e->nodetypes[node] != TYPE_ID_NONE) {
+		return e->nodetypes[node];
+	}
+
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+	TypeId type = type_prim(TYPE_VOID);
+
+	switch ((AstKind)n->kind) {
+	case AST_INT:
+		type = type_prim(TYPE_INT);
+		break;
+	case AST_FLOAT:
+		type = type_prim(TYPE_FLOAT);
+		break;
+	case AST_RUNE:
+		type = type_prim(TYPE_RUNE);
+		break;
+	case AST_BOOL:
+		type = type_prim(TYPE_BOOL);
+		break;
+	case AST_STRING:
+		type = type_prim(TYPE_STRING);
+		break;
+	case AST_ARRAY: {
+		TypeId elem = type_prim(TYPE_VOID);
+		for (u32 i = n->lhs; i < n->rhs; i += 1) {
+			TypeId member = expr_type(e, ast->extra[i]);
+			if (i == n->lhs || !unify_types(e, elem, member, &elem)) {
+				elem = member;
+			}
+		}
+		type = type_array(e->types, concrete(e, elem, TYPE_ID_NONE), n->rhs - n->lhs);
+		break;
+	}
+	case AST_IDENT:
+		if (e->decls[node] != AST_NONE) {
+			type = decl_type(e, e->decls[node]);
+		}
+		break;
+	case AST_UNARY:
+		if (n->op == TK_LNOT) {
+			type = type_prim(TYPE_BOOL);
+		} else if (n->op == TK_BAND) {
+			type = concrete(e, expr_type(e, n->lhs), TYPE_ID_NONE);
+			type = type_pointer(e->types, type);
+		} else if (n->op == TK_STAR) {
+			TypeId ptr = expr_type(e, n->lhs);
+			if (storage_of(e, ptr) == TYPE_POINTER) {
+				type = type_get(e->types, ptr)->elem;
+			}
+		} else {
+			type = expr_type(e, n->lhs);
+		}
+		break;
+	case AST_BINARY:
+		switch ((TokenKind)n->op) {
+		case TK_LEQUAL_EQ:
+		case TK_LNOT_EQ:
+		case TK_LESS:
+		case TK_LESS_EQ:
+		case TK_GREATER:
+		case TK_GREATER_EQ:
+		case TK_LAND:
+		case TK_LOR:
+			type = type_prim(TYPE_BOOL);
+			break;
+		case TK_SHIFTL:
+		case TK_SHIFTR:
+			type = expr_type(e, n->lhs);
+			break;
+		default:
+			if (!unify_types(e, expr_type(e, n->lhs), expr_type(e, n->rhs), &type)) {
+				type = type_prim(TYPE_VOID);
+			}
+			break;
+		}
+		break;
+	case AST_CAST:
+		type = type_of_ast(e, n->rhs);
+		break;
+	case AST_CALL: {
+		TypeId callee = expr_type(e, n->lhs);
+		if (storage_of(e, callee) == TYPE_FUNC) {
+			type = type_get(e->types, callee)->elem;
+		}
+		break;
+	}
+	case AST_BLOCK:
+		if (n->rhs > n->lhs && ast->nodes[ast->extra[n->rhs - 1]].kind != AST_BINDING) {
+			type = expr_type(e, ast->extra[n->rhs - 1]);
+		}
+		break;
+	case AST_IF: {
+		NodeIndex then = ast->extra[n->rhs];
+		NodeIndex other = ast->extra[n->rhs + 1];
+		if (other != AST_NONE
+		    && !unify_types(e, expr_type(e, then), expr_type(e, other), &type)) {
+			type = type_prim(TYPE_VOID);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	e->nodetypes[node] = type;
+	return type;
+}
+
+static void put_type(Emitter *e, CBuf *b, TypeId type);
+
+// Emit the typedef of a composite type, after the types it's made of
+static void declare_type(Emitter *e, TypeId type) {
+	if (type >= e->declaredsize) {
+		u32 size = e->declaredsize;
+		while (type >= e->declaredsize) {
+			e->declaredsize *= 2;
+		}
+		e->declared = xrealloc(MEM_EMIT, e->declared, e->declaredsize);
+		memset(e->declared + size, 0, e->declaredsize - size);
+	}
+
+	if (e->declared[type]) {
+		return;
+	}
+	e->declared[type] = true;
+
+	TypeEntry entry = *type_get(e->types, type);
+	CBuf def;
+	buf_init(&def);
+
+	switch ((TypeStorage)entry.storage) {
+	case TYPE_POINTER:
+		buf_printf(&def, "typedef ");
+		put_type(e, &def, entry.elem);
+		buf_printf(&def, " *ax_t%u;\n", type);
+		break;
+	case TYPE_ARRAY:
+		buf_printf(&def, "typedef struct ax_t%u {\n\t", type);
+		put_type(e, &def, entry.elem);
+		if (entry.data == TYPE_LEN_NONE) {
+			buf_printf(&def, " *ptr;\n\tuint64_t len;\n} ax_t%u;\n", type);
+		} else {
+			// C has no empty arrays
+			u32 len = entry.data == 0 ? 1 : entry.data;
+			buf_printf(&def, " v[%u];\n} ax_t%u;\n", len, type);
+		}
+		break;
+	default: { // TYPE_FUNC
+		buf_printf(&def, "typedef ");
+		put_type(e, &def, entry.elem);
+		buf_printf(&def, " (*ax_t%u)(", type);
+
+		for (u32 i = 0; i < entry.count; i += 1) {
+			buf_printf(&def, i == 0 ? "" : ", ");
+			put_type(e, &def, e->types->params[entry.data + i]);
+		}
+		buf_printf(&def, entry.count == 0 ? "void);\n" : ");\n");
+		break;
+	}
+	}
+
+	buf_printf(&e->typedefs, "%s", def.data);
+	buf_free(&def);
+}
+
+static void put_type(Emitter *e, CBuf *b, TypeId type) {
+	TypeStorage storage = storage_of(e, type);
+	if (storage == TYPE_POINTER || storage == TYPE_ARRAY || storage == TYPE_FUNC) {
+		declare_type(e, type);
+		buf_printf(b, "ax_t%u", type);
+	} else if (storage < sizeof(prim_names) / sizeof(const char *)
+	           && prim_names[storage] != NULL) {
+		buf_printf(b, "%s", prim_names[storage]);
+	} else {
+		buf_printf(b, "%s", prim_names[TYPE_I32]); // Untyped constants
+	}
+}
+
+// C identifiers only have ASCII letters, other bytes are escaped
+static void put_mangled(CBuf *b, const char *name) {
+	for (const char *c = name; *c != '\0'; c += 1) {
+		bool alnum = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z')
+		          || (*c >= '0' && *c <= '9') || *c == '_';
+		if (alnum) {
+			buf_printf(b, "%c", *c);
+		} else {
+			buf_printf(b, "_x%02X", (u8)*c);
+		}
+	}
+}
+
+// Globals and functions have an ax_ prefix, locals the index of their node as
+// suffix, so shadowed names and C keywords never clash
+static void put_name(Emitter *e, CBuf *b, NodeIndex decl) {
+	const char *name = name_str(e, e->ast->nodes[decl].lhs);
+	if ((e->flags[decl] & EMIT_GLOBAL) != 0) {
+		buf_printf(b, "ax_");
+		put_mangled(b, name);
+	} else {
+		put_mangled(b, name);
+		buf_printf(b, "_%u", decl);
+	}
+}
+
+// Index of the rune array of a string literal, emitted on first use
+static u32 string_index(Emitter *e, u32 str) {
+	if (e->strings[str] != 0) {
+		return e->strings[str] - 1;
+	}
+
+	const char *data = intern_str(&e->ast->names, str);
+	const char *end = data + intern_len(&e->ast->names, str);
+	CBuf *b = &e->typedefs;
+
+	buf_printf(b, "static uint32_t ax_str%u[] = {", e->strcount);
+	u32 count = 0;
+	while (data < end) {
+		u32 rune;
+		data = u8_decode(data, &rune);
+		buf_printf(b, count % 12 == 0 ? "\n\t0x%X," : " 0x%X,", rune);
+		count += 1;
+	}
+	buf_printf(b, "%s0 // NUL\n};\n", count == 0 ? " " : "\n\t");
+
+	e->strcount += 1;
+	e->strings[str] = e->strcount;
+	return e->strcount - 1;
+}
+
+static u32 string_len(const Emitter *e, u32 str) {
+	const char *data = intern_str(&e->ast->names, str);
+	const char *end = data + intern_len(&e->ast->names, str);
+
+	u32 count = 0;
+	while (data < end) {
+		u32 rune;
+		data = u8_decode(data, &rune);
+		count += 1;
+	}
+	return count;
+}
+
+static void put_int(CBuf *b, bool neg, u64 mag) {
+	if (neg && mag - 1 == INT64_MAX) {
+		buf_printf(b, "(-INT64_C(%" PRId64 ") - 1)", INT64_MAX);
+	} else if (mag <= INT32_MAX) {
+		buf_printf(b, neg ? "-%" PRIu64 : "%" PRIu64, mag);
+	} else if (neg || mag <= INT64_MAX) {
+		buf_printf(b, neg ? "-INT64_C(%" PRIu64 ")" : "INT64_C(%" PRIu64 ")", mag);
+	} else {
+		buf_printf(b, "UINT64_C(%" PRIu64 ")", mag);
+	}
+}
+
+static void put_float(CBuf *b, f64 value, TypeStorage storage) {
+	if (isnan(value)) {
+		buf_printf(b, "NAN");
+		return;
+	} else if (isinf(value)) {
+		buf_printf(b, value < 0 ? "-INFINITY" : "INFINITY");
+		return;
+	}
+
+	char text[40];
+	snprintf(text, sizeof(text), storage == TYPE_F32 ? "%.9g" : "%.17g", value);
+	bool integral = strpbrk(text, ".e") == NULL;
+	buf_printf(b, "%s%s%s", text, integral ? ".0" : "", storage == TYPE_F32 ? "f" : "");
+}
+
+// Compile-time value as a C expression, or as an initializer with braces
+static void put_const(
+	Emitter *e, CBuf *b, NodeIndex node, const ConstValue *v, TypeId type, bool init
+) {
+	TypeStorage from = (TypeStorage)v->storage;
+	TypeStorage storage = storage_of(e, type);
+	const TypeEntry *entry = type_get(e->types, type);
+
+	if ((is_int(from) || from == TYPE_BOOL) && is_float(storage) && from == TYPE_INT) {
+		put_float(b, v->neg ? -(f64)v->mag : (f64)v->mag, storage);
+	} else if (is_int(from) || from == TYPE_BOOL) {
+		if (from != storage && (from != TYPE_INT || !is_int(storage))) {
+			expect_type(e, node, type_prim(from), type);
+		} else if (storage == TYPE_BOOL) {
+			buf_printf(b, v->mag != 0 ? "true" : "false");
+		} else if (!const_fits(v, storage)) {
+			push_error(e, node, "Constant overflows %s", type_storage2str(storage));
+		} else {
+			put_int(b, v->neg, v->mag);
+		}
+	} else if (is_float(from)) {
+		if (!is_float(storage) || (from != storage && from != TYPE_FLOAT)) {
+			expect_type(e, node, type_prim(from), type);
+		} else {
+			put_float(b, v->fval, storage);
+		}
+	} else if (from == TYPE_STRING) {
+		if (type != e->runes) {
+			expect_type(e, node, e->runes, type);
+			return;
+		}
+
+		u32 index = string_index(e, v->str);
+		u32 len = string_len(e, v->str);
+		if (init) {
+			buf_printf(b, "{ ax_str%u, %u }", index, len);
+		} else {
+			buf_printf(b, "((ax_t%u){ ax_str%u, %u })", type, index, len);
+		}
+	} else {
+		if (storage != TYPE_ARRAY || entry->data != v->array.count) {
+			push_error(
+				e, node, "Array of %u elements doesn't match type %s", v->array.count,
+				type_name(e, type)
+			);
+			return;
+		}
+
+		TypeId elem = entry->elem;
+		const ConstValue *elems = consteval_elems(e->consts, v);
+		buf_printf(b, init ? "{ { " : "((ax_t%u){ { ", type);
+		for (u32 i = 0; i < v->array.count; i += 1) {
+			buf_printf(b, i == 0 ? "" : ", ");
+			put_const(e, b, node, &elems[i], elem, true);
+		}
+		buf_printf(b, init ? " } }" : " } })");
+	}
+}
+
+// Literal value, with an optional minus sign folded in
+static ConstValue literal_value(const Emitter *e, NodeIndex node, bool neg) {
+	const AstNode *n = &e->ast->nodes[node];
+	ConstValue v = { 0 };
+
+	switch ((AstKind)n->kind) {
+	case AST_INT:
+		v.storage = TYPE_INT;
+		v.mag = (u64)n->rhs << 32 | n->lhs;
+		v.neg = neg && v.mag != 0;
+		break;
+	case AST_FLOAT: {
+		u64 bits = (u64)n->rhs << 32 | n->lhs;
+		v.storage = TYPE_FLOAT;
+		memcpy(&v.fval, &bits, sizeof(f64));
+		v.fval = neg ? -v.fval : v.fval;
+		break;
+	}
+	case AST_RUNE:
+		v.storage = TYPE_RUNE;
+		v.mag = n->lhs;
+		break;
+	case AST_BOOL:
+		v.storage = TYPE_BOOL;
+		v.mag = n->lhs;
+		break;
+	default:
+		v.storage = TYPE_STRING;
+		v.str = n->lhs;
+		break;
+	}
+
+	return v;
+}
+
+static bool is_literal(const Emitter *e, NodeIndex node) {
+	AstKind kind = (AstKind)e->ast->nodes[node].kind;
+	return kind >= AST_INT && kind <= AST_BOOL;
+}
+
+// Value of a literal, a negated literal or an inlined constant
+static bool const_operand(const Emitter *e, NodeIndex node, ConstValue *out) {
+	const AstNode *n = &e->ast->nodes[node];
+
+	if (is_literal(e, node)) {
+		*out = literal_value(e, node, false);
+		return true;
+	} else if (n->kind == AST_UNARY && n->op == TK_MINUS && is_literal(e, n->lhs)
+	           && e->ast->nodes[n->lhs].kind <= AST_FLOAT) {
+		*out = literal_value(e, n->lhs, true);
+		return true;
+	} else if (n->kind == AST_IDENT && e->decls[node] != AST_NONE
+	           && (e->flags[e->decls[node]] & EMIT_INLINE) != 0) {
+		*out = *consteval_get(e->consts, e->decls[node]);
+		return true;
+	}
+
+	return false;
+}
+
+static bool is_native_call(const Emitter *e, NodeIndex node) {
+	const AstNode *n = &e->ast->nodes[node];
+	if (n->kind != AST_CALL || e->ast->nodes[n->lhs].kind != AST_IDENT
+	    || e->decls[n->lhs] != AST_NONE) {
+		return false;
+	}
+
+	char name[256];
+	return ast_full_name(e->ast, n->lhs, name, sizeof(name))
+	    && strcmp(name, "std::fmt::println") == 0;
+}
+
+// Expression of a block made of a single expression
+static NodeIndex block_expr(const Emitter *e, NodeIndex node) {
+	const AstNode *n = &e->ast->nodes[node];
+	if (n->kind == AST_BLOCK && n->rhs - n->lhs == 1) {
+		NodeIndex stmt = e->ast->extra[n->lhs];
+		return e->ast->nodes[stmt].kind == AST_BINDING ? node : stmt;
+	}
+	return node;
+}
+
+static bool has_stmts(const Emitter *e, NodeIndex node);
+
+// Whether an expression can only be written as C statements
+static bool needs_stmts(const Emitter *e, NodeIndex node) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+
+	switch ((AstKind)n->kind) {
+	case AST_BLOCK:
+		return block_expr(e, node) == node || has_stmts(e, block_expr(e, node));
+	case AST_FOR:
+	case AST_ASSIGN:
+	case AST_BINDING:
+		return true;
+	case AST_IF: {
+		NodeIndex then = ast->extra[n->rhs];
+		NodeIndex other = ast->extra[n->rhs + 1];
+		return other == AST_NONE || has_stmts(e, block_expr(e, then))
+		    || has_stmts(e, block_expr(e, other));
+	}
+	case AST_BINARY:
+		return (n->op == TK_LAND || n->op == TK_LOR) && has_stmts(e, n->rhs);
+	case AST_CALL:
+		return is_native_call(e, node);
+	default:
+		return false;
+	}
+}
+
+// Whether an expression or one of its operands needs statements
+static bool has_stmts(const Emitter *e, NodeIndex node) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+	if (needs_stmts(e, node)) {
+		return true;
+	}
+
+	switch ((AstKind)n->kind) {
+	case AST_UNARY:
+	case AST_CAST:
+		return has_stmts(e, n->lhs);
+	case AST_BINARY:
+		return has_stmts(e, n->lhs) || has_stmts(e, n->rhs);
+	case AST_IF:
+		return has_stmts(e, n->lhs);
+	case AST_CALL:
+		if (has_stmts(e, n->lhs)) {
+			return true;
+		}
+		for (u32 i = ast->extra[n->rhs]; i < ast->extra[n->rhs + 1]; i += 1) {
+			if (has_stmts(e, ast->extra[i])) {
+				return true;
+			}
+		}
+		return false;
+	case AST_ARRAY:
+		for (u32 i = n->lhs; i < n->rhs; i += 1) {
+			if (has_stmts(e, ast->extra[i])) {
+				return true;
+			}
+		}
+		return false;
+	default:
+		return false;
+	}
+}
+
+static TypeId emit_expr(Emitter *e, CBuf *x, NodeIndex node, TypeId want);
+static void emit_stmt(Emitter *e, NodeIndex node, const char *target, TypeId type);
+
+// Bounds of float to integer conversions, exclusive
+static const char *cast_limits[] = {
+	[TYPE_I8] = "128.0",
+	[TYPE_I16] = "32768.0",
+	[TYPE_I32] = "2147483648.0",
+	[TYPE_I64] = "9223372036854775808.0",
+	[TYPE_U8] = "256.0",
+	[TYPE_U16] = "65536.0",
+	[TYPE_U32] = "4294967296.0",
+	[TYPE_U64] = "18446744073709551616.0",
+};
+
+static const char *helper_names[] = {
+	[HELPER_DIV] = "div",
+	[HELPER_REM] = "rem",
+	[HELPER_CAST] = "cast",
+};
+
+// Suffix of helper names, the name of the type without the _t
+static void put_helper_name(CBuf *b, Helper helper, TypeStorage storage) {
+	const char *type = prim_names[storage];
+	int len = (int)(strlen(type) - 2);
+	buf_printf(b, "ax_%s_%.*s", helper_names[helper], len, type);
+}
+
+// Emit a runtime helper on first use, with the same semantics as the VM
+static void use_helper(Emitter *e, CBuf *x, Helper helper, TypeStorage storage) {
+	storage = storage == TYPE_RUNE ? TYPE_U32 : storage;
+	put_helper_name(x, helper, storage);
+	if (e->helpers[helper][storage]) {
+		return;
+	}
+	e->helpers[helper][storage] = true;
+
+	CBuf *b = &e->helperdefs;
+	const char *t = prim_names[storage];
+	const char *u = int_bits(storage) == 64 ? "uint64_t" : "uint32_t";
+	bool sign = is_signed(storage);
+
+	buf_printf(b, "\nstatic inline %s ", t);
+	put_helper_name(b, helper, storage);
+
+	if (helper == HELPER_CAST) {
+		const char *limit = cast_limits[storage];
+		char macro[16];
+		int len = (int)strlen(t) - 2;
+		for (int i = 0; i < len; i += 1) {
+			macro[i] = t[i] >= 'a' && t[i] <= 'z' ? (char)(t[i] - 'a' + 'A') : t[i];
+		}
+
+		buf_printf(b, "(double v) {\n\tif (isnan(v)) {\n\t\treturn 0;\n");
+		buf_printf(
+			b, "\t} else if (v >= %s) {\n\t\treturn %.*s_MAX;\n", limit, len, macro
+		);
+		if (sign) {
+			buf_printf(b, "\t} else if (v <= -%s) {\n", limit);
+			buf_printf(b, "\t\treturn %.*s_MIN;\n\t}\n", len, macro);
+		} else {
+			buf_printf(b, "\t} else if (v <= 0.0) {\n\t\treturn 0;\n\t}\n");
+		}
+		buf_printf(b, "\treturn (%s)v;\n}\n", t);
+	} else {
+		buf_printf(b, "(%s a, %s b) {\n\tif (b == 0) {\n", t, t);
+		buf_printf(b, "\t\tax_trap(\"Division by zero\");\n\t}\n");
+		if (!sign) {
+			const char *op = helper == HELPER_DIV ? "/" : "%";
+			buf_printf(b, "\treturn (%s)(a %s b);\n}\n", t, op);
+		} else if (helper == HELPER_DIV) {
+			buf_printf(
+				b, "\treturn b == -1 ? (%s)(0u - (%s)a) : (%s)(a / b);\n}\n", t, u, t
+			);
+		} else {
+			buf_printf(b, "\treturn b == -1 ? 0 : (%s)(a %% b);\n}\n", t);
+		}
+	}
+}
+
+static const char *unsigned_name(TypeStorage storage) {
+	return storage == TYPE_I64 ? "uint64_t" : "uint32_t";
+}
+
+/*
+ * Arithmetic with the wrapping semantics of the VM: int-sized signed types go
+ * through unsigned ones, whose overflow is defined, and types smaller than int
+ * are truncated back after the promotion.
+ */
+static void put_arith(
+	Emitter *e, CBuf *x, TypeId type, const char *op, const char *a, const char *b
+) {
+	TypeStorage storage = storage_of(e, type);
+	const char *name = prim_names[storage];
+
+	if (storage == TYPE_I32 || storage == TYPE_I64) {
+		const char *u = unsigned_name(storage);
+		buf_printf(x, "(%s)((%s)%s %s (%s)%s)", name, u, a, op, u, b);
+	} else if (int_bits(storage) < 32 && is_int(storage)) {
+		buf_printf(x, "(%s)(%s %s %s)", name, a, op, b);
+	} else {
+		buf_printf(x, "(%s %s %s)", a, op, b);
+	}
+}
+
+static void put_shift(
+	Emitter *e, CBuf *x, TypeId type, bool left, const char *a, const char *b
+) {
+	TypeStorage storage = storage_of(e, type);
+	const char *name = prim_names[storage];
+	u32 mask = int_bits(storage) - 1;
+
+	if (left && is_signed(storage)) {
+		const char *u = int_bits(storage) == 64 ? "uint64_t" : "uint32_t";
+		buf_printf(x, "(%s)((%s)%s << (%s & %u))", name, u, a, b, mask);
+	} else {
+		buf_printf(x, "(%s)(%s %s (%s & %u))", name, a, left ? "<<" : ">>", b, mask);
+	}
+}
+
+static const char *arith_op(TokenKind op) {
+	switch (op) {
+	case TK_PLUS:
+	case TK_PLUS_EQ:
+		return "+";
+	case TK_MINUS:
+	case TK_MINUS_EQ:
+		return "-";
+	case TK_STAR:
+	case TK_STAR_EQ:
+		return "*";
+	case TK_SLASH:
+	case TK_SLASH_EQ:
+		return "/";
+	case TK_MOD:
+	case TK_MOD_EQ:
+		return "%";
+	case TK_BAND:
+	case TK_BAND_EQ:
+		return "&";
+	case TK_BOR:
+	case TK_BOR_EQ:
+		return "|";
+	case TK_BXOR:
+	case TK_BXOR_EQ:
+		return "^";
+	case TK_SHIFTL:
+	case TK_SHIFTL_EQ:
+		return "<<";
+	case TK_SHIFTR:
+	case TK_SHIFTR_EQ:
+		return ">>";
+	default:
+		return NULL;
+	}
+}
+
+// Whether an integer division by the right operand can't trap or overflow
+static bool safe_divisor(const Emitter *e, NodeIndex divisor) {
+	ConstValue value;
+	return const_operand(e, divisor, &value) && value.mag != 0
+	    && (!value.neg || value.mag != 1);
+}
+
+// Binary arithmetic on already emitted operands, checking the operand type
+static void put_binary(
+	Emitter *e, CBuf *x, NodeIndex node, TypeId type, const char *op, const char *a,
+	const char *b, NodeIndex divisor
+) {
+	TypeStorage storage = storage_of(e, type);
+	bool bitwise = op[0] == '&' || op[0] == '|' || op[0] == '^';
+
+	if (!(is_int(storage) || (is_float(storage) && !bitwise && op[0] != '<'
+	                          && op[0] != '>'))) {
+		push_error(e, node, "Invalid operation on type %s", type_name(e, type));
+	} else if (op[0] == '<' || op[0] == '>') {
+		put_shift(e, x, type, op[0] == '<', a, b);
+	} else if (op[0] == '%' && is_float(storage)) {
+		buf_printf(x, "%s(%s, %s)", storage == TYPE_F32 ? "fmodf" : "fmod", a, b);
+	} else if ((op[0] == '/' || op[0] == '%') && is_int(storage)
+	           && !safe_divisor(e, divisor)) {
+		use_helper(e, x, op[0] == '/' ? HELPER_DIV : HELPER_REM, storage);
+		buf_printf(x, "(%s, %s)", a, b);
+	} else if (bitwise || is_float(storage)) {
+		buf_printf(x, "(%s %s %s)", a, op, b);
+	} else if (op[0] == '/' || op[0] == '%') {
+		buf_printf(x, "(%s)(%s %s %s)", prim_names[storage], a, op, b);
+	} else {
+		put_arith(e, x, type, op, a, b);
+	}
+}
+
+static TypeId emit_binary(Emitter *e, CBuf *x, NodeIndex node, TypeId want) {
+	const AstNode *n = &e->ast->nodes[node];
+	TokenKind tok = (TokenKind)n->op;
+	TypeId lt = expr_type(e, n->lhs);
+	TypeId rt = expr_type(e, n->rhs);
+	TypeId boolean = type_prim(TYPE_BOOL);
+
+	CBuf a, b;
+	buf_init(&a);
+	buf_init(&b);
+
+	TypeId type = TYPE_ID_NONE;
+	const char *op = arith_op(tok);
+
+	if (tok == TK_LAND || tok == TK_LOR) {
+		expect_type(e, n->lhs, emit_expr(e, &a, n->lhs, boolean), boolean);
+		expect_type(e, n->rhs, emit_expr(e, &b, n->rhs, boolean), boolean);
+		buf_printf(x, "(%s %s %s)", a.data, tok == TK_LAND ? "&&" : "||", b.data);
+		type = boolean;
+	} else if (tok == TK_SHIFTL || tok == TK_SHIFTR) {
+		type = concrete(e, lt, want);
+		TypeId amount = concrete(e, rt, type);
+		if (!is_int(storage_of(e, amount))) {
+			push_error(e, n->rhs, "Shift amount must be an integer");
+		}
+
+		expect_type(e, n->lhs, emit_expr(e, &a, n->lhs, type), type);
+		emit_expr(e, &b, n->rhs, amount);
+		put_binary(e, x, node, type, op, a.data, b.data, n->rhs);
+	} else if (!unify_types(e, lt, rt, &type)) {
+		push_error(
+			e, node, "Mismatched types %s and %s", type_name(e, lt), type_name(e, rt)
+		);
+	} else if (op != NULL) {
+		type = concrete(e, type, want);
+		expect_type(e, n->lhs, emit_expr(e, &a, n->lhs, type), type);
+		expect_type(e, n->rhs, emit_expr(e, &b, n->rhs, type), type);
+		put_binary(e, x, node, type, op, a.data, b.data, n->rhs);
+	} else {
+		TypeId operands = concrete(e, type, TYPE_ID_NONE);
+		TypeStorage storage = storage_of(e, operands);
+		bool equality = tok == TK_LEQUAL_EQ || tok == TK_LNOT_EQ;
+		bool valid = is_int(storage) || is_float(storage)
+		          || (equality && (storage == TYPE_BOOL || storage == TYPE_POINTER
+		                           || storage == TYPE_FUNC));
+		if (!valid) {
+			push_error(e, node, "Invalid comparison of type %s", type_name(e, operands));
+		}
+
+		emit_expr(e, &a, n->lhs, operands);
+		emit_expr(e, &b, n->rhs, operands);
+		buf_printf(x, "(%s %s %s)", a.data, lex_tok2str(tok), b.data);
+		type = boolean;
+	}
+
+	buf_free(&a);
+	buf_free(&b);
+	return type;
+}
+
+static TypeId emit_unary(Emitter *e, CBuf *x, NodeIndex node, TypeId want) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+	ConstValue value;
+
+	if (n->op == TK_MINUS && const_operand(e, node, &value)) {
+		TypeId type = concrete(e, type_prim((TypeStorage)value.storage), want);
+		put_const(e, x, node, &value, type, false);
+		return type;
+	}
+
+	CBuf a;
+	buf_init(&a);
+	TypeId type;
+
+	if (n->op == TK_LNOT) {
+		type = type_prim(TYPE_BOOL);
+		expect_type(e, n->lhs, emit_expr(e, &a, n->lhs, type), type);
+		buf_printf(x, "(!%s)", a.data);
+	} else if (n->op == TK_BAND) {
+		const AstNode *operand = &ast->nodes[n->lhs];
+		NodeIndex decl = operand->kind == AST_IDENT ? e->decls[n->lhs] : AST_NONE;
+		bool addressable = (operand->kind == AST_UNARY && operand->op == TK_STAR)
+		                || (decl != AST_NONE && ast->nodes[decl].kind != AST_FN_DECL
+		                    && (e->flags[decl] & EMIT_INLINE) == 0);
+		if (!addressable) {
+			push_error(e, node, "Cannot take the address of a temporary value");
+		}
+
+		type = expr_type(e, node);
+		emit_expr(e, &a, n->lhs, type_get(e->types, type)->elem);
+		buf_printf(x, "(&%s)", a.data);
+	} else if (n->op == TK_STAR) {
+		TypeId ptr = emit_expr(e, &a, n->lhs, TYPE_ID_NONE);
+		if (storage_of(e, ptr) != TYPE_POINTER) {
+			push_error(e, node, "Cannot dereference type %s", type_name(e, ptr));
+			type = type_prim(TYPE_VOID);
+		} else {
+			type = type_get(e->types, ptr)->elem;
+		}
+		buf_printf(x, "(*%s)", a.data);
+	} else {
+		type = concrete(e, expr_type(e, n->lhs), want);
+		TypeStorage storage = storage_of(e, type);
+		expect_type(e, n->lhs, emit_expr(e, &a, n->lhs, type), type);
+
+		if (n->op == TK_MINUS && (is_int(storage) || is_float(storage))) {
+			if (storage == TYPE_I32 || storage == TYPE_I64) {
+				const char *u = unsigned_name(storage);
+				buf_printf(x, "(%s)(0u - (%s)%s)", prim_names[storage], u, a.data);
+			} else {
+				buf_printf(x, "(%s)(-%s)", prim_names[storage], a.data);
+			}
+		} else if (n->op == TK_BNOT && is_int(storage)) {
+			buf_printf(x, "(%s)(~%s)", prim_names[storage], a.data);
+		} else {
+			push_error(e, node, "Invalid operation on type %s", type_name(e, type));
+		}
+	}
+
+	buf_free(&a);
+	return type;
+}
+
+static TypeId emit_cast(Emitter *e, CBuf *x, NodeIndex node) {
+	const AstNode *n = &e->ast->nodes[node];
+	TypeId to = type_of_ast(e, n->rhs);
+	TypeId from = expr_type(e, n->lhs);
+	TypeStorage ts = storage_of(e, to);
+
+	// Untyped operands are computed at their widest and then truncated
+	ConstValue value;
+	if (storage_of(e, from) == TYPE_INT) {
+		bool big = const_operand(e, n->lhs, &value) && !value.neg
+		        && value.mag > INT64_MAX;
+		from = type_prim(big ? TYPE_U64 : TYPE_I64);
+	} else {
+		from = concrete(e, from, TYPE_ID_NONE);
+	}
+
+	TypeStorage fs = storage_of(e, from);
+	bool numeric = (is_int(fs) || is_float(fs) || fs == TYPE_BOOL)
+	            && (is_int(ts) || is_float(ts));
+	bool valid = from == to || numeric || (fs == TYPE_POINTER && ts == TYPE_POINTER);
+	if (!valid) {
+		push_error(
+			e, node, "Invalid cast from %s to %s", type_name(e, from), type_name(e, to)
+		);
+	}
+
+	CBuf a;
+	buf_init(&a);
+	expect_type(e, n->lhs, emit_expr(e, &a, n->lhs, from), from);
+
+	if (is_float(fs) && is_int(ts)) {
+		use_helper(e, x, HELPER_CAST, ts);
+		buf_printf(x, "(%s)", a.data);
+	} else {
+		buf_printf(x, "((");
+		put_type(e, x, to);
+		buf_printf(x, ")%s)", a.data);
+	}
+
+	buf_free(&a);
+	return to;
+}
+
+static TypeId emit_call(Emitter *e, CBuf *x, NodeIndex node) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+	NodeIndex decl = ast->nodes[n->lhs].kind == AST_IDENT ? e->decls[n->lhs] : AST_NONE;
+	if (decl != AST_NONE && ast->nodes[decl].kind != AST_FN_DECL) {
+		decl = AST_NONE; // Function pointer, no default arguments
+	}
+
+	CBuf arg;
+	buf_init(&arg);
+
+	TypeId callee = emit_expr(e, &arg, n->lhs, TYPE_ID_NONE);
+	if (storage_of(e, callee) != TYPE_FUNC) {
+		push_error(e, node, "Cannot call a value of type %s", type_name(e, callee));
+		buf_free(&arg);
+		return type_prim(TYPE_VOID);
+	}
+
+	TypeEntry fn = *type_get(e->types, callee);
+	u32 start = ast->extra[n->rhs];
+	u32 count = ast->extra[n->rhs + 1] - start;
+	if (count > fn.count) {
+		push_error(e, node, "Too many arguments");
+	}
+
+	u32 pstart = 0;
+	if (decl != AST_NONE) {
+		NodeIndex proto = ast->extra[ast->nodes[decl].rhs];
+		pstart = ast->extra[ast->nodes[proto].lhs];
+	}
+
+	buf_printf(x, "%s(", arg.data);
+	for (u32 i = 0; i < fn.count; i += 1) {
+		NodeIndex value = i < count ? ast->extra[start + i] : AST_NONE;
+		if (value == AST_NONE && decl != AST_NONE) {
+			NodeIndex param = ast->extra[pstart + i];
+			value = ast->extra[ast->nodes[param].rhs + 1];
+		}
+
+		if (value == AST_NONE) {
+			push_error(e, node, "Missing argument %u", i + 1);
+			break;
+		}
+
+		TypeId type = e->types->params[fn.data + i];
+		buf_clear(&arg);
+		expect_type(e, value, emit_expr(e, &arg, value, type), type);
+		buf_printf(x, "%s%s", i == 0 ? "" : ", ", arg.data);
+	}
+	buf_printf(x, ")");
+
+	buf_free(&arg);
+	return fn.elem;
+}
+
+static TypeId emit_array(Emitter *e, CBuf *x, NodeIndex node, TypeId want) {
+	const AstNode *n = &e->ast->nodes[node];
+	u32 count = n->rhs - n->lhs;
+
+	TypeId type = expr_type(e, node);
+	if (want != TYPE_ID_NONE && storage_of(e, want) == TYPE_ARRAY
+	    && type_get(e->types, want)->data == count) {
+		type = want;
+	}
+
+	TypeId elem = type_get(e->types, type)->elem;
+	CBuf member;
+	buf_init(&member);
+
+	buf_printf(x, "((ax_t%u){ { ", type);
+	declare_type(e, type);
+	for (u32 i = n->lhs; i < n->rhs; i += 1) {
+		NodeIndex value = e->ast->extra[i];
+		buf_clear(&member);
+		expect_type(e, value, emit_expr(e, &member, value, elem), elem);
+		buf_printf(x, "%s%s", i == n->lhs ? "" : ", ", member.data);
+	}
+	buf_printf(x, count == 0 ? "0 } })" : " } })");
+
+	buf_free(&member);
+	return type;
+}
+
+// Hoist an expression that needs statements into a temporary
+static TypeId emit_temp(Emitter *e, CBuf *x, NodeIndex node, TypeId want) {
+	TypeId type = concrete(e, expr_type(e, node), want);
+	if (storage_of(e, type) == TYPE_VOID) {
+		emit_stmt(e, node, NULL, TYPE_ID_NONE);
+		buf_printf(x, "((void)0)");
+		return type;
+	}
+
+	char name[16];
+	snprintf(name, sizeof(name), "t%u", e->tempcount);
+	e->tempcount += 1;
+
+	CBuf decl;
+	buf_init(&decl);
+	put_type(e, &decl, type);
+	line(e, "%s %s;", decl.data, name);
+	buf_free(&decl);
+
+	emit_stmt(e, node, name, type);
+	buf_printf(x, "%s", name);
+	return type;
+}
+
+/*
+ * Write the C expression of a node into x, statements needed by its operands
+ * are emitted before to the current output. The result is the type of the
+ * expression, untyped constants take the wanted type when it's compatible.
+ */
+static TypeId emit_expr(Emitter *e, CBuf *x, NodeIndex node, TypeId want) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+
+	if (needs_stmts(e, node)) {
+		return emit_temp(e, x, node, want);
+	}
+
+	// Operations on constants were evaluated, with their overflow checks
+	const ConstValue *folded = consteval_get(e->consts, node);
+	if (folded != NULL && n->kind != AST_BINDING) {
+		TypeId type = concrete(e, type_prim((TypeStorage)folded->storage), want);
+		put_const(e, x, node, folded, type, false);
+		return type;
+	}
+
+	switch ((AstKind)n->kind) {
+	case AST_INT:
+	case AST_FLOAT:
+	case AST_RUNE:
+	case AST_BOOL:
+	case AST_STRING: {
+		ConstValue value = literal_value(e, node, false);
+		TypeId type = concrete(e, type_prim((TypeStorage)value.storage), want);
+		put_const(e, x, node, &value, type, false);
+		return type;
+	}
+	case AST_ARRAY:
+		return emit_array(e, x, node, want);
+	case AST_IDENT: {
+		NodeIndex decl = e->decls[node];
+		if (decl == AST_NONE) {
+			push_error(
+				e, node, "Unknown external name '%s'", name_str(e, n->lhs)
+			);
+			return type_prim(TYPE_VOID);
+		} else if ((e->flags[decl] & EMIT_INLINE) != 0) {
+			const ConstValue *value = consteval_get(e->consts, decl);
+			TypeId type = concrete(e, decl_type(e, decl), want);
+			put_const(e, x, node, value, type, false);
+			return type;
+		}
+
+		put_name(e, x, decl);
+		return decl_type(e, decl);
+	}
+	case AST_UNARY:
+		return emit_unary(e, x, node, want);
+	case AST_BINARY:
+		return emit_binary(e, x, node, want);
+	case AST_CAST:
+		return emit_cast(e, x, node);
+	case AST_CALL:
+		return emit_call(e, x, node);
+	case AST_BLOCK:
+		return emit_expr(e, x, block_expr(e, node), want);
+	case AST_IF: {
+		// Both branches are expressions without side effects in statements
+		TypeId type = concrete(e, expr_type(e, node), want);
+		CBuf cond, then, other;
+		buf_init(&cond);
+		buf_init(&then);
+		buf_init(&other);
+
+		TypeId boolean = type_prim(TYPE_BOOL);
+		NodeIndex a = block_expr(e, ast->extra[n->rhs]);
+		NodeIndex b = block_expr(e, ast->extra[n->rhs + 1]);
+		expect_type(e, n->lhs, emit_expr(e, &cond, n->lhs, boolean), boolean);
+		expect_type(e, a, emit_expr(e, &then, a, type), type);
+		expect_type(e, b, emit_expr(e, &other, b, type), type);
+		buf_printf(x, "(%s ? %s : %s)", cond.data, then.data, other.data);
+
+		buf_free(&cond);
+		buf_free(&then);
+		buf_free(&other);
+		return type;
+	}
+	case AST_VOID:
+		buf_printf(x, "((void)0)");
+		return type_prim(TYPE_VOID);
+	default:
+		push_error(e, node, "Unexpected %s", ast_kind2str((AstKind)n->kind));
+		return type_prim(TYPE_VOID);
+	}
+}
+
+// Escape bytes of a format string for a C string literal
+static void put_cstring(CBuf *b, const char *str, usize len) {
+	for (usize i = 0; i < len; i += 1) {
+		u8 c = (u8)str[i];
+		if (c == '%') {
+			buf_printf(b, "%%%%");
+		} else if (c == '"' || c == '\\') {
+			buf_printf(b, "\\%c", c);
+		} else if (c >= 0x20 && c < 0x7F) {
+			buf_printf(b, "%c", c);
+		} else {
+			buf_printf(b, "\\%03o", c); // Octal escapes have at most 3 digits
+		}
+	}
+}
+
+static void flush_printf(Emitter *e, CBuf *fmt, CBuf *args) {
+	if (fmt->len > 0) {
+		line(e, "printf(\"%s\"%s);", fmt->data, args->data);
+	}
+	buf_clear(fmt);
+	buf_clear(args);
+}
+
+// Append one argument to a printf() call, runes and strings are printed with
+// the runtime helpers instead
+static void put_format_arg(
+	Emitter *e, NodeIndex node, CBuf *fmt, CBuf *args, char spec, const char *value,
+	TypeId type
+) {
+	TypeStorage storage = storage_of(e, type);
+	bool hex = spec != '\0';
+
+	if (hex && !(is_int(storage) && storage != TYPE_RUNE)) {
+		push_error(e, node, "Hexadecimal format of type %s", type_name(e, type));
+	} else if (hex) {
+		bool wide = int_bits(storage) == 64;
+		const char *conv = spec == 'x' ? (wide ? "PRIx64" : "PRIx32")
+		                               : (wide ? "PRIX64" : "PRIX32");
+		buf_printf(fmt, "%%\" %s \"", conv);
+		buf_printf(
+			args, ", (%s)(%s)%s", wide ? "uint64_t" : "uint32_t",
+			prim_names[is_signed(storage) ? storage + TYPE_U16 - TYPE_I16 : storage],
+			value
+		);
+	} else if (storage == TYPE_BOOL) {
+		buf_printf(fmt, "%%s");
+		buf_printf(args, ", %s ? \"true\" : \"false\"", value);
+	} else if (is_float(storage)) {
+		buf_printf(fmt, "%%g");
+		buf_printf(args, ", (double)%s", value);
+	} else if (storage == TYPE_RUNE) {
+		flush_printf(e, fmt, args);
+		line(e, "ax_print_rune(%s);", value);
+	} else if (type == e->runes) {
+		flush_printf(e, fmt, args);
+		line(e, "{");
+		line(e, "\tax_t%u s = %s;", type, value);
+		line(e, "\tax_print_runes(s.ptr, s.len);");
+		line(e, "}");
+	} else if (is_int(storage)) {
+		bool wide = int_bits(storage) == 64;
+		bool sign = is_signed(storage);
+		const char *conv = sign ? (wide ? "PRId64" : "PRId32")
+		                        : (wide ? "PRIu64" : "PRIu32");
+		buf_printf(fmt, "%%\" %s \"", conv);
+		buf_printf(
+			args, ", (%s)%s", sign ? (wide ? "int64_t" : "int32_t")
+			                       : (wide ? "uint64_t" : "uint32_t"),
+			value
+		);
+	} else {
+		push_error(e, node, "Cannot format values of type %s", type_name(e, type));
+	}
+}
+
+// Expand std::fmt::println, its format string must be constant
+static void emit_println(Emitter *e, NodeIndex node) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+	u32 start = ast->extra[n->rhs];
+	u32 end = ast->extra[n->rhs + 1];
+
+	ConstValue format;
+	if (start == end || !const_operand(e, ast->extra[start], &format)
+	    || format.storage != TYPE_STRING) {
+		push_error(e, node, "The first argument of println must be a constant string");
+		return;
+	}
+
+	const char *str = intern_str(&ast->names, format.str);
+	usize len = intern_len(&ast->names, format.str);
+	u32 arg = start + 1;
+
+	CBuf fmt, args, value;
+	buf_init(&fmt);
+	buf_init(&args);
+	buf_init(&value);
+
+	usize from = 0;
+	for (usize i = 0; i < len; i += 1) {
+		if (str[i] != '{' && str[i] != '}') {
+			continue;
+		}
+
+		put_cstring(&fmt, str + from, i - from);
+		if (i + 1 < len && str[i + 1] == str[i]) {
+			put_cstring(&fmt, str + i, 1);
+			i += 1;
+			from = i + 1;
+			continue;
+		} else if (str[i] == '}') {
+			push_error(e, node, "Unmatched '}' in format string");
+			break;
+		}
+
+		char spec = '\0';
+		bool hex = i + 1 < len && (str[i + 1] == 'x' || str[i + 1] == 'X');
+		if (hex && i + 2 < len && str[i + 2] == '}') {
+			spec = str[i + 1];
+			i += 2;
+		} else if (i + 1 < len && str[i + 1] == '}') {
+			i += 1;
+		} else {
+			push_error(e, node, "Invalid format specifier");
+			break;
+		}
+
+		if (arg == end) {
+			push_error(e, node, "Missing format argument");
+			break;
+		}
+
+		NodeIndex a = ast->extra[arg];
+		buf_clear(&value);
+		TypeId type = emit_expr(e, &value, a, concrete(e, expr_type(e, a), TYPE_ID_NONE));
+		put_format_arg(e, a, &fmt, &args, spec, value.data, type);
+
+		arg += 1;
+		from = i + 1;
+	}
+
+	if (arg != end && e->ok) {
+		push_error(e, node, "Too many format arguments");
+	}
+
+	put_cstring(&fmt, str + from, len - from);
+	buf_printf(&fmt, "\\n");
+	flush_printf(e, &fmt, &args);
+
+	buf_free(&fmt);
+	buf_free(&args);
+	buf_free(&value);
+}
+
+static void emit_binding(Emitter *e, NodeIndex node) {
+	const AstNode *n = &e->ast->nodes[node];
+	NodeIndex init = e->ast->extra[n->rhs + 1];
+	if ((e->flags[node] & EMIT_INLINE) != 0) {
+		return;
+	}
+
+	TypeId type = decl_type(e, node);
+	CBuf decl, value;
+	buf_init(&decl);
+	buf_init(&value);
+
+	put_type(e, &decl, type);
+	buf_printf(&decl, " ");
+	put_name(e, &decl, node);
+
+	if (init == AST_NONE) {
+		line(e, "%s = { 0 };", decl.data);
+	} else {
+		expect_type(e, init, emit_expr(e, &value, init, type), type);
+		line(e, "%s = %s;", decl.data, value.data);
+	}
+
+	if ((e->flags[node] & EMIT_USED) == 0) {
+		buf_clear(&decl);
+		put_name(e, &decl, node);
+		line(e, "(void)%s;", decl.data);
+	}
+
+	buf_free(&decl);
+	buf_free(&value);
+}
+
+// Write an assignment expression, statements for the operands are emitted
+static void emit_assign(Emitter *e, CBuf *x, NodeIndex node) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+	const AstNode *target = &ast->nodes[n->lhs];
+	const char *op = arith_op((TokenKind)n->op);
+
+	CBuf lhs, rhs;
+	buf_init(&lhs);
+	buf_init(&rhs);
+
+	TypeId type;
+	bool deref = target->kind == AST_UNARY && target->op == TK_STAR;
+	if (deref && op != NULL && ast->nodes[target->lhs].kind != AST_IDENT) {
+		// The pointer is evaluated once, it's read and written
+		CBuf ptr;
+		buf_init(&ptr);
+		TypeId ptrtype = emit_expr(e, &ptr, target->lhs, TYPE_ID_NONE);
+		if (storage_of(e, ptrtype) != TYPE_POINTER) {
+			push_error(e, node, "Cannot dereference type %s", type_name(e, ptrtype));
+		}
+
+		buf_clear(&rhs);
+		put_type(e, &rhs, ptrtype);
+		line(e, "%s t%u = %s;", rhs.data, e->tempcount, ptr.data);
+		buf_printf(&lhs, "(*t%u)", e->tempcount);
+		e->tempcount += 1;
+		buf_clear(&rhs);
+		buf_free(&ptr);
+
+		type = type_get(e->types, ptrtype)->elem;
+	} else if (target->kind == AST_IDENT || deref) {
+		type = emit_expr(e, &lhs, n->lhs, TYPE_ID_NONE);
+	} else {
+		push_error(e, node, "Invalid assignment target");
+		type = type_prim(TYPE_VOID);
+	}
+
+	if (op == NULL) {
+		expect_type(e, n->rhs, emit_expr(e, &rhs, n->rhs, type), type);
+		buf_printf(x, "%s = %s", lhs.data, rhs.data);
+	} else {
+		TypeId rtype = type;
+		if (n->op == TK_SHIFTL_EQ || n->op == TK_SHIFTR_EQ) {
+			rtype = concrete(e, expr_type(e, n->rhs), type);
+		}
+
+		expect_type(e, n->rhs, emit_expr(e, &rhs, n->rhs, rtype), rtype);
+		buf_printf(x, "%s = ", lhs.data);
+		put_binary(e, x, node, type, op, lhs.data, rhs.data, n->rhs);
+	}
+
+	buf_free(&lhs);
+	buf_free(&rhs);
+}
+
+// Statements of a block without the braces, the last one gets the target
+static void emit_body(Emitter *e, NodeIndex node, const char *target, TypeId type) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+	if (n->kind != AST_BLOCK) {
+		emit_stmt(e, node, target, type);
+		return;
+	}
+
+	NodeIndex last = n->rhs > n->lhs ? ast->extra[n->rhs - 1] : AST_NONE;
+	if (target != NULL && (last == AST_NONE || ast->nodes[last].kind == AST_BINDING)) {
+		expect_type(e, node, type_prim(TYPE_VOID), type);
+	}
+
+	for (u32 i = n->lhs; i < n->rhs; i += 1) {
+		bool value = i + 1 == n->rhs;
+		emit_stmt(e, ast->extra[i], value ? target : NULL, value ? type : TYPE_ID_NONE);
+	}
+}
+
+static void emit_if(Emitter *e, NodeIndex node, const char *target, TypeId type) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+	NodeIndex other = ast->extra[n->rhs + 1];
+	if (target != NULL && other == AST_NONE) {
+		expect_type(e, node, type_prim(TYPE_VOID), type);
+	}
+
+	CBuf cond;
+	buf_init(&cond);
+	TypeId boolean = type_prim(TYPE_BOOL);
+	expect_type(e, n->lhs, emit_expr(e, &cond, n->lhs, boolean), boolean);
+
+	line(e, "if (%s) {", cond.data);
+	e->indent += 1;
+	emit_body(e, ast->extra[n->rhs], target, type);
+	e->indent -= 1;
+
+	if (other != AST_NONE) {
+		line(e, "} else {");
+		e->indent += 1;
+		emit_body(e, other, target, type);
+		e->indent -= 1;
+	}
+	line(e, "}");
+
+	buf_free(&cond);
+}
+
+static void emit_for(Emitter *e, NodeIndex node) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+	u32 initstart = ast->extra[n->lhs];
+	u32 initend = ast->extra[n->lhs + 1];
+	NodeIndex cond = ast->extra[n->lhs + 2];
+	NodeIndex post = ast->extra[n->lhs + 3];
+
+	// The loop bindings are scoped to the loop
+	bool scoped = initend > initstart;
+	if (scoped) {
+		line(e, "{");
+		e->indent += 1;
+	}
+
+	for (u32 i = initstart; i < initend; i += 1) {
+		emit_stmt(e, ast->extra[i], NULL, TYPE_ID_NONE);
+	}
+
+	// Loops with simple headers keep the canonical form optimizers look for
+	bool simple = (cond == AST_NONE || !has_stmts(e, cond))
+	           && (post == AST_NONE
+	               || (ast->nodes[post].kind == AST_ASSIGN
+	                   && ast->nodes[ast->nodes[post].lhs].kind == AST_IDENT
+	                   && !has_stmts(e, ast->nodes[post].rhs)));
+
+	CBuf header, step;
+	buf_init(&header);
+	buf_init(&step);
+	TypeId boolean = type_prim(TYPE_BOOL);
+
+	if (simple) {
+		if (cond != AST_NONE) {
+			expect_type(e, cond, emit_expr(e, &header, cond, boolean), boolean);
+		}
+		if (post != AST_NONE) {
+			emit_assign(e, &step, post);
+		}
+
+		line(e, "for (; %s; %s) {", header.data, step.data);
+		e->indent += 1;
+		emit_body(e, n->rhs, NULL, TYPE_ID_NONE);
+		e->indent -= 1;
+		line(e, "}");
+	} else {
+		line(e, "for (;;) {");
+		e->indent += 1;
+		if (cond != AST_NONE) {
+			expect_type(e, cond, emit_expr(e, &header, cond, boolean), boolean);
+			line(e, "if (!%s) {", header.data);
+			line(e, "\tbreak;");
+			line(e, "}");
+		}
+
+		emit_body(e, n->rhs, NULL, TYPE_ID_NONE);
+		if (post != AST_NONE) {
+			emit_stmt(e, post, NULL, TYPE_ID_NONE);
+		}
+		e->indent -= 1;
+		line(e, "}");
+	}
+
+	if (scoped) {
+		e->indent -= 1;
+		line(e, "}");
+	}
+
+	buf_free(&header);
+	buf_free(&step);
+}
+
+/*
+ * Emit a node as statements, its value is assigned to target (or returned
+ * with return_target) when it isn't NULL.
+ */
+static void emit_stmt(Emitter *e, NodeIndex node, const char *target, TypeId type) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[node];
+
+	switch ((AstKind)n->kind) {
+	case AST_BLOCK:
+		line(e, "{");
+		e->indent += 1;
+		emit_body(e, node, target, type);
+		e->indent -= 1;
+		line(e, "}");
+		return;
+	case AST_IF:
+		emit_if(e, node, target, type);
+		return;
+	case AST_FOR:
+		emit_for(e, node);
+		break;
+	case AST_BINDING:
+		emit_binding(e, node);
+		break;
+	case AST_ASSIGN: {
+		CBuf x;
+		buf_init(&x);
+		emit_assign(e, &x, node);
+		line(e, "%s;", x.data);
+		buf_free(&x);
+		break;
+	}
+	case AST_CALL:
+		if (is_native_call(e, node)) {
+			emit_println(e, node);
+			break;
+		}
+		// fallthrough
+	default: {
+		CBuf x;
+		buf_init(&x);
+
+		if (n->kind == AST_BINARY && (n->op == TK_LAND || n->op == TK_LOR)
+		    && has_stmts(e, n->rhs)) {
+			// The right operand is only evaluated if the left one doesn't decide
+			char name[16];
+			snprintf(name, sizeof(name), "t%u", e->tempcount);
+			e->tempcount += 1;
+
+			TypeId boolean = type_prim(TYPE_BOOL);
+			expect_type(e, n->lhs, emit_expr(e, &x, n->lhs, boolean), boolean);
+			line(e, "bool %s = %s;", name, x.data);
+			line(e, n->op == TK_LAND ? "if (%s) {" : "if (!%s) {", name);
+			e->indent += 1;
+			emit_body(e, n->rhs, name, boolean);
+			e->indent -= 1;
+			line(e, "}");
+
+			buf_clear(&x);
+			buf_printf(&x, "%s", name);
+			if (target != NULL) {
+				expect_type(e, node, boolean, type);
+			}
+		} else {
+			TypeId got = emit_expr(e, &x, node, type);
+			if (target != NULL) {
+				expect_type(e, node, got, type);
+			}
+		}
+
+		if (target == return_target) {
+			line(e, "return %s;", x.data);
+		} else if (target != NULL) {
+			line(e, "%s = %s;", target, x.data);
+		} else if (n->kind == AST_CALL) {
+			line(e, "%s;", x.data);
+		} else {
+			line(e, "(void)%s;", x.data);
+		}
+
+		buf_free(&x);
+		return;
+	}
+	}
+
+	if (target != NULL) {
+		expect_type(e, node, type_prim(TYPE_VOID), type);
+	}
+}
+
+static void put_signature(Emitter *e, CBuf *b, NodeIndex decl) {
+	const Ast *ast = e->ast;
+	NodeIndex proto = ast->extra[ast->nodes[decl].rhs];
+	const AstNode *p = &ast->nodes[proto];
+	u32 start = ast->extra[p->lhs];
+	u32 end = ast->extra[p->lhs + 1];
+	TypeEntry fn = *type_get(e->types, decl_type(e, decl));
+
+	// Functions nothing calls are inline so they don't cause warnings
+	bool entry = strcmp(name_str(e, ast->nodes[decl].lhs), "main") == 0;
+	bool used = entry || (e->flags[decl] & EMIT_USED) != 0;
+	buf_printf(b, used ? "static " : "static inline ");
+	put_type(e, b, fn.elem);
+	buf_printf(b, " ");
+	put_name(e, b, decl);
+	buf_printf(b, "(");
+
+	for (u32 i = start; i < end; i += 1) {
+		buf_printf(b, i == start ? "" : ", ");
+		put_type(e, b, e->types->params[fn.data + i - start]);
+		buf_printf(b, " ");
+		put_name(e, b, ast->extra[i]);
+	}
+	buf_printf(b, start == end ? "void)" : ")");
+}
+
+static void emit_fn(Emitter *e, NodeIndex decl) {
+	const Ast *ast = e->ast;
+	const AstNode *n = &ast->nodes[decl];
+	NodeIndex proto = ast->extra[n->rhs];
+	const AstNode *p = &ast->nodes[proto];
+	TypeId ret = type_get(e->types, decl_type(e, decl))->elem;
+
+	CBuf sig;
+	buf_init(&sig);
+	put_signature(e, &sig, decl);
+	buf_printf(&e->globals, "%s;\n", sig.data);
+
+	e->out = &e->funcs;
+	e->indent = 0;
+	e->tempcount = 0;
+	line(e, "\n%s {", sig.data);
+	e->indent = 1;
+
+	for (u32 i = ast->extra[p->lhs]; i < ast->extra[p->lhs + 1]; i += 1) {
+		NodeIndex param = ast->extra[i];
+		if ((e->flags[param] & EMIT_USED) == 0) {
+			buf_clear(&sig);
+			put_name(e, &sig, param);
+			line(e, "(void)%s;", sig.data);
+		}
+	}
+
+	if (storage_of(e, ret) == TYPE_VOID) {
+		emit_body(e, ast->extra[n->rhs + 1], NULL, TYPE_ID_NONE);
+	} else {
+		emit_body(e, ast->extra[n->rhs + 1], return_target, ret);
+	}
+
+	e->indent = 0;
+	line(e, "}");
+	buf_free(&sig);
+}
+
+static void emit_global(Emitter *e, NodeIndex binding) {
+	// Unused globals are left out, the C compiler would warn about them
+	u8 flags = e->flags[binding];
+	const ConstValue *value = consteval_get(e->consts, binding);
+	if ((flags & EMIT_INLINE) != 0 || (flags & EMIT_USED) == 0 || value == NULL) {
+		return;
+	}
+
+	bool constant = (e->ast->nodes[binding].flags & AST_FLAG_MUT) == 0
+	             && (flags & EMIT_ADDRESS) == 0;
+	TypeId type = decl_type(e, binding);
+	CBuf *b = &e->globals;
+	buf_printf(b, constant ? "static const " : "static ");
+	put_type(e, b, type);
+	buf_printf(b, " ");
+	put_name(e, b, binding);
+	buf_printf(b, " = ");
+	put_const(e, b, binding, value, type, true);
+	buf_printf(b, ";\n");
+}
+
+// Mark globals, used declarations and constants written at their uses
+static void scan_unit(Emitter *e) {
+	const Ast *ast = e->ast;
+	const AstNode *root = &ast->nodes[0];
+
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		NodeIndex decl = ast->extra[i];
+		const AstNode *n = &ast->nodes[decl];
+		if (n->kind == AST_FN_DECL) {
+			e->flags[decl] |= EMIT_GLOBAL;
+		} else if (n->kind == AST_GLOBAL) {
+			for (u32 j = n->lhs; j < n->rhs; j += 1) {
+				e->flags[ast->extra[j]] |= EMIT_GLOBAL;
+			}
+		}
+	}
+
+	// Operands of folded operations aren't written, parents come after them
+	for (NodeIndex node = ast->nodelen - 1; node > 0; node -= 1) {
+		const AstNode *n = &ast->nodes[node];
+		bool operation = n->kind == AST_UNARY || n->kind == AST_BINARY
+		              || n->kind == AST_CAST;
+		if (operation
+		    && ((e->flags[node] & EMIT_FOLDED) != 0
+		        || consteval_get(e->consts, node) != NULL)) {
+			e->flags[n->lhs] |= EMIT_FOLDED;
+			e->flags[n->kind == AST_BINARY ? n->rhs : n->lhs] |= EMIT_FOLDED;
+		}
+	}
+
+	// Declarations are added after their children, so the nodes of a function
+	// are the ones since the previous declaration
+	NodeIndex node = 1;
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		NodeIndex decl = ast->extra[i];
+		bool fn = ast->nodes[decl].kind == AST_FN_DECL;
+
+		for (; node <= decl; node += 1) {
+			const AstNode *n = &ast->nodes[node];
+			NodeIndex target = n->kind == AST_IDENT ? e->decls[node] : AST_NONE;
+
+			// Recursive calls don't count, they're unused without other calls,
+			// and global initializers are folded so they don't use anything
+			if (target != AST_NONE && fn && target != decl
+			    && (e->flags[node] & EMIT_FOLDED) == 0) {
+				e->flags[target] |= EMIT_USED;
+			} else if (n->kind == AST_UNARY && n->op == TK_BAND
+			           && ast->nodes[n->lhs].kind == AST_IDENT
+			           && e->decls[n->lhs] != AST_NONE) {
+				e->flags[e->decls[n->lhs]] |= EMIT_ADDRESS;
+			} else if (n->kind == AST_BINDING && (n->flags & AST_FLAG_MUT) == 0
+			           && ast->extra[n->rhs] == AST_NONE) {
+				const ConstValue *value = consteval_get(e->consts, node);
+				if (value != NULL && is_untyped((TypeStorage)value->storage)) {
+					e->flags[node] |= EMIT_INLINE;
+				}
+			}
+		}
+	}
+}
+
+bool emitc_unit(
+	const Ast *ast, const NodeIndex *decls, TypeTable *types, const ConstEval *consts,
+	const char *path, FILE *out
+) {
+	Emitter e = {
+		.ast = ast,
+		.decls = decls,
+		.types = types,
+		.consts = consts,
+		.path = path,
+		.ok = true,
+	};
+
+	e.nodetypes = xcalloc(MEM_EMIT, ast->nodelen, sizeof(TypeId));
+	e.flags = xcalloc(MEM_EMIT, ast->nodelen, sizeof(u8));
+	e.declaredsize = 64;
+	e.declared = xcalloc(MEM_EMIT, e.declaredsize, sizeof(u8));
+	e.strings = xcalloc(MEM_EMIT, ast->names.count + 1, sizeof(u32));
+	e.runes = type_array(e.types, type_prim(TYPE_RUNE), TYPE_LEN_NONE);
+
+	buf_init(&e.typedefs);
+	buf_init(&e.helperdefs);
+	buf_init(&e.globals);
+	buf_init(&e.funcs);
+	declare_type(&e, e.runes);
+	scan_unit(&e);
+
+	NodeIndex entry = AST_NONE;
+	const AstNode *root = &ast->nodes[0];
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		NodeIndex decl = ast->extra[i];
+		const AstNode *n = &ast->nodes[decl];
+
+		if (n->kind == AST_GLOBAL) {
+			for (u32 j = n->lhs; j < n->rhs; j += 1) {
+				emit_global(&e, ast->extra[j]);
+			}
+		} else if (n->kind == AST_FN_DECL) {
+			emit_fn(&e, decl);
+			if (strcmp(name_str(&e, n->lhs), "main") == 0) {
+				entry = decl;
+			}
+		}
+	}
+
+	if (entry == AST_NONE) {
+		fprintf(stderr, "%s: No 'main' function\n", path);
+		e.ok = false;
+	} else {
+		TypeEntry fn = *type_get(e.types, decl_type(&e, entry));
+		if (fn.count != 0) {
+			push_error(&e, entry, "'main' must not have parameters");
+		}
+
+		bool status = is_int(storage_of(&e, fn.elem));
+		buf_printf(&e.funcs, "\nint main(void) {\n");
+		buf_printf(&e.funcs, status ? "\treturn (int)ax_main();\n" : "\tax_main();\n");
+		buf_printf(&e.funcs, status ? "}\n" : "\treturn 0;\n}\n");
+	}
+
+	if (e.ok) {
+		fprintf(out, "// Generated by ax from %s\n\n%s\n", path, prelude);
+		fprintf(out, "%s\n%s%s\n", e.typedefs.data, runtime, e.helperdefs.data);
+		fprintf(out, "%s%s", e.globals.data, e.funcs.data);
+	}
+
+	buf_free(&e.typedefs);
+	buf_free(&e.helperdefs);
+	buf_free(&e.globals);
+	buf_free(&e.funcs);
+	xfree(e.nodetypes);
+	xfree(e.flags);
+	xfree(e.declared);
+	xfree(e.strings);
+	return e.ok;
+}
@@ -0,0 +1,574 @@
+#include "iface.h"
+
+#include "intern.h"
+#include "lex.h"
+#include "loader.h"
+#include "parse.h"
+#include "trace.h"
+#include "typetab.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ALIGN8(x) (((x) + 7) & ~(usize)7)
+
+typedef struct IfaceBuilder {
+	Interner strings;      // Written as the pool
+	TypeTable *types;      // Written whole, declarations refer to its IDs
+	u32 package;           // Interned, INTERN_NONE until the first file is parsed
+	SourceManager sources; // Files being parsed
+
+	IfaceDecl *decls; // Names are IDs of strings until written
+	u32 decllen;
+	u32 declsize;
+} IfaceBuilder;
+
+// Offsets of the sections of an interface file
+typedef struct IfaceLayout {
+	usize types;
+	usize params;
+	usize decls;
+	usize pool;
+	usize size;
+} IfaceLayout;
+
+static IfaceLayout iface_layout(const IfaceHeader *header) {
+	IfaceLayout layout;
+	layout.types = ALIGN8(sizeof(IfaceHeader));
+	layout.params = ALIGN8(layout.types + (usize)header->typecount * sizeof(IfaceType));
+	layout.decls = ALIGN8(layout.params + (usize)header->paramcount * sizeof(u32));
+	layout.pool = ALIGN8(layout.decls + (usize)header->declcount * sizeof(IfaceDecl));
+	layout.size = layout.pool + header->poolsize;
+	return layout;
+}
+
+bool iface_open(Iface *iface, const char *path) {
+	memset(iface, 0, sizeof(Iface));
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (usize)st.st_size < sizeof(IfaceHeader)) {
+		close(fd);
+		return false;
+	}
+
+	usize size = (usize)st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+
+	const IfaceHeader *header = map;
+	IfaceLayout layout = iface_layout(header);
+	if (header->magic != IFACE_MAGIC || header->version != IFACE_VERSION
+	    || layout.size != size || header->poolsize <= header->package
+	    || ((const char *)map)[size - 1] != '\0') {
+		munmap(map, size);
+		return false;
+	}
+
+	iface->map = map;
+	iface->size = size;
+	iface->header = header;
+	iface->types = (const IfaceType *)((const char *)map + layout.types);
+	iface->params = (const u32 *)((const char *)map + layout.params);
+	iface->decls = (const IfaceDecl *)((const char *)map + layout.decls);
+	iface->pool = (const char *)map + layout.pool;
+	return true;
+}
+
+void iface_close(Iface *iface) {
+	if (iface->map != NULL) {
+		munmap(iface->map, iface->size);
+	}
+	memset(iface, 0, sizeof(Iface));
+}
+
+const IfaceDecl *iface_find(const Iface *iface, const char *name) {
+	u32 lo = 0;
+	u32 hi = iface->header->declcount;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(iface_str(iface, iface->decls[mid].name), name);
+		if (cmp == 0) {
+			return &iface->decls[mid];
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+static u64 hash_contents(u64 hash, const char *data, usize len) {
+	for (usize i = 0; i < len; i += 1) { // FNV-1a
+		hash ^= (u8)data[i];
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+// Hash of the contents of the files, each one followed by its length
+static bool hash_files(const char *const *paths, u32 count, u64 *out) {
+	TRACE_BEGIN("iface_hash");
+	u64 hash = 14695981039346656037u;
+	bool ok = true;
+
+	Loader loader;
+	loader_init(&loader, paths, count, true);
+	for (u32 i = 0; i < count; i += 1) {
+		const SourceFile *src = loader_get(&loader, i);
+		if (src->data == NULL) {
+			log_error("Failed to open file: %s: %s", src->path, strerror(src->error));
+			ok = false;
+		} else {
+			u64 len = src->len;
+			hash = hash_contents(hash, src->data, src->len);
+			hash = hash_contents(hash, (const char *)&len, sizeof(len));
+		}
+		loader_release(&loader, i);
+	}
+	loader_free(&loader);
+
+	TRACE_END("iface_hash");
+	*out = hash;
+	return ok;
+}
+
+// Intern a name of the tree in the builder
+static u32 intern_name(IfaceBuilder *b, const Ast *ast, u32 name) {
+	const char *str = intern_str(&ast->names, name);
+	return intern(&b->strings, str, intern_len(&ast->names, name));
+}
+
+// Files without a PackageDecl belong to a package named after the file
+static u32 intern_stem(IfaceBuilder *b, const char *path) {
+	const char *start = strrchr(path, '/');
+	start = start == NULL ? path : start + 1;
+
+	const char *end = strrchr(start, '.');
+	if (end == NULL) {
+		end = start + strlen(start);
+	}
+
+	return intern(&b->strings, start, (usize)(end - start));
+}
+
+static TypeId fn_type(IfaceBuilder *b, const Ast *ast, NodeIndex decl) {
+	const AstNode *proto = &ast->nodes[ast->extra[ast->nodes[decl].rhs]];
+	u32 start = ast->extra[proto->lhs];
+	u32 count = ast->extra[proto->lhs + 1] - start;
+
+	TypeId ret = proto->rhs == AST_NONE ? type_prim(TYPE_VOID)
+	                                    : type_from_ast(b->types, ast, proto->rhs);
+	TypeId *params = xcalloc(MEM_IFACE, count + 1, sizeof(TypeId));
+	TypeId id = ret;
+	for (u32 i = 0; i < count && id != TYPE_ID_NONE; i += 1) {
+		const AstNode *param = &ast->nodes[ast->extra[start + i]];
+		params[i] = type_from_ast(b->types, ast, ast->extra[param->rhs]);
+		id = params[i];
+	}
+
+	if (id != TYPE_ID_NONE) {
+		id = type_func(b->types, ret, params, count);
+	}
+	xfree(params);
+	return id;
+}
+
+// Declared type of a global, or the untyped constant type of a literal
+static TypeId binding_type(IfaceBuilder *b, const Ast *ast, NodeIndex binding) {
+	const AstNode *n = &ast->nodes[binding];
+	NodeIndex type = ast->extra[n->rhs];
+	NodeIndex init = ast->extra[n->rhs + 1];
+	if (type != AST_NONE) {
+		return type_from_ast(b->types, ast, type);
+	} else if (init == AST_NONE) {
+		return TYPE_ID_NONE;
+	}
+
+	switch (ast->nodes[init].kind) {
+	case AST_INT:
+		return type_prim(TYPE_INT);
+	case AST_FLOAT:
+		return type_prim(TYPE_FLOAT);
+	case AST_RUNE:
+		return type_prim(TYPE_RUNE);
+	case AST_BOOL:
+		return type_prim(TYPE_BOOL);
+	case AST_STRING:
+		return type_prim(TYPE_STRING);
+	default:
+		return TYPE_ID_NONE; // Only known once the expression is checked
+	}
+}
+
+static void add_decl(IfaceBuilder *b, u32 name, TypeId type, IfaceKind kind) {
+	if (b->decllen == b->declsize) {
+		b->declsize *= 2;
+		b->decls = xrealloc(MEM_IFACE, b->decls, b->declsize * sizeof(IfaceDecl));
+	}
+
+	b->decls[b->decllen] = (IfaceDecl) { .name = name, .type = type, .kind = (u8)kind };
+	b->decllen += 1;
+}
+
+static bool add_decls(IfaceBuilder *b, const Ast *ast, const char *path) {
+	const AstNode *root = &ast->nodes[0];
+	u32 package = INTERN_NONE;
+	for (u32 i = root->lhs; i < root->rhs && package == INTERN_NONE; i += 1) {
+		const AstNode *n = &ast->nodes[ast->extra[i]];
+		if (n->kind == AST_PACKAGE) {
+			package = intern_name(b, ast, n->lhs);
+		}
+	}
+	if (package == INTERN_NONE) {
+		package = intern_stem(b, path);
+	}
+
+	if (b->package == INTERN_NONE) {
+		b->package = package;
+	} else if (b->package != package) {
+		log_error(
+			"%s: Package '%s' differs from '%s'", path, intern_str(&b->strings, package),
+			intern_str(&b->strings, b->package)
+		);
+		return false;
+	}
+
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		NodeIndex decl = ast->extra[i];
+		const AstNode *n = &ast->nodes[decl];
+		if ((n->flags & AST_FLAG_PUB) == 0) {
+			continue;
+		}
+
+		if (n->kind == AST_FN_DECL) {
+			add_decl(b, intern_name(b, ast, n->lhs), fn_type(b, ast, decl), IFACE_FN);
+		} else if (n->kind == AST_GLOBAL) {
+			IfaceKind kind = (n->flags & AST_FLAG_MUT) != 0 ? IFACE_MUT : IFACE_CONST;
+			for (u32 j = n->lhs; j < n->rhs; j += 1) {
+				NodeIndex binding = ast->extra[j];
+				u32 name = intern_name(b, ast, ast->nodes[binding].lhs);
+				add_decl(b, name, binding_type(b, ast, binding), kind);
+			}
+		}
+	}
+	return true;
+}
+
+// Lex and parse a file read by the loader, then add its pub declarations
+static bool iface_source(IfaceBuilder *b, const SourceFile *src) {
+	TRACE_BEGIN_DETAIL("iface_source", src->path);
+
+	u32 id = source_add(&b->sources, src->path, src->data, src->len, false);
+	LexState lex;
+	if (id == 0 || !lex_init(&lex, &b->sources, id, NULL)) {
+		log_error("Failed to initialize lexer for file: %s", src->path);
+		if (id != 0) {
+			source_remove(&b->sources, id);
+		}
+		TRACE_END("iface_source");
+		return false;
+	}
+	lex.recover = true;
+
+	u32 len;
+	Token *tokens = lex_scan_all(&lex, MEM_IFACE, &len);
+	bool ok = tokens[len - 1].kind != TK_ERROR;
+	if (!ok) {
+		log_error("%s:%s", src->path, lex.error);
+	} else {
+		Ast ast;
+		ast_init(&ast, &b->sources);
+
+		char error[PARSE_ERROR_MAX];
+		ok = parse_tokens(tokens, len, NULL, &ast, error);
+		if (ok) {
+			ok = add_decls(b, &ast, src->path);
+		} else {
+			log_error("%s:%s", src->path, error);
+		}
+		ast_free(&ast);
+	}
+
+	for (u32 i = 0; i < len; i += 1) {
+		lex_release(&lex, &tokens[i]);
+	}
+	xfree(tokens);
+	lex_close(&lex);
+	source_remove(&b->sources, id);
+
+	TRACE_END("iface_source");
+	return ok;
+}
+
+static int compare_decls(const char *pool, const IfaceDecl *x, const IfaceDecl *y) {
+	return strcmp(pool + x->name, pool + y->name);
+}
+
+static void sort_decls(const char *pool, IfaceDecl *items, IfaceDecl *tmp, u32 len) {
+	if (len < 2) {
+		return;
+	}
+
+	u32 half = len / 2;
+	sort_decls(pool, items, tmp, half);
+	sort_decls(pool, items + half, tmp, len - half);
+
+	u32 i = 0;
+	u32 j = half;
+	u32 k = 0;
+	while (i < half || j < len) {
+		if (j == len || (i < half && compare_decls(pool, &items[i], &items[j]) <= 0)) {
+			tmp[k] = items[i];
+			i += 1;
+		} else {
+			tmp[k] = items[j];
+			j += 1;
+		}
+		k += 1;
+	}
+	memcpy(items, tmp, len * sizeof(IfaceDecl));
+}
+
+// Write a section at its offset, padding the bytes before it with zeros
+static bool write_section(
+	FILE *out, usize *pos, usize offset, const void *data, usize len
+) {
+	static const char zeros[8] = { 0 };
+	if (fwrite(zeros, 1, offset - *pos, out) != offset - *pos
+	    || fwrite(data, 1, len, out) != len) {
+		return false;
+	}
+
+	*pos = offset + len;
+	return true;
+}
+
+static bool iface_write(IfaceBuilder *b, const char *path, u64 hash) {
+	TRACE_BEGIN("iface_write");
+	const Interner *strings = &b->strings;
+	bool ok = true;
+
+	for (u32 i = 0; i < b->decllen; i += 1) {
+		b->decls[i].name = strings->offsets[b->decls[i].name];
+	}
+
+	IfaceDecl *tmp = xcalloc(MEM_IFACE, b->decllen + 1, sizeof(IfaceDecl));
+	sort_decls(strings->pool, b->decls, tmp, b->decllen);
+	xfree(tmp);
+
+	for (u32 i = 1; i < b->decllen; i += 1) {
+		if (compare_decls(strings->pool, &b->decls[i - 1], &b->decls[i]) == 0) {
+			log_error("'%s' is declared twice", strings->pool + b->decls[i].name);
+			ok = false;
+		}
+	}
+
+	const TypeTable *tab = b->types;
+	IfaceType *types = xcalloc(MEM_IFACE, tab->len, sizeof(IfaceType));
+	for (u32 i = 0; i < tab->len; i += 1) {
+		const TypeEntry *t = &tab->types[i];
+		types[i] = (IfaceType) {
+			.storage = t->storage,
+			.elem = t->elem,
+			.data = t->data,
+			.count = t->count,
+		};
+	}
+
+	IfaceHeader header = {
+		.magic = IFACE_MAGIC,
+		.version = IFACE_VERSION,
+		.hash = hash,
+		.package = strings->offsets[b->package],
+		.typecount = tab->len,
+		.paramcount = tab->paramlen,
+		.declcount = b->decllen,
+		.poolsize = (u32)strings->poollen,
+	};
+	IfaceLayout layout = iface_layout(&header);
+
+	// Written next to the interface and renamed over it, readers never see half
+	// of it
+	usize pathlen = strlen(path);
+	char *tmppath = xcalloc(MEM_IFACE, pathlen + 5, sizeof(char));
+	memcpy(tmppath, path, pathlen);
+	memcpy(tmppath + pathlen, ".tmp", 4);
+
+	FILE *out = ok ? fopen(tmppath, "wb") : NULL;
+	if (out != NULL) {
+		usize pos = 0;
+		ok = write_section(out, &pos, 0, &header, sizeof(header))
+		  && write_section(out, &pos, layout.types, types, tab->len * sizeof(IfaceType))
+		  && write_section(
+			   out, &pos, layout.params, tab->params, tab->paramlen * sizeof(u32)
+		  )
+		  && write_section(
+			   out, &pos, layout.decls, b->decls, b->decllen * sizeof(IfaceDecl)
+		  )
+		  && write_section(out, &pos, layout.pool, strings->pool, strings->poollen);
+		ok = fclose(out) == 0 && ok;
+		ok = ok && rename(tmppath, path) == 0;
+
+		if (!ok) {
+			log_error("Failed to write interface: %s: %s", path, strerror(errno));
+			unlink(tmppath);
+		}
+	}
+
+	xfree(tmppath);
+	xfree(types);
+
+	TRACE_END("iface_write");
+	return ok && out != NULL;
+}
+
+bool iface_build(
+	const char *path, const char *const *files, u32 count, TypeTable *types
+) {
+	u64 hash;
+	if (!hash_files(files, count, &hash)) {
+		return false;
+	}
+
+	Iface old;
+	if (iface_open(&old, path)) {
+		bool same = old.header->hash == hash;
+		iface_close(&old);
+		if (same) {
+			log_debug("%s is up to date", path);
+			return true;
+		}
+	}
+
+	IfaceBuilder b = { .types = types };
+	intern_init(&b.strings);
+	source_init(&b.sources, NULL);
+	b.declsize = 64;
+	b.decls = xcalloc(MEM_IFACE, b.declsize, sizeof(IfaceDecl));
+
+	bool ok = true;
+	Loader loader;
+	loader_init(&loader, files, count, true);
+	for (u32 i = 0; i < count; i += 1) {
+		const SourceFile *src = loader_get(&loader, i);
+		if (src->data == NULL) {
+			log_error("Failed to open file: %s: %s", src->path, strerror(src->error));
+			ok = false;
+		} else {
+			ok = iface_source(&b, src) && ok;
+		}
+		loader_release(&loader, i);
+	}
+	loader_free(&loader);
+
+	log_debug("%u pub declarations, %u types", b.decllen, b.types->len);
+	ok = ok && iface_write(&b, path, hash);
+
+	xfree(b.decls);
+	source_free(&b.sources);
+	intern_free(&b.strings);
+	return ok;
+}
+
+// Interface of a package in dir, the file name is the package name with "::"
+// replaced by "."
+static bool open_package(Iface *iface, const char *dir, const char *package) {
+	usize dirlen = strlen(dir);
+	usize len = strlen(package);
+	char *path = xcalloc(MEM_IFACE, dirlen + len + 6, sizeof(char));
+	memcpy(path, dir, dirlen);
+	path[dirlen] = '/';
+
+	usize pos = dirlen + 1;
+	for (usize i = 0; i < len; i += 1) {
+		if (package[i] == ':' && package[i + 1] == ':') {
+			path[pos] = '.';
+			i += 1;
+		} else {
+			path[pos] = package[i];
+		}
+		pos += 1;
+	}
+	memcpy(path + pos, ".axi", 4);
+
+	bool ok = iface_open(iface, path);
+	if (ok && strcmp(iface_str(iface, iface->header->package), package) != 0) {
+		log_warn("Interface %s is for another package, it's ignored", path);
+		iface_close(iface);
+		ok = false;
+	}
+
+	xfree(path);
+	return ok;
+}
+
+bool iface_check_uses(const Ast *ast, const char *path, const char *dir) {
+	TRACE_BEGIN("iface_check_uses");
+	const AstNode *root = &ast->nodes[0];
+
+	// Interface of each package used, by the name ID of its path
+	u32 uselen = 0;
+	u32 *uses = xcalloc(MEM_IFACE, root->rhs - root->lhs + 1, sizeof(u32));
+	Iface *ifaces = xcalloc(MEM_IFACE, root->rhs - root->lhs + 1, sizeof(Iface));
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		const AstNode *n = &ast->nodes[ast->extra[i]];
+		if (n->kind == AST_USE
+		    && open_package(&ifaces[uselen], dir, intern_str(&ast->names, n->lhs))) {
+			uses[uselen] = n->lhs;
+			uselen += 1;
+		}
+	}
+
+	bool ok = true;
+	for (NodeIndex node = 0; node < ast->nodelen && uselen > 0; node += 1) {
+		char name[256];
+		if (ast->nodes[node].kind != AST_IDENT
+		    || !ast_full_name(ast, node, name, sizeof(name))) {
+			continue;
+		}
+
+		// The package is everything before the last separator
+		char *sep = strstr(name, "::");
+		for (char *s = sep; s != NULL; s = strstr(s + 2, "::")) {
+			sep = s;
+		}
+		*sep = '\0';
+
+		for (u32 i = 0; i < uselen; i += 1) {
+			if (strcmp(intern_str(&ast->names, uses[i]), name) != 0
+			    || iface_find(&ifaces[i], sep + 2) != NULL) {
+				continue;
+			}
+
+			Location loc = source_decode(ast->sources, ast->locs[node], NULL);
+			fprintf(
+				stderr, "%s:%d:%d '%s' is not a pub declaration of package '%s'\n", path,
+				loc.lineno, loc.colno, sep + 2, name
+			);
+			ok = false;
+		}
+	}
+
+	for (u32 i = 0; i < uselen; i += 1) {
+		iface_close(&ifaces[i]);
+	}
+	xfree(ifaces);
+	xfree(uses);
+
+	TRACE_END("iface_check_uses");
+	return ok;
+}
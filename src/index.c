@@ -0,0 +1,605 @@
+#include "index.h"
+
+#include "ast.h"
+#include "intern.h"
+#include "lex.h"
+#include "loader.h"
+#include "parse.h"
+#include "trace.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ALIGN8(x) (((x) + 7) & ~(usize)7)
+
+typedef struct BuildEntry {
+	u32 name; // Interned in the builder
+	u32 file;
+	Location loc; // Decoded, the index outlives the source buffers
+	u8 kind;
+	u8 flags;
+} BuildEntry;
+
+typedef struct BuildFile {
+	u32 path; // Interned in the builder
+	u32 package;
+	i64 mtime;
+	u64 size;
+	bool failed; // Couldn't be read or parsed, left out of the index
+} BuildFile;
+
+typedef struct IndexBuilder {
+	Interner strings;
+	SourceManager sources; // Files being indexed
+
+	BuildFile *files;
+	u32 filelen;
+
+	BuildEntry *entries;
+	u32 entrylen;
+	u32 entrysize;
+} IndexBuilder;
+
+// Offsets of the sections of an index file
+typedef struct IndexLayout {
+	usize files;
+	usize entries;
+	usize pool;
+	usize size;
+} IndexLayout;
+
+static const char *kind_names[] = {
+	[INDEX_FN] = "fn",
+	[INDEX_CONST] = "const",
+	[INDEX_MUT] = "mut",
+	[INDEX_USE] = "use",
+};
+
+static IndexLayout index_layout(u32 filecount, u32 entrycount, u32 poolsize) {
+	IndexLayout layout;
+	layout.files = ALIGN8(sizeof(IndexHeader));
+	layout.entries = ALIGN8(layout.files + (usize)filecount * sizeof(IndexFile));
+	layout.pool = ALIGN8(layout.entries + (usize)entrycount * sizeof(IndexEntry));
+	layout.size = layout.pool + poolsize;
+	return layout;
+}
+
+// Every file and entry only refers to the file table and pool, so lookups
+// never read out of the mapping. The pool ends with a NUL, so any offset in it
+// is a terminated string.
+static bool index_valid(const Index *index) {
+	const IndexHeader *header = index->header;
+	for (u32 i = 0; i < header->filecount; i += 1) {
+		const IndexFile *file = &index->files[i];
+		if (file->path >= header->poolsize || file->package >= header->poolsize) {
+			return false;
+		}
+	}
+
+	for (u32 i = 0; i < header->entrycount; i += 1) {
+		const IndexEntry *entry = &index->entries[i];
+		if (entry->file >= header->filecount || entry->name >= header->poolsize
+		    || entry->kind > INDEX_USE) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool index_open(Index *index, const char *path) {
+	memset(index, 0, sizeof(Index));
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (usize)st.st_size < sizeof(IndexHeader)) {
+		close(fd);
+		return false;
+	}
+
+	usize size = (usize)st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+
+	const IndexHeader *header = map;
+	IndexLayout layout =
+		index_layout(header->filecount, header->entrycount, header->poolsize);
+	if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION
+	    || layout.size != size || header->poolsize == 0
+	    || ((const char *)map)[size - 1] != '\0') {
+		munmap(map, size);
+		return false;
+	}
+
+	index->map = map;
+	index->size = size;
+	index->header = header;
+	index->files = (const IndexFile *)((const char *)map + layout.files);
+	index->entries = (const IndexEntry *)((const char *)map + layout.entries);
+	index->pool = (const char *)map + layout.pool;
+
+	if (!index_valid(index)) {
+		index_close(index);
+		return false;
+	}
+	return true;
+}
+
+void index_close(Index *index) {
+	if (index->map != NULL) {
+		munmap(index->map, index->size);
+	}
+	memset(index, 0, sizeof(Index));
+}
+
+// First entry whose name isn't less than name, or greater than it if after
+static u32 search_name(const Index *index, const char *name, bool after) {
+	u32 lo = 0;
+	u32 hi = index->header->entrycount;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(index_str(index, index->entries[mid].name), name);
+		if (cmp < 0 || (after && cmp == 0)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+const IndexEntry *index_find(const Index *index, const char *name, u32 *count) {
+	u32 first = search_name(index, name, false);
+	u32 end = search_name(index, name, true);
+
+	*count = end - first;
+	return end > first ? &index->entries[first] : NULL;
+}
+
+// Declarations are printed with their package, uses with the path used
+static void print_entry(const Index *index, const IndexEntry *entry, FILE *out) {
+	const IndexFile *file = &index->files[entry->file];
+	fprintf(
+		out, "%s:%u:%u %s%s ", index_str(index, file->path), entry->lineno, entry->colno,
+		(entry->flags & AST_FLAG_PUB) != 0 ? "pub " : "", kind_names[entry->kind]
+	);
+
+	if (entry->kind != INDEX_USE) {
+		fprintf(out, "%s::", index_str(index, file->package));
+	}
+	fprintf(out, "%s\n", index_str(index, entry->name));
+}
+
+bool index_lookup(const Index *index, const char *name, FILE *out) {
+	u32 count;
+	const IndexEntry *entries = index_find(index, name, &count);
+	for (u32 i = 0; i < count; i += 1) {
+		print_entry(index, &entries[i], out);
+	}
+
+	const char *sep = NULL;
+	for (const char *s = strstr(name, "::"); s != NULL; s = strstr(s + 2, "::")) {
+		sep = s;
+	}
+	if (sep == NULL) {
+		return count > 0;
+	}
+
+	// Declarations of the last segment in the package named by the others
+	usize pkglen = (usize)(sep - name);
+	u32 declcount;
+	const IndexEntry *decls = index_find(index, sep + 2, &declcount);
+	for (u32 i = 0; i < declcount; i += 1) {
+		const char *package = index_str(index, index->files[decls[i].file].package);
+		if (decls[i].kind != INDEX_USE && strlen(package) == pkglen
+		    && memcmp(package, name, pkglen) == 0) {
+			print_entry(index, &decls[i], out);
+			count += 1;
+		}
+	}
+
+	return count > 0;
+}
+
+static u32 intern_cstr(IndexBuilder *b, const char *str) {
+	return intern(&b->strings, str, strlen(str));
+}
+
+// Intern a name of the tree in the builder
+static u32 intern_name(IndexBuilder *b, const Ast *ast, u32 name) {
+	const char *str = intern_str(&ast->names, name);
+	return intern(&b->strings, str, intern_len(&ast->names, name));
+}
+
+// Files without a PackageDecl belong to a package named after the file
+static u32 intern_stem(IndexBuilder *b, const char *path) {
+	const char *start = strrchr(path, '/');
+	start = start == NULL ? path : start + 1;
+
+	const char *end = strrchr(start, '.');
+	if (end == NULL) {
+		end = start + strlen(start);
+	}
+
+	return intern(&b->strings, start, (usize)(end - start));
+}
+
+static void add_entry(
+	IndexBuilder *b, u32 file, u32 name, Location loc, IndexKind kind, u16 flags
+) {
+	if (b->entrylen == b->entrysize) {
+		b->entrysize *= 2;
+		b->entries = xrealloc(MEM_INDEX, b->entries, b->entrysize * sizeof(BuildEntry));
+	}
+
+	b->entries[b->entrylen] = (BuildEntry) {
+		.name = name,
+		.file = file,
+		.loc = loc,
+		.kind = (u8)kind,
+		.flags = (u8)(flags & AST_FLAG_PUB),
+	};
+	b->entrylen += 1;
+}
+
+static void add_decls(IndexBuilder *b, u32 file, const Ast *ast) {
+	const AstNode *root = &ast->nodes[0];
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		NodeIndex decl = ast->extra[i];
+		const AstNode *n = &ast->nodes[decl];
+		Location loc = source_decode(ast->sources, ast->locs[decl], NULL);
+
+		switch (n->kind) {
+		case AST_PACKAGE:
+			b->files[file].package = intern_name(b, ast, n->lhs);
+			break;
+		case AST_USE:
+			add_entry(b, file, intern_name(b, ast, n->lhs), loc, INDEX_USE, n->flags);
+			break;
+		case AST_FN_DECL:
+			add_entry(b, file, intern_name(b, ast, n->lhs), loc, INDEX_FN, n->flags);
+			break;
+		case AST_GLOBAL:
+			for (u32 j = n->lhs; j < n->rhs; j += 1) {
+				NodeIndex binding = ast->extra[j];
+				IndexKind kind = (n->flags & AST_FLAG_MUT) != 0 ? INDEX_MUT : INDEX_CONST;
+				add_entry(
+					b, file, intern_name(b, ast, ast->nodes[binding].lhs),
+					source_decode(ast->sources, ast->locs[binding], NULL), kind, n->flags
+				);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+// Lex and parse a file read by the loader, then add its declarations
+static bool index_source(IndexBuilder *b, u32 file, const SourceFile *src) {
+	TRACE_BEGIN_DETAIL("index_source", src->path);
+
+	// The buffer stays the loader's, it's only borrowed until the entries have
+	// their locations decoded
+	u32 id = source_add(&b->sources, src->path, src->data, src->len, false);
+	LexState lex;
+	if (id == 0 || !lex_init(&lex, &b->sources, id, NULL)) {
+		log_error("Failed to initialize lexer for file: %s", src->path);
+		if (id != 0) {
+			source_remove(&b->sources, id);
+		}
+		TRACE_END("index_source");
+		return false;
+	}
+	lex.recover = true;
+
+	u32 len;
+	Token *tokens = lex_scan_all(&lex, MEM_INDEX, &len);
+	bool ok = tokens[len - 1].kind != TK_ERROR;
+	if (!ok) {
+		log_error("%s:%s", src->path, lex.error);
+	} else {
+		Ast ast;
+		ast_init(&ast, &b->sources);
+
+		char error[PARSE_ERROR_MAX];
+		ok = parse_tokens(tokens, len, NULL, &ast, error);
+		if (ok) {
+			add_decls(b, file, &ast);
+		} else {
+			log_error("%s:%s", src->path, error);
+		}
+		ast_free(&ast);
+	}
+
+	for (u32 i = 0; i < len; i += 1) {
+		lex_release(&lex, &tokens[i]);
+	}
+	xfree(tokens);
+	lex_close(&lex);
+	source_remove(&b->sources, id);
+
+	TRACE_END("index_source");
+	return ok;
+}
+
+// Order of the entries in the index: name, then file and position
+static int compare_entries(
+	const IndexBuilder *b, const BuildEntry *x, const BuildEntry *y
+) {
+	if (x->name != y->name) {
+		return strcmp(intern_str(&b->strings, x->name), intern_str(&b->strings, y->name));
+	} else if (x->file != y->file) {
+		return x->file < y->file ? -1 : 1;
+	} else if (x->loc.lineno != y->loc.lineno) {
+		return x->loc.lineno < y->loc.lineno ? -1 : 1;
+	} else if (x->loc.colno != y->loc.colno) {
+		return x->loc.colno < y->loc.colno ? -1 : 1;
+	}
+	return 0;
+}
+
+static void sort_entries(
+	const IndexBuilder *b, BuildEntry *items, BuildEntry *tmp, u32 len
+) {
+	if (len < 2) {
+		return;
+	}
+
+	u32 half = len / 2;
+	sort_entries(b, items, tmp, half);
+	sort_entries(b, items + half, tmp, len - half);
+
+	u32 i = 0;
+	u32 j = half;
+	u32 k = 0;
+	while (i < half || j < len) {
+		if (j == len || (i < half && compare_entries(b, &items[i], &items[j]) <= 0)) {
+			tmp[k] = items[i];
+			i += 1;
+		} else {
+			tmp[k] = items[j];
+			j += 1;
+		}
+		k += 1;
+	}
+	memcpy(items, tmp, len * sizeof(BuildEntry));
+}
+
+// Write a section at its offset, padding the bytes before it with zeros
+static bool write_section(
+	FILE *out, usize *pos, usize offset, const void *data, usize len
+) {
+	static const char zeros[8] = { 0 };
+	if (fwrite(zeros, 1, offset - *pos, out) != offset - *pos
+	    || fwrite(data, 1, len, out) != len) {
+		return false;
+	}
+
+	*pos = offset + len;
+	return true;
+}
+
+// Offset in the pool of a string of the builder
+static u32 pool_offset(Interner *pool, const IndexBuilder *b, u32 id) {
+	u32 pooled = intern(pool, intern_str(&b->strings, id), intern_len(&b->strings, id));
+	return pool->offsets[pooled];
+}
+
+static bool index_write(IndexBuilder *b, const char *path) {
+	TRACE_BEGIN("index_write");
+
+	// Files that failed are left out, the others keep their order
+	u32 *remap = xcalloc(MEM_INDEX, b->filelen + 1, sizeof(u32));
+	u32 filecount = 0;
+	for (u32 i = 0; i < b->filelen; i += 1) {
+		remap[i] = filecount;
+		filecount += b->files[i].failed ? 0 : 1;
+	}
+	for (u32 i = 0; i < b->entrylen; i += 1) {
+		b->entries[i].file = remap[b->entries[i].file];
+	}
+
+	BuildEntry *tmp = xcalloc(MEM_INDEX, b->entrylen + 1, sizeof(BuildEntry));
+	sort_entries(b, b->entries, tmp, b->entrylen);
+	xfree(tmp);
+
+	// Strings are pooled in the order they're written, so the file only depends
+	// on what's indexed and not on which files were read again
+	Interner pool;
+	intern_init(&pool);
+
+	IndexFile *files = xcalloc(MEM_INDEX, filecount + 1, sizeof(IndexFile));
+	for (u32 i = 0; i < b->filelen; i += 1) {
+		const BuildFile *f = &b->files[i];
+		if (f->failed) {
+			continue;
+		}
+
+		files[remap[i]] = (IndexFile) {
+			.path = pool_offset(&pool, b, f->path),
+			.package = pool_offset(&pool, b, f->package),
+			.mtime = f->mtime,
+			.size = f->size,
+		};
+	}
+
+	IndexEntry *entries = xcalloc(MEM_INDEX, b->entrylen + 1, sizeof(IndexEntry));
+	for (u32 i = 0; i < b->entrylen; i += 1) {
+		const BuildEntry *e = &b->entries[i];
+		entries[i] = (IndexEntry) {
+			.name = pool_offset(&pool, b, e->name),
+			.file = e->file,
+			.lineno = (u32)e->loc.lineno,
+			.colno = (u32)e->loc.colno,
+			.kind = e->kind,
+			.flags = e->flags,
+		};
+	}
+
+	IndexHeader header = {
+		.magic = INDEX_MAGIC,
+		.version = INDEX_VERSION,
+		.filecount = filecount,
+		.entrycount = b->entrylen,
+		.poolsize = (u32)pool.poollen,
+	};
+	IndexLayout layout = index_layout(filecount, b->entrylen, header.poolsize);
+
+	// Written next to the index and renamed over it, readers never see half of it
+	usize pathlen = strlen(path);
+	char *tmppath = xcalloc(MEM_INDEX, pathlen + 5, sizeof(char));
+	memcpy(tmppath, path, pathlen);
+	memcpy(tmppath + pathlen, ".tmp", 4);
+
+	bool ok = false;
+	FILE *out = fopen(tmppath, "wb");
+	if (out != NULL) {
+		usize pos = 0;
+		ok = write_section(out, &pos, 0, &header, sizeof(header))
+		  && write_section(out, &pos, layout.files, files, filecount * sizeof(IndexFile))
+		  && write_section(
+			   out, &pos, layout.entries, entries, b->entrylen * sizeof(IndexEntry)
+		  )
+		  && write_section(out, &pos, layout.pool, pool.pool, pool.poollen);
+		ok = fclose(out) == 0 && ok;
+		ok = ok && rename(tmppath, path) == 0;
+	}
+
+	if (!ok) {
+		log_error("Failed to write index: %s: %s", path, strerror(errno));
+		unlink(tmppath);
+	}
+
+	xfree(tmppath);
+	xfree(entries);
+	xfree(files);
+	intern_free(&pool);
+	xfree(remap);
+
+	TRACE_END("index_write");
+	return ok;
+}
+
+bool index_build(const char *path, const char *const *paths, u32 count) {
+	IndexBuilder b = { 0 };
+	intern_init(&b.strings);
+	source_init(&b.sources, NULL);
+	b.files = xcalloc(MEM_INDEX, count + 1, sizeof(BuildFile));
+	b.entrysize = 256;
+	b.entries = xcalloc(MEM_INDEX, b.entrysize, sizeof(BuildEntry));
+
+	Index old;
+	u32 oldcount = 0;
+	if (index_open(&old, path)) {
+		// The paths of the previous index are interned first, so the ID of each
+		// one is its position in the file table + 1
+		while (oldcount < old.header->filecount) {
+			const char *file = index_str(&old, old.files[oldcount].path);
+			if (intern_cstr(&b, file) != oldcount + 1) {
+				break; // Listed twice, only trust the files before
+			}
+			oldcount += 1;
+		}
+	}
+
+	// Files of the previous index kept, as their index in the new one + 1
+	u32 *reuse = xcalloc(MEM_INDEX, oldcount + 1, sizeof(u32));
+	// File of each path ID + 1, a path and a package are interned per file
+	u32 *fileof = xcalloc(MEM_INDEX, oldcount + 2 * (usize)count + 1, sizeof(u32));
+	const char **changed = xcalloc(MEM_INDEX, count + 1, sizeof(const char *));
+	u32 *changedfile = xcalloc(MEM_INDEX, count + 1, sizeof(u32));
+	u32 changedlen = 0;
+	bool ok = true;
+
+	TRACE_BEGIN("index_stat");
+	for (u32 i = 0; i < count; i += 1) {
+		struct stat st;
+		if (stat(paths[i], &st) != 0) {
+			log_error("Failed to open file: %s: %s", paths[i], strerror(errno));
+			ok = false;
+			continue;
+		}
+
+		u32 id = intern_cstr(&b, paths[i]);
+		if (fileof[id] != 0) {
+			continue; // Listed twice
+		}
+
+		u32 file = b.filelen;
+		b.filelen += 1;
+		fileof[id] = file + 1;
+
+		BuildFile *f = &b.files[file];
+		*f = (BuildFile) {
+			.path = id,
+			.mtime = (i64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec,
+			.size = (u64)st.st_size,
+		};
+
+		const IndexFile *prev = id <= oldcount ? &old.files[id - 1] : NULL;
+		if (prev != NULL && prev->mtime == f->mtime && prev->size == f->size) {
+			reuse[id - 1] = file + 1;
+			f->package = intern_cstr(&b, index_str(&old, prev->package));
+		} else {
+			f->package = intern_stem(&b, paths[i]);
+			changed[changedlen] = paths[i];
+			changedfile[changedlen] = file;
+			changedlen += 1;
+		}
+	}
+	TRACE_END("index_stat");
+
+	// Entries of the unchanged files are copied from the previous index
+	for (u32 i = 0; oldcount > 0 && i < old.header->entrycount; i += 1) {
+		const IndexEntry *e = &old.entries[i];
+		if (e->file < oldcount && reuse[e->file] != 0) {
+			Location loc = { .lineno = (int)e->lineno, .colno = (int)e->colno };
+			u32 name = intern_cstr(&b, index_str(&old, e->name));
+			add_entry(&b, reuse[e->file] - 1, name, loc, e->kind, e->flags);
+		}
+	}
+	log_debug("%u files unchanged, %u to index", b.filelen - changedlen, changedlen);
+	index_close(&old);
+
+	// The others are read ahead while the previous ones are parsed
+	Loader loader;
+	loader_init(&loader, changed, changedlen, true);
+	for (u32 i = 0; i < changedlen; i += 1) {
+		const SourceFile *src = loader_get(&loader, i);
+		BuildFile *f = &b.files[changedfile[i]];
+
+		if (src->data == NULL) {
+			log_error("Failed to open file: %s: %s", src->path, strerror(src->error));
+			f->failed = true;
+		} else {
+			f->failed = !index_source(&b, changedfile[i], src);
+		}
+		ok = !f->failed && ok;
+		loader_release(&loader, i);
+	}
+	loader_free(&loader);
+
+	ok = index_write(&b, path) && ok;
+
+	xfree(changedfile);
+	xfree(changed);
+	xfree(fileof);
+	xfree(reuse);
+	xfree(b.entries);
+	xfree(b.files);
+	source_free(&b.sources);
+	intern_free(&b.strings);
+	return ok;
+}
@@ -0,0 +1,108 @@
+#include "intern.h"
+
+#include "util.h"
+
+#include <string.h>
+
+static u32 hash_bytes(const char *str, usize len) {
+	u32 hash = 2166136261u; // FNV-1a
+	for (usize i = 0; i < len; i += 1) {
+		hash ^= (u8)str[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void table_grow(Interner *in) {
+	u32 size = in->tablesize * 2;
+	u32 *table = xcalloc(MEM_INTERN, size, sizeof(u32));
+
+	for (u32 i = 0; i < in->tablesize; i += 1) {
+		u32 id = in->table[i];
+		if (id == INTERN_NONE) {
+			continue;
+		}
+
+		u32 slot = hash_bytes(in->pool + in->offsets[id], in->lens[id]) & (size - 1);
+		while (table[slot] != INTERN_NONE) {
+			slot = (slot + 1) & (size - 1);
+		}
+		table[slot] = id;
+	}
+
+	xfree(in->table);
+	in->table = table;
+	in->tablesize = size;
+}
+
+void intern_init(Interner *in) {
+	memset(in, 0, sizeof(Interner));
+
+	in->poolsize = 1024;
+	in->pool = xcalloc(MEM_INTERN, in->poolsize, sizeof(char));
+	in->poollen = 1; // Offset 0 is the empty string
+
+	in->capacity = 64;
+	in->offsets = xcalloc(MEM_INTERN, in->capacity, sizeof(u32));
+	in->lens = xcalloc(MEM_INTERN, in->capacity, sizeof(u32));
+	in->count = 1; // ID 0 is INTERN_NONE
+
+	in->tablesize = 128;
+	in->table = xcalloc(MEM_INTERN, in->tablesize, sizeof(u32));
+}
+
+void intern_free(Interner *in) {
+	xfree(in->pool);
+	xfree(in->offsets);
+	xfree(in->lens);
+	xfree(in->table);
+	memset(in, 0, sizeof(Interner));
+}
+
+u32 intern(Interner *in, const char *str, usize len) {
+	u32 mask = in->tablesize - 1;
+	u32 slot = hash_bytes(str, len) & mask;
+
+	while (in->table[slot] != INTERN_NONE) {
+		u32 id = in->table[slot];
+		if (in->lens[id] == len && memcmp(in->pool + in->offsets[id], str, len) == 0) {
+			return id;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	if (in->count == in->capacity) {
+		in->capacity *= 2;
+		in->offsets = xrealloc(MEM_INTERN, in->offsets, in->capacity * sizeof(u32));
+		in->lens = xrealloc(MEM_INTERN, in->lens, in->capacity * sizeof(u32));
+	}
+
+	while (in->poollen + len + 1 > in->poolsize) {
+		in->poolsize *= 2;
+		in->pool = xrealloc(MEM_INTERN, in->pool, in->poolsize);
+	}
+
+	u32 id = in->count;
+	in->count += 1;
+
+	in->offsets[id] = (u32)in->poollen;
+	in->lens[id] = (u32)len;
+	memcpy(in->pool + in->poollen, str, len);
+	in->pool[in->poollen + len] = '\0';
+	in->poollen += len + 1;
+
+	in->table[slot] = id;
+	if (in->count * 2 > in->tablesize) { // Keep load factor under 50%
+		table_grow(in);
+	}
+
+	return id;
+}
+
+const char *intern_str(const Interner *in, u32 id) {
+	return in->pool + in->offsets[id];
+}
+
+usize intern_len(const Interner *in, u32 id) {
+	return in->lens[id];
+}
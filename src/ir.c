@@ -0,0 +1,758 @@
+#include "ir.h"
+
+#include "util.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+
+static const char *ops[] = {
+	[IR_NOP] = "nop",   [IR_CONST] = "const", [IR_PARAM] = "param", [IR_COPY] = "copy",
+	[IR_PHI] = "phi",   [IR_ARITH] = "arith", [IR_NOT] = "not",     [IR_CAST] = "cast",
+	[IR_GGET] = "gget", [IR_GSET] = "gset",   [IR_CALL] = "call",   [IR_CALLN] = "calln",
+	[IR_JMP] = "jmp",   [IR_BR] = "br",       [IR_RET] = "ret",
+};
+
+static_assert(
+	sizeof(ops) / sizeof(const char *) == IR_OP_COUNT,
+	"Ops array doesn't have the same size of IrOp Enum."
+);
+
+static const char *types[] = {
+	[VM_I8] = "i8",   [VM_I16] = "i16", [VM_I32] = "i32", [VM_I64] = "i64",
+	[VM_U8] = "u8",   [VM_U16] = "u16", [VM_U32] = "u32", [VM_U64] = "u64",
+	[VM_F32] = "f32", [VM_F64] = "f64", [IR_VOID] = "void",
+};
+
+static const char *ariths[] = {
+	[ARITH_ADD] = "add", [ARITH_SUB] = "sub", [ARITH_MUL] = "mul", [ARITH_DIV] = "div",
+	[ARITH_MOD] = "mod", [ARITH_NEG] = "neg", [ARITH_EQ] = "eq",   [ARITH_NE] = "ne",
+	[ARITH_LT] = "lt",   [ARITH_LE] = "le",   [ARITH_AND] = "and", [ARITH_OR] = "or",
+	[ARITH_XOR] = "xor", [ARITH_SHL] = "shl", [ARITH_SHR] = "shr", [ARITH_BNOT] = "bnot",
+};
+
+void ir_init(IrFunc *f) {
+	memset(f, 0, sizeof(IrFunc));
+
+	f->instsize = 64;
+	f->insts = xcalloc(MEM_IR, f->instsize, sizeof(IrInst));
+	f->instlen = 1; // IR_NONE
+
+	f->extrasize = 16;
+	f->extra = xcalloc(MEM_IR, f->extrasize, sizeof(u32));
+
+	f->constsize = 16;
+	f->consts = xcalloc(MEM_IR, f->constsize, sizeof(Value));
+
+	f->blocksize = 8;
+	f->blocks = xcalloc(MEM_IR, f->blocksize, sizeof(IrBlock));
+}
+
+void ir_free(IrFunc *f) {
+	for (u32 i = 0; i < f->blocklen; i += 1) {
+		xfree(f->blocks[i].insts);
+		xfree(f->blocks[i].preds);
+	}
+	xfree(f->insts);
+	xfree(f->extra);
+	xfree(f->consts);
+	xfree(f->blocks);
+	xfree(f->rpo);
+	memset(f, 0, sizeof(IrFunc));
+}
+
+u32 ir_add_block(IrFunc *f) {
+	if (f->blocklen == f->blocksize) {
+		f->blocksize *= 2;
+		f->blocks = xrealloc(MEM_IR, f->blocks, f->blocksize * sizeof(IrBlock));
+	}
+
+	f->blocks[f->blocklen] = (IrBlock) {
+		.succ = { IR_NO_BLOCK, IR_NO_BLOCK },
+		.idom = IR_NO_BLOCK,
+		.order = UINT32_MAX,
+	};
+	f->blocklen += 1;
+	return f->blocklen - 1;
+}
+
+// Phis are at the start of blocks, with the ones already replaced
+static bool is_phi(const IrFunc *f, IrRef ref) {
+	IrOp op = (IrOp)f->insts[ref].op;
+	return op == IR_PHI || op == IR_COPY || op == IR_NOP;
+}
+
+static IrRef new_inst(IrFunc *f, u32 block, IrOp op, u8 type, u16 aux, u32 a, u32 b) {
+	if (f->instlen == f->instsize) {
+		f->instsize *= 2;
+		f->insts = xrealloc(MEM_IR, f->insts, f->instsize * sizeof(IrInst));
+	}
+
+	f->insts[f->instlen] = (IrInst) {
+		.op = (u8)op,
+		.type = type,
+		.aux = aux,
+		.block = block,
+		.a = a,
+		.b = b,
+	};
+	f->instlen += 1;
+	return f->instlen - 1;
+}
+
+// Insert an instruction in the list of a block at a position
+static void block_insert(IrFunc *f, u32 block, u32 at, IrRef ref) {
+	IrBlock *b = &f->blocks[block];
+	if (b->len == b->size) {
+		b->size = b->size == 0 ? 8 : b->size * 2;
+		b->insts = xrealloc(MEM_IR, b->insts, b->size * sizeof(IrRef));
+	}
+
+	memmove(&b->insts[at + 1], &b->insts[at], (b->len - at) * sizeof(IrRef));
+	b->insts[at] = ref;
+	b->len += 1;
+	f->insts[ref].block = block;
+}
+
+IrRef ir_add(IrFunc *f, u32 block, IrOp op, u8 type, u16 aux, u32 a, u32 b) {
+	assert(!ir_terminated(f, block));
+	IrRef ref = new_inst(f, block, op, type, aux, a, b);
+	block_insert(f, block, f->blocks[block].len, ref);
+	return ref;
+}
+
+IrRef ir_insert(IrFunc *f, u32 block, IrOp op, u8 type, u16 aux, u32 a, u32 b) {
+	IrRef ref = new_inst(f, block, op, type, aux, a, b);
+	u32 len = f->blocks[block].len;
+	block_insert(f, block, ir_terminated(f, block) ? len - 1 : len, ref);
+	return ref;
+}
+
+static u32 add_const(IrFunc *f, Value value) {
+	if (f->constlen == f->constsize) {
+		f->constsize *= 2;
+		f->consts = xrealloc(MEM_IR, f->consts, f->constsize * sizeof(Value));
+	}
+
+	f->consts[f->constlen] = value;
+	f->constlen += 1;
+	return f->constlen - 1;
+}
+
+IrRef ir_const(IrFunc *f, u32 block, VmType type, Value value) {
+	return ir_insert(f, block, IR_CONST, (u8)type, 0, add_const(f, value), 0);
+}
+
+void ir_set_const(IrFunc *f, IrRef ref, VmType type, Value value) {
+	IrInst *inst = &f->insts[ref];
+	inst->op = IR_CONST;
+	inst->type = (u8)type;
+	inst->aux = 0;
+	inst->a = add_const(f, value);
+	inst->b = 0;
+}
+
+u32 ir_add_extra(IrFunc *f, const u32 *values, u32 count) {
+	while (f->extralen + count > f->extrasize) {
+		f->extrasize *= 2;
+		f->extra = xrealloc(MEM_IR, f->extra, f->extrasize * sizeof(u32));
+	}
+
+	u32 start = f->extralen;
+	memcpy(f->extra + start, values, count * sizeof(u32));
+	f->extralen += count;
+	return start;
+}
+
+IrRef ir_phi(IrFunc *f, u32 block, VmType type, const IrRef *values) {
+	const IrBlock *b = &f->blocks[block];
+	u32 start = values != NULL ? ir_add_extra(f, values, b->predlen) : 0;
+	u32 end = values != NULL ? start + b->predlen : 0;
+	IrRef ref = new_inst(f, block, IR_PHI, (u8)type, 0, start, end);
+
+	u32 at = 0;
+	while (at < b->len && is_phi(f, b->insts[at])) {
+		at += 1;
+	}
+	block_insert(f, block, at, ref);
+	return ref;
+}
+
+static void add_pred(IrFunc *f, u32 block, u32 pred) {
+	IrBlock *b = &f->blocks[block];
+	if (b->predlen == b->predsize) {
+		b->predsize = b->predsize == 0 ? 4 : b->predsize * 2;
+		b->preds = xrealloc(MEM_IR, b->preds, b->predsize * sizeof(u32));
+	}
+
+	b->preds[b->predlen] = pred;
+	b->predlen += 1;
+}
+
+void ir_jump(IrFunc *f, u32 block, u32 target) {
+	ir_add(f, block, IR_JMP, IR_VOID, 0, 0, 0);
+	f->blocks[block].succ[0] = target;
+	add_pred(f, target, block);
+}
+
+void ir_branch(IrFunc *f, u32 block, IrRef cond, u32 then, u32 other) {
+	ir_add(f, block, IR_BR, IR_VOID, 0, cond, 0);
+	f->blocks[block].succ[0] = then;
+	f->blocks[block].succ[1] = other;
+	add_pred(f, then, block);
+	add_pred(f, other, block);
+}
+
+void ir_ret(IrFunc *f, u32 block, IrRef value) {
+	ir_add(f, block, IR_RET, IR_VOID, 0, value, 0);
+}
+
+bool ir_is_pure(const IrFunc *f, IrRef ref) {
+	const IrInst *inst = &f->insts[ref];
+	switch ((IrOp)inst->op) {
+	case IR_CONST:
+	case IR_NOT:
+	case IR_CAST:
+		return true;
+	case IR_ARITH: {
+		bool division = inst->aux == ARITH_DIV || inst->aux == ARITH_MOD;
+		if (!division || inst->type >= VM_F32) {
+			return true;
+		}
+
+		// Integer division by zero is a runtime error
+		const IrInst *divisor = &f->insts[inst->b];
+		return divisor->op == IR_CONST && f->consts[divisor->a].u != 0;
+	}
+	default:
+		return false;
+	}
+}
+
+u32 *ir_operands(IrFunc *f, IrRef ref, u32 *count) {
+	IrInst *inst = &f->insts[ref];
+	switch ((IrOp)inst->op) {
+	case IR_ARITH:
+		*count = inst->aux == ARITH_NEG || inst->aux == ARITH_BNOT ? 1 : 2;
+		return &inst->a;
+	case IR_COPY:
+	case IR_NOT:
+	case IR_CAST:
+	case IR_BR:
+		*count = 1;
+		return &inst->a;
+	case IR_RET:
+		*count = inst->a != IR_NONE ? 1 : 0;
+		return &inst->a;
+	case IR_GSET:
+		*count = 1;
+		return &inst->b;
+	case IR_PHI:
+	case IR_CALL:
+		*count = inst->b - inst->a;
+		return &f->extra[inst->a];
+	case IR_CALLN:
+		*count = inst->b - inst->a - 1;
+		return &f->extra[inst->a + 1];
+	default:
+		*count = 0;
+		return NULL;
+	}
+}
+
+// Drop the removed instructions from the lists of the blocks
+static void compact_blocks(IrFunc *f) {
+	for (u32 i = 0; i < f->blocklen; i += 1) {
+		IrBlock *b = &f->blocks[i];
+		u32 len = 0;
+		for (u32 j = 0; j < b->len; j += 1) {
+			if (f->insts[b->insts[j]].op != IR_NOP) {
+				b->insts[len] = b->insts[j];
+				len += 1;
+			}
+		}
+		b->len = len;
+	}
+}
+
+static IrRef resolve(const IrFunc *f, IrRef ref) {
+	while (f->insts[ref].op == IR_COPY) {
+		ref = f->insts[ref].a;
+	}
+	return ref;
+}
+
+void ir_resolve_copies(IrFunc *f) {
+	bool found = false;
+	for (u32 i = 0; i < f->blocklen; i += 1) {
+		const IrBlock *b = &f->blocks[i];
+		for (u32 j = 0; j < b->len; j += 1) {
+			u32 count;
+			u32 *operands = ir_operands(f, b->insts[j], &count);
+			for (u32 k = 0; k < count; k += 1) {
+				operands[k] = resolve(f, operands[k]);
+			}
+			found = found || f->insts[b->insts[j]].op == IR_COPY;
+		}
+	}
+
+	if (!found) {
+		return;
+	}
+
+	for (u32 i = 1; i < f->instlen; i += 1) {
+		if (f->insts[i].op == IR_COPY) {
+			f->insts[i].op = IR_NOP;
+		}
+	}
+	compact_blocks(f);
+}
+
+void ir_remove(IrFunc *f, IrRef ref) {
+	IrBlock *b = &f->blocks[f->insts[ref].block];
+	for (u32 i = 0; i < b->len; i += 1) {
+		if (b->insts[i] == ref) {
+			memmove(&b->insts[i], &b->insts[i + 1], (b->len - i - 1) * sizeof(IrRef));
+			b->len -= 1;
+			break;
+		}
+	}
+	f->insts[ref].op = IR_NOP;
+}
+
+void ir_move(IrFunc *f, IrRef ref, u32 block) {
+	IrInst inst = f->insts[ref];
+	ir_remove(f, ref);
+	f->insts[ref] = inst;
+
+	u32 len = f->blocks[block].len;
+	block_insert(f, block, ir_terminated(f, block) ? len - 1 : len, ref);
+}
+
+void ir_remove_edge(IrFunc *f, u32 pred, u32 block) {
+	IrBlock *b = &f->blocks[block];
+	u32 at = 0;
+	while (at < b->predlen && b->preds[at] != pred) {
+		at += 1;
+	}
+	assert(at < b->predlen);
+
+	memmove(&b->preds[at], &b->preds[at + 1], (b->predlen - at - 1) * sizeof(u32));
+	b->predlen -= 1;
+
+	for (u32 i = 0; i < b->len && is_phi(f, b->insts[i]); i += 1) {
+		IrInst *phi = &f->insts[b->insts[i]];
+		if (phi->op != IR_PHI || phi->b == phi->a) {
+			continue; // Incomplete phis get their operands when sealed
+		}
+
+		u32 *values = &f->extra[phi->a];
+		memmove(&values[at], &values[at + 1], (phi->b - phi->a - at - 1) * sizeof(u32));
+		phi->b -= 1;
+	}
+}
+
+u32 ir_split_edge(IrFunc *f, u32 pred, u32 block) {
+	u32 mid = ir_add_block(f);
+	IrBlock *p = &f->blocks[pred];
+	p->succ[p->succ[0] == block ? 0 : 1] = mid;
+
+	IrBlock *b = &f->blocks[block];
+	for (u32 i = 0; i < b->predlen; i += 1) {
+		if (b->preds[i] == pred) {
+			b->preds[i] = mid;
+			break;
+		}
+	}
+
+	add_pred(f, mid, pred);
+	ir_add(f, mid, IR_JMP, IR_VOID, 0, 0, 0);
+	f->blocks[mid].succ[0] = block;
+	return mid;
+}
+
+// Postorder with the second successor visited first, so the reverse has the
+// then branch of ifs and the body of loops right after their condition
+static u32 postorder(IrFunc *f, u32 *order) {
+	u32 *stack = xcalloc(MEM_IR, f->blocklen + 1, sizeof(u32));
+	u8 *next = xcalloc(MEM_IR, f->blocklen, sizeof(u8)); // Successors visited + 1
+	u32 stacklen = 1;
+	u32 len = 0;
+	stack[0] = 0;
+	next[0] = 1;
+
+	while (stacklen > 0) {
+		u32 block = stack[stacklen - 1];
+		const IrBlock *b = &f->blocks[block];
+		if (next[block] > 2) {
+			order[len] = block;
+			len += 1;
+			stacklen -= 1;
+			continue;
+		}
+
+		u32 succ = b->succ[2 - next[block]];
+		next[block] += 1;
+		if (succ != IR_NO_BLOCK && next[succ] == 0) {
+			next[succ] = 1;
+			stack[stacklen] = succ;
+			stacklen += 1;
+		}
+	}
+
+	xfree(stack);
+	xfree(next);
+	return len;
+}
+
+static u32 intersect(const IrFunc *f, u32 a, u32 b) {
+	while (a != b) {
+		while (f->blocks[a].order > f->blocks[b].order) {
+			a = f->blocks[a].idom;
+		}
+		while (f->blocks[b].order > f->blocks[a].order) {
+			b = f->blocks[b].idom;
+		}
+	}
+	return a;
+}
+
+void ir_dominators(IrFunc *f) {
+	u32 *post = xcalloc(MEM_IR, f->blocklen, sizeof(u32));
+	u32 len = postorder(f, post);
+
+	xfree(f->rpo);
+	f->rpo = xcalloc(MEM_IR, len + 1, sizeof(u32));
+	f->rpolen = len;
+	for (u32 i = 0; i < f->blocklen; i += 1) {
+		f->blocks[i].order = UINT32_MAX;
+		f->blocks[i].idom = IR_NO_BLOCK;
+	}
+	for (u32 i = 0; i < len; i += 1) {
+		f->rpo[i] = post[len - 1 - i];
+		f->blocks[f->rpo[i]].order = i;
+	}
+	xfree(post);
+
+	// Unreachable blocks are left out of the phis of the reachable ones
+	for (u32 i = 0; i < f->blocklen; i += 1) {
+		IrBlock *b = &f->blocks[i];
+		if (b->order != UINT32_MAX) {
+			continue;
+		}
+
+		// Unreachable successors are emptied whole, before or after this block
+		for (u32 j = 0; j < 2; j += 1) {
+			u32 succ = b->succ[j];
+			if (succ != IR_NO_BLOCK && f->blocks[succ].order != UINT32_MAX) {
+				ir_remove_edge(f, i, succ);
+			}
+			b->succ[j] = IR_NO_BLOCK;
+		}
+		for (u32 j = 0; j < b->len; j += 1) {
+			f->insts[b->insts[j]].op = IR_NOP;
+		}
+		b->len = 0;
+		b->predlen = 0;
+	}
+
+	// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+	f->blocks[0].idom = 0;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (u32 i = 1; i < len; i += 1) {
+			IrBlock *b = &f->blocks[f->rpo[i]];
+			u32 idom = IR_NO_BLOCK;
+			for (u32 j = 0; j < b->predlen; j += 1) {
+				u32 pred = b->preds[j];
+				if (f->blocks[pred].idom == IR_NO_BLOCK) {
+					continue; // Not processed yet
+				}
+				idom = idom == IR_NO_BLOCK ? pred : intersect(f, pred, idom);
+			}
+
+			if (b->idom != idom) {
+				b->idom = idom;
+				changed = true;
+			}
+		}
+	}
+	f->blocks[0].idom = IR_NO_BLOCK;
+}
+
+bool ir_dominates(const IrFunc *f, u32 a, u32 b) {
+	while (b != a && b != IR_NO_BLOCK) {
+		b = f->blocks[b].idom;
+	}
+	return b == a;
+}
+
+static void dump_value(const IrFunc *f, IrRef ref, FILE *out) {
+	const IrInst *inst = &f->insts[ref];
+	if (inst->op != IR_CONST) {
+		fprintf(out, "v%u", ref);
+	} else if (inst->type >= VM_F32) {
+		const Value *value = ir_const_value(f, ref);
+		fprintf(out, "%g", inst->type == VM_F32 ? value->f : value->d);
+	} else if (inst->type <= VM_I64) {
+		fprintf(out, "%" PRId64, ir_const_value(f, ref)->i);
+	} else {
+		fprintf(out, "%" PRIu64, ir_const_value(f, ref)->u);
+	}
+}
+
+static void dump_inst(const IrFunc *f, IrRef ref, FILE *out) {
+	const IrInst *inst = &f->insts[ref];
+	fprintf(out, "    ");
+	if (inst->type != IR_VOID) {
+		fprintf(out, "v%u = ", ref);
+	}
+
+	IrOp op = (IrOp)inst->op;
+	fprintf(out, "%s", op == IR_ARITH ? ariths[inst->aux] : ops[op]);
+	if (op == IR_CAST) {
+		fprintf(out, " %s", types[inst->aux / VM_TYPE_COUNT]);
+	}
+	if (inst->type != IR_VOID) {
+		fprintf(out, " %s", types[inst->type]);
+	}
+
+	switch (op) {
+	case IR_CONST:
+		fprintf(out, " ");
+		dump_value(f, ref, out);
+		break;
+	case IR_PARAM:
+		fprintf(out, " %u", inst->a);
+		break;
+	case IR_GGET:
+	case IR_GSET:
+		fprintf(out, " g%u", inst->a);
+		break;
+	case IR_CALL:
+		fprintf(out, " f%u", inst->aux);
+		break;
+	case IR_CALLN:
+		fprintf(out, " native%u", inst->aux);
+		break;
+	default:
+		break;
+	}
+
+	u32 count;
+	const u32 *operands = ir_operands((IrFunc *)f, ref, &count);
+	for (u32 i = 0; i < count; i += 1) {
+		fprintf(out, i == 0 ? " " : ", ");
+		if (op == IR_PHI) {
+			fprintf(out, "b%u: ", f->blocks[inst->block].preds[i]);
+		}
+		dump_value(f, operands[i], out);
+	}
+
+	const IrBlock *b = &f->blocks[inst->block];
+	if (op == IR_JMP) {
+		fprintf(out, " b%u", b->succ[0]);
+	} else if (op == IR_BR) {
+		fprintf(out, ", b%u, b%u", b->succ[0], b->succ[1]);
+	}
+	fprintf(out, "\n");
+}
+
+void ir_dump(const IrFunc *f, const char *name, FILE *out) {
+	fprintf(out, "fn %s: %u params, returns %s\n", name, f->params, types[f->ret]);
+	for (u32 i = 0; i < f->blocklen; i += 1) {
+		const IrBlock *b = &f->blocks[i];
+		if (b->len == 0) {
+			continue; // Removed
+		}
+
+		fprintf(out, "  b%u:", i);
+		for (u32 j = 0; j < b->predlen; j += 1) {
+			fprintf(out, "%s b%u", j == 0 ? " ; preds" : ",", b->preds[j]);
+		}
+		fprintf(out, "\n");
+
+		for (u32 j = 0; j < b->len; j += 1) {
+			dump_inst(f, b->insts[j], out);
+		}
+	}
+}
+
+const char *ir_op2str(IrOp op) {
+	return ops[op];
+}
+
+void ir_builder_init(IrBuilder *b, IrFunc *f) {
+	memset(b, 0, sizeof(IrBuilder));
+	b->func = f;
+
+	b->keysize = 64;
+	b->keys = xcalloc(MEM_IR, b->keysize, sizeof(u64));
+	b->defs = xcalloc(MEM_IR, b->keysize, sizeof(IrRef));
+
+	b->sealedsize = 16;
+	b->sealed = xcalloc(MEM_IR, b->sealedsize, sizeof(bool));
+
+	b->pendingsize = 8;
+	b->pending = xcalloc(MEM_IR, b->pendingsize, sizeof(IrPending));
+}
+
+void ir_builder_free(IrBuilder *b) {
+	xfree(b->keys);
+	xfree(b->defs);
+	xfree(b->sealed);
+	xfree(b->pending);
+	memset(b, 0, sizeof(IrBuilder));
+}
+
+static u32 find_slot(const IrBuilder *b, u64 key) {
+	u64 hash = key * 0x9E3779B97F4A7C15u;
+	u32 mask = b->keysize - 1;
+	u32 slot = (u32)(hash >> 32) & mask;
+	while (b->keys[slot] != 0 && b->keys[slot] != key) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+void ir_write_var(IrBuilder *b, u32 var, u32 block, IrRef value) {
+	assert(var != 0);
+	if ((b->keylen + 1) * 4 > b->keysize * 3) {
+		u64 *keys = b->keys;
+		IrRef *defs = b->defs;
+		u32 size = b->keysize;
+
+		b->keysize *= 2;
+		b->keys = xcalloc(MEM_IR, b->keysize, sizeof(u64));
+		b->defs = xcalloc(MEM_IR, b->keysize, sizeof(IrRef));
+		for (u32 i = 0; i < size; i += 1) {
+			if (keys[i] != 0) {
+				u32 slot = find_slot(b, keys[i]);
+				b->keys[slot] = keys[i];
+				b->defs[slot] = defs[i];
+			}
+		}
+		xfree(keys);
+		xfree(defs);
+	}
+
+	u64 key = (u64)var << 32 | block;
+	u32 slot = find_slot(b, key);
+	if (b->keys[slot] == 0) {
+		b->keys[slot] = key;
+		b->keylen += 1;
+	}
+	b->defs[slot] = value;
+}
+
+static bool is_sealed(const IrBuilder *b, u32 block) {
+	return block < b->sealedsize && b->sealed[block];
+}
+
+// Unassigned variables are zero, the constant is in the entry block so it
+// dominates every use
+static IrRef zero(IrBuilder *b, VmType type) {
+	return ir_const(b->func, 0, type, (Value) { .u = 0 });
+}
+
+// A phi merging a single value (besides itself) is replaced by it
+static IrRef remove_trivial_phi(IrBuilder *b, IrRef phi) {
+	IrFunc *f = b->func;
+	IrRef same = IR_NONE;
+	for (u32 i = f->insts[phi].a; i < f->insts[phi].b; i += 1) {
+		IrRef value = resolve(f, f->extra[i]);
+		if (value == same || value == phi) {
+			continue;
+		} else if (same != IR_NONE) {
+			return phi; // Merges at least two values
+		}
+		same = value;
+	}
+
+	if (same == IR_NONE) {
+		same = zero(b, (VmType)f->insts[phi].type);
+	}
+
+	// Uses are rewritten by ir_resolve_copies(), phis that become trivial then
+	// are removed by the optimization passes
+	f->insts[phi].op = IR_COPY;
+	f->insts[phi].a = same;
+	return same;
+}
+
+static IrRef add_phi_operands(IrBuilder *b, u32 var, IrRef phi) {
+	IrFunc *f = b->func;
+	u32 block = f->insts[phi].block;
+	u32 count = f->blocks[block].predlen;
+	VmType type = (VmType)f->insts[phi].type;
+
+	// Reading may add instructions and blocks, so the operands are gathered
+	// before being copied to the extra array
+	IrRef *values = xcalloc(MEM_IR, count + 1, sizeof(IrRef));
+	for (u32 i = 0; i < count; i += 1) {
+		values[i] = ir_read_var(b, var, f->blocks[block].preds[i], type);
+	}
+
+	u32 start = ir_add_extra(f, values, count);
+	f->insts[phi].a = start;
+	f->insts[phi].b = start + count;
+	xfree(values);
+
+	return remove_trivial_phi(b, phi);
+}
+
+IrRef ir_read_var(IrBuilder *b, u32 var, u32 block, VmType type) {
+	IrFunc *f = b->func;
+	u32 slot = find_slot(b, (u64)var << 32 | block);
+	if (b->keys[slot] != 0) {
+		return resolve(f, b->defs[slot]);
+	}
+
+	IrRef value;
+	const IrBlock *blk = &f->blocks[block];
+	if (!is_sealed(b, block)) {
+		value = ir_phi(f, block, type, NULL);
+		if (b->pendinglen == b->pendingsize) {
+			b->pendingsize *= 2;
+			b->pending = xrealloc(MEM_IR, b->pending, b->pendingsize * sizeof(IrPending));
+		}
+		IrPending pending = { .block = block, .var = var, .phi = value };
+		b->pending[b->pendinglen] = pending;
+		b->pendinglen += 1;
+	} else if (blk->predlen == 0) {
+		value = zero(b, type);
+	} else if (blk->predlen == 1) {
+		value = ir_read_var(b, var, blk->preds[0], type);
+	} else {
+		// Written first to end the lookup at this phi in loops
+		IrRef phi = ir_phi(f, block, type, NULL);
+		ir_write_var(b, var, block, phi);
+		value = add_phi_operands(b, var, phi);
+	}
+
+	ir_write_var(b, var, block, value);
+	return value;
+}
+
+void ir_seal(IrBuilder *b, u32 block) {
+	if (block >= b->sealedsize) {
+		u32 size = b->sealedsize * 2 > block ? b->sealedsize * 2 : block + 1;
+		b->sealed = xrealloc(MEM_IR, b->sealed, size * sizeof(bool));
+		memset(&b->sealed[b->sealedsize], 0, (size - b->sealedsize) * sizeof(bool));
+		b->sealedsize = size;
+	}
+
+	for (u32 i = 0; i < b->pendinglen;) {
+		IrPending pending = b->pending[i];
+		if (pending.block != block) {
+			i += 1;
+			continue;
+		}
+
+		b->pendinglen -= 1;
+		b->pending[i] = b->pending[b->pendinglen];
+		add_phi_operands(b, pending.var, pending.phi);
+	}
+	b->sealed[block] = true;
+}
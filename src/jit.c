@@ -0,0 +1,840 @@
+#include "jit.h"
+
+#include "util.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+	#define JIT_X86_64
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+// Compiled function, entered at the address of one of its instructions
+typedef int (*JitCode)(Value *base, void *vm, const void *at);
+
+#define JIT_NO_ENTRY UINT32_MAX
+
+void jit_init(
+	Jit *jit, const Program *prog, Value *globals, u32 threshold, const JitHooks *hooks,
+	void *vm
+) {
+	memset(jit, 0, sizeof(Jit));
+	jit->prog = prog;
+	jit->hooks = hooks;
+	jit->vm = vm;
+	jit->globals = globals;
+	jit->threshold = threshold;
+	jit->funcs = xcalloc(MEM_JIT, prog->funclen, sizeof(JitFunc));
+}
+
+void jit_free(Jit *jit) {
+	for (u32 i = 0; i < jit->prog->funclen; i += 1) {
+#ifdef JIT_X86_64
+		if (jit->funcs[i].code != NULL) {
+			munmap(jit->funcs[i].code, jit->funcs[i].size);
+		}
+#endif
+		xfree(jit->funcs[i].entries);
+	}
+	xfree(jit->funcs);
+}
+
+int jit_run(const Jit *jit, u32 func, Value *base, const u32 *pc) {
+	const JitFunc *f = &jit->funcs[func];
+	assert(f->code != NULL);
+
+	u32 at = 0;
+	if (pc != NULL) {
+		at = (u32)(pc - (jit->prog->code + jit->prog->funcs[func].start));
+	}
+	assert(f->entries[at] != JIT_NO_ENTRY);
+
+	union {
+		u8 *code;
+		JitCode fn;
+	} entry = { .code = f->code };
+	return entry.fn(base, jit->vm, f->code + f->entries[at]);
+}
+
+#ifdef JIT_X86_64
+
+typedef enum HostReg {
+	RAX,
+	RCX,
+	RDX,
+	RBX, // Registers of the function
+	RSP,
+	RBP,
+	RSI,
+	RDI,
+	R8,
+	R9,
+	R10,
+	R11,
+	R12, // VM passed to the hooks
+} HostReg;
+
+typedef enum Cond {
+	CC_B = 0x2,
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_BE = 0x6,
+	CC_A = 0x7,
+	CC_P = 0xA,
+	CC_NP = 0xB,
+	CC_L = 0xC,
+	CC_LE = 0xE,
+	CC_NONE = 0xFF, // Unconditional jump
+} Cond;
+
+// Encoding of an instruction besides its opcode
+typedef enum OpFlag {
+	X_W = 0x01,    // 64-bit operands
+	X_BYTE = 0x02, // Byte registers, SPL to DIL need a REX prefix
+	X_66 = 0x04,   // Mandatory prefixes of SSE instructions
+	X_F2 = 0x08,
+	X_F3 = 0x10,
+} OpFlag;
+
+// Host registers caching VM registers, the ones not used by the templates
+// or the calling convention of the hooks besides their arguments
+#define CACHE_SIZE 6
+static const u8 cache_regs[CACHE_SIZE] = { RSI, RDI, R8, R9, R10, R11 };
+
+#define HOST(slot) (cache_regs[slot])
+#define SLOT(slot) (1u << (slot))
+
+typedef struct Patch {
+	u32 at;     // Offset of the rel32 of the jump
+	u32 target; // Instruction jumped to
+} Patch;
+
+typedef struct Emitter {
+	u8 *buf;
+	u32 len;
+	u32 size;
+
+	Patch *patches;
+	u32 patchlen;
+
+	// VM register cached by each host register, -1 if none, and when it was
+	// last used for evictions
+	i32 cached[CACHE_SIZE];
+	u32 used[CACHE_SIZE];
+	u32 clock;
+
+	// Register set by the last comparison and the condition of its flags, so
+	// a conditional jump on it right after doesn't test it again
+	i32 flagreg;
+	Cond flagcc;
+} Emitter;
+
+static void emit_u8(Emitter *e, u8 byte) {
+	if (e->len == e->size) {
+		e->size *= 2;
+		e->buf = xrealloc(MEM_JIT, e->buf, e->size);
+	}
+
+	e->buf[e->len] = byte;
+	e->len += 1;
+}
+
+static void emit_u32(Emitter *e, u32 value) {
+	for (u32 i = 0; i < 4; i += 1) {
+		emit_u8(e, (u8)(value >> (i * 8)));
+	}
+}
+
+static void emit_u64(Emitter *e, u64 value) {
+	emit_u32(e, (u32)value);
+	emit_u32(e, (u32)(value >> 32));
+}
+
+static void emit_opcode(Emitter *e, u32 opcode, u32 flags, u8 reg, u8 rm, bool rmreg) {
+	if ((flags & X_66) != 0) {
+		emit_u8(e, 0x66);
+	} else if ((flags & X_F2) != 0) {
+		emit_u8(e, 0xF2);
+	} else if ((flags & X_F3) != 0) {
+		emit_u8(e, 0xF3);
+	}
+
+	u8 rex = 0x40 | ((flags & X_W) != 0 ? 0x08 : 0) | (reg >= 8 ? 0x04 : 0)
+	       | (rm >= 8 ? 0x01 : 0);
+	bool byte = (flags & X_BYTE) != 0
+	         && ((reg >= 4 && reg < 8) || (rmreg && rm >= 4 && rm < 8));
+	if (rex != 0x40 || byte) {
+		emit_u8(e, rex);
+	}
+
+	if (opcode > 0xFFFF) {
+		emit_u8(e, (u8)(opcode >> 16));
+	}
+	if (opcode > 0xFF) {
+		emit_u8(e, (u8)(opcode >> 8));
+	}
+	emit_u8(e, (u8)opcode);
+}
+
+// Instruction on two host registers, reg can be an opcode extension
+static void op_rr(Emitter *e, u32 opcode, u32 flags, u8 reg, u8 rm) {
+	emit_opcode(e, opcode, flags, reg, rm, true);
+	emit_u8(e, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// Instruction on a host register and the VM register r, at [rbx + 8 * r]
+static void op_rm(Emitter *e, u32 opcode, u32 flags, u8 reg, u32 r) {
+	emit_opcode(e, opcode, flags, reg, RBX, false);
+
+	u32 disp = r * (u32)sizeof(Value);
+	if (disp < 0x80) {
+		emit_u8(e, 0x40 | (reg & 7) << 3 | RBX);
+		emit_u8(e, (u8)disp);
+	} else {
+		emit_u8(e, 0x80 | (reg & 7) << 3 | RBX);
+		emit_u32(e, disp);
+	}
+}
+
+// Instruction on a host register and the memory at [rax]
+static void op_rax(Emitter *e, u32 opcode, u32 flags, u8 reg) {
+	emit_opcode(e, opcode, flags, reg, RAX, false);
+	emit_u8(e, (reg & 7) << 3 | RAX);
+}
+
+static void mov_imm(Emitter *e, u8 reg, u64 imm) {
+	if (imm <= UINT32_MAX) {
+		// The 32-bit move zero extends
+		if (reg >= 8) {
+			emit_u8(e, 0x41);
+		}
+		emit_u8(e, 0xB8 + (reg & 7));
+		emit_u32(e, (u32)imm);
+	} else if ((i64)imm >= INT32_MIN && (i64)imm <= INT32_MAX) {
+		op_rr(e, 0xC7, X_W, 0, reg);
+		emit_u32(e, (u32)imm);
+	} else {
+		emit_u8(e, reg >= 8 ? 0x49 : 0x48);
+		emit_u8(e, 0xB8 + (reg & 7));
+		emit_u64(e, imm);
+	}
+}
+
+static void emit_call(Emitter *e, u64 addr) {
+	mov_imm(e, RAX, addr);
+	op_rr(e, 0xFF, 0, 2, RAX); // call rax
+}
+
+// Jump to an offset already emitted
+static void jump_back(Emitter *e, Cond cc, u32 to) {
+	if (cc == CC_NONE) {
+		emit_u8(e, 0xE9);
+	} else {
+		emit_u8(e, 0x0F);
+		emit_u8(e, 0x80 + cc);
+	}
+	emit_u32(e, (u32)((i64)to - (i64)(e->len + 4)));
+}
+
+// Jump to an instruction of the function, patched when all are emitted
+static void jump_to(Emitter *e, Cond cc, u32 target) {
+	jump_back(e, cc, e->len);
+	e->patches[e->patchlen] = (Patch) { .at = e->len - 4, .target = target };
+	e->patchlen += 1;
+}
+
+// Short forward jump over a template, landed by land()
+static u32 skip(Emitter *e, Cond cc) {
+	emit_u8(e, cc == CC_NONE ? 0xEB : 0x70 + cc);
+	emit_u8(e, 0);
+	return e->len - 1;
+}
+
+static void land(Emitter *e, u32 at) {
+	assert(e->len - (at + 1) < 0x80);
+	e->buf[at] = (u8)(e->len - (at + 1));
+}
+
+static void cache_clear(Emitter *e) {
+	for (u32 i = 0; i < CACHE_SIZE; i += 1) {
+		e->cached[i] = -1;
+	}
+}
+
+static void cache_drop(Emitter *e, u32 r) {
+	for (u32 i = 0; i < CACHE_SIZE; i += 1) {
+		if (e->cached[i] == (i32)r) {
+			e->cached[i] = -1;
+		}
+	}
+}
+
+// Free host register, or the least recently used one outside of avoid
+static u32 cache_victim(Emitter *e, u32 avoid) {
+	u32 best = CACHE_SIZE;
+	for (u32 i = 0; i < CACHE_SIZE; i += 1) {
+		if ((avoid & SLOT(i)) != 0) {
+			continue;
+		} else if (e->cached[i] < 0) {
+			best = i;
+			break;
+		} else if (best == CACHE_SIZE || e->used[i] < e->used[best]) {
+			best = i;
+		}
+	}
+
+	assert(best < CACHE_SIZE);
+	e->cached[best] = -1;
+	e->clock += 1;
+	e->used[best] = e->clock;
+	return best;
+}
+
+static void cache_bind(Emitter *e, u32 slot, u32 r) {
+	cache_drop(e, r);
+	e->cached[slot] = (i32)r;
+	e->clock += 1;
+	e->used[slot] = e->clock;
+}
+
+// Host register holding the VM register r, loaded if it isn't cached
+static u32 cache_use(Emitter *e, u32 r, u32 avoid) {
+	for (u32 i = 0; i < CACHE_SIZE; i += 1) {
+		if (e->cached[i] == (i32)r) {
+			e->clock += 1;
+			e->used[i] = e->clock;
+			return i;
+		}
+	}
+
+	u32 slot = cache_victim(e, avoid);
+	op_rm(e, 0x8B, X_W, HOST(slot), r);
+	cache_bind(e, slot, r);
+	return slot;
+}
+
+// Store the result in slot to the VM register r, it stays cached
+static void define(Emitter *e, u32 slot, u32 r) {
+	op_rm(e, 0x89, X_W, HOST(slot), r);
+	cache_bind(e, slot, r);
+}
+
+// Sign or zero extend the low bits of reg like vm_norm_int()
+static void normalize(Emitter *e, u8 reg, VmType type) {
+	switch (type) {
+	case VM_I8:
+		op_rr(e, 0x0FBE, X_W | X_BYTE, reg, reg); // movsx r64, r8
+		break;
+	case VM_I16:
+		op_rr(e, 0x0FBF, X_W, reg, reg); // movsx r64, r16
+		break;
+	case VM_I32:
+		op_rr(e, 0x63, X_W, reg, reg); // movsxd r64, r32
+		break;
+	case VM_U8:
+		op_rr(e, 0x0FB6, X_BYTE, reg, reg); // movzx r32, r8
+		break;
+	case VM_U16:
+		op_rr(e, 0x0FB7, 0, reg, reg); // movzx r32, r16
+		break;
+	case VM_U32:
+		op_rr(e, 0x8B, 0, reg, reg); // mov r32, r32
+		break;
+	default:
+		break;
+	}
+}
+
+// Call a hook with the registers of the function, leave if it failed
+static void emit_hook(Emitter *e, JitHook hook, const u32 *pc, u32 leave) {
+	op_rr(e, 0x89, X_W, R12, RDI);
+	op_rr(e, 0x89, X_W, RBX, RSI);
+	mov_imm(e, RDX, (u64)(uintptr_t)pc);
+	emit_call(e, (u64)(uintptr_t)hook);
+
+	op_rr(e, 0x85, 0, RAX, RAX); // test eax, eax
+	jump_back(e, CC_NE, leave);
+	cache_clear(e);
+}
+
+static void emit_int_op(
+	Emitter *e, const Jit *jit, u32 ins, const u32 *pc, VmType type, VmArith arith,
+	u32 leave
+) {
+	static const u32 alu[] = {
+		[ARITH_ADD] = 0x03, [ARITH_SUB] = 0x2B, [ARITH_AND] = 0x23,
+		[ARITH_OR] = 0x0B,  [ARITH_XOR] = 0x33, [ARITH_MUL] = 0x0FAF,
+	};
+
+	bool sign = type <= VM_I64;
+	u32 bits = 8u << (type % 4);
+
+	u32 b = cache_use(e, INS_B(ins), 0);
+	if (arith == ARITH_NEG || arith == ARITH_BNOT) {
+		u32 d = cache_victim(e, SLOT(b));
+		op_rr(e, 0x8B, X_W, HOST(d), HOST(b));
+		op_rr(e, 0xF7, X_W, arith == ARITH_NEG ? 3 : 2, HOST(d));
+		normalize(e, HOST(d), type);
+		define(e, d, INS_A(ins));
+		return;
+	}
+
+	u32 c = cache_use(e, INS_C(ins), SLOT(b));
+	u32 d = cache_victim(e, SLOT(b) | SLOT(c));
+
+	switch (arith) {
+	case ARITH_ADD:
+	case ARITH_SUB:
+	case ARITH_MUL:
+	case ARITH_AND:
+	case ARITH_OR:
+	case ARITH_XOR:
+		op_rr(e, 0x8B, X_W, HOST(d), HOST(b));
+		op_rr(e, alu[arith], X_W, HOST(d), HOST(c));
+		if (arith == ARITH_ADD || arith == ARITH_SUB || arith == ARITH_MUL) {
+			normalize(e, HOST(d), type);
+		}
+		break;
+	case ARITH_SHL:
+	case ARITH_SHR:
+		op_rr(e, 0x8B, X_W, RCX, HOST(c));
+		if (bits < 64) {
+			op_rr(e, 0x83, 0, 4, RCX); // and ecx, bits - 1
+			emit_u8(e, (u8)(bits - 1));
+		}
+
+		// The operands are extended to 64 bits, so shifting right keeps them so
+		op_rr(e, 0x8B, X_W, HOST(d), HOST(b));
+		op_rr(e, 0xD3, X_W, arith == ARITH_SHL ? 4 : sign ? 7 : 5, HOST(d));
+		if (arith == ARITH_SHL) {
+			normalize(e, HOST(d), type);
+		}
+		break;
+	case ARITH_DIV:
+	case ARITH_MOD: {
+		op_rr(e, 0x85, X_W, HOST(c), HOST(c));
+		u32 nonzero = skip(e, CC_NE);
+		op_rr(e, 0x89, X_W, R12, RDI);
+		op_rr(e, 0x89, X_W, RBX, RSI);
+		mov_imm(e, RDX, (u64)(uintptr_t)pc);
+		emit_call(e, (u64)(uintptr_t)jit->hooks->div_zero);
+		jump_back(e, CC_NONE, leave);
+		land(e, nonzero);
+
+		op_rr(e, 0x8B, X_W, RAX, HOST(b));
+		if (sign) {
+			// INT64_MIN / -1 traps, the interpreter wraps it
+			op_rr(e, 0x83, X_W, 7, HOST(c)); // cmp c, -1
+			emit_u8(e, 0xFF);
+			u32 divide = skip(e, CC_NE);
+			if (arith == ARITH_DIV) {
+				op_rr(e, 0xF7, X_W, 3, RAX); // neg rax
+			} else {
+				op_rr(e, 0x33, 0, RAX, RAX);
+			}
+			u32 done = skip(e, CC_NONE);
+
+			land(e, divide);
+			emit_u8(e, 0x48); // cqo
+			emit_u8(e, 0x99);
+			op_rr(e, 0xF7, X_W, 7, HOST(c)); // idiv c
+			if (arith == ARITH_MOD) {
+				op_rr(e, 0x8B, X_W, RAX, RDX);
+			}
+			land(e, done);
+		} else {
+			op_rr(e, 0x33, 0, RDX, RDX);
+			op_rr(e, 0xF7, X_W, 6, HOST(c)); // div c
+			if (arith == ARITH_MOD) {
+				op_rr(e, 0x8B, X_W, RAX, RDX);
+			}
+		}
+
+		op_rr(e, 0x8B, X_W, HOST(d), RAX);
+		if (arith == ARITH_DIV) {
+			normalize(e, HOST(d), type);
+		}
+	} break;
+	default: { // Comparisons
+		Cond cc = arith == ARITH_EQ ? CC_E
+		        : arith == ARITH_NE ? CC_NE
+		        : arith == ARITH_LT ? (sign ? CC_L : CC_B)
+		                            : (sign ? CC_LE : CC_BE);
+
+		op_rr(e, 0x33, 0, HOST(d), HOST(d));
+		op_rr(e, 0x3B, X_W, HOST(b), HOST(c));
+		op_rr(e, 0x0F90 + cc, X_BYTE, 0, HOST(d)); // setcc
+		define(e, d, INS_A(ins));
+
+		e->flagreg = (i32)INS_A(ins);
+		e->flagcc = cc;
+		return;
+	}
+	}
+
+	define(e, d, INS_A(ins));
+}
+
+static void emit_float_op(Emitter *e, u32 ins, VmType type, VmArith arith) {
+	static const u32 sse[] = {
+		[ARITH_ADD] = 0x0F58,
+		[ARITH_SUB] = 0x0F5C,
+		[ARITH_MUL] = 0x0F59,
+		[ARITH_DIV] = 0x0F5E,
+	};
+
+	// movss and movsd, the other operations have the same prefixes
+	u32 mov = type == VM_F32 ? X_F3 : X_F2;
+	u32 ucomi = type == VM_F32 ? 0 : X_66;
+	u32 a = INS_A(ins);
+	u32 b = INS_B(ins);
+	u32 c = INS_C(ins);
+
+	switch (arith) {
+	case ARITH_ADD:
+	case ARITH_SUB:
+	case ARITH_MUL:
+	case ARITH_DIV:
+		op_rm(e, 0x0F10, mov, 0, b);
+		op_rm(e, sse[arith], mov, 0, c);
+		op_rm(e, 0x0F11, mov, 0, a);
+		cache_drop(e, a);
+		break;
+	case ARITH_MOD:
+		op_rm(e, 0x0F10, mov, 0, b);
+		op_rm(e, 0x0F10, mov, 1, c);
+		emit_call(e, type == VM_F32 ? (u64)(uintptr_t)fmodf : (u64)(uintptr_t)fmod);
+		op_rm(e, 0x0F11, mov, 0, a);
+		cache_clear(e);
+		break;
+	case ARITH_NEG:
+		// Flip the sign bit, f32 only writes the low half like the interpreter
+		if (type == VM_F32) {
+			op_rm(e, 0x8B, 0, RAX, b);
+			op_rr(e, 0x0FBA, 0, 7, RAX); // btc eax, 31
+			emit_u8(e, 31);
+			op_rm(e, 0x89, 0, RAX, a);
+			cache_drop(e, a);
+		} else {
+			u32 s = cache_use(e, b, 0);
+			u32 d = cache_victim(e, SLOT(s));
+			op_rr(e, 0x8B, X_W, HOST(d), HOST(s));
+			op_rr(e, 0x0FBA, X_W, 7, HOST(d)); // btc d, 63
+			emit_u8(e, 63);
+			define(e, d, a);
+		}
+		break;
+	case ARITH_EQ:
+	case ARITH_NE: {
+		// Unordered operands set ZF and PF
+		u32 d = cache_victim(e, 0);
+		op_rr(e, 0x33, 0, HOST(d), HOST(d));
+		op_rr(e, 0x33, 0, RCX, RCX);
+		op_rm(e, 0x0F10, mov, 0, b);
+		op_rm(e, 0x0F2E, ucomi, 0, c);
+		if (arith == ARITH_EQ) {
+			op_rr(e, 0x0F90 + CC_E, X_BYTE, 0, HOST(d));
+			op_rr(e, 0x0F90 + CC_NP, X_BYTE, 0, RCX);
+			op_rr(e, 0x23, 0, HOST(d), RCX);
+		} else {
+			op_rr(e, 0x0F90 + CC_NE, X_BYTE, 0, HOST(d));
+			op_rr(e, 0x0F90 + CC_P, X_BYTE, 0, RCX);
+			op_rr(e, 0x0B, 0, HOST(d), RCX);
+		}
+		define(e, d, a);
+	} break;
+	default: { // LT and LE, as C > B and C >= B which are false when unordered
+		Cond cc = arith == ARITH_LT ? CC_A : CC_AE;
+		u32 d = cache_victim(e, 0);
+		op_rr(e, 0x33, 0, HOST(d), HOST(d));
+		op_rm(e, 0x0F10, mov, 0, c);
+		op_rm(e, 0x0F2E, ucomi, 0, b);
+		op_rr(e, 0x0F90 + cc, X_BYTE, 0, HOST(d));
+		define(e, d, a);
+
+		e->flagreg = (i32)a;
+		e->flagcc = cc;
+	} break;
+	}
+}
+
+static u32 ins_width(u32 ins) {
+	Opcode op = INS_OP(ins);
+	return op == OP_LOADKX || op == OP_CALLN ? 2 : 1;
+}
+
+// Mark the targets of the jumps, where the cache starts empty
+static bool find_labels(const u32 *code, u32 len, bool *labels) {
+	labels[0] = true;
+	for (u32 i = 0; i < len; i += ins_width(code[i])) {
+		i64 target;
+		switch (INS_OP(code[i])) {
+		case OP_JMP:
+			target = (i64)i + 1 + INS_SAX(code[i]);
+			break;
+		case OP_JMPF:
+		case OP_JMPT:
+			target = (i64)i + 1 + INS_SBX(code[i]);
+			break;
+		default:
+			continue;
+		}
+
+		if (target < 0 || target >= len) {
+			return false;
+		}
+		labels[target] = true;
+	}
+	return true;
+}
+
+// Emit the code of the function
+//
+// @return Offset of each jump target, NULL if an instruction isn't supported
+static u32 *emit_func(
+	const Jit *jit, const VmFunc *func, const bool *labels, Emitter *e
+) {
+	static const u8 prologue[] = {
+		0x55,             // push rbp
+		0x48, 0x89, 0xE5, // mov rbp, rsp
+		0x53,             // push rbx
+		0x41, 0x54,       // push r12
+		0x48, 0x89, 0xFB, // mov rbx, rdi
+		0x49, 0x89, 0xF4, // mov r12, rsi
+		0xFF, 0xE2,       // jmp rdx
+	};
+	static const u8 epilogue[] = {
+		0x41, 0x5C, // pop r12
+		0x5B,       // pop rbx
+		0x5D,       // pop rbp
+		0xC3,       // ret
+	};
+
+	for (u32 i = 0; i < sizeof(prologue); i += 1) {
+		emit_u8(e, prologue[i]);
+	}
+
+	// Returning jumps back here, the hooks already set eax when they fail
+	u32 ret = e->len;
+	op_rr(e, 0x33, 0, RAX, RAX);
+	u32 leave = e->len;
+	for (u32 i = 0; i < sizeof(epilogue); i += 1) {
+		emit_u8(e, epilogue[i]);
+	}
+
+	const u32 *code = jit->prog->code + func->start;
+	u32 *offsets = xcalloc(MEM_JIT, func->len, sizeof(u32));
+	bool ok = true;
+
+	for (u32 i = 0; i < func->len && ok; i += ins_width(code[i])) {
+		u32 ins = code[i];
+		const u32 *pc = code + i + 1;
+		offsets[i] = e->len;
+
+		if (labels[i]) {
+			cache_clear(e);
+			e->flagreg = -1;
+		}
+
+		i32 flagreg = e->flagreg;
+		Cond flagcc = e->flagcc;
+		e->flagreg = -1;
+
+		Opcode op = INS_OP(ins);
+		switch (op) {
+		case OP_NOP:
+			break;
+		case OP_MOV: {
+			u32 b = cache_use(e, INS_B(ins), 0);
+			u32 d = cache_victim(e, SLOT(b));
+			op_rr(e, 0x8B, X_W, HOST(d), HOST(b));
+			define(e, d, INS_A(ins));
+		} break;
+		case OP_LOADI:
+		case OP_LOADK:
+		case OP_LOADKX: {
+			u64 value = op == OP_LOADI  ? (u64)(i64)INS_SBX(ins)
+			          : op == OP_LOADK ? jit->prog->consts[INS_BX(ins)].u
+			                           : jit->prog->consts[code[i + 1]].u;
+			u32 d = cache_victim(e, 0);
+			mov_imm(e, HOST(d), value);
+			define(e, d, INS_A(ins));
+		} break;
+		case OP_GGET: {
+			u32 d = cache_victim(e, 0);
+			mov_imm(e, RAX, (u64)(uintptr_t)&jit->globals[INS_BX(ins)]);
+			op_rax(e, 0x8B, X_W, HOST(d));
+			define(e, d, INS_A(ins));
+		} break;
+		case OP_GSET: {
+			u32 a = cache_use(e, INS_A(ins), 0);
+			mov_imm(e, RAX, (u64)(uintptr_t)&jit->globals[INS_BX(ins)]);
+			op_rax(e, 0x89, X_W, HOST(a));
+		} break;
+		case OP_JMP:
+			jump_to(e, CC_NONE, (u32)((i64)i + 1 + INS_SAX(ins)));
+			break;
+		case OP_JMPF:
+		case OP_JMPT: {
+			u32 target = (u32)((i64)i + 1 + INS_SBX(ins));
+			Cond cc;
+			if (flagreg == (i32)INS_A(ins)) {
+				cc = op == OP_JMPT ? flagcc : (Cond)(flagcc ^ 1);
+			} else {
+				u32 a = cache_use(e, INS_A(ins), 0);
+				op_rr(e, 0x85, X_W, HOST(a), HOST(a));
+				cc = op == OP_JMPT ? CC_NE : CC_E;
+			}
+			jump_to(e, cc, target);
+		} break;
+		case OP_CALL:
+			emit_hook(e, jit->hooks->call, pc, leave);
+			break;
+		case OP_CALLN:
+			emit_hook(e, jit->hooks->native, pc, leave);
+			break;
+		case OP_RET: {
+			u32 a = cache_use(e, INS_A(ins), 0);
+			op_rm(e, 0x89, X_W, HOST(a), 0);
+			jump_back(e, CC_NONE, ret);
+		} break;
+		case OP_RET0:
+			jump_back(e, CC_NONE, ret);
+			break;
+		case OP_NOT: {
+			u32 b = cache_use(e, INS_B(ins), 0);
+			u32 d = cache_victim(e, SLOT(b));
+			op_rr(e, 0x33, 0, HOST(d), HOST(d));
+			op_rr(e, 0x85, X_W, HOST(b), HOST(b));
+			op_rr(e, 0x0F90 + CC_E, X_BYTE, 0, HOST(d));
+			define(e, d, INS_A(ins));
+
+			e->flagreg = (i32)INS_A(ins);
+			e->flagcc = CC_E;
+		} break;
+		case OP_CAST: {
+			VmType from = INS_C(ins) / VM_TYPE_COUNT;
+			VmType to = INS_C(ins) % VM_TYPE_COUNT;
+			u32 b = cache_use(e, INS_B(ins), 0);
+
+			if (from < VM_F32 && to < VM_F32) {
+				u32 d = cache_victim(e, SLOT(b));
+				op_rr(e, 0x8B, X_W, HOST(d), HOST(b));
+				normalize(e, HOST(d), to);
+				define(e, d, INS_A(ins));
+				break;
+			}
+
+			// Value is passed and returned in a general purpose register
+			op_rr(e, 0x8B, X_W, RDI, HOST(b));
+			mov_imm(e, RSI, from);
+			mov_imm(e, RDX, to);
+			emit_call(e, (u64)(uintptr_t)vm_cast);
+			op_rm(e, 0x89, X_W, RAX, INS_A(ins));
+			cache_clear(e);
+		} break;
+		default:
+			if (op >= OP_ADD_F32 && op < OP_COUNT) {
+				u32 index = op - OP_ADD_F32;
+				VmType type = VM_F32 + index / ARITH_FLOAT_COUNT;
+				emit_float_op(e, ins, type, index % ARITH_FLOAT_COUNT);
+			} else if (op >= OP_ADD_I8 && op < OP_ADD_F32) {
+				u32 index = op - OP_ADD_I8;
+				VmType type = index / ARITH_INT_COUNT;
+				emit_int_op(e, jit, ins, pc, type, index % ARITH_INT_COUNT, leave);
+			} else {
+				ok = false; // Not supported, the function stays interpreted
+			}
+			break;
+		}
+	}
+
+	for (u32 i = 0; i < e->patchlen && ok; i += 1) {
+		const Patch *p = &e->patches[i];
+		u32 rel = offsets[p->target] - (p->at + 4);
+		memcpy(e->buf + p->at, &rel, sizeof(u32));
+	}
+
+	// Only the jump targets can be entered, the cache is empty there
+	for (u32 i = 0; i < func->len; i += 1) {
+		if (!labels[i]) {
+			offsets[i] = JIT_NO_ENTRY;
+		}
+	}
+
+	if (!ok) {
+		xfree(offsets);
+		return NULL;
+	}
+	return offsets;
+}
+
+// Copy the code to new pages, executable once they are written
+static u8 *map_code(const u8 *buf, usize len, usize *size) {
+	usize page = (usize)sysconf(_SC_PAGESIZE);
+	*size = (len + page - 1) / page * page;
+
+	int prot = PROT_READ | PROT_WRITE;
+	u8 *code = mmap(NULL, *size, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		return NULL;
+	}
+
+	memcpy(code, buf, len);
+	if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(code, *size);
+		return NULL;
+	}
+	return code;
+}
+
+bool jit_compile(Jit *jit, u32 func) {
+	JitFunc *f = &jit->funcs[func];
+	const VmFunc *vf = &jit->prog->funcs[func];
+	f->failed = true; // Until it's done, it's never compiled twice
+
+	bool *labels = xcalloc(MEM_JIT, vf->len, sizeof(bool));
+	if (!find_labels(jit->prog->code + vf->start, vf->len, labels)) {
+		xfree(labels);
+		return false;
+	}
+
+	Emitter e = {
+		.size = 256,
+		.flagreg = -1,
+	};
+	e.buf = xcalloc(MEM_JIT, e.size, 1);
+	e.patches = xcalloc(MEM_JIT, vf->len, sizeof(Patch));
+	cache_clear(&e);
+
+	f->entries = emit_func(jit, vf, labels, &e);
+	if (f->entries != NULL) {
+		f->code = map_code(e.buf, e.len, &f->size);
+		if (f->code != NULL) {
+			f->failed = false;
+			jit->compiled += 1;
+			jit->codesize += e.len;
+		} else {
+			xfree(f->entries);
+			f->entries = NULL;
+		}
+	}
+
+	xfree(e.buf);
+	xfree(e.patches);
+	xfree(labels);
+	return !f->failed;
+}
+
+#else
+
+bool jit_compile(Jit *jit, u32 func) {
+	jit->funcs[func].failed = true;
+	return false;
+}
+
+#endif
@@ -9,7 +9,8 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
-#include <inttypes.h>
+#include <math.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <string.h>
 
@@ -18,6 +19,7 @@ static const char *tokens[] = {
 	[TK_AS] = "as",
 	[TK_BOOL] = "bool",
 	[TK_CONST] = "const",
+	[TK_ELSE] = "else",
 	[TK_F32] = "f32",
 	[TK_F64] = "f64",
 	[TK_FALSE] = "false",
@@ -91,23 +93,49 @@ static_assert(
 	"Tokens array doesn't have the same size of Tokens Enum."
 );
 
-static _Noreturn void push_error(Location loc, const char *fmt, ...) {
-	fprintf(stderr, "%d:%d ", loc.lineno, loc.colno);
+static _Noreturn void push_error(LexState *lex, SourceLoc loc, const char *fmt, ...) {
+	Location pos = source_decode(lex->sources, loc, NULL);
+	int len = snprintf(lex->error, sizeof(lex->error), "%d:%d ", pos.lineno, pos.colno);
 
 	va_list args;
 	va_start(args, fmt);
-	vfprintf(stderr, fmt, args);
+	vsnprintf(lex->error + len, sizeof(lex->error) - len, fmt, args);
 	va_end(args);
 
-	fprintf(stderr, "\n");
+	if (lex->env != NULL) {
+		longjmp(*lex->env, 1);
+	}
 
+	fprintf(stderr, "%s\n", lex->error);
 	exit(EXIT_FAILURE);
 }
 
+// Location of the last character read from the file
+static inline SourceLoc here_loc(const LexState *lex) {
+	return lex->base + (SourceLoc)lex->here;
+}
+
+static char *lex_strndup(LexState *lex, const char *str, usize len, MemTag tag) {
+	char *dup = lex->alloc.alloc(lex->alloc.ctx, len + 1, tag);
+	if (dup == NULL) {
+		push_error(lex, here_loc(lex), "Out of memory");
+	}
+
+	memcpy(dup, str, len);
+	dup[len] = '\0';
+	return dup;
+}
+
 static void buffer_insert(LexState *lex, const char *s, usize size) {
 	if (lex->buflen + size >= lex->bufsize) {
-		lex->bufsize *= 2;
-		lex->buf = xrealloc(lex->buf, lex->bufsize);
+		usize bufsize = lex->bufsize * 2;
+		char *buf = lex->alloc.realloc(lex->alloc.ctx, lex->buf, lex->bufsize, bufsize);
+		if (buf == NULL) {
+			push_error(lex, here_loc(lex), "Out of memory");
+		}
+
+		lex->buf = buf;
+		lex->bufsize = bufsize;
 	}
 
 	memcpy(lex->buf + lex->buflen, s, size);
@@ -127,23 +155,30 @@ static void stack_push(LexState *lex, u32 c, bool frombuf) {
 	lex->stack[0] = c;
 
 	if (frombuf) { // Consume the character from buffer
-		lex->buflen -= 1;
+		char tmp[UTF8_MAXBYTES];
+		lex->buflen -= u8_encode(tmp, c);
 		lex->buf[lex->buflen] = '\0';
 	}
 }
 
-static void update_line(Location *loc, u32 c) {
-	if (c == '\n') { // Update line number and reset column
-		loc->lineno += 1;
-		loc->colno = 0;
-	} else if (c == '\t') {
-		loc->colno += 4; // All tabs count as 4 columns
-	} else {
-		loc->colno += 1;
+// Bytes of the character in the file, 0 for the end of file
+static usize chr_size(u32 c) {
+	if (c == UTF8_EOF || c == UTF8_INVALID) {
+		return 0;
 	}
+	return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
 }
 
-static u32 nextchr(LexState *lex, Location *loc, bool buffer) {
+// Offset of the next character to read, before the pushed back ones
+static usize tell(const LexState *lex) {
+	usize offset = lex->offset;
+	for (usize i = 0; i < 2 && lex->stack[i] != UTF8_INVALID; i += 1) {
+		offset -= chr_size(lex->stack[i]);
+	}
+	return offset;
+}
+
+static u32 nextchr(LexState *lex, SourceLoc *loc, bool buffer) {
 	u32 c;
 
 	if (lex->stack[0] != UTF8_INVALID) {
@@ -152,10 +187,11 @@ static u32 nextchr(LexState *lex, Location *loc, bool buffer) {
 		lex->stack[1] = UTF8_INVALID;
 	} else {
 		c = u8_get(lex->file);
-		update_line(&lex->loc, c);
+		lex->here = lex->offset;
+		lex->offset += chr_size(c);
 
 		if (c == UTF8_INVALID && !feof(lex->file)) {
-			push_error(*loc, "Invalid UTF-8 sequence found");
+			push_error(lex, here_loc(lex), "Invalid UTF-8 sequence found");
 		}
 
 		if (c == UTF8_INVALID) {
@@ -163,16 +199,15 @@ static u32 nextchr(LexState *lex, Location *loc, bool buffer) {
 		}
 	}
 
+	// The characters pushed back come after this one in the file
 	if (loc != NULL) {
-		*loc = lex->loc;
-		for (usize i = 0; i < 2 && lex->stack[i] != UTF8_INVALID; i += 1) {
-			update_line(&lex->loc, lex->stack[i]);
-		}
+		*loc = lex->base + (SourceLoc)(tell(lex) - chr_size(c));
 	}
 
 	// Check if we need to store the character in the buffer
 	if (buffer && c != '\0') {
-		buffer_insert(lex, (char *)&c, 1);
+		char tmp[UTF8_MAXBYTES];
+		buffer_insert(lex, tmp, u8_encode(tmp, c));
 	}
 
 	return c;
@@ -182,7 +217,7 @@ static inline bool is_space(u32 c) {
 	return c == ' ' || c == '\t' || c == '\n';
 }
 
-static u32 trimspaces(LexState *lex, Location *loc) {
+static u32 trimspaces(LexState *lex, SourceLoc *loc) {
 	u32 c = ' ';
 
 	while (c != UTF8_EOF && is_space(c)) {
@@ -192,6 +227,17 @@ static u32 trimspaces(LexState *lex, Location *loc) {
 	return c;
 }
 
+// Record the source text of the literal, from its location to the next character
+static void set_span(LexState *lex, Token *out) {
+	usize start = out->loc - lex->base;
+	out->text = lex->data + start;
+	out->len = (u32)(tell(lex) - start);
+}
+
+static inline u32 hex_value(u32 c) {
+	return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
 static TokenKind lex_number(LexState *lex, Token *out) {
 	enum Base {
 		B_BIN = 0x01,                  // Binary
@@ -228,45 +274,40 @@ static TokenKind lex_number(LexState *lex, Token *out) {
 		['_'] = { B_BIN, B_OCT, B_HEX, B_DEC, B_DEC | F_FLT, B_HEX | F_FLT, 0 },
 	};
 
-	u32 c = nextchr(lex, &out->loc, true);
+	u32 c = nextchr(lex, &out->loc, false);
 	assert(c != UTF8_EOF && c <= 0x7f && isdigit(c));
 
 	enum Base state = B_DEC;
-	u8 base = 10;
 
 	if (c == '0') {
-		c = nextchr(lex, NULL, true);
+		c = nextchr(lex, NULL, false);
 
 		if (isdigit(c) || c == '_') {
-			push_error(out->loc, "Leading zero in decimal literal");
+			push_error(lex, out->loc, "Leading zero in decimal literal");
 		} else if (c == 'b') {
 			state = B_BIN | F_SYM;
-			base = 2;
 		} else if (c == 'o') {
 			state = B_OCT | F_SYM;
-			base = 8;
 		} else if (c == 'x') {
 			state = B_HEX | F_SYM;
-			base = 16;
 		}
 	}
 
 	if (state != B_DEC) { // Get the next character if base was specified
-		c = nextchr(lex, NULL, true);
+		c = nextchr(lex, NULL, false);
 	}
 
-	usize exp_idx = 0; // Index in buffer where the exponent start
 	while (c != UTF8_EOF) {
 		// Check if it a valid number in current base
 		if (strchr(numbers[state & B_MASK], (i32)c) != NULL) {
 			state &= ~(F_SYM | F_SEP);
-			c = nextchr(lex, NULL, true);
+			c = nextchr(lex, NULL, false);
 			continue;
 		}
 
 		if ((state & F_SEP) > 0) {
 			// The current state is a separator, but didn't found a digit after it
-			push_error(out->loc, "Expected digit, found: '%c'", c);
+			push_error(lex, out->loc, "Expected digit, found: '%c'", c);
 		}
 
 		if (strchr(valid_states[(u8)c], state) == NULL) {
@@ -276,10 +317,6 @@ static TokenKind lex_number(LexState *lex, Token *out) {
 		switch (c) {
 		case '_':
 			state |= F_SEP;
-
-			// Consume separator
-			lex->buflen -= 1;
-			lex->buf[lex->buflen] = '\0';
 			break;
 		case '-':
 		case '+':
@@ -289,7 +326,6 @@ static TokenKind lex_number(LexState *lex, Token *out) {
 		case 'E':
 		case 'p':
 		case 'P':
-			exp_idx = lex->buflen - 1;
 			state |= B_DEC | F_EXP;
 			// FALLTHROUGH
 		case '.':
@@ -300,53 +336,17 @@ static TokenKind lex_number(LexState *lex, Token *out) {
 		}
 
 		state |= F_SYM;
-		c = nextchr(lex, NULL, true);
+		c = nextchr(lex, NULL, false);
 	}
 
 	if (c != UTF8_EOF) {
-		stack_push(lex, c, true);
+		stack_push(lex, c, false);
 	}
 
+	// The value is only decoded by tok_int_value() or tok_float_value()
 	out->kind = TK_CCONST;
-
-	errno = 0;
-	if ((state & F_FLT) > 0) {
-		out->fval = strtod(lex->buf, NULL);
-		out->storage = TYPE_FLOAT;
-	} else {
-		u64 exp = 0;
-		if (exp_idx != 0) {
-			exp = strtoumax(lex->buf + exp_idx, NULL, 10);
-		}
-
-		out->uval = strtoumax(lex->buf + (base == 10 ? 0 : 2), NULL, base);
-		out->storage = TYPE_INT;
-
-		if (out->uval != 0) {
-			// Compute exponent if the value is not 0
-			for (u64 i = 0; i < exp; i += 1) {
-				u64 prev = out->uval;
-				out->uval *= 10;
-
-				// Verify for overflow
-				if (out->uval / 10 != prev) {
-					errno = ERANGE;
-					out->uval = INT64_MAX;
-				}
-			}
-		}
-
-		// Try to find the storage size
-		if (out->uval > (u64)INT64_MAX) {
-			out->storage = TYPE_U64;
-		}
-	}
-
-	if (errno == ERANGE) {
-		push_error(out->loc, "Integer constant overflow");
-	}
-
-	buffer_clear(lex);
+	out->storage = (state & F_FLT) > 0 ? TYPE_FLOAT : TYPE_INT;
+	set_span(lex, out);
 	return out->kind;
 }
 
@@ -356,10 +356,10 @@ static int keyword_cmp(const void *v1, const void *v2) {
 
 static TokenKind lex_identifier(LexState *lex, Token *out) {
 	u32 c = nextchr(lex, &out->loc, true);
-	assert(c != UTF8_EOF && c <= 0x7f && (isalpha(c) || c == '_'));
+	assert(c != UTF8_EOF && u8_is_id_start(c));
 
 	while (c != UTF8_EOF) {
-		if (c > 0x7f || (!isalnum(c) && c != '_')) {
+		if (!u8_is_id_continue(c)) {
 			// We found a invalid identifier symbol
 			stack_push(lex, c, true);
 			break;
@@ -382,140 +382,165 @@ static TokenKind lex_identifier(LexState *lex, Token *out) {
 	} else {
 		// We didn't found a matching keyword, so we treat it as a identifier
 		out->kind = TK_IDENTIFIER;
-		out->ident = xstrndup(lex->buf, lex->buflen);
+		out->ident = lex_strndup(lex, lex->buf, lex->buflen, MEM_LEX_IDENT);
 	}
 
 	buffer_clear(lex);
 	return out->kind;
 }
 
-static usize lex_rune(LexState *lex, char *out) {
+// Check the escape sequence after a backslash, it's decoded by decode_char()
+static void lex_escape(LexState *lex) {
+	SourceLoc loc = here_loc(lex);
 	u32 c = nextchr(lex, NULL, false);
-	assert(c != UTF8_EOF);
+	u32 digits = 0;
 
-	// Parse the escape characters
-	if (c == '\\') {
-		Location loc = lex->loc;
-		char buf[9] = { 0 };
-		char *endptr = NULL;
+	switch (c) {
+	case 'n':
+	case 'r':
+	case 't':
+	case '\\':
+	case '\'':
+	case '"':
+	case '0':
+		return;
+	case 'x':
+		digits = 2;
+		break;
+	case 'u':
+		digits = 4;
+		break;
+	case 'U':
+		digits = 8;
+		break;
+	case UTF8_EOF:
+		push_error(lex, here_loc(lex), "Unexpected end of file");
+	default:
+		push_error(lex, loc, "Invalid escape sequence '\\%c'", c);
+	}
 
+	u32 value = 0;
+	for (u32 i = 0; i < digits; i += 1) {
 		c = nextchr(lex, NULL, false);
+		if (c > 0x7f || !isxdigit((int)c)) {
+			push_error(lex, loc, "Invalid hex escape sequence");
+		}
+		value = value << 4 | hex_value(c);
+	}
 
-		switch (c) {
-		case 'n':
-			out[0] = '\n';
-			return 1;
-		case 'r':
-			out[0] = '\r';
-			return 1;
-		case 't':
-			out[0] = '\t';
-			return 1;
-		case '\\':
-			out[0] = '\\';
-			return 1;
-		case '\'':
-			out[0] = '\'';
-			return 1;
-		case '"':
-			out[0] = '\"';
-			return 1;
-		case '0':
-			out[0] = '\0';
-			return 1;
-		case 'x':
-			buf[0] = (char)nextchr(lex, NULL, false);
-			buf[1] = (char)nextchr(lex, NULL, false);
-			buf[2] = '\0';
-
-			c = strtoul(buf, &endptr, 16);
-			if (*endptr != '\0') {
-				push_error(loc, "Invalid hex escape sequence");
-			}
-
-			out[0] = (char)c;
-			return 1;
-		case 'u':
-			for (u32 i = 0; i < 4; i += 1) {
-				buf[i] = (char)nextchr(lex, NULL, false);
-			}
-			buf[4] = '\0';
-
-			c = strtoul(buf, &endptr, 16);
-			if (*endptr != '\0') {
-				push_error(loc, "Invalid hex escape sequence");
-			}
+	if (value > 0x10ffff) {
+		push_error(lex, loc, "Invalid hex escape sequence");
+	}
+}
 
-			return u8_encode(out, c);
-		case 'U':
-			for (u32 i = 0; i < 8; i += 1) {
-				buf[i] = (char)nextchr(lex, NULL, false);
-			}
-			buf[8] = '\0';
+// Decode a character of a literal checked while scanning, or its escape sequence
+static const char *decode_char(const char *s, char *out, usize *size) {
+	if (*s != '\\') {
+		u32 c;
+		const char *end = u8_decode(s, &c);
+		*size = (usize)(end - s);
+		memcpy(out, s, *size);
+		return end;
+	}
 
-			c = strtoul(out, &endptr, 16);
-			if (*endptr != '\0') {
-				push_error(loc, "Invalid hex escape sequence");
-			}
+	*size = 1;
+	char kind = s[1];
+	s += 2;
+
+	u32 digits = 0;
+	switch (kind) {
+	case 'n':
+		out[0] = '\n';
+		return s;
+	case 'r':
+		out[0] = '\r';
+		return s;
+	case 't':
+		out[0] = '\t';
+		return s;
+	case '0':
+		out[0] = '\0';
+		return s;
+	case 'x':
+		digits = 2;
+		break;
+	case 'u':
+		digits = 4;
+		break;
+	case 'U':
+		digits = 8;
+		break;
+	default: // \\ \' \"
+		out[0] = kind;
+		return s;
+	}
 
-			return u8_encode(buf, c);
-		case UTF8_EOF:
-			push_error(lex->loc, "Unexpected end of file");
-		default:
-			push_error(loc, "Invalid escape sequence '\\%c'", c);
-		}
+	u32 c = 0;
+	for (u32 i = 0; i < digits; i += 1) {
+		c = c << 4 | hex_value((u8)s[i]);
 	}
 
-	return u8_encode(out, c);
+	// A \x escape is a single byte, the others are code points
+	if (kind == 'x') {
+		out[0] = (char)c;
+	} else {
+		*size = u8_encode(out, c);
+	}
+	return s + digits;
 }
 
 static TokenKind lex_string(LexState *lex, Token *out) {
 	u32 c = nextchr(lex, &out->loc, false);
-	char buf[UTF8_MAXBYTES + 1] = { 0 };
 
 	switch (c) {
 	case '"':
 		c = nextchr(lex, NULL, false);
 		while (c != '"') {
 			if (c == UTF8_EOF) {
-				push_error(out->loc, "Unexpected end of file");
+				push_error(lex, out->loc, "Unexpected end of file");
 			}
 
-			stack_push(lex, c, false);
-			usize size = lex_rune(lex, buf);
-			buffer_insert(lex, buf, size);
+			if (c == '\\') {
+				out->flags |= TOK_ESCAPES;
+				lex_escape(lex);
+			}
 
 			c = nextchr(lex, NULL, false);
 		}
 
+		// The value is only decoded by tok_string_value()
 		out->kind = TK_CCONST;
 		out->storage = TYPE_STRING;
-		out->str.len = lex->buflen;
-		out->str.ptr = xstrndup(lex->buf, lex->buflen);
-
-		buffer_clear(lex);
+		set_span(lex, out);
 		break;
-	case '\'':
+	case '\'': {
 		c = nextchr(lex, NULL, false);
 
 		if (c == '\'') {
-			push_error(out->loc, "Expected character before closing single-quote");
+			push_error(lex, out->loc, "Expected character before closing single-quote");
+		} else if (c == UTF8_EOF) {
+			push_error(lex, out->loc, "Unexpected end of file");
+		} else if (c == '\\') {
+			lex_escape(lex);
 		}
 
-		stack_push(lex, c, false);
-		usize size = lex_rune(lex, buf);
-		buf[size] = '\0';
-
-		u8_decode(buf, &out->rune);
-
 		c = nextchr(lex, NULL, false);
 		if (c != '\'') {
-			push_error(out->loc, "Expected closing single-quote");
+			push_error(lex, out->loc, "Expected closing single-quote");
 		}
 
 		out->kind = TK_CCONST;
 		out->storage = TYPE_RUNE;
-		break;
+		set_span(lex, out);
+
+		char buf[UTF8_MAXBYTES + 1] = { 0 };
+		usize size;
+		decode_char(out->text + 1, buf, &size);
+		buf[size] = '\0';
+
+		u8_decode(buf, &out->rune);
+		out->flags |= TOK_DECODED;
+	} break;
 	default:
 		assert(0); // UNREACHABLE
 	}
@@ -523,6 +548,8 @@ static TokenKind lex_string(LexState *lex, Token *out) {
 	return out->kind;
 }
 
+static TokenKind scan_token(LexState *lex, Token *tok);
+
 static TokenKind lex_duo_operator(LexState *lex, Token *out) {
 	u32 c = nextchr(lex, &out->loc, false);
 	assert(c != UTF8_EOF);
@@ -630,7 +657,7 @@ static TokenKind lex_duo_operator(LexState *lex, Token *out) {
 			while (c != UTF8_EOF && c != '\n') {
 				c = nextchr(lex, NULL, false);
 			}
-			out->kind = lex_scan(lex, out); // Search for a valid token
+			out->kind = scan_token(lex, out); // Search for a valid token
 		} else if (c == '=') {
 			out->kind = TK_SLASH_EQ;
 		} else {
@@ -661,6 +688,8 @@ static TokenKind lex_tri_operator(LexState *lex, Token *out) {
 				stack_push(lex, c, false);
 				out->kind = TK_SHIFTL;
 			}
+		} else if (c == '=') {
+			out->kind = TK_LESS_EQ;
 		} else {
 			stack_push(lex, c, false);
 			out->kind = TK_LESS;
@@ -676,6 +705,8 @@ static TokenKind lex_tri_operator(LexState *lex, Token *out) {
 				stack_push(lex, c, false);
 				out->kind = TK_SHIFTR;
 			}
+		} else if (c == '=') {
+			out->kind = TK_GREATER_EQ;
 		} else {
 			stack_push(lex, c, false);
 			out->kind = TK_GREATER;
@@ -688,43 +719,61 @@ static TokenKind lex_tri_operator(LexState *lex, Token *out) {
 	return out->kind;
 }
 
-void lex_init(LexState *lex, FILE *file) {
+bool lex_init(LexState *lex, SourceManager *sources, u32 file, const Allocator *alloc) {
 	memset(lex, 0, sizeof(LexState));
 
-	lex->file = file;
-	lex->loc.lineno = 1;
-	lex->loc.colno = 1;
+	// The lexer only reads through stdio, the stream doesn't copy the buffer
+	usize len;
+	char *data = (char *)source_data(sources, file, &len);
+	lex->file = fmemopen(data, len, "rb");
+	if (lex->file == NULL) {
+		return false;
+	}
+
+	lex->sources = sources;
+	lex->data = data;
+	lex->base = source_loc(sources, file, 0);
+	lex->alloc = alloc != NULL ? *alloc : default_allocator;
 
 	lex->bufsize = 128;
-	lex->buf = xcalloc(1, lex->bufsize * sizeof(char));
+	lex->buf = lex->alloc.alloc(lex->alloc.ctx, lex->bufsize, MEM_LEX_BUFFER);
 
 	lex->stack[0] = UTF8_INVALID;
 	lex->stack[1] = UTF8_INVALID;
+
+	if (lex->buf == NULL) {
+		fclose(lex->file);
+		return false;
+	}
+	return true;
 }
 
 void lex_close(LexState *lex) {
+	while (lex->ringlen > 0) {
+		lex_advance(lex);
+	}
+
 	fclose(lex->file);
-	free(lex->buf);
+	lex->alloc.free(lex->alloc.ctx, lex->buf, lex->bufsize);
 }
 
-TokenKind lex_scan(LexState *lex, Token *tok) {
+static TokenKind scan_token(LexState *lex, Token *tok) {
+	tok->flags = 0; // The token may be reused by the caller
 	u32 c = trimspaces(lex, &tok->loc);
 	if (c == UTF8_EOF) { // Check if we reached the end-of-file
 		tok->kind = TK_EOF;
 		return tok->kind;
 	}
 
-	// We only scan ASCII characters for identifiers and digits
-	if (c <= 0x7f) {
-		if (isdigit(c)) {
-			stack_push(lex, c, false);
-			return lex_number(lex, tok);
-		}
+	// Digits are only ASCII, identifiers can start with any XID_Start character
+	if (c <= 0x7f && (u8_ascii_class[c] & U8_DIGIT) != 0) {
+		stack_push(lex, c, false);
+		return lex_number(lex, tok);
+	}
 
-		if (isalpha(c) || c == '_') {
-			stack_push(lex, c, false);
-			return lex_identifier(lex, tok);
-		}
+	if (u8_is_id_start(c)) {
+		stack_push(lex, c, false);
+		return lex_identifier(lex, tok);
 	}
 
 	switch (c) {
@@ -780,14 +829,213 @@ TokenKind lex_scan(LexState *lex, Token *tok) {
 		tok->kind = TK_SEMICOLON;
 		break;
 	default:
-		push_error(lex->loc, "Unknown symbol found: %c", c);
+		push_error(lex, here_loc(lex), "Unknown symbol found: %c", c);
 		break;
 	}
 
 	return tok->kind;
 }
 
+TokenKind lex_scan(LexState *lex, Token *tok) {
+	if (!lex->recover) {
+		return scan_token(lex, tok);
+	}
+
+	jmp_buf env;
+	if (setjmp(env) != 0) {
+		lex->env = NULL;
+		buffer_clear(lex);
+
+		tok->kind = TK_ERROR;
+		return tok->kind;
+	}
+
+	lex->env = &env;
+	TokenKind kind = scan_token(lex, tok);
+	lex->env = NULL;
+
+	return kind;
+}
+
+Token *lex_scan_all(LexState *lex, MemTag tag, u32 *len) {
+	u32 size = 256;
+	u32 count = 0;
+	Token *tokens = xcalloc(tag, size, sizeof(Token));
+
+	for (;;) {
+		if (count == size) {
+			size *= 2;
+			tokens = xrealloc(tag, tokens, size * sizeof(Token));
+		}
+
+		tokens[count] = (Token) { 0 };
+		TokenKind kind = lex_scan(lex, &tokens[count]);
+		count += 1;
+		if (kind == TK_EOF || kind == TK_ERROR) {
+			break;
+		}
+	}
+
+	*len = count;
+	return tokens;
+}
+
 const char *lex_tok2str(TokenKind tok) {
 	assert(tok <= TK_LAST_OPERATOR);
 	return tokens[tok];
 }
+
+Token *lex_peek(LexState *lex, usize n) {
+	assert(n < LEX_LOOKAHEAD);
+
+	while (lex->ringlen <= n) {
+		Token *tok = &lex->ring[(lex->ringhead + lex->ringlen) & (LEX_LOOKAHEAD - 1)];
+		*tok = (Token) { 0 };
+		lex_scan(lex, tok);
+		lex->ringlen += 1;
+	}
+
+	return &lex->ring[(lex->ringhead + n) & (LEX_LOOKAHEAD - 1)];
+}
+
+void lex_advance(LexState *lex) {
+	if (lex->ringlen == 0) {
+		lex_peek(lex, 0);
+	}
+
+	lex_release(lex, &lex->ring[lex->ringhead]);
+	lex->ringhead = (lex->ringhead + 1) & (LEX_LOOKAHEAD - 1);
+	lex->ringlen -= 1;
+}
+
+void lex_release(LexState *lex, Token *tok) {
+	if (tok->kind == TK_IDENTIFIER && tok->ident != NULL) {
+		lex->alloc.free(lex->alloc.ctx, tok->ident, strlen(tok->ident) + 1);
+		tok->ident = NULL;
+	} else if (tok->kind == TK_CCONST && (tok->flags & TOK_OWNED) != 0) {
+		// Allocated for the literal without its quotes, see tok_string_value()
+		lex->alloc.free(lex->alloc.ctx, (char *)tok->str.ptr, tok->len - 1);
+		tok->str.ptr = NULL;
+		tok->flags &= ~TOK_OWNED;
+	}
+}
+
+bool tok_int_value(Token *tok, u64 *out) {
+	assert(tok->kind == TK_CCONST && tok->storage == TYPE_INT);
+	if ((tok->flags & TOK_DECODED) != 0) {
+		*out = tok->uval;
+		return true;
+	}
+
+	const char *s = tok->text;
+	const char *end = s + tok->len;
+
+	// A leading zero is only allowed alone or before the base
+	u64 base = 10;
+	if (tok->len >= 2 && s[0] == '0') {
+		base = s[1] == 'b' ? 2 : s[1] == 'o' ? 8 : 16;
+		s += 2;
+	}
+
+	u64 value = 0;
+	for (; s < end; s += 1) {
+		if (*s == '_') {
+			continue;
+		}
+
+		u64 digit = hex_value((u8)*s);
+		if (value > (UINT64_MAX - digit) / base) {
+			return false;
+		}
+		value = value * base + digit;
+	}
+
+	tok->uval = value;
+	tok->flags |= TOK_DECODED;
+	*out = value;
+	return true;
+}
+
+bool tok_float_value(Token *tok, const Allocator *alloc, f64 *out) {
+	assert(tok->kind == TK_CCONST && tok->storage == TYPE_FLOAT);
+	if ((tok->flags & TOK_DECODED) != 0) {
+		*out = tok->fval;
+		return true;
+	}
+
+	// strtod() needs a NUL-terminated copy, without the separators
+	char small[64];
+	char *buf = small;
+	if (tok->len >= sizeof(small)) {
+		buf = alloc->alloc(alloc->ctx, tok->len + 1, MEM_LEX_BUFFER);
+		if (buf == NULL) {
+			errno = ENOMEM;
+			return false;
+		}
+	}
+
+	usize len = 0;
+	for (u32 i = 0; i < tok->len; i += 1) {
+		if (tok->text[i] != '_') {
+			buf[len] = tok->text[i];
+			len += 1;
+		}
+	}
+	buf[len] = '\0';
+
+	// Underflow also sets ERANGE, tiny values round to zero or a subnormal instead
+	errno = 0;
+	f64 value = strtod(buf, NULL);
+	bool ok = errno != ERANGE || (value != HUGE_VAL && value != -HUGE_VAL);
+	if (buf != small) {
+		alloc->free(alloc->ctx, buf, tok->len + 1);
+	}
+
+	if (!ok) {
+		errno = ERANGE;
+		return false;
+	}
+
+	tok->fval = value;
+	tok->flags |= TOK_DECODED;
+	*out = value;
+	return true;
+}
+
+const char *tok_string_value(Token *tok, const Allocator *alloc, usize *len) {
+	assert(tok->kind == TK_CCONST && tok->storage == TYPE_STRING);
+	if ((tok->flags & TOK_DECODED) != 0) {
+		*len = tok->str.len;
+		return tok->str.ptr;
+	}
+
+	// Without the quotes
+	const char *s = tok->text + 1;
+	const char *end = tok->text + tok->len - 1;
+
+	if ((tok->flags & TOK_ESCAPES) == 0) {
+		tok->str.ptr = s;
+		tok->str.len = (usize)(end - s);
+	} else {
+		// Escape sequences are never shorter than what they decode to
+		char *str = alloc->alloc(alloc->ctx, (usize)(end - s) + 1, MEM_LEX_STRING);
+		if (str == NULL) {
+			return NULL;
+		}
+
+		usize size = 0;
+		while (s < end) {
+			usize n;
+			s = decode_char(s, str + size, &n);
+			size += n;
+		}
+
+		tok->str.ptr = str;
+		tok->str.len = size;
+		tok->flags |= TOK_OWNED;
+	}
+
+	tok->flags |= TOK_DECODED;
+	*len = tok->str.len;
+	return tok->str.ptr;
+}
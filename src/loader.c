@@ -0,0 +1,484 @@
+#include "loader.h"
+
+#include "trace.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+	#include <linux/io_uring.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+#endif
+
+#define LOADER_CHUNK       16384 // Initial size of the buffers, most sources fit in it
+#define LOADER_THREADS_MAX 8     // Reads are I/O bound, more threads than cores is fine
+
+// Make room for size bytes and the NUL terminator in the buffer of the file
+static bool reserve_buffer(Loader *loader, u32 index, u64 size) {
+	LoaderBuffer *buffer = &loader->buffers[index % LOADER_DEPTH];
+	SourceFile *file = &loader->files[index];
+
+	if (size >= SIZE_MAX) {
+		file->error = EFBIG;
+		return false;
+	} else if (buffer->data == NULL) {
+		buffer->size = (usize)size + 1;
+		buffer->data = xcalloc(MEM_SOURCE, buffer->size, sizeof(char));
+	} else if (buffer->size <= size) {
+		buffer->size = (usize)size + 1;
+		buffer->data = xrealloc(MEM_SOURCE, buffer->data, buffer->size);
+	}
+
+	file->data = buffer->data;
+	return true;
+}
+
+#ifdef __linux__
+
+typedef struct LoaderRing {
+	int fd;
+
+	u32 *sqtail;
+	u32 sqmask;
+	u32 *sqarray;
+	struct io_uring_sqe *sqes;
+	u32 queued; // Entries written to the queue but not submitted
+
+	u32 *cqhead;
+	u32 *cqtail;
+	u32 cqmask;
+	struct io_uring_cqe *cqes;
+
+	void *sqmap;
+	usize sqmaplen;
+	void *cqmap; // NULL if the kernel maps both rings together
+	usize cqmaplen;
+	usize sqeslen;
+} LoaderRing;
+
+static inline u32 load_acquire(u32 *ptr) {
+	return atomic_load_explicit((_Atomic u32 *)ptr, memory_order_acquire);
+}
+
+static inline void store_release(u32 *ptr, u32 value) {
+	atomic_store_explicit((_Atomic u32 *)ptr, value, memory_order_release);
+}
+
+static bool ring_supports(int fd) {
+	usize size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = xcalloc(MEM_SOURCE, 1, size);
+
+	bool ok = syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	const u8 ops[] = { IORING_OP_OPENAT, IORING_OP_READ };
+	for (usize i = 0; ok && i < sizeof(ops); i += 1) {
+		ok = ops[i] <= probe->last_op
+		  && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) != 0;
+	}
+
+	xfree(probe);
+	if (!ok) {
+		return false;
+	}
+
+	// Files are opened into these slots, so they never go through the fd table
+	int fds[LOADER_DEPTH];
+	for (u32 i = 0; i < LOADER_DEPTH; i += 1) {
+		fds[i] = -1;
+	}
+	return syscall(SYS_io_uring_register, fd, IORING_REGISTER_FILES, fds, LOADER_DEPTH)
+	    == 0;
+}
+
+static void ring_free(LoaderRing *ring) {
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqeslen);
+	}
+	if (ring->cqmap != NULL) {
+		munmap(ring->cqmap, ring->cqmaplen);
+	}
+	if (ring->sqmap != NULL) {
+		munmap(ring->sqmap, ring->sqmaplen);
+	}
+
+	close(ring->fd); // Also closes the files left in the slots
+	xfree(ring);
+}
+
+// Returns NULL if io_uring or the operations used aren't available
+static LoaderRing *ring_init(void) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	// Every file has at most two operations in flight
+	int fd = (int)syscall(SYS_io_uring_setup, 2 * LOADER_DEPTH, &params);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	LoaderRing *ring = xcalloc(MEM_SOURCE, 1, sizeof(LoaderRing));
+	ring->fd = fd;
+
+	// Opening into a slot needs 5.15 and skipping completions 5.17, only the
+	// latter has a feature flag
+	if ((params.features & IORING_FEAT_CQE_SKIP) == 0 || !ring_supports(fd)) {
+		ring_free(ring);
+		return NULL;
+	}
+
+	ring->sqmaplen = params.sq_off.array + params.sq_entries * sizeof(u32);
+	ring->cqmaplen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single && ring->cqmaplen > ring->sqmaplen) {
+		ring->sqmaplen = ring->cqmaplen;
+	}
+
+	int prot = PROT_READ | PROT_WRITE;
+	int flags = MAP_SHARED | MAP_POPULATE;
+	void *sq = mmap(NULL, ring->sqmaplen, prot, flags, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		ring_free(ring);
+		return NULL;
+	}
+	ring->sqmap = sq;
+
+	void *cq = sq;
+	if (!single) {
+		cq = mmap(NULL, ring->cqmaplen, prot, flags, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			ring_free(ring);
+			return NULL;
+		}
+		ring->cqmap = cq;
+	}
+
+	ring->sqeslen = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(NULL, ring->sqeslen, prot, flags, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		ring_free(ring);
+		return NULL;
+	}
+	ring->sqes = sqes;
+
+	char *sqbase = sq;
+	ring->sqtail = (u32 *)(sqbase + params.sq_off.tail);
+	ring->sqmask = *(u32 *)(sqbase + params.sq_off.ring_mask);
+	ring->sqarray = (u32 *)(sqbase + params.sq_off.array);
+
+	char *cqbase = cq;
+	ring->cqhead = (u32 *)(cqbase + params.cq_off.head);
+	ring->cqtail = (u32 *)(cqbase + params.cq_off.tail);
+	ring->cqmask = *(u32 *)(cqbase + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cqbase + params.cq_off.cqes);
+
+	return ring;
+}
+
+// Get a zeroed submission entry, the queue never fills up since it has room
+// for all the operations that can be in flight
+static struct io_uring_sqe *ring_push(LoaderRing *ring, u32 index) {
+	u32 tail = *ring->sqtail + ring->queued;
+	u32 entry = tail & ring->sqmask;
+
+	struct io_uring_sqe *sqe = &ring->sqes[entry];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = index;
+
+	ring->sqarray[entry] = entry;
+	ring->queued += 1;
+	return sqe;
+}
+
+// Read from the end of the data read so far to the end of the buffer
+static void ring_read(Loader *loader, u32 index) {
+	const LoaderBuffer *buffer = &loader->buffers[index % LOADER_DEPTH];
+	const SourceFile *file = &loader->files[index];
+	usize room = buffer->size - 1 - file->len;
+
+	struct io_uring_sqe *sqe = ring_push(loader->ring, index);
+	sqe->opcode = IORING_OP_READ;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = (i32)(index % LOADER_DEPTH);
+	sqe->addr = (u64)(uintptr_t)(file->data + file->len);
+	sqe->len = (u32)(room < UINT32_MAX ? room : UINT32_MAX);
+	sqe->off = file->len;
+}
+
+// The open and the first read are linked so they are issued together, the
+// open only completes on failure and then the read is canceled
+static void ring_start(Loader *loader, u32 index) {
+	SourceFile *file = &loader->files[index];
+	reserve_buffer(loader, index, LOADER_CHUNK);
+
+	struct io_uring_sqe *open = ring_push(loader->ring, index);
+	open->opcode = IORING_OP_OPENAT;
+	open->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+	open->fd = AT_FDCWD;
+	open->addr = (u64)(uintptr_t)file->path;
+	open->open_flags = O_RDONLY; // The kernel rejects O_CLOEXEC for slots
+	open->file_index = index % LOADER_DEPTH + 1; // Replaces the previous file
+
+	ring_read(loader, index);
+}
+
+static void ring_complete(Loader *loader, const struct io_uring_cqe *cqe) {
+	u32 index = (u32)cqe->user_data;
+	SourceFile *file = &loader->files[index];
+	const LoaderBuffer *buffer = &loader->buffers[index % LOADER_DEPTH];
+
+	if (file->done || cqe->res == -ECANCELED) {
+		return; // The open failed, its own completion has the error
+	} else if (cqe->res < 0) {
+		file->error = -cqe->res;
+		file->data = NULL;
+		file->len = 0;
+		file->done = true;
+		return;
+	}
+
+	// Short reads of regular files only happen at the end
+	usize room = buffer->size - 1 - file->len;
+	file->len += (usize)cqe->res;
+	if ((usize)cqe->res == room) {
+		reserve_buffer(loader, index, (u64)buffer->size * 2);
+		ring_read(loader, index);
+		return;
+	}
+
+	file->data[file->len] = '\0';
+	file->done = true;
+}
+
+// Submit the queued operations, waiting for at least one completion if wait
+static void ring_enter(Loader *loader, bool wait) {
+	LoaderRing *ring = loader->ring;
+	store_release(ring->sqtail, *ring->sqtail + ring->queued);
+
+	u32 submit = ring->queued;
+	ring->queued = 0;
+	if (submit == 0 && !wait) {
+		return;
+	}
+
+	u32 flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	while (syscall(SYS_io_uring_enter, ring->fd, submit, wait ? 1 : 0, flags, NULL, 0)
+	       < 0) {
+		if (errno != EINTR) {
+			log_fatal("io_uring_enter failed: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		submit = 0; // Interrupted while waiting, the entries were consumed
+	}
+
+	u32 head = *ring->cqhead;
+	u32 tail = load_acquire(ring->cqtail);
+	for (; head != tail; head += 1) {
+		struct io_uring_cqe cqe = ring->cqes[head & ring->cqmask];
+		store_release(ring->cqhead, head + 1); // Completions may queue more reads
+		ring_complete(loader, &cqe);
+	}
+}
+
+#endif
+
+static void read_file(Loader *loader, u32 index) {
+	SourceFile *file = &loader->files[index];
+	int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		file->error = errno;
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		file->error = errno;
+	} else if (reserve_buffer(loader, index, (u64)st.st_size)) {
+		usize size = (usize)st.st_size;
+		while (file->len < size) {
+			ssize_t n = pread(
+				fd, file->data + file->len, size - file->len, (off_t)file->len
+			);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			} else if (n < 0) {
+				file->error = errno;
+				break;
+			} else if (n == 0) {
+				break; // Truncated meanwhile
+			}
+			file->len += (usize)n;
+		}
+		file->data[file->len] = '\0';
+	}
+	close(fd);
+
+	if (file->error != 0) {
+		file->data = NULL;
+		file->len = 0;
+	}
+}
+
+static void *load_worker(void *arg) {
+	Loader *loader = arg;
+	trace_thread_name("loader");
+
+	pthread_mutex_lock(&loader->lock);
+	for (;;) {
+		while (!loader->stop && loader->next >= loader->limit) {
+			pthread_cond_wait(&loader->changed, &loader->lock);
+		}
+		if (loader->stop) {
+			break;
+		}
+
+		u32 index = loader->next;
+		loader->next += 1;
+		pthread_mutex_unlock(&loader->lock);
+
+		TRACE_BEGIN_DETAIL("load", loader->files[index].path);
+		read_file(loader, index);
+		TRACE_END("load");
+
+		pthread_mutex_lock(&loader->lock);
+		loader->files[index].done = true;
+		pthread_cond_broadcast(&loader->changed);
+	}
+	pthread_mutex_unlock(&loader->lock);
+
+	return NULL;
+}
+
+static void threads_init(Loader *loader) {
+	loader->backend = LOADER_THREADS;
+	pthread_mutex_init(&loader->lock, NULL);
+	pthread_cond_init(&loader->changed, NULL);
+
+	u32 count = loader->count < LOADER_THREADS_MAX ? loader->count : LOADER_THREADS_MAX;
+	loader->threads = xcalloc(MEM_SOURCE, count + 1, sizeof(pthread_t));
+	while (loader->threadlen < count) {
+		if (pthread_create(&loader->threads[loader->threadlen], NULL, load_worker, loader)
+		    != 0) {
+			break;
+		}
+		loader->threadlen += 1;
+	}
+}
+
+void loader_init(Loader *loader, const char *const *paths, u32 count, bool uring) {
+	memset(loader, 0, sizeof(Loader));
+	loader->count = count;
+	loader->limit = count < LOADER_DEPTH ? count : LOADER_DEPTH;
+
+	loader->files = xcalloc(MEM_SOURCE, count + 1, sizeof(SourceFile));
+	for (u32 i = 0; i < count; i += 1) {
+		loader->files[i].path = paths[i];
+	}
+
+#ifdef __linux__
+	loader->ring = uring ? ring_init() : NULL;
+	if (loader->ring != NULL) {
+		loader->backend = LOADER_URING;
+		return;
+	}
+#else
+	(void)uring;
+#endif
+
+	threads_init(loader);
+}
+
+void loader_free(Loader *loader) {
+	if (loader->backend == LOADER_THREADS) {
+		pthread_mutex_lock(&loader->lock);
+		loader->stop = true;
+		pthread_cond_broadcast(&loader->changed);
+		pthread_mutex_unlock(&loader->lock);
+
+		for (u32 i = 0; i < loader->threadlen; i += 1) {
+			pthread_join(loader->threads[i], NULL);
+		}
+		xfree(loader->threads);
+		pthread_mutex_destroy(&loader->lock);
+		pthread_cond_destroy(&loader->changed);
+	}
+
+#ifdef __linux__
+	if (loader->ring != NULL) {
+		// Wait for the reads in flight, the kernel writes to the buffers
+		for (u32 i = 0; i < loader->next; i += 1) {
+			while (!loader->files[i].done) {
+				ring_enter(loader, true);
+			}
+		}
+		ring_free(loader->ring);
+	}
+#endif
+
+	for (u32 i = 0; i < LOADER_DEPTH; i += 1) {
+		xfree(loader->buffers[i].data);
+	}
+	xfree(loader->files);
+	memset(loader, 0, sizeof(Loader));
+}
+
+const SourceFile *loader_get(Loader *loader, u32 index) {
+	SourceFile *file = &loader->files[index];
+
+#ifdef __linux__
+	if (loader->ring != NULL) {
+		// Refill the window in batches, so a system call starts many files
+		if (loader->next <= index + LOADER_DEPTH / 2) {
+			TRACE_BEGIN("load_submit");
+			while (loader->next < loader->limit) {
+				ring_start(loader, loader->next);
+				loader->next += 1;
+			}
+			ring_enter(loader, false);
+			TRACE_END("load_submit");
+		}
+
+		if (!file->done) {
+			TRACE_BEGIN_DETAIL("load_wait", file->path);
+			while (!file->done) {
+				ring_enter(loader, true);
+			}
+			TRACE_END("load_wait");
+		}
+		return file;
+	}
+#endif
+
+	pthread_mutex_lock(&loader->lock);
+	if (!file->done && loader->threadlen == 0) {
+		// No thread could be started, load it here
+		loader->next = index + 1;
+		read_file(loader, index);
+		file->done = true;
+	}
+	while (!file->done) {
+		pthread_cond_wait(&loader->changed, &loader->lock);
+	}
+	pthread_mutex_unlock(&loader->lock);
+
+	return file;
+}
+
+void loader_release(Loader *loader, u32 index) {
+	// Its buffer can be used by the file LOADER_DEPTH after it
+	u32 limit = loader->count - index - 1 < LOADER_DEPTH ? loader->count
+	                                                     : index + 1 + LOADER_DEPTH;
+
+	if (loader->backend == LOADER_THREADS) {
+		pthread_mutex_lock(&loader->lock);
+		loader->limit = limit;
+		pthread_cond_broadcast(&loader->changed);
+		pthread_mutex_unlock(&loader->lock);
+	} else {
+		loader->limit = limit;
+	}
+}
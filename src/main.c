@@ -1,69 +1,613 @@
+#include "ast.h"
+#include "compile.h"
+#include "consteval.h"
+#include "deps.h"
+#include "emitc.h"
+#include "iface.h"
+#include "index.h"
+#include "jit.h"
 #include "lex.h"
+#include "loader.h"
+#include "memstats.h"
+#include "opt.h"
+#include "parse.h"
+#include "perf.h"
+#include "resolve.h"
+#include "server.h"
+#include "trace.h"
 #include "utf8.h"
 #include "util.h"
+#include "vm.h"
+#include "watch.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-int main(int argc, char *argv[]) {
-	if (argc != 2) {
-		log_fatal("Usage: %s <file.ax>", argv[0]);
-		return EXIT_FAILURE;
-	}
-
-	// Enforce extension
-	const char *ext = strrchr(argv[1], '.');
-	if (ext == NULL || (strcmp(ext, ".ax") != 0 && strcmp(ext, ".AX") != 0)) {
-		log_fatal(
-			"Unknown extension found in file: %s! Valid extensions are: .ax .AX", argv[1]
-		);
-		return EXIT_FAILURE;
-	}
+typedef enum Mode {
+	MODE_PARSE,    // Parse file and report syntax errors
+	MODE_TOKENS,   // Print all tokens
+	MODE_AST,      // Print the syntax tree
+	MODE_DEPS,     // Print the package dependency graph of all files
+	MODE_RUN,      // Compile to bytecode and run main
+	MODE_BYTECODE, // Print the disassembled bytecode
+	MODE_IR,       // Print the optimized SSA form of each function
+	MODE_EMIT_C,   // Translate to C source
+	MODE_SERVE,    // Answer requests on a socket from a cache
+	MODE_INDEX,    // Build the symbol index of all files
+	MODE_LOOKUP,   // Look names up in a symbol index
+	MODE_WATCH,    // Check the files of a directory as they change
+	MODE_IFACE,    // Build the interface of the package of all files
+} Mode;
 
-	FILE *file = xfopen(argv[1], "rb");
+// Settings of the compilation of a single file
+typedef struct Options {
+	Mode mode;
+	const char *out_path; // Where MODE_EMIT_C writes, stdout if NULL
+	const char *socket;   // Where MODE_SERVE listens
+	const char *index;    // Index MODE_INDEX writes and MODE_LOOKUP reads
+	const char *iface;    // Interface MODE_IFACE writes
+	const char *packages; // Directory of the interfaces of used packages
+	u32 jobs;             // Threads used by the parser
+	bool pipeline;        // Lex on another thread while parsing
+	PassManager passes;   // Optimizations enabled for the bytecode
+	bool pass_stats;      // Print what the optimizations did
+	u32 jit;              // Threshold of the JIT, VM_JIT_OFF to only interpret
+} Options;
 
-	LexState lex = { 0 };
-	lex_init(&lex, file);
+#define TRACE_BATCH 1024 // Tokens per "lex_scan" trace event
 
+static void dump_tokens(LexState *lex) {
 	Token tok = { 0 };
-	while (lex_scan(&lex, &tok) != TK_EOF) {
+	usize count = 0;
+
+	TRACE_BEGIN("lex_scan");
+	while (lex_scan(lex, &tok) != TK_EOF) {
+		count += 1;
+		if (count % TRACE_BATCH == 0) {
+			TRACE_END("lex_scan");
+			TRACE_BEGIN("lex_scan");
+		}
+
+		Location loc = source_decode(lex->sources, tok.loc, NULL);
 		if (tok.kind <= TK_LAST_OPERATOR) {
-			log_debug(
-				"%d:%d -> %s", tok.loc.lineno, tok.loc.colno, lex_tok2str(tok.kind)
-			);
+			log_debug("%d:%d -> %s", loc.lineno, loc.colno, lex_tok2str(tok.kind));
 		}
 
 		if (tok.kind == TK_IDENTIFIER && tok.ident != NULL) {
-			log_debug("%d:%d -> %s", tok.loc.lineno, tok.loc.colno, tok.ident);
-			free(tok.ident);
-			tok.ident = NULL;
+			log_debug("%d:%d -> %s", loc.lineno, loc.colno, tok.ident);
+			lex_release(lex, &tok);
 		}
 
 		if (tok.kind == TK_CCONST) {
 			switch (tok.storage) {
-			case TYPE_FLOAT:
-				log_debug("%d:%d -> %f", tok.loc.lineno, tok.loc.colno, tok.fval);
-				break;
-			case TYPE_INT:
-				log_debug("%d:%d -> %d", tok.loc.lineno, tok.loc.colno, tok.uval);
-				break;
-			case TYPE_STRING:
-				if (tok.str.ptr != NULL) {
-					log_debug("%d:%d -> %s", tok.loc.lineno, tok.loc.colno, tok.str.ptr);
-					free(tok.str.ptr);
-					tok.str.ptr = NULL;
+			case TYPE_FLOAT: {
+				f64 value;
+				if (tok_float_value(&tok, &lex->alloc, &value)) {
+					log_debug("%d:%d -> %f", loc.lineno, loc.colno, value);
 				}
-				break;
+			} break;
+			case TYPE_INT: {
+				u64 value;
+				if (tok_int_value(&tok, &value)) {
+					log_debug(
+						"%d:%d -> %llu", loc.lineno, loc.colno, (unsigned long long)value
+					);
+				}
+			} break;
+			case TYPE_STRING: {
+				usize len;
+				const char *str = tok_string_value(&tok, &lex->alloc, &len);
+				if (str != NULL) {
+					log_debug("%d:%d -> %.*s", loc.lineno, loc.colno, (int)len, str);
+				}
+				lex_release(lex, &tok);
+			} break;
 			case TYPE_RUNE:
-				log_debug("%d:%d -> %c", tok.loc.lineno, tok.loc.colno, tok.rune);
+				log_debug("%d:%d -> %c", loc.lineno, loc.colno, tok.rune);
 				break;
 			default:
 				break;
 			}
 		}
 	}
+	TRACE_END("lex_scan");
+}
+
+static bool check_extension(const char *path) {
+	const char *ext = strrchr(path, '.');
+	if (ext == NULL || (strcmp(ext, ".ax") != 0 && strcmp(ext, ".AX") != 0)) {
+		log_fatal(
+			"Unknown extension found in file: %s! Valid extensions are: .ax .AX", path
+		);
+		return false;
+	}
+
+	return true;
+}
+
+static int run_deps(SourceManager *sources, char **paths, int count) {
+	DepsGraph graph;
+	deps_init(&graph);
+
+	bool ok = true;
+	const char **valid = xcalloc(MEM_MISC, (usize)count + 1, sizeof(const char *));
+	u32 validlen = 0;
+	for (int i = 0; i < count; i += 1) {
+		if (check_extension(paths[i])) {
+			valid[validlen] = paths[i];
+			validlen += 1;
+		} else {
+			ok = false;
+		}
+	}
+
+	// Files are read ahead while the previous ones are lexed
+	Loader loader;
+	loader_init(&loader, valid, validlen, true);
+	log_debug(
+		"Loading sources with %s", loader.backend == LOADER_URING ? "io_uring" : "threads"
+	);
+
+	for (u32 i = 0; i < validlen; i += 1) {
+		const SourceFile *file = loader_get(&loader, i);
+		if (file->data == NULL) {
+			log_error("Failed to open file: %s: %s", file->path, strerror(file->error));
+			ok = false;
+		} else {
+			// The buffer stays the loader's, it's only borrowed while scanning
+			u32 id = source_add(sources, file->path, file->data, file->len, false);
+			if (id == 0) {
+				log_error("Failed to add file: %s: %s", file->path, strerror(errno));
+				ok = false;
+			} else {
+				ok = deps_scan_source(&graph, sources, id) && ok;
+				source_remove(sources, id);
+			}
+		}
+		loader_release(&loader, i);
+	}
+
+	loader_free(&loader);
+	xfree(valid);
+
+	TRACE_BEGIN("deps_sort");
+	u32 *order = xcalloc(MEM_MISC, graph.nodelen + 1, sizeof(u32));
+	ok = ok && deps_sort(&graph, order);
+	TRACE_END("deps_sort");
+
+	if (ok) {
+		deps_print(&graph, order, stdout);
+	}
+
+	xfree(order);
+	deps_free(&graph);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static bool run_bytecode(
+	const Ast *ast, const NodeIndex *decls, TypeTable *types, const ConstEval *consts,
+	const char *path, const Options *opts
+) {
+	Program prog;
+	program_init(&prog);
+	PassManager passes = opts->passes;
+	if (opts->mode == MODE_IR) {
+		passes.dump = stdout;
+	}
+
+	TRACE_BEGIN("compile");
+	bool ok = compile_unit(&prog, ast, decls, types, consts, path, &passes);
+	TRACE_END("compile");
+
+	if (opts->pass_stats) {
+		opt_print_stats(&passes, stderr);
+	}
+
+	if (ok && opts->mode == MODE_BYTECODE) {
+		program_dump(&prog, stdout);
+	} else if (ok && opts->mode == MODE_RUN) {
+		TRACE_BEGIN("vm_run");
+		ok = vm_run(&prog, stdout, opts->jit) == 0;
+		TRACE_END("vm_run");
+	}
+
+	log_debug("%u instructions, %u constants", prog.codelen, prog.constlen);
+	program_free(&prog);
+	return ok;
+}
+
+// Write the C translation of the unit to out_path, or stdout if it's NULL
+static bool emit_c(
+	const Ast *ast, const NodeIndex *decls, TypeTable *types, const ConstEval *consts,
+	const char *path, const char *out_path
+) {
+	FILE *out = out_path != NULL ? xfopen(out_path, "w") : stdout;
+
+	TRACE_BEGIN("emit_c");
+	bool ok = emitc_unit(ast, decls, types, consts, path, out);
+	TRACE_END("emit_c");
+
+	if (out != stdout) {
+		ok = fclose(out) == 0 && ok;
+	}
+	return ok;
+}
+
+// Number of threads available to the process
+static u32 cpu_count(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count < 1 ? 1 : (u32)count;
+}
+
+// Counters are sampled around the lexing phase when perf isn't NULL
+static int run_file(
+	SourceManager *sources, const char *path, const Options *opts, PerfCounters *perf
+) {
+	Mode mode = opts->mode;
+
+	// Enforce extension
+	if (!check_extension(path)) {
+		return EXIT_FAILURE;
+	}
+
+	TRACE_BEGIN_DETAIL("source_load", path);
+	u32 file = source_load(sources, path);
+	TRACE_END("source_load");
+
+	if (file == 0) {
+		log_fatal("Failed to open file: %s: %s", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	usize bytes;
+	source_data(sources, file, &bytes);
+
+	TRACE_BEGIN("lex_init");
+	LexState lex = { 0 };
+	bool ok = lex_init(&lex, sources, file, NULL);
+	TRACE_END("lex_init");
+
+	if (!ok) {
+		log_fatal("Failed to initialize lexer!");
+		return EXIT_FAILURE;
+	}
+
+	if (perf != NULL) {
+		perf_start(perf);
+	}
+
+	if (mode == MODE_TOKENS) {
+		dump_tokens(&lex);
+
+		if (perf != NULL) {
+			perf_stop(perf);
+		}
+	} else {
+		Ast ast;
+		ast_init(&ast, sources);
+
+		// Lexing is done on demand by the parser, so it's part of this event
+		TRACE_BEGIN("parse");
+		if (opts->pipeline) {
+			parse_unit_pipelined(&lex, &ast);
+		} else {
+			parse_unit_parallel(&lex, &ast, opts->jobs);
+		}
+		TRACE_END("parse");
+
+		if (perf != NULL) {
+			perf_stop(perf);
+		}
+
+		TRACE_BEGIN("resolve");
+		NodeIndex *decls = xcalloc(MEM_SYMBOLS, ast.nodelen, sizeof(NodeIndex));
+		ok = resolve_unit(&ast, path, decls);
+		TRACE_END("resolve");
+
+		if (ok && opts->packages != NULL) {
+			ok = iface_check_uses(&ast, path, opts->packages);
+		}
+
+		if (ok) {
+			TRACE_BEGIN("consteval");
+			TypeTable types;
+			typetab_init(&types);
+			ConstEval consts;
+			consteval_init(&consts, &ast, decls, &types, path);
+			ok = consteval_unit(&consts);
+			log_debug("%u constants", consts.valuelen - 1);
+			TRACE_END("consteval");
+
+			if (ok && (mode == MODE_RUN || mode == MODE_BYTECODE || mode == MODE_IR)) {
+				ok = run_bytecode(&ast, decls, &types, &consts, path, opts);
+			} else if (ok && mode == MODE_EMIT_C) {
+				ok = emit_c(&ast, decls, &types, &consts, path, opts->out_path);
+			}
+			consteval_free(&consts);
+			typetab_free(&types);
+		}
+		xfree(decls);
+
+		if (mode == MODE_AST) {
+			ast_dump(&ast, 0, stdout);
+		}
+
+		log_debug(
+			"%u nodes, %u extra, %u names", ast.nodelen, ast.extralen, ast.names.count
+		);
+		ast_free(&ast);
+	}
+
+	if (perf != NULL) {
+		perf_report(perf, mode == MODE_TOKENS ? "lex" : "lex+parse", bytes, stderr);
+	}
 
+	TRACE_BEGIN("lex_close");
 	lex_close(&lex);
-	return EXIT_SUCCESS;
+	TRACE_END("lex_close");
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int run_index(const char *index, char **paths, int count) {
+	bool ok = true;
+	const char **valid = xcalloc(MEM_MISC, (usize)count + 1, sizeof(const char *));
+	u32 validlen = 0;
+	for (int i = 0; i < count; i += 1) {
+		if (check_extension(paths[i])) {
+			valid[validlen] = paths[i];
+			validlen += 1;
+		} else {
+			ok = false;
+		}
+	}
+
+	TRACE_BEGIN("index_build");
+	ok = index_build(index, valid, validlen) && ok;
+	TRACE_END("index_build");
+
+	xfree(valid);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int run_iface(const char *iface, char **paths, int count) {
+	bool ok = true;
+	for (int i = 0; i < count; i += 1) {
+		ok = check_extension(paths[i]) && ok;
+	}
+
+	if (ok) {
+		TRACE_BEGIN("iface_build");
+		TypeTable types;
+		typetab_init(&types);
+		ok = iface_build(iface, (const char *const *)paths, (u32)count, &types);
+		typetab_free(&types);
+		TRACE_END("iface_build");
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int run_lookup(const char *path, char **names, int count) {
+	Index index;
+	if (!index_open(&index, path)) {
+		log_error("Failed to open index: %s", path);
+		return EXIT_FAILURE;
+	}
+
+	bool ok = true;
+	for (int i = 0; i < count; i += 1) {
+		if (!index_lookup(&index, names[i], stdout)) {
+			log_error("Not found: %s", names[i]);
+			ok = false;
+		}
+	}
+
+	index_close(&index);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+	Options opts = { .mode = MODE_PARSE, .jit = VM_JIT_OFF };
+	opt_init(&opts.passes);
+	bool mem_stats = false;
+	bool perf_stats = false;
+	bool passes = false;
+	const char *trace_path = NULL;
+	int bad = 0; // Index of an unknown option or bad value
+
+	// Accounting has to see every block, so it starts before the first one
+	for (int i = 1; i < argc && !mem_stats; i += 1) {
+		mem_stats = strcmp(argv[i], "--mem-stats") == 0;
+	}
+	static MemStats stats; // Outlives main() in case memory is freed at exit
+	if (mem_stats) {
+		Allocator counting = mem_stats_allocator(&stats);
+		mem_set_allocator(&counting);
+	}
+
+	char **paths = xcalloc(MEM_MISC, argc, sizeof(char *));
+	int pathlen = 0;
+
+	for (int i = 1; i < argc; i += 1) {
+		if (strcmp(argv[i], "--tokens") == 0) {
+			opts.mode = MODE_TOKENS;
+		} else if (strcmp(argv[i], "--ast") == 0) {
+			opts.mode = MODE_AST;
+		} else if (strcmp(argv[i], "--run") == 0) {
+			opts.mode = MODE_RUN;
+		} else if (strcmp(argv[i], "--bytecode") == 0) {
+			opts.mode = MODE_BYTECODE;
+		} else if (strcmp(argv[i], "--ir") == 0) {
+			opts.mode = MODE_IR;
+		} else if (strcmp(argv[i], "--emit-c") == 0) {
+			opts.mode = MODE_EMIT_C;
+		} else if (strncmp(argv[i], "--emit-c=", 9) == 0 && argv[i][9] != '\0') {
+			opts.mode = MODE_EMIT_C;
+			opts.out_path = argv[i] + 9;
+		} else if (strncmp(argv[i], "--serve=", 8) == 0 && argv[i][8] != '\0') {
+			opts.mode = MODE_SERVE;
+			opts.socket = argv[i] + 8;
+		} else if (strncmp(argv[i], "--index=", 8) == 0 && argv[i][8] != '\0') {
+			opts.mode = MODE_INDEX;
+			opts.index = argv[i] + 8;
+		} else if (strncmp(argv[i], "--lookup=", 9) == 0 && argv[i][9] != '\0') {
+			opts.mode = MODE_LOOKUP;
+			opts.index = argv[i] + 9;
+		} else if (strncmp(argv[i], "--iface=", 8) == 0 && argv[i][8] != '\0') {
+			opts.mode = MODE_IFACE;
+			opts.iface = argv[i] + 8;
+		} else if (strncmp(argv[i], "--packages=", 11) == 0 && argv[i][11] != '\0') {
+			opts.packages = argv[i] + 11;
+		} else if (strcmp(argv[i], "--watch") == 0) {
+			opts.mode = MODE_WATCH;
+		} else if (strcmp(argv[i], "--deps") == 0) {
+			opts.mode = MODE_DEPS;
+		} else if (strncmp(argv[i], "--jobs=", 7) == 0 && argv[i][7] != '\0') {
+			char *end;
+			unsigned long jobs = strtoul(argv[i] + 7, &end, 10);
+			if (*end != '\0' || jobs == 0 || jobs > UINT16_MAX) {
+				bad = i;
+				break;
+			}
+			opts.jobs = (u32)jobs;
+		} else if (strncmp(argv[i], "--passes=", 9) == 0) {
+			passes = true;
+			if (!opt_parse(&opts.passes, argv[i] + 9)) {
+				bad = i;
+				break;
+			}
+		} else if (strcmp(argv[i], "--pass-stats") == 0) {
+			opts.pass_stats = true;
+		} else if (strcmp(argv[i], "--jit") == 0) {
+			opts.jit = JIT_THRESHOLD;
+		} else if (strncmp(argv[i], "--jit=", 6) == 0 && argv[i][6] != '\0') {
+			char *end;
+			unsigned long threshold = strtoul(argv[i] + 6, &end, 10);
+			if (*end != '\0' || threshold >= VM_JIT_OFF) {
+				bad = i;
+				break;
+			}
+			opts.jit = (u32)threshold;
+		} else if (strcmp(argv[i], "--pipeline") == 0) {
+			opts.pipeline = true;
+		} else if (strcmp(argv[i], "--mem-stats") == 0) {
+			continue; // Enabled above
+		} else if (strcmp(argv[i], "--perf") == 0) {
+			perf_stats = true;
+		} else if (strncmp(argv[i], "--trace=", 8) == 0 && argv[i][8] != '\0') {
+			trace_path = argv[i] + 8;
+		} else if (argv[i][0] != '-') {
+			paths[pathlen] = argv[i];
+			pathlen += 1;
+		} else {
+			bad = i;
+			break;
+		}
+	}
+
+	Mode mode = opts.mode;
+	bool list = mode == MODE_DEPS || mode == MODE_INDEX || mode == MODE_LOOKUP
+	         || mode == MODE_IFACE; // Modes taking any number of files or names
+	bool usage = false;
+	if (bad != 0) {
+		log_error("Unknown option or bad value: %s", argv[bad]);
+		usage = true;
+	} else if (mode == MODE_SERVE && pathlen != 0) {
+		log_error("--serve doesn't take files");
+		usage = true;
+	} else if (list && pathlen == 0) {
+		log_error("No file or name given");
+		usage = true;
+	} else if (!list && mode != MODE_SERVE && pathlen != 1) {
+		log_error("Expected a single file or directory");
+		usage = true;
+	} else if (perf_stats && (list || mode == MODE_SERVE || mode == MODE_WATCH)) {
+		log_error("--perf only works when compiling a single file");
+		usage = true;
+	} else if (opts.jit != VM_JIT_OFF && mode != MODE_RUN) {
+		log_error("--jit only works with --run");
+		usage = true;
+	} else if ((passes || opts.pass_stats) && mode != MODE_RUN && mode != MODE_IR) {
+		log_error("--passes and --pass-stats only work with --run or --ir");
+		usage = true;
+	}
+
+	if (usage) {
+		log_fatal(
+			"Usage: %s [options] [--tokens | --ast | --run | --bytecode | --ir | "
+			"--emit-c[=<out.c>]] <file.ax>",
+			argv[0]
+		);
+		log_fatal("       %s [options] --deps <file.ax>...", argv[0]);
+		log_fatal("       %s [options] --serve=<socket>", argv[0]);
+		log_fatal("       %s [options] --watch <dir>", argv[0]);
+		log_fatal("       %s [options] --index=<out.idx> <file.ax>...", argv[0]);
+		log_fatal("       %s [options] --lookup=<file.idx> <name>...", argv[0]);
+		log_fatal("       %s [options] --iface=<out.axi> <file.ax>...", argv[0]);
+		log_fatal(
+			"Options: --mem-stats --trace=<out.json> --jobs=<n> --pipeline "
+			"--perf (only to compile a single file)"
+		);
+		log_fatal(
+			"         --passes=<fold,cse,licm,dce | none> --pass-stats "
+			"(with --run or --ir)"
+		);
+		log_fatal("         --packages=<dir> (interfaces of the packages used)");
+		log_fatal("         --jit[=<calls or loop iterations>] (with --run)");
+		xfree(paths);
+		return EXIT_FAILURE;
+	}
+
+	// Counters only measure the calling thread, so the parser doesn't use others
+	if (opts.jobs == 0) {
+		opts.jobs = perf_stats ? 1 : cpu_count();
+	}
+	opts.pipeline = opts.pipeline && !perf_stats;
+
+	if (trace_path != NULL) {
+		trace_enable();
+		trace_thread_name("main");
+	}
+
+	SourceManager sources;
+	source_init(&sources, NULL);
+
+	int status;
+	if (mode == MODE_DEPS) {
+		status = run_deps(&sources, paths, pathlen);
+	} else if (mode == MODE_SERVE) {
+		status = server_run(opts.socket);
+	} else if (mode == MODE_WATCH) {
+		status = watch_run(paths[0]);
+	} else if (mode == MODE_INDEX) {
+		status = run_index(opts.index, paths, pathlen);
+	} else if (mode == MODE_LOOKUP) {
+		status = run_lookup(opts.index, paths, pathlen);
+	} else if (mode == MODE_IFACE) {
+		status = run_iface(opts.iface, paths, pathlen);
+	} else if (perf_stats) {
+		PerfCounters perf;
+		if (!perf_open(&perf)) {
+			log_warn("Hardware counters unavailable, reporting time only");
+		}
+		status = run_file(&sources, paths[0], &opts, &perf);
+		perf_close(&perf);
+	} else {
+		status = run_file(&sources, paths[0], &opts, NULL);
+	}
+	xfree(paths);
+
+	if (trace_path != NULL && !trace_write(trace_path)) {
+		status = EXIT_FAILURE;
+	}
+
+	source_free(&sources);
+	if (mem_stats) {
+		mem_stats_print(&stats, stderr);
+	}
+
+	return status;
 }
@@ -0,0 +1,187 @@
+#include "memstats.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Stored before every block, keeps the returned memory aligned to max_align_t
+typedef union MemHeader {
+	struct {
+		size_t size;
+		MemTag tag;
+	};
+	max_align_t align;
+} MemHeader;
+
+static const char *tag_names[] = {
+	[MEM_MISC] = "misc",
+	[MEM_LEX_BUFFER] = "lex buffer",
+	[MEM_LEX_IDENT] = "identifiers",
+	[MEM_LEX_STRING] = "strings",
+	[MEM_INTERN] = "intern",
+	[MEM_AST] = "ast",
+	[MEM_PARSE] = "parse",
+	[MEM_DEPS] = "deps",
+	[MEM_TRACE] = "trace",
+	[MEM_TYPES] = "types",
+	[MEM_SYMBOLS] = "symbols",
+	[MEM_CONSTS] = "consts",
+	[MEM_VM] = "vm",
+	[MEM_EMIT] = "emit",
+	[MEM_SOURCE] = "sources",
+	[MEM_CACHE] = "cache",
+	[MEM_SERVER] = "server",
+	[MEM_INDEX] = "index",
+	[MEM_IR] = "ir",
+	[MEM_IFACE] = "iface",
+	[MEM_JIT] = "jit",
+};
+
+_Static_assert(
+	sizeof(tag_names) / sizeof(const char *) == MEM_TAG_COUNT,
+	"Tag names array doesn't have the same size of MemTag Enum."
+);
+
+static void update_peak(MemCounters *counters, size_t live) {
+	size_t peak = atomic_load_explicit(&counters->peak, memory_order_relaxed);
+	while (live > peak) {
+		if (atomic_compare_exchange_weak_explicit(
+				&counters->peak, &peak, live, memory_order_relaxed, memory_order_relaxed
+			)) {
+			break;
+		}
+	}
+}
+
+static void counters_add(MemCounters *counters, size_t size, bool realloc) {
+	size_t bucket = 0;
+	while (bucket < MEM_BUCKETS - 1 && ((size_t)16 << bucket) < size) {
+		bucket += 1;
+	}
+
+	atomic_fetch_add_explicit(&counters->histogram[bucket], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&counters->total, size, memory_order_relaxed);
+	atomic_fetch_add_explicit(
+		realloc ? &counters->reallocs : &counters->allocs, 1, memory_order_relaxed
+	);
+
+	size_t live = atomic_fetch_add_explicit(&counters->live, size, memory_order_relaxed);
+	update_peak(counters, live + size);
+}
+
+static void counters_sub(MemCounters *counters, size_t size, bool free) {
+	atomic_fetch_sub_explicit(&counters->live, size, memory_order_relaxed);
+	if (free) {
+		atomic_fetch_add_explicit(&counters->frees, 1, memory_order_relaxed);
+	}
+}
+
+static void *counted_alloc(void *ctx, size_t size, MemTag tag) {
+	MemStats *stats = ctx;
+	if (size > SIZE_MAX - sizeof(MemHeader)) {
+		return NULL;
+	}
+
+	MemHeader *header = calloc(1, sizeof(MemHeader) + size);
+	if (header == NULL) {
+		return NULL;
+	}
+
+	header->size = size;
+	header->tag = tag;
+	counters_add(&stats->tags[tag], size, false);
+	counters_add(&stats->all, size, false);
+	return header + 1;
+}
+
+// The sizes come from the header, mem_realloc() and mem_free() don't know them
+static void *counted_realloc(void *ctx, void *ptr, size_t oldsize, size_t newsize) {
+	MemStats *stats = ctx;
+	(void)oldsize;
+	if (ptr == NULL) {
+		return counted_alloc(ctx, newsize, MEM_MISC);
+	} else if (newsize > SIZE_MAX - sizeof(MemHeader)) {
+		return NULL;
+	}
+
+	MemHeader *header = (MemHeader *)ptr - 1;
+	size_t size = header->size;
+
+	header = realloc(header, sizeof(MemHeader) + newsize);
+	if (header == NULL) {
+		return NULL;
+	}
+	header->size = newsize;
+
+	counters_sub(&stats->tags[header->tag], size, false);
+	counters_sub(&stats->all, size, false);
+	counters_add(&stats->tags[header->tag], newsize, true);
+	counters_add(&stats->all, newsize, true);
+	return header + 1;
+}
+
+static void counted_free(void *ctx, void *ptr, size_t size) {
+	MemStats *stats = ctx;
+	(void)size;
+	if (ptr == NULL) {
+		return;
+	}
+
+	MemHeader *header = (MemHeader *)ptr - 1;
+	counters_sub(&stats->tags[header->tag], header->size, true);
+	counters_sub(&stats->all, header->size, true);
+	free(header);
+}
+
+Allocator mem_stats_allocator(MemStats *stats) {
+	return (Allocator) {
+		.alloc = counted_alloc,
+		.realloc = counted_realloc,
+		.free = counted_free,
+		.ctx = stats,
+	};
+}
+
+static void print_counters(FILE *out, const char *name, const MemCounters *counters) {
+	fprintf(
+		out, "%-12s %10zu %10zu %10zu %8zu %8zu %8zu\n", name,
+		atomic_load(&counters->live), atomic_load(&counters->peak),
+		atomic_load(&counters->total), atomic_load(&counters->allocs),
+		atomic_load(&counters->reallocs), atomic_load(&counters->frees)
+	);
+}
+
+void mem_stats_print(const MemStats *stats, FILE *out) {
+	fprintf(
+		out, "%-12s %10s %10s %10s %8s %8s %8s\n", "tag", "live", "peak", "total",
+		"allocs", "reallocs", "frees"
+	);
+
+	for (size_t i = 0; i < MEM_TAG_COUNT; i += 1) {
+		if (atomic_load(&stats->tags[i].allocs) > 0) {
+			print_counters(out, tag_names[i], &stats->tags[i]);
+		}
+	}
+	print_counters(out, "all", &stats->all);
+
+	fprintf(out, "\nsize histogram (bytes <= bucket: count)\n");
+	for (size_t i = 0; i < MEM_TAG_COUNT; i += 1) {
+		if (atomic_load(&stats->tags[i].allocs) == 0) {
+			continue;
+		}
+
+		fprintf(out, "%-12s", tag_names[i]);
+		for (size_t j = 0; j < MEM_BUCKETS; j += 1) {
+			size_t count = atomic_load(&stats->tags[i].histogram[j]);
+			if (count == 0) {
+				continue;
+			}
+
+			if (j == MEM_BUCKETS - 1) {
+				fprintf(out, " inf:%zu", count);
+			} else {
+				fprintf(out, " %zu:%zu", (size_t)16 << j, count);
+			}
+		}
+		fprintf(out, "\n");
+	}
+}
@@ -0,0 +1,548 @@
+#include "opt.h"
+
+#include "trace.h"
+#include "util.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+typedef u32 (*PassFn)(IrFunc *f);
+
+static u64 now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000u + (u64)ts.tv_nsec;
+}
+
+static IrRef resolve(const IrFunc *f, IrRef ref) {
+	while (f->insts[ref].op == IR_COPY) {
+		ref = f->insts[ref].a;
+	}
+	return ref;
+}
+
+// Operands may still point to copies made earlier in the same pass
+static void resolve_operands(IrFunc *f, IrRef ref) {
+	u32 count;
+	u32 *operands = ir_operands(f, ref, &count);
+	for (u32 i = 0; i < count; i += 1) {
+		operands[i] = resolve(f, operands[i]);
+	}
+}
+
+static void make_copy(IrFunc *f, IrRef ref, IrRef value) {
+	IrInst *inst = &f->insts[ref];
+	inst->op = IR_COPY;
+	inst->aux = 0;
+	inst->a = value;
+	inst->b = 0;
+}
+
+static bool is_const(const IrFunc *f, IrRef ref, u64 bits) {
+	return f->insts[ref].op == IR_CONST && ir_const_value(f, ref)->u == bits;
+}
+
+static bool is_unary(u16 arith) {
+	return arith == ARITH_NEG || arith == ARITH_BNOT;
+}
+
+static bool is_comparison(u16 arith) {
+	return arith >= ARITH_EQ && arith <= ARITH_LE;
+}
+
+// Integer operations with a neutral operand
+static bool fold_identity(IrFunc *f, IrRef ref) {
+	const IrInst *inst = &f->insts[ref];
+	if (inst->type >= VM_F32 || is_unary(inst->aux)) {
+		return false;
+	}
+
+	switch ((VmArith)inst->aux) {
+	case ARITH_ADD:
+	case ARITH_OR:
+	case ARITH_XOR:
+		if (is_const(f, inst->a, 0)) {
+			make_copy(f, ref, inst->b);
+			return true;
+		}
+		// Fallthrough
+	case ARITH_SUB:
+	case ARITH_SHL:
+	case ARITH_SHR:
+		if (is_const(f, inst->b, 0)) {
+			make_copy(f, ref, inst->a);
+			return true;
+		}
+		return false;
+	case ARITH_MUL:
+	case ARITH_DIV:
+		if (is_const(f, inst->b, 1)) {
+			make_copy(f, ref, inst->a);
+			return true;
+		}
+		return false;
+	default:
+		return false;
+	}
+}
+
+static bool fold_branch(IrFunc *f, IrRef ref) {
+	IrInst *inst = &f->insts[ref];
+	IrBlock *b = &f->blocks[inst->block];
+	bool taken = ir_const_value(f, inst->a)->u != 0;
+	u32 target = b->succ[taken ? 0 : 1];
+
+	ir_remove_edge(f, inst->block, b->succ[taken ? 1 : 0]);
+	b = &f->blocks[inst->block];
+	b->succ[0] = target;
+	b->succ[1] = IR_NO_BLOCK;
+	inst->op = IR_JMP;
+	inst->a = 0;
+	return true;
+}
+
+static bool fold_inst(IrFunc *f, IrRef ref) {
+	resolve_operands(f, ref);
+	const IrInst *inst = &f->insts[ref];
+
+	switch ((IrOp)inst->op) {
+	case IR_ARITH: {
+		bool unary = is_unary(inst->aux);
+		if (f->insts[inst->a].op != IR_CONST
+		    || (!unary && f->insts[inst->b].op != IR_CONST)) {
+			return fold_identity(f, ref);
+		}
+
+		// Divisions by zero are left to fail at run time
+		Value value;
+		Value b = unary ? (Value) { .u = 0 } : *ir_const_value(f, inst->b);
+		if (!vm_arith(inst->type, inst->aux, *ir_const_value(f, inst->a), b, &value)) {
+			return false;
+		}
+
+		VmType type = is_comparison(inst->aux) ? VM_U8 : (VmType)inst->type;
+		ir_set_const(f, ref, type, value);
+		return true;
+	}
+	case IR_NOT:
+		if (f->insts[inst->a].op == IR_CONST) {
+			Value value = { .u = ir_const_value(f, inst->a)->u == 0 };
+			ir_set_const(f, ref, VM_U8, value);
+			return true;
+		}
+		return false;
+	case IR_CAST:
+		if (f->insts[inst->a].op == IR_CONST) {
+			VmType from = inst->aux / VM_TYPE_COUNT;
+			VmType to = inst->aux % VM_TYPE_COUNT;
+			ir_set_const(f, ref, to, vm_cast(*ir_const_value(f, inst->a), from, to));
+			return true;
+		}
+		return false;
+	case IR_PHI: {
+		IrRef same = IR_NONE;
+		for (u32 i = inst->a; i < inst->b; i += 1) {
+			IrRef value = f->extra[i];
+			if (value == same || value == ref) {
+				continue;
+			} else if (same != IR_NONE) {
+				return false;
+			}
+			same = value;
+		}
+
+		if (same == IR_NONE) {
+			return false; // Only reachable from itself
+		}
+		make_copy(f, ref, same);
+		return true;
+	}
+	case IR_BR:
+		return f->insts[inst->a].op == IR_CONST && fold_branch(f, ref);
+	default:
+		return false;
+	}
+}
+
+// Constant folding, propagated through the uses until nothing changes
+static u32 pass_fold(IrFunc *f) {
+	u32 changes = 0;
+	bool again = true;
+
+	while (again) {
+		again = false;
+		ir_dominators(f);
+
+		// Definitions are visited before their uses, except in phis
+		for (u32 i = 0; i < f->rpolen; i += 1) {
+			const IrBlock *b = &f->blocks[f->rpo[i]];
+			for (u32 j = 0; j < b->len; j += 1) {
+				if (fold_inst(f, b->insts[j])) {
+					changes += 1;
+					again = true;
+				}
+			}
+		}
+
+		ir_resolve_copies(f);
+	}
+
+	return changes;
+}
+
+static bool is_commutative(u16 arith) {
+	switch ((VmArith)arith) {
+	case ARITH_ADD:
+	case ARITH_MUL:
+	case ARITH_EQ:
+	case ARITH_NE:
+	case ARITH_AND:
+	case ARITH_OR:
+	case ARITH_XOR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static u64 inst_hash(const IrFunc *f, IrRef ref) {
+	const IrInst *inst = &f->insts[ref];
+	u64 a = inst->op == IR_CONST ? ir_const_value(f, ref)->u : inst->a;
+	u64 hash = (u64)inst->op << 40 | (u64)inst->type << 32 | inst->aux;
+	hash = (hash ^ a) * 0x9E3779B97F4A7C15u;
+	hash = (hash ^ inst->b) * 0x9E3779B97F4A7C15u;
+	return hash ^ hash >> 29;
+}
+
+static bool inst_equal(const IrFunc *f, IrRef x, IrRef y) {
+	const IrInst *a = &f->insts[x];
+	const IrInst *b = &f->insts[y];
+	if (a->op != b->op || a->type != b->type || a->aux != b->aux) {
+		return false;
+	} else if (a->op == IR_CONST) {
+		return ir_const_value(f, x)->u == ir_const_value(f, y)->u;
+	}
+	return a->a == b->a && a->b == b->b;
+}
+
+// Pure instructions computing the same value as one in a dominating block are
+// replaced by it, constants included
+static u32 pass_cse(IrFunc *f) {
+	ir_dominators(f);
+
+	u32 size = 16;
+	while (size < f->instlen * 2) {
+		size *= 2;
+	}
+	IrRef *table = xcalloc(MEM_IR, size, sizeof(IrRef));
+	u32 changes = 0;
+
+	for (u32 i = 0; i < f->rpolen; i += 1) {
+		u32 block = f->rpo[i];
+		const IrBlock *b = &f->blocks[block];
+
+		for (u32 j = 0; j < b->len; j += 1) {
+			IrRef ref = b->insts[j];
+			if (!ir_is_pure(f, ref)) {
+				continue;
+			}
+
+			resolve_operands(f, ref);
+			IrInst *inst = &f->insts[ref];
+			if (inst->op == IR_ARITH && is_commutative(inst->aux) && inst->a > inst->b) {
+				IrRef tmp = inst->a;
+				inst->a = inst->b;
+				inst->b = tmp;
+			}
+
+			u32 slot = (u32)inst_hash(f, ref) & (size - 1);
+			while (table[slot] != IR_NONE && !inst_equal(f, table[slot], ref)) {
+				slot = (slot + 1) & (size - 1);
+			}
+
+			IrRef prev = table[slot];
+			if (prev != IR_NONE && ir_dominates(f, f->insts[prev].block, block)) {
+				make_copy(f, ref, prev);
+				changes += 1;
+			} else {
+				table[slot] = ref; // The most recent is the most likely to dominate
+			}
+		}
+	}
+
+	xfree(table);
+	ir_resolve_copies(f);
+	return changes;
+}
+
+static bool is_invariant(IrFunc *f, IrRef ref, const bool *inloop) {
+	const IrInst *inst = &f->insts[ref];
+	if (inst->op == IR_PHI || !ir_is_pure(f, ref)) {
+		return false;
+	}
+
+	u32 count;
+	const u32 *operands = ir_operands(f, ref, &count);
+	for (u32 i = 0; i < count; i += 1) {
+		if (inloop[f->insts[operands[i]].block]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Hoist the pure instructions of a natural loop whose operands are defined
+// outside of it, returns the number moved
+static u32 hoist_loop(IrFunc *f, u32 header, bool *inloop, u32 *stack) {
+	memset(inloop, 0, f->blocklen * sizeof(bool));
+	inloop[header] = true;
+
+	// Blocks reaching a back edge without going through the header
+	bool loop = false;
+	u32 stacklen = 0;
+	const IrBlock *h = &f->blocks[header];
+	for (u32 i = 0; i < h->predlen; i += 1) {
+		u32 pred = h->preds[i];
+		if (!ir_dominates(f, header, pred)) {
+			continue;
+		}
+
+		loop = true;
+		if (!inloop[pred]) {
+			inloop[pred] = true;
+			stack[stacklen] = pred;
+			stacklen += 1;
+		}
+	}
+	if (!loop) {
+		return 0;
+	}
+
+	while (stacklen > 0) {
+		stacklen -= 1;
+		const IrBlock *b = &f->blocks[stack[stacklen]];
+		for (u32 i = 0; i < b->predlen; i += 1) {
+			if (!inloop[b->preds[i]]) {
+				inloop[b->preds[i]] = true;
+				stack[stacklen] = b->preds[i];
+				stacklen += 1;
+			}
+		}
+	}
+
+	// The preheader is the only block entering the loop, and only leads to it
+	u32 preheader = IR_NO_BLOCK;
+	for (u32 i = 0; i < h->predlen; i += 1) {
+		if (inloop[h->preds[i]]) {
+			continue;
+		} else if (preheader != IR_NO_BLOCK) {
+			return 0;
+		}
+		preheader = h->preds[i];
+	}
+	if (preheader == IR_NO_BLOCK || f->blocks[preheader].succ[1] != IR_NO_BLOCK) {
+		return 0;
+	}
+
+	// In reverse postorder, so instructions using hoisted ones can follow them
+	u32 changes = 0;
+	for (u32 i = f->blocks[header].order; i < f->rpolen; i += 1) {
+		u32 block = f->rpo[i];
+		if (!inloop[block]) {
+			continue;
+		}
+
+		for (u32 j = 0; j < f->blocks[block].len;) {
+			IrRef ref = f->blocks[block].insts[j];
+			if (is_invariant(f, ref, inloop)) {
+				ir_move(f, ref, preheader);
+				changes += 1;
+			} else {
+				j += 1;
+			}
+		}
+	}
+
+	return changes;
+}
+
+// Loop invariant code motion, inner loops first so their invariants can be
+// hoisted again out of the outer loops
+static u32 pass_licm(IrFunc *f) {
+	ir_dominators(f);
+
+	bool *inloop = xcalloc(MEM_IR, f->blocklen, sizeof(bool));
+	u32 *stack = xcalloc(MEM_IR, f->blocklen, sizeof(u32));
+	u32 changes = 0;
+
+	// Inner loop headers come after the outer ones in reverse postorder
+	for (u32 i = f->rpolen; i > 0; i -= 1) {
+		changes += hoist_loop(f, f->rpo[i - 1], inloop, stack);
+	}
+
+	xfree(inloop);
+	xfree(stack);
+	return changes;
+}
+
+// Values read by nothing with a side effect are removed, with the blocks that
+// can't be reached anymore
+static u32 pass_dce(IrFunc *f) {
+	ir_dominators(f);
+
+	bool *live = xcalloc(MEM_IR, f->instlen, sizeof(bool));
+	IrRef *work = xcalloc(MEM_IR, f->instlen, sizeof(IrRef));
+	u32 worklen = 0;
+
+	for (u32 i = 0; i < f->rpolen; i += 1) {
+		const IrBlock *b = &f->blocks[f->rpo[i]];
+		for (u32 j = 0; j < b->len; j += 1) {
+			IrRef ref = b->insts[j];
+			IrOp op = (IrOp)f->insts[ref].op;
+			if (!ir_is_pure(f, ref) && op != IR_GGET && op != IR_PHI) {
+				live[ref] = true;
+				work[worklen] = ref;
+				worklen += 1;
+			}
+		}
+	}
+
+	while (worklen > 0) {
+		worklen -= 1;
+		u32 count;
+		const u32 *operands = ir_operands(f, work[worklen], &count);
+		for (u32 i = 0; i < count; i += 1) {
+			if (!live[operands[i]]) {
+				live[operands[i]] = true;
+				work[worklen] = operands[i];
+				worklen += 1;
+			}
+		}
+	}
+
+	u32 changes = 0;
+	for (u32 i = 0; i < f->rpolen; i += 1) {
+		IrBlock *b = &f->blocks[f->rpo[i]];
+		u32 len = 0;
+		for (u32 j = 0; j < b->len; j += 1) {
+			IrRef ref = b->insts[j];
+			if (live[ref]) {
+				b->insts[len] = ref;
+				len += 1;
+			} else {
+				f->insts[ref].op = IR_NOP;
+				changes += 1;
+			}
+		}
+		b->len = len;
+	}
+
+	xfree(live);
+	xfree(work);
+	return changes;
+}
+
+static const struct {
+	const char *name;
+	PassFn run;
+} passes[] = {
+	[PASS_FOLD] = { "fold", pass_fold },
+	[PASS_CSE] = { "cse", pass_cse },
+	[PASS_LICM] = { "licm", pass_licm },
+	[PASS_DCE] = { "dce", pass_dce },
+};
+
+static_assert(
+	sizeof(passes) / sizeof(passes[0]) == PASS_COUNT,
+	"Passes array doesn't have the same size of OptPass Enum."
+);
+
+void opt_init(PassManager *pm) {
+	memset(pm, 0, sizeof(PassManager));
+	pm->enabled = PASS_ALL;
+}
+
+bool opt_parse(PassManager *pm, const char *list) {
+	pm->enabled = 0;
+	if (strcmp(list, "none") == 0) {
+		return true;
+	}
+
+	const char *start = list;
+	while (true) {
+		const char *end = strchr(start, ',');
+		usize len = end != NULL ? (usize)(end - start) : strlen(start);
+
+		u32 pass = 0;
+		while (pass < PASS_COUNT
+		       && (strlen(passes[pass].name) != len
+		           || strncmp(passes[pass].name, start, len) != 0)) {
+			pass += 1;
+		}
+		if (pass == PASS_COUNT) {
+			return false;
+		}
+
+		pm->enabled |= 1u << pass;
+		if (end == NULL) {
+			return true;
+		}
+		start = end + 1;
+	}
+}
+
+static u32 count_insts(const IrFunc *f) {
+	u32 count = 0;
+	for (u32 i = 0; i < f->blocklen; i += 1) {
+		count += f->blocks[i].len;
+	}
+	return count;
+}
+
+void opt_run(PassManager *pm, IrFunc *f, const char *name) {
+	pm->funcs += 1;
+	pm->before += count_insts(f);
+
+	for (u32 i = 0; i < PASS_COUNT; i += 1) {
+		if ((pm->enabled & 1u << i) == 0) {
+			continue;
+		}
+
+		TRACE_BEGIN_DETAIL(passes[i].name, name);
+		u64 start = now_ns();
+		u32 changes = passes[i].run(f);
+		pm->stats[i].ns += now_ns() - start;
+		TRACE_END(passes[i].name);
+
+		pm->stats[i].runs += 1;
+		pm->stats[i].changes += changes;
+	}
+
+	pm->after += count_insts(f);
+	if (pm->dump != NULL) {
+		ir_dump(f, name, pm->dump);
+	}
+}
+
+void opt_print_stats(const PassManager *pm, FILE *out) {
+	fprintf(out, "%-8s %12s %8s %10s\n", "pass", "time (ms)", "runs", "changes");
+	for (u32 i = 0; i < PASS_COUNT; i += 1) {
+		const PassStats *stats = &pm->stats[i];
+		if ((pm->enabled & 1u << i) != 0) {
+			fprintf(
+				out, "%-8s %12.3f %8u %10u\n", passes[i].name, (double)stats->ns / 1e6,
+				stats->runs, stats->changes
+			);
+		}
+	}
+	fprintf(
+		out, "instructions: %" PRIu64 " -> %" PRIu64 " in %u functions\n", pm->before,
+		pm->after, pm->funcs
+	);
+}
+
+const char *opt_pass2str(OptPass pass) {
+	return passes[pass].name;
+}
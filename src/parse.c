@@ -0,0 +1,1420 @@
+#include "parse.h"
+
+#include "trace.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define PARSE_BATCHES 4         // Batches per thread, so threads finish together
+#define PARSE_MIN_BATCH 4096    // Minimum tokens per batch worth a thread
+#define PIPE_SIZE       4096    // Tokens in flight from the lexer thread, power of two
+#define PIPE_BATCH      256     // Tokens published or freed at once by each side
+#define PIPE_SPINS      1024    // Polls of the other side before yielding the CPU
+
+/*
+ * Single-producer single-consumer ring of tokens between the lexer thread and
+ * the parser. Positions only grow and are masked to index the ring. Each side
+ * publishes its position every PIPE_BATCH tokens and before waiting, and the
+ * two positions are on separate cache lines, so the atomics are amortized.
+ */
+typedef struct TokenPipe {
+	LexState *lex;
+	Token *ring;
+	char pad0[64];
+
+	// Written by the lexer: tokens before tail are scanned
+	atomic_uint tail;
+	u32 produced; // Position of the token being scanned
+	char pad1[64];
+
+	// Written by the parser: tokens before head are freed
+	atomic_uint head;
+} TokenPipe;
+
+typedef struct ParseState {
+	LexState *lex;
+	Ast *ast;
+	Allocator alloc; // Of the data of the tokens
+
+	// When tokens isn't NULL they are read from tokens[pos..end) instead of the
+	// lexer, tokens[end] must exist and is never consumed
+	Token *tokens;
+	u32 pos;
+	u32 end;
+
+	// When pipe isn't NULL tokens are read from it at pos instead, the ones
+	// before avail are scanned. Once done is set the last one is at avail.
+	TokenPipe *pipe;
+	u32 avail;
+	bool done;
+
+	// Errors are printed and terminate the process, unless env is set: then
+	// the message is stored in error and parsing jumps back to env
+	jmp_buf *env;
+	char error[PARSE_ERROR_MAX];
+
+	// Children of the lists being parsed, copied to the extra array once the
+	// list is complete so every list is contiguous.
+	NodeIndex *scratch;
+	u32 scratchlen;
+	u32 scratchsize;
+
+	// Buffer used to join "::" separated identifiers
+	char *namebuf;
+	usize namelen;
+	usize namesize;
+
+	// Nesting of the expression or type being parsed, and heights of the
+	// trees of the last declaration, both limited to AST_MAX_DEPTH
+	u32 depth;
+	u16 *heights;
+	u32 heightsize;
+} ParseState;
+
+static _Noreturn void push_error(ParseState *p, SourceLoc loc, const char *fmt, ...) {
+	Location pos = source_decode(p->ast->sources, loc, NULL);
+	int len = snprintf(p->error, sizeof(p->error), "%d:%d ", pos.lineno, pos.colno);
+
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(p->error + len, sizeof(p->error) - (usize)len, fmt, args);
+	va_end(args);
+
+	if (p->env != NULL) {
+		longjmp(*p->env, 1);
+	}
+
+	fprintf(stderr, "%s\n", p->error);
+	exit(EXIT_FAILURE);
+}
+
+static const char *tok_name(TokenKind kind) {
+	switch (kind) {
+	case TK_IDENTIFIER:
+		return "identifier";
+	case TK_CCONST:
+		return "constant";
+	case TK_EOF:
+		return "end of file";
+	case TK_NONE:
+		return "nothing";
+	case TK_ERROR:
+		return "error";
+	default:
+		return lex_tok2str(kind);
+	}
+}
+
+// Wait until the counter isn't value anymore, spinning first then yielding
+static u32 pipe_wait(atomic_uint *counter, u32 value) {
+	for (u32 spins = 0;; spins += 1) {
+		u32 now = atomic_load_explicit(counter, memory_order_acquire);
+		if (now != value) {
+			return now;
+		} else if (spins >= PIPE_SPINS) {
+			sched_yield();
+		}
+	}
+}
+
+// Token at pos + n, waiting for the lexer thread if it isn't scanned yet
+static Token *pipe_peek(ParseState *p, u32 n) {
+	TokenPipe *pipe = p->pipe;
+	while (!p->done && p->pos + n >= p->avail) {
+		// The freed tokens are handed back first, the lexer may be waiting
+		atomic_store_explicit(&pipe->head, p->pos, memory_order_release);
+		p->avail = pipe_wait(&pipe->tail, p->avail);
+
+		// The last token is only read from here, so it's checked for errors
+		TokenKind last = pipe->ring[(p->avail - 1) & (PIPE_SIZE - 1)].kind;
+		if (last == TK_EOF || last == TK_ERROR) {
+			p->done = true;
+			p->avail -= 1;
+			p->end = p->avail;
+		}
+	}
+
+	u32 pos = p->done && p->pos + n > p->end ? p->end : p->pos + n;
+	Token *tok = &pipe->ring[pos & (PIPE_SIZE - 1)];
+	if (tok->kind == TK_ERROR) {
+		// Reported once reached, like when the parser drives the lexer
+		fprintf(stderr, "%s\n", pipe->lex->error);
+		exit(EXIT_FAILURE);
+	}
+	return tok;
+}
+
+static inline Token *cur(ParseState *p) {
+	if (p->pipe != NULL) {
+		if (p->pos < p->avail) {
+			return &p->pipe->ring[p->pos & (PIPE_SIZE - 1)];
+		}
+		return pipe_peek(p, 0);
+	} else if (p->tokens == NULL) {
+		return lex_peek(p->lex, 0);
+	}
+	return &p->tokens[p->pos];
+}
+
+static inline TokenKind peek(ParseState *p) {
+	return cur(p)->kind;
+}
+
+static inline TokenKind peek2(ParseState *p) {
+	if (p->pipe != NULL) {
+		return pipe_peek(p, 1)->kind;
+	} else if (p->tokens == NULL) {
+		return lex_peek(p->lex, 1)->kind;
+	}
+	return p->tokens[p->pos < p->end ? p->pos + 1 : p->end].kind;
+}
+
+static inline void advance(ParseState *p) {
+	if (p->pipe != NULL) {
+		if (p->pos >= p->avail) {
+			pipe_peek(p, 0);
+		}
+
+		// The last token is never consumed, it's at avail once done
+		if (p->pos < p->avail) {
+			lex_release(p->lex, &p->pipe->ring[p->pos & (PIPE_SIZE - 1)]);
+			p->pos += 1;
+			if (p->pos % PIPE_BATCH == 0) {
+				atomic_store_explicit(&p->pipe->head, p->pos, memory_order_release);
+			}
+		}
+	} else if (p->tokens == NULL) {
+		lex_advance(p->lex);
+	} else if (p->pos < p->end) {
+		p->pos += 1;
+	}
+}
+
+// Whether all the tokens to parse were consumed
+static inline bool at_end(ParseState *p) {
+	return p->tokens != NULL ? p->pos >= p->end : peek(p) == TK_EOF;
+}
+
+static bool accept(ParseState *p, TokenKind kind) {
+	if (peek(p) != kind) {
+		return false;
+	}
+
+	advance(p);
+	return true;
+}
+
+static SourceLoc expect(ParseState *p, TokenKind kind) {
+	if (peek(p) != kind) {
+		push_error(
+			p, cur(p)->loc, "Expected '%s', found '%s'", tok_name(kind), tok_name(peek(p))
+		);
+	}
+
+	SourceLoc loc = cur(p)->loc;
+	advance(p);
+	return loc;
+}
+
+static void scratch_push(ParseState *p, NodeIndex node) {
+	if (p->scratchlen == p->scratchsize) {
+		p->scratchsize *= 2;
+		p->scratch = xrealloc(MEM_PARSE, p->scratch, p->scratchsize * sizeof(NodeIndex));
+	}
+
+	p->scratch[p->scratchlen] = node;
+	p->scratchlen += 1;
+}
+
+// Move the scratch entries pushed after 'top' to the extra array and return the
+// starting index, the end index is start + count.
+static u32 scratch_commit(ParseState *p, u32 top, u32 *end) {
+	u32 count = p->scratchlen - top;
+	u32 start = ast_add_extra(p->ast, p->scratch + top, count);
+	p->scratchlen = top;
+
+	*end = start + count;
+	return start;
+}
+
+static NodeIndex add_node(ParseState *p, AstKind kind, SourceLoc loc, u32 lhs, u32 rhs) {
+	return ast_add_node(p->ast, kind, loc, lhs, rhs);
+}
+
+static NodeIndex add_op_node(
+	ParseState *p, AstKind kind, u8 op, SourceLoc loc, u32 lhs, u32 rhs
+) {
+	NodeIndex node = ast_add_node(p->ast, kind, loc, lhs, rhs);
+	p->ast->nodes[node].op = op;
+	return node;
+}
+
+static u32 add_pair(ParseState *p, u32 first, u32 second) {
+	const u32 values[2] = { first, second };
+	return ast_add_extra(p->ast, values, 2);
+}
+
+// Enter a nested expression or type, the caller decrements depth when done
+static void nest(ParseState *p) {
+	p->depth += 1;
+	if (p->depth > AST_MAX_DEPTH) {
+		push_error(p, cur(p)->loc, "Expression nested too deeply");
+	}
+}
+
+static void namebuf_insert(ParseState *p, const char *s, usize len) {
+	while (p->namelen + len + 1 > p->namesize) {
+		p->namesize *= 2;
+		p->namebuf = xrealloc(MEM_PARSE, p->namebuf, p->namesize);
+	}
+
+	memcpy(p->namebuf + p->namelen, s, len);
+	p->namelen += len;
+}
+
+// Name <- (XID_Start | "_") XID_Continue*
+static u32 parse_name(ParseState *p) {
+	if (peek(p) != TK_IDENTIFIER) {
+		push_error(
+			p, cur(p)->loc, "Expected identifier, found '%s'", tok_name(peek(p))
+		);
+	}
+
+	u32 name = intern(&p->ast->names, cur(p)->ident, strlen(cur(p)->ident));
+	advance(p);
+	return name;
+}
+
+// Identifier <- Name ("::" Identifier)?
+static u32 parse_identifier(ParseState *p) {
+	if (peek(p) != TK_IDENTIFIER) {
+		push_error(
+			p, cur(p)->loc, "Expected identifier, found '%s'", tok_name(peek(p))
+		);
+	}
+
+	p->namelen = 0;
+	namebuf_insert(p, cur(p)->ident, strlen(cur(p)->ident));
+	advance(p);
+
+	while (accept(p, TK_COLON2)) {
+		if (peek(p) != TK_IDENTIFIER) {
+			push_error(p, cur(p)->loc, "Expected identifier after '::'");
+		}
+
+		namebuf_insert(p, "::", 2);
+		namebuf_insert(p, cur(p)->ident, strlen(cur(p)->ident));
+		advance(p);
+	}
+
+	return intern(&p->ast->names, p->namebuf, p->namelen);
+}
+
+static NodeIndex parse_expr(ParseState *p);
+static NodeIndex parse_type(ParseState *p);
+static NodeIndex parse_block(ParseState *p);
+
+// Parameter <- Identifier ":" Type ("=" Expr)?
+static NodeIndex parse_param(ParseState *p) {
+	SourceLoc loc = cur(p)->loc;
+	u32 name = parse_identifier(p);
+
+	expect(p, TK_COLON);
+	NodeIndex type = parse_type(p);
+
+	NodeIndex init = AST_NONE;
+	if (accept(p, TK_EQUAL)) {
+		init = parse_expr(p);
+	}
+
+	return add_node(p, AST_PARAM, loc, name, add_pair(p, type, init));
+}
+
+// Prototype <- "(" Parameters ")" "->" Type
+static NodeIndex parse_prototype(ParseState *p) {
+	SourceLoc loc = expect(p, TK_PAREN_L);
+
+	u32 top = p->scratchlen;
+	while (peek(p) != TK_PAREN_R) {
+		scratch_push(p, parse_param(p));
+
+		if (!accept(p, TK_COMMA)) {
+			break;
+		}
+	}
+	expect(p, TK_PAREN_R);
+
+	u32 end;
+	u32 start = scratch_commit(p, top, &end);
+
+	expect(p, TK_ARROW);
+	NodeIndex ret = parse_type(p);
+
+	return add_node(p, AST_PROTOTYPE, loc, add_pair(p, start, end), ret);
+}
+
+static bool tok2type(TokenKind kind, TypeStorage *out) {
+	switch (kind) {
+	case TK_BOOL:
+		*out = TYPE_BOOL;
+		return true;
+	case TK_F32:
+		*out = TYPE_F32;
+		return true;
+	case TK_F64:
+		*out = TYPE_F64;
+		return true;
+	case TK_I8:
+		*out = TYPE_I8;
+		return true;
+	case TK_I16:
+		*out = TYPE_I16;
+		return true;
+	case TK_I32:
+		*out = TYPE_I32;
+		return true;
+	case TK_I64:
+		*out = TYPE_I64;
+		return true;
+	case TK_U8:
+		*out = TYPE_U8;
+		return true;
+	case TK_U16:
+		*out = TYPE_U16;
+		return true;
+	case TK_U32:
+		*out = TYPE_U32;
+		return true;
+	case TK_U64:
+		*out = TYPE_U64;
+		return true;
+	case TK_RUNE:
+		*out = TYPE_RUNE;
+		return true;
+	case TK_VOID:
+		*out = TYPE_VOID;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Type <- PrimitiveType | PointerType | ArrayType | FuncType
+static NodeIndex parse_type(ParseState *p) {
+	SourceLoc loc = cur(p)->loc;
+	NodeIndex node;
+
+	TypeStorage storage;
+	if (tok2type(peek(p), &storage)) {
+		advance(p);
+		return add_op_node(p, AST_TYPE_PRIM, (u8)storage, loc, 0, 0);
+	}
+
+	nest(p);
+	switch (peek(p)) {
+	case TK_STAR:
+		advance(p);
+		node = add_node(p, AST_TYPE_PTR, loc, parse_type(p), 0);
+		break;
+	case TK_BRACKET_L: {
+		advance(p);
+
+		NodeIndex len = AST_NONE;
+		if (peek(p) != TK_BRACKET_R) {
+			len = parse_expr(p);
+		}
+		expect(p, TK_BRACKET_R);
+
+		node = add_node(p, AST_TYPE_ARRAY, loc, len, parse_type(p));
+	} break;
+	case TK_FN:
+		advance(p);
+		node = add_node(p, AST_TYPE_FN, loc, parse_prototype(p), 0);
+		break;
+	default:
+		push_error(p, loc, "Expected type, found '%s'", tok_name(peek(p)));
+	}
+
+	p->depth -= 1;
+	return node;
+}
+
+static NodeIndex parse_literal(ParseState *p) {
+	SourceLoc loc = cur(p)->loc;
+	Token *tok = cur(p);
+	NodeIndex node = AST_NONE;
+
+	switch (tok->storage) {
+	case TYPE_INT: {
+		u64 value;
+		if (!tok_int_value(tok, &value)) {
+			push_error(p, loc, "Integer constant overflow");
+		}
+
+		u8 storage = value > (u64)INT64_MAX ? TYPE_U64 : TYPE_INT;
+		node = add_op_node(p, AST_INT, storage, loc, (u32)value, (u32)(value >> 32));
+	} break;
+	case TYPE_FLOAT: {
+		f64 value;
+		if (!tok_float_value(tok, &p->alloc, &value)) {
+			push_error(
+				p, loc, errno == ENOMEM ? "Out of memory" : "Float constant out of range"
+			);
+		}
+
+		u64 bits;
+		memcpy(&bits, &value, sizeof(u64));
+		node = add_node(p, AST_FLOAT, loc, (u32)bits, (u32)(bits >> 32));
+	} break;
+	case TYPE_RUNE:
+		node = add_node(p, AST_RUNE, loc, tok->rune, 0);
+		break;
+	case TYPE_STRING: {
+		usize len;
+		const char *str = tok_string_value(tok, &p->alloc, &len);
+		if (str == NULL) {
+			push_error(p, loc, "Out of memory");
+		}
+		node = add_node(p, AST_STRING, loc, intern(&p->ast->names, str, len), 0);
+	} break;
+	default:
+		assert(0); // UNREACHABLE
+	}
+
+	advance(p);
+	return node;
+}
+
+// ArrayLiteral <- "[" ArrayMember? "]"
+static NodeIndex parse_array(ParseState *p) {
+	SourceLoc loc = expect(p, TK_BRACKET_L);
+
+	u32 top = p->scratchlen;
+	while (peek(p) != TK_BRACKET_R) {
+		scratch_push(p, parse_expr(p));
+
+		if (!accept(p, TK_COMMA)) {
+			break;
+		}
+	}
+	expect(p, TK_BRACKET_R);
+
+	u32 end;
+	u32 start = scratch_commit(p, top, &end);
+	return add_node(p, AST_ARRAY, loc, start, end);
+}
+
+// NestedExpr <- Identifier | Literal | "(" Expr ")"
+static NodeIndex parse_nested(ParseState *p) {
+	SourceLoc loc = cur(p)->loc;
+	NodeIndex node;
+
+	switch (peek(p)) {
+	case TK_IDENTIFIER:
+		return add_node(p, AST_IDENT, loc, parse_identifier(p), 0);
+	case TK_CCONST:
+		return parse_literal(p);
+	case TK_TRUE:
+	case TK_FALSE:
+		node = add_node(p, AST_BOOL, loc, peek(p) == TK_TRUE, 0);
+		advance(p);
+		return node;
+	case TK_VOID:
+		advance(p);
+		return add_node(p, AST_VOID, loc, 0, 0);
+	case TK_BRACKET_L:
+		return parse_array(p);
+	case TK_PAREN_L:
+		advance(p);
+		node = parse_expr(p);
+		expect(p, TK_PAREN_R);
+		return node;
+	default:
+		push_error(p, loc, "Expected expression, found '%s'", tok_name(peek(p)));
+	}
+}
+
+// ExeExpr <- NestedExpr | CallExpr
+static NodeIndex parse_exe(ParseState *p) {
+	NodeIndex node = parse_nested(p);
+
+	while (peek(p) == TK_PAREN_L) {
+		SourceLoc loc = cur(p)->loc;
+		advance(p);
+
+		u32 top = p->scratchlen;
+		while (peek(p) != TK_PAREN_R) {
+			scratch_push(p, parse_expr(p));
+
+			if (!accept(p, TK_COMMA)) {
+				break;
+			}
+		}
+		expect(p, TK_PAREN_R);
+
+		u32 end;
+		u32 start = scratch_commit(p, top, &end);
+		node = add_node(p, AST_CALL, loc, node, add_pair(p, start, end));
+	}
+
+	return node;
+}
+
+// UnaryExpr <- ExeExpr | BlockExpr | UnaryOp UnaryExpr
+static NodeIndex parse_unary(ParseState *p) {
+	SourceLoc loc = cur(p)->loc;
+	TokenKind op = peek(p);
+
+	switch (op) {
+	case TK_MINUS:
+	case TK_BNOT:
+	case TK_LNOT:
+	case TK_STAR:
+	case TK_BAND: {
+		advance(p);
+
+		nest(p);
+		NodeIndex operand = parse_unary(p);
+		p->depth -= 1;
+
+		return add_op_node(p, AST_UNARY, (u8)op, loc, operand, 0);
+	}
+	case TK_BRACE_L:
+		return parse_block(p);
+	default:
+		return parse_exe(p);
+	}
+}
+
+// CastExpr <- UnaryExpr | CastExpr "as" Type
+static NodeIndex parse_cast(ParseState *p) {
+	NodeIndex node = parse_unary(p);
+
+	while (peek(p) == TK_AS) {
+		SourceLoc loc = cur(p)->loc;
+		advance(p);
+		node = add_node(p, AST_CAST, loc, node, parse_type(p));
+	}
+
+	return node;
+}
+
+// Binding power of binary operators, 0 if it's not a binary operator
+static int binary_prec(TokenKind kind) {
+	switch (kind) {
+	case TK_LOR:
+		return 1;
+	case TK_LAND:
+		return 2;
+	case TK_LEQUAL_EQ:
+	case TK_LNOT_EQ:
+	case TK_LESS:
+	case TK_GREATER:
+	case TK_LESS_EQ:
+	case TK_GREATER_EQ:
+		return 3;
+	case TK_BOR:
+	case TK_BXOR:
+	case TK_BAND:
+		return 4;
+	case TK_SHIFTL:
+	case TK_SHIFTR:
+		return 5;
+	case TK_PLUS:
+	case TK_MINUS:
+		return 6;
+	case TK_STAR:
+	case TK_SLASH:
+	case TK_MOD:
+		return 7;
+	default:
+		return 0;
+	}
+}
+
+// OrExpr down to MulExpr, all binary operators are left associative
+static NodeIndex parse_binary(ParseState *p, int min_prec) {
+	NodeIndex lhs = parse_cast(p);
+
+	for (;;) {
+		TokenKind op = peek(p);
+		int prec = binary_prec(op);
+		if (prec == 0 || prec < min_prec) {
+			break;
+		}
+
+		SourceLoc loc = cur(p)->loc;
+		advance(p);
+
+		NodeIndex rhs = parse_binary(p, prec + 1);
+		lhs = add_op_node(p, AST_BINARY, (u8)op, loc, lhs, rhs);
+	}
+
+	return lhs;
+}
+
+static bool is_assign_op(TokenKind kind) {
+	switch (kind) {
+	case TK_EQUAL:
+	case TK_PLUS_EQ:
+	case TK_MINUS_EQ:
+	case TK_STAR_EQ:
+	case TK_SLASH_EQ:
+	case TK_MOD_EQ:
+	case TK_SHIFTL_EQ:
+	case TK_SHIFTR_EQ:
+	case TK_BAND_EQ:
+	case TK_BOR_EQ:
+	case TK_BXOR_EQ:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// IfExpr <- "if" "(" Expr ")" Expr ("else" Expr)?
+static NodeIndex parse_if(ParseState *p) {
+	SourceLoc loc = expect(p, TK_IF);
+
+	expect(p, TK_PAREN_L);
+	NodeIndex cond = parse_expr(p);
+	expect(p, TK_PAREN_R);
+
+	NodeIndex then = parse_expr(p);
+	NodeIndex otherwise = AST_NONE;
+	if (accept(p, TK_ELSE)) {
+		otherwise = parse_expr(p);
+	}
+
+	return add_node(p, AST_IF, loc, cond, add_pair(p, then, otherwise));
+}
+
+static bool at_binding(ParseState *p) {
+	return peek(p) == TK_CONST || peek(p) == TK_MUT
+	    || (peek(p) == TK_IDENTIFIER && peek2(p) == TK_COLON);
+}
+
+// Binding <- ("const" | "mut")? Name (":" Type?)? ("=" Expr)?
+static NodeIndex parse_binding(ParseState *p) {
+	SourceLoc loc = cur(p)->loc;
+
+	u16 flags = 0;
+	if (accept(p, TK_MUT)) {
+		flags |= AST_FLAG_MUT;
+	} else {
+		accept(p, TK_CONST);
+	}
+
+	u32 name = parse_name(p);
+
+	NodeIndex type = AST_NONE;
+	if (accept(p, TK_COLON) && peek(p) != TK_EQUAL) {
+		type = parse_type(p);
+	}
+
+	NodeIndex init = AST_NONE;
+	if (accept(p, TK_EQUAL)) {
+		init = parse_expr(p);
+	} else if (type == AST_NONE) {
+		push_error(p, loc, "Binding with inferred type must be initialized");
+	}
+
+	NodeIndex node = add_node(p, AST_BINDING, loc, name, add_pair(p, type, init));
+	p->ast->nodes[node].flags = flags;
+	return node;
+}
+
+// ForLoop <- "for" "(" ForFields ")" Expr
+// ForFields <- (ForInital ";")? Expr (";" Expr)?
+static NodeIndex parse_for(ParseState *p) {
+	SourceLoc loc = expect(p, TK_FOR);
+	expect(p, TK_PAREN_L);
+
+	u32 top = p->scratchlen;
+	if (at_binding(p)) {
+		do {
+			scratch_push(p, parse_binding(p));
+		} while (accept(p, TK_COMMA));
+
+		expect(p, TK_SEMICOLON);
+	}
+
+	u32 end;
+	u32 start = scratch_commit(p, top, &end);
+
+	NodeIndex cond = parse_expr(p);
+	NodeIndex post = AST_NONE;
+	if (accept(p, TK_SEMICOLON)) {
+		post = parse_expr(p);
+	}
+	expect(p, TK_PAREN_R);
+
+	const u32 fields[4] = { start, end, cond, post };
+	u32 extra = ast_add_extra(p->ast, fields, 4);
+
+	return add_node(p, AST_FOR, loc, extra, parse_expr(p));
+}
+
+// AssignExpr <- AssignTarget AssignOp Expr
+static NodeIndex parse_assign(ParseState *p) {
+	NodeIndex lhs = parse_binary(p, 1);
+	TokenKind op = peek(p);
+	if (!is_assign_op(op)) {
+		return lhs;
+	}
+
+	// AssignTarget <- ObjectSelector | IndirectTarget
+	const AstNode *target = &p->ast->nodes[lhs];
+	if (target->kind != AST_IDENT
+	    && !(target->kind == AST_UNARY && target->op == TK_STAR)) {
+		push_error(p, cur(p)->loc, "Invalid assignment target");
+	}
+
+	SourceLoc loc = cur(p)->loc;
+	advance(p);
+
+	return add_op_node(p, AST_ASSIGN, (u8)op, loc, lhs, parse_expr(p));
+}
+
+// Expr <- OrExpr | AssignExpr | IfExpr | ForLoop
+static NodeIndex parse_expr(ParseState *p) {
+	nest(p);
+
+	NodeIndex node;
+	if (peek(p) == TK_IF) {
+		node = parse_if(p);
+	} else if (peek(p) == TK_FOR) {
+		node = parse_for(p);
+	} else {
+		node = parse_assign(p);
+	}
+
+	p->depth -= 1;
+	return node;
+}
+
+// Whether the expression ends with a block, so the ';' after it is optional
+static bool ends_with_block(const Ast *ast, NodeIndex node) {
+	const AstNode *n = &ast->nodes[node];
+
+	switch (n->kind) {
+	case AST_BLOCK:
+		return true;
+	case AST_IF: {
+		NodeIndex last = ast->extra[n->rhs + 1];
+		if (last == AST_NONE) {
+			last = ast->extra[n->rhs];
+		}
+		return ends_with_block(ast, last);
+	}
+	case AST_FOR:
+		return ends_with_block(ast, n->rhs);
+	default:
+		return false;
+	}
+}
+
+// BlockExpr <- "{" ExprList "}"
+static NodeIndex parse_block(ParseState *p) {
+	SourceLoc loc = expect(p, TK_BRACE_L);
+
+	u32 top = p->scratchlen;
+	while (peek(p) != TK_BRACE_R) {
+		NodeIndex node = at_binding(p) ? parse_binding(p) : parse_expr(p);
+		scratch_push(p, node);
+
+		if (!accept(p, TK_SEMICOLON) && !ends_with_block(p->ast, node)) {
+			push_error(p, cur(p)->loc, "Expected ';', found '%s'", tok_name(peek(p)));
+		}
+	}
+	expect(p, TK_BRACE_R);
+
+	u32 end;
+	u32 start = scratch_commit(p, top, &end);
+	return add_node(p, AST_BLOCK, loc, start, end);
+}
+
+// UseDecl <- "pub"? "use" Identifier ("as" Name)? ";"
+static NodeIndex parse_use(ParseState *p, u16 flags) {
+	SourceLoc loc = expect(p, TK_USE);
+
+	u32 path = parse_identifier(p);
+	u32 alias = INTERN_NONE;
+	if (accept(p, TK_AS)) {
+		alias = parse_name(p);
+	}
+	expect(p, TK_SEMICOLON);
+
+	NodeIndex node = add_node(p, AST_USE, loc, path, alias);
+	p->ast->nodes[node].flags = flags;
+	return node;
+}
+
+// GlobalVarDecl <- ("const" | "mut") GlobalBindings
+static NodeIndex parse_global(ParseState *p, u16 flags) {
+	SourceLoc loc = cur(p)->loc;
+	if (accept(p, TK_MUT)) {
+		flags |= AST_FLAG_MUT;
+	} else {
+		expect(p, TK_CONST);
+	}
+
+	u32 top = p->scratchlen;
+	do {
+		// GlobalBinding <- Identifier ":" (Type)? "=" Expr
+		SourceLoc bloc = cur(p)->loc;
+		u32 name = parse_identifier(p);
+		expect(p, TK_COLON);
+
+		NodeIndex type = AST_NONE;
+		if (peek(p) != TK_EQUAL) {
+			type = parse_type(p);
+		}
+		expect(p, TK_EQUAL);
+
+		NodeIndex init = parse_expr(p);
+		NodeIndex binding = add_node(p, AST_BINDING, bloc, name, add_pair(p, type, init));
+		p->ast->nodes[binding].flags = flags;
+		scratch_push(p, binding);
+	} while (accept(p, TK_COMMA));
+
+	u32 end;
+	u32 start = scratch_commit(p, top, &end);
+
+	NodeIndex node = add_node(p, AST_GLOBAL, loc, start, end);
+	p->ast->nodes[node].flags = flags;
+	return node;
+}
+
+// FuncDecl <- "fn" Identifier Prototype BlockExpr
+static NodeIndex parse_fn(ParseState *p, u16 flags) {
+	SourceLoc loc = expect(p, TK_FN);
+
+	u32 name = parse_identifier(p);
+	NodeIndex proto = parse_prototype(p);
+	NodeIndex body = parse_block(p);
+
+	NodeIndex node = add_node(p, AST_FN_DECL, loc, name, add_pair(p, proto, body));
+	p->ast->nodes[node].flags = flags;
+	return node;
+}
+
+// PackageHeader <- PackageDecl? Uses?
+static void parse_header(ParseState *p) {
+	if (peek(p) == TK_PACKAGE) {
+		SourceLoc loc = cur(p)->loc;
+		advance(p);
+
+		u32 name = parse_name(p);
+		expect(p, TK_SEMICOLON);
+		scratch_push(p, add_node(p, AST_PACKAGE, loc, name, 0));
+	}
+
+	while (peek(p) == TK_USE || (peek(p) == TK_PUB && peek2(p) == TK_USE)) {
+		u16 flags = accept(p, TK_PUB) ? AST_FLAG_PUB : 0;
+		scratch_push(p, parse_use(p, flags));
+	}
+}
+
+// Height of a child if it's taller than height
+static u32 taller(const ParseState *p, NodeIndex first, u32 height, NodeIndex child) {
+	u32 child_height = child != AST_NONE ? p->heights[child - first] : 0;
+	return child_height > height ? child_height : height;
+}
+
+// Height of the tallest child in a range of the extra array, or height
+static u32 range_height(
+	const ParseState *p, NodeIndex first, u32 height, u32 start, u32 end
+) {
+	for (u32 i = start; i < end; i += 1) {
+		height = taller(p, first, height, p->ast->extra[i]);
+	}
+	return height;
+}
+
+/*
+ * Check the height of the trees of the nodes added since first, the loops of
+ * binary operators, casts and calls build them deeper than the parser nests.
+ * Children are added before their parent, so a single pass is enough.
+ */
+static void check_heights(ParseState *p, NodeIndex first) {
+	const Ast *ast = p->ast;
+	u32 count = ast->nodelen - first;
+	if (count > p->heightsize) {
+		p->heightsize = count > p->heightsize * 2 ? count : p->heightsize * 2;
+		xfree(p->heights);
+		p->heights = xcalloc(MEM_PARSE, p->heightsize, sizeof(u16));
+	}
+
+	for (NodeIndex i = first; i < ast->nodelen; i += 1) {
+		const AstNode *n = &ast->nodes[i];
+		u32 lhs = n->lhs;
+		u32 rhs = n->rhs;
+		u32 height = 0;
+
+		switch ((AstKind)n->kind) {
+		case AST_FN_DECL:
+		case AST_PARAM:
+		case AST_BINDING:
+			height = range_height(p, first, 0, rhs, rhs + 2);
+			break;
+		case AST_GLOBAL:
+		case AST_ARRAY:
+		case AST_BLOCK:
+			height = range_height(p, first, 0, lhs, rhs);
+			break;
+		case AST_PROTOTYPE:
+			height = taller(p, first, 0, rhs);
+			height = range_height(p, first, height, ast->extra[lhs], ast->extra[lhs + 1]);
+			break;
+		case AST_TYPE_PTR:
+		case AST_TYPE_FN:
+		case AST_UNARY:
+			height = taller(p, first, 0, lhs);
+			break;
+		case AST_TYPE_ARRAY:
+		case AST_BINARY:
+		case AST_CAST:
+		case AST_ASSIGN:
+			height = taller(p, first, taller(p, first, 0, lhs), rhs);
+			break;
+		case AST_CALL:
+			height = taller(p, first, 0, lhs);
+			height = range_height(p, first, height, ast->extra[rhs], ast->extra[rhs + 1]);
+			break;
+		case AST_IF:
+			height = range_height(p, first, taller(p, first, 0, lhs), rhs, rhs + 2);
+			break;
+		case AST_FOR:
+			height = taller(p, first, 0, rhs);
+			height = range_height(p, first, height, ast->extra[lhs], ast->extra[lhs + 1]);
+			height = range_height(p, first, height, lhs + 2, lhs + 4);
+			break;
+		default:
+			break; // Leaves
+		}
+
+		if (height >= AST_MAX_DEPTH) {
+			push_error(p, ast->locs[i], "Expression nested too deeply");
+		}
+		p->heights[i - first] = (u16)(height + 1);
+	}
+}
+
+// Declarations <- (FuncDecl ";"? | GlobalVarDecl ";")*
+static void parse_decls(ParseState *p) {
+	while (!at_end(p)) {
+		NodeIndex first = p->ast->nodelen;
+		u16 flags = accept(p, TK_PUB) ? AST_FLAG_PUB : 0;
+
+		switch (peek(p)) {
+		case TK_FN:
+			scratch_push(p, parse_fn(p, flags));
+			accept(p, TK_SEMICOLON); // The ';' after a function body is optional
+			break;
+		case TK_CONST:
+		case TK_MUT:
+			scratch_push(p, parse_global(p, flags));
+			expect(p, TK_SEMICOLON);
+			break;
+		case TK_USE:
+			push_error(p, cur(p)->loc, "'use' must come before other declarations");
+		default:
+			push_error(
+				p, cur(p)->loc, "Expected declaration, found '%s'", tok_name(peek(p))
+			);
+		}
+
+		check_heights(p, first);
+	}
+}
+
+static void parse_init(ParseState *p, LexState *lex, Ast *ast) {
+	*p = (ParseState) {
+		.lex = lex,
+		.ast = ast,
+		.alloc = lex != NULL ? lex->alloc : default_allocator,
+		.scratchsize = 64,
+		.namesize = 64,
+	};
+	p->scratch = xcalloc(MEM_PARSE, p->scratchsize, sizeof(NodeIndex));
+	p->namebuf = xcalloc(MEM_PARSE, p->namesize, sizeof(char));
+}
+
+// Set the root to the declarations in the scratch list and free the state
+static void parse_finish(ParseState *p) {
+	u32 end;
+	u32 start = scratch_commit(p, 0, &end);
+	p->ast->nodes[0] = (AstNode) { .kind = AST_ROOT, .lhs = start, .rhs = end };
+	p->ast->locs[0] = SOURCE_NONE;
+
+	xfree(p->scratch);
+	xfree(p->namebuf);
+	xfree(p->heights);
+}
+
+// PackageUnit <- PackageHeader Declarations
+void parse_unit(LexState *lex, Ast *ast) {
+	ParseState p;
+	parse_init(&p, lex, ast);
+
+	parse_header(&p);
+	parse_decls(&p);
+
+	parse_finish(&p);
+}
+
+bool parse_tokens(
+	Token *tokens, u32 len, const Allocator *alloc, Ast *ast, char *error
+) {
+	// Not on the stack, it's read after longjmp()
+	ParseState *p = xcalloc(MEM_PARSE, 1, sizeof(ParseState));
+	parse_init(p, NULL, ast);
+	p->alloc = alloc != NULL ? *alloc : default_allocator;
+	p->tokens = tokens;
+	p->end = len - 1;
+
+	jmp_buf env;
+	if (setjmp(env) == 0) {
+		p->env = &env;
+		parse_header(p);
+		parse_decls(p);
+
+		parse_finish(p);
+		xfree(p);
+		return true;
+	}
+
+	memcpy(error, p->error, PARSE_ERROR_MAX);
+	xfree(p->scratch);
+	xfree(p->namebuf);
+	xfree(p->heights);
+	xfree(p);
+	return false;
+}
+
+// Declarations parsed by a worker into their own tree
+typedef struct ParseBatch {
+	ParseState state; // Not on the stack, it's read after longjmp()
+	Ast ast;
+	u32 start; // Token range
+	u32 end;
+
+	NodeIndex *decls;
+	u32 decllen;
+	bool failed;
+} ParseBatch;
+
+typedef struct ParseJob {
+	SourceManager *sources;
+	const Allocator *alloc;
+	Token *tokens;
+	ParseBatch *batches;
+	u32 batchlen;
+	atomic_uint next; // Next batch to parse
+} ParseJob;
+
+/*
+ * Find where the top-level declaration at tokens[pos] ends by matching
+ * brackets: functions end at the brace closing their body (and an optional
+ * ';'), globals at the next ';' outside brackets. The result is 0 if the
+ * tokens don't have this shape, the parser reports the error then.
+ */
+static u32 scan_decl(const Token *tokens, u32 pos, u32 end) {
+	if (tokens[pos].kind == TK_PUB) {
+		pos += 1;
+	}
+
+	TokenKind kind = tokens[pos].kind;
+	if (kind != TK_FN && kind != TK_CONST && kind != TK_MUT) {
+		return 0;
+	}
+
+	u32 depth = 0;
+	for (u32 i = pos + 1; i < end; i += 1) {
+		switch (tokens[i].kind) {
+		case TK_PAREN_L:
+		case TK_BRACKET_L:
+		case TK_BRACE_L:
+			depth += 1;
+			break;
+		case TK_PAREN_R:
+		case TK_BRACKET_R:
+		case TK_BRACE_R:
+			if (depth == 0) {
+				return 0;
+			}
+
+			depth -= 1;
+			if (depth == 0 && kind == TK_FN && tokens[i].kind == TK_BRACE_R) {
+				return tokens[i + 1].kind == TK_SEMICOLON ? i + 2 : i + 1;
+			}
+			break;
+		case TK_SEMICOLON:
+			if (depth == 0 && kind != TK_FN) {
+				return i + 1;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void parse_batch(const ParseJob *job, ParseBatch *batch) {
+	TRACE_BEGIN("parse_batch");
+
+	ParseState *p = &batch->state;
+	ast_init(&batch->ast, job->sources);
+	parse_init(p, NULL, &batch->ast);
+	p->alloc = *job->alloc;
+	p->tokens = job->tokens;
+	p->pos = batch->start;
+	p->end = batch->end;
+
+	jmp_buf env;
+	if (setjmp(env) == 0) {
+		p->env = &env;
+		parse_decls(p);
+
+		batch->decllen = p->scratchlen;
+		batch->decls = xcalloc(MEM_PARSE, batch->decllen + 1, sizeof(NodeIndex));
+		memcpy(batch->decls, p->scratch, p->scratchlen * sizeof(NodeIndex));
+	} else {
+		batch->failed = true;
+	}
+
+	xfree(p->scratch);
+	xfree(p->namebuf);
+	xfree(p->heights);
+	TRACE_END("parse_batch");
+}
+
+static void *parse_worker(void *arg) {
+	ParseJob *job = arg;
+	trace_thread_name("parse");
+
+	for (;;) {
+		u32 i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+		if (i >= job->batchlen) {
+			break;
+		}
+		parse_batch(job, &job->batches[i]);
+	}
+
+	return NULL;
+}
+
+// Group the declarations in tokens[pos..end) into batches of similar size,
+// returns 0 if they can't be split
+static u32 split_batches(
+	const Token *tokens, u32 pos, u32 end, u32 jobs, ParseBatch **out
+) {
+	u32 target = (end - pos) / (jobs * PARSE_BATCHES);
+	target = target < PARSE_MIN_BATCH ? PARSE_MIN_BATCH : target;
+	if (jobs < 2 || end - pos < 2 * target) {
+		return 0;
+	}
+
+	u32 size = (end - pos) / target + 1;
+	ParseBatch *batches = xcalloc(MEM_PARSE, size, sizeof(ParseBatch));
+	u32 len = 0;
+
+	u32 start = pos;
+	while (pos < end) {
+		u32 next = scan_decl(tokens, pos, end);
+		if (next == 0) {
+			xfree(batches);
+			return 0;
+		}
+		pos = next;
+
+		if (pos - start >= target || pos == end) {
+			if (len == size) {
+				size *= 2;
+				batches = xrealloc(MEM_PARSE, batches, size * sizeof(ParseBatch));
+			}
+
+			batches[len] = (ParseBatch) { .start = start, .end = pos };
+			len += 1;
+			start = pos;
+		}
+	}
+
+	*out = batches;
+	return len;
+}
+
+// Parse the batches on the worker threads and append their trees in order
+static void parse_batches(ParseState *p, ParseBatch *batches, u32 len, u32 jobs) {
+	ParseJob job = {
+		.sources = p->ast->sources,
+		.alloc = &p->alloc,
+		.tokens = p->tokens,
+		.batches = batches,
+		.batchlen = len,
+	};
+	atomic_init(&job.next, 0);
+
+	u32 threadlen = jobs < len ? jobs : len;
+	pthread_t *threads = xcalloc(MEM_PARSE, threadlen, sizeof(pthread_t));
+	u32 started = 0;
+	while (started < threadlen) {
+		if (pthread_create(&threads[started], NULL, parse_worker, &job) != 0) {
+			break;
+		}
+		started += 1;
+	}
+
+	// The calling thread takes batches too, all of them if no thread started
+	parse_worker(&job);
+	for (u32 i = 0; i < started; i += 1) {
+		pthread_join(threads[i], NULL);
+	}
+	xfree(threads);
+
+	// Only the first error is reported, like when parsing on a single thread
+	for (u32 i = 0; i < len; i += 1) {
+		if (batches[i].failed) {
+			fprintf(stderr, "%s\n", batches[i].state.error);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	TRACE_BEGIN("parse_merge");
+	for (u32 i = 0; i < len; i += 1) {
+		ParseBatch *batch = &batches[i];
+		NodeIndex offset = ast_append(p->ast, &batch->ast);
+		for (u32 j = 0; j < batch->decllen; j += 1) {
+			scratch_push(p, batch->decls[j] + offset);
+		}
+
+		ast_free(&batch->ast);
+		xfree(batch->decls);
+	}
+	TRACE_END("parse_merge");
+}
+
+void parse_unit_parallel(LexState *lex, Ast *ast, u32 jobs) {
+	if (jobs < 2) {
+		parse_unit(lex, ast);
+		return;
+	}
+
+	// The declarations are split on the token stream, so the file is scanned
+	// first, the last token is TK_EOF
+	TRACE_BEGIN("lex_all");
+	u32 len;
+	Token *tokens = lex_scan_all(lex, MEM_PARSE, &len);
+	TRACE_END("lex_all");
+
+	ParseState p;
+	parse_init(&p, lex, ast);
+	p.tokens = tokens;
+	p.end = len - 1;
+
+	parse_header(&p);
+
+	ParseBatch *batches = NULL;
+	u32 batchlen = split_batches(tokens, p.pos, p.end, jobs, &batches);
+	if (batchlen > 1) {
+		parse_batches(&p, batches, batchlen, jobs - 1);
+	} else {
+		parse_decls(&p); // Small or malformed, not worth the threads
+	}
+	xfree(batches);
+
+	parse_finish(&p);
+
+	for (u32 i = 0; i < len; i += 1) {
+		lex_release(lex, &tokens[i]);
+	}
+	xfree(tokens);
+}
+
+// Scan the file into the pipe, lexer errors jump out of it
+static void pipe_scan(TokenPipe *pipe) {
+	u32 head = 0;
+	for (;;) {
+		u32 tail = pipe->produced;
+		if (tail - head == PIPE_SIZE) {
+			// Published first, the parser may be waiting for these tokens
+			atomic_store_explicit(&pipe->tail, tail, memory_order_release);
+			head = pipe_wait(&pipe->head, head);
+			continue;
+		}
+
+		Token *tok = &pipe->ring[tail & (PIPE_SIZE - 1)];
+		*tok = (Token) { 0 };
+		TokenKind kind = lex_scan(pipe->lex, tok);
+		pipe->produced = tail + 1;
+
+		if (kind == TK_EOF || pipe->produced % PIPE_BATCH == 0) {
+			atomic_store_explicit(&pipe->tail, pipe->produced, memory_order_release);
+		}
+		if (kind == TK_EOF) {
+			break;
+		}
+	}
+}
+
+static void *pipe_lexer(void *arg) {
+	TokenPipe *pipe = arg;
+	trace_thread_name("lex");
+	TRACE_BEGIN("lex_pipe");
+
+	// The error is ended with TK_ERROR, the parser reports it once it gets there
+	jmp_buf env;
+	if (setjmp(env) == 0) {
+		pipe->lex->env = &env;
+		pipe_scan(pipe);
+	} else {
+		Token *tok = &pipe->ring[pipe->produced & (PIPE_SIZE - 1)];
+		SourceLoc loc = pipe->lex->base + (SourceLoc)pipe->lex->here;
+		*tok = (Token) { .kind = TK_ERROR, .loc = loc };
+		atomic_store_explicit(&pipe->tail, pipe->produced + 1, memory_order_release);
+	}
+	pipe->lex->env = NULL;
+
+	TRACE_END("lex_pipe");
+	return NULL;
+}
+
+void parse_unit_pipelined(LexState *lex, Ast *ast) {
+	TokenPipe *pipe = xcalloc(MEM_PARSE, 1, sizeof(TokenPipe));
+	pipe->lex = lex;
+	pipe->ring = xcalloc(MEM_PARSE, PIPE_SIZE, sizeof(Token));
+	atomic_init(&pipe->tail, 0);
+	atomic_init(&pipe->head, 0);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, pipe_lexer, pipe) != 0) {
+		xfree(pipe->ring);
+		xfree(pipe);
+		parse_unit(lex, ast);
+		return;
+	}
+
+	ParseState p;
+	parse_init(&p, lex, ast);
+	p.pipe = pipe;
+
+	parse_header(&p);
+	parse_decls(&p);
+
+	parse_finish(&p);
+
+	// The lexer is done once the parser reached TK_EOF
+	pthread_join(thread, NULL);
+	xfree(pipe->ring);
+	xfree(pipe);
+}
@@ -0,0 +1,160 @@
+#include "perf.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
+
+static const char *names[] = {
+	[PERF_INSTRUCTIONS] = "instructions",
+	[PERF_CYCLES] = "cycles",
+	[PERF_BRANCH_MISSES] = "branch-misses",
+	[PERF_L1D_MISSES] = "L1D-misses",
+};
+
+static u64 now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000u + (u64)ts.tv_nsec;
+}
+
+#ifdef __linux__
+static int open_counter(PerfCounter counter) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	switch (counter) {
+	case PERF_INSTRUCTIONS:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case PERF_CYCLES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case PERF_BRANCH_MISSES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+		break;
+	case PERF_L1D_MISSES:
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		break;
+	case PERF_COUNTER_COUNT:
+		return -1;
+	}
+
+	// Measure the calling thread on any CPU
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+bool perf_open(PerfCounters *perf) {
+	memset(perf, 0, sizeof(PerfCounters));
+
+	bool any = false;
+	for (usize i = 0; i < PERF_COUNTER_COUNT; i += 1) {
+#ifdef __linux__
+		perf->fds[i] = open_counter((PerfCounter)i);
+#else
+		perf->fds[i] = -1;
+#endif
+		any = any || perf->fds[i] >= 0;
+	}
+
+	return any;
+}
+
+void perf_close(PerfCounters *perf) {
+	for (usize i = 0; i < PERF_COUNTER_COUNT; i += 1) {
+#ifdef __linux__
+		if (perf->fds[i] >= 0) {
+			close(perf->fds[i]);
+		}
+#endif
+		perf->fds[i] = -1;
+	}
+}
+
+void perf_start(PerfCounters *perf) {
+#ifdef __linux__
+	for (usize i = 0; i < PERF_COUNTER_COUNT; i += 1) {
+		if (perf->fds[i] >= 0) {
+			ioctl(perf->fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(perf->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#endif
+
+	perf->start = now_ns();
+}
+
+void perf_stop(PerfCounters *perf) {
+	perf->elapsed += now_ns() - perf->start;
+
+#ifdef __linux__
+	for (usize i = 0; i < PERF_COUNTER_COUNT; i += 1) {
+		if (perf->fds[i] < 0) {
+			continue;
+		}
+
+		ioctl(perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+		u64 data[3]; // Value, time enabled, time running
+		if (read(perf->fds[i], data, sizeof(data)) != sizeof(data)) {
+			continue;
+		}
+
+		// Scale the value if the counter was multiplexed with other events
+		if (data[2] > 0 && data[2] < data[1]) {
+			data[0] = (u64)((double)data[0] * ((double)data[1] / (double)data[2]));
+		}
+		perf->values[i] += data[0];
+	}
+#endif
+}
+
+void perf_report(const PerfCounters *perf, const char *phase, usize bytes, FILE *out) {
+	f64 ms = (f64)perf->elapsed / 1e6;
+	f64 kb = (f64)bytes / 1024.0;
+
+	fprintf(out, "%s: %zu bytes in %.3f ms", phase, bytes, ms);
+	if (perf->elapsed > 0) {
+		fprintf(out, " (%.1f MB/s)", (f64)bytes / 1e6 / ((f64)perf->elapsed / 1e9));
+	}
+	fprintf(out, "\n");
+
+	for (usize i = 0; i < PERF_COUNTER_COUNT; i += 1) {
+		if (perf->fds[i] < 0) {
+			fprintf(out, "  %-14s unavailable\n", names[i]);
+		} else if (i == PERF_INSTRUCTIONS || i == PERF_CYCLES || kb == 0) {
+			fprintf(
+				out, "  %-14s %12llu\n", names[i], (unsigned long long)perf->values[i]
+			);
+		} else {
+			fprintf(
+				out, "  %-14s %12llu (%.2f per KB)\n", names[i],
+				(unsigned long long)perf->values[i], (f64)perf->values[i] / kb
+			);
+		}
+	}
+
+	if (perf->fds[PERF_INSTRUCTIONS] >= 0 && perf->fds[PERF_CYCLES] >= 0
+	    && perf->values[PERF_CYCLES] > 0) {
+		fprintf(
+			out, "  %-14s %12.2f\n", "IPC",
+			(f64)perf->values[PERF_INSTRUCTIONS] / (f64)perf->values[PERF_CYCLES]
+		);
+	}
+}
@@ -0,0 +1,208 @@
+#include "resolve.h"
+
+#include "symtab.h"
+#include "util.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+typedef struct ResolveState {
+	const Ast *ast;
+	const char *path;
+	NodeIndex *decls;
+	SymbolTable syms;
+	bool ok;
+} ResolveState;
+
+static void push_error(ResolveState *r, NodeIndex node, const char *fmt, ...) {
+	Location loc = source_decode(r->ast->sources, r->ast->locs[node], NULL);
+	fprintf(stderr, "%s:%d:%d ", r->path, loc.lineno, loc.colno);
+
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+
+	fprintf(stderr, "\n");
+	r->ok = false;
+}
+
+static const char *name_str(ResolveState *r, u32 name) {
+	return intern_str(&r->ast->names, name);
+}
+
+static void declare(ResolveState *r, u32 name, NodeIndex decl) {
+	if (symtab_declare(&r->syms, name, decl) == SYM_NONE) {
+		push_error(r, decl, "'%s' is already declared in this scope", name_str(r, name));
+	}
+}
+
+static void resolve_node(ResolveState *r, NodeIndex node);
+
+static void resolve_range(ResolveState *r, u32 start, u32 end) {
+	for (u32 i = start; i < end; i += 1) {
+		resolve_node(r, r->ast->extra[i]);
+	}
+}
+
+static void resolve_ident(ResolveState *r, NodeIndex node) {
+	u32 name = r->ast->nodes[node].lhs;
+	if (memchr(name_str(r, name), ':', intern_len(&r->ast->names, name)) != NULL) {
+		return; // Qualified name
+	}
+
+	u32 sym = symtab_lookup(&r->syms, name);
+	if (sym == SYM_NONE) {
+		push_error(r, node, "Undefined name '%s'", name_str(r, name));
+		return;
+	}
+
+	r->decls[node] = symtab_get(&r->syms, sym)->decl;
+}
+
+// AssignTarget of an identifier must be a mutable binding
+static void check_assign(ResolveState *r, NodeIndex target) {
+	const Ast *ast = r->ast;
+	if (ast->nodes[target].kind != AST_IDENT || r->decls[target] == AST_NONE) {
+		return;
+	}
+
+	const AstNode *decl = &ast->nodes[r->decls[target]];
+	if (decl->kind == AST_FN_DECL
+	    || (decl->kind == AST_BINDING && (decl->flags & AST_FLAG_MUT) == 0)) {
+		push_error(
+			r, target, "Cannot assign to constant '%s'", name_str(r, decl->lhs)
+		);
+	}
+}
+
+// Parameter names of function types aren't in scope anywhere
+static void resolve_prototype(ResolveState *r, NodeIndex proto, bool declare_params) {
+	const Ast *ast = r->ast;
+	const AstNode *n = &ast->nodes[proto];
+
+	for (u32 i = ast->extra[n->lhs]; i < ast->extra[n->lhs + 1]; i += 1) {
+		NodeIndex param = ast->extra[i];
+		const AstNode *p = &ast->nodes[param];
+
+		resolve_node(r, ast->extra[p->rhs]);
+		resolve_node(r, ast->extra[p->rhs + 1]);
+		if (declare_params) {
+			declare(r, p->lhs, param);
+		}
+	}
+
+	resolve_node(r, n->rhs);
+}
+
+static void resolve_node(ResolveState *r, NodeIndex node) {
+	if (node == AST_NONE) {
+		return;
+	}
+
+	const Ast *ast = r->ast;
+	const AstNode *n = &ast->nodes[node];
+
+	switch ((AstKind)n->kind) {
+	case AST_IDENT:
+		resolve_ident(r, node);
+		break;
+	case AST_BINARY:
+	case AST_CAST:
+	case AST_TYPE_ARRAY:
+		resolve_node(r, n->lhs);
+		resolve_node(r, n->rhs);
+		break;
+	case AST_ASSIGN:
+		resolve_node(r, n->lhs);
+		resolve_node(r, n->rhs);
+		check_assign(r, n->lhs);
+		break;
+	case AST_UNARY:
+	case AST_TYPE_PTR:
+		resolve_node(r, n->lhs);
+		break;
+	case AST_TYPE_FN:
+		resolve_prototype(r, n->lhs, false);
+		break;
+	case AST_CALL:
+		resolve_node(r, n->lhs);
+		resolve_range(r, ast->extra[n->rhs], ast->extra[n->rhs + 1]);
+		break;
+	case AST_ARRAY:
+		resolve_range(r, n->lhs, n->rhs);
+		break;
+	case AST_BLOCK:
+		symtab_enter(&r->syms);
+		resolve_range(r, n->lhs, n->rhs);
+		symtab_exit(&r->syms);
+		break;
+	case AST_IF:
+		resolve_node(r, n->lhs);
+		resolve_node(r, ast->extra[n->rhs]);
+		resolve_node(r, ast->extra[n->rhs + 1]);
+		break;
+	case AST_FOR: {
+		const u32 *fields = ast->extra + n->lhs; // InitStart, InitEnd, Cond, Post
+
+		symtab_enter(&r->syms);
+		resolve_range(r, fields[0], fields[1]);
+		resolve_node(r, fields[2]);
+		resolve_node(r, fields[3]);
+		resolve_node(r, n->rhs);
+		symtab_exit(&r->syms);
+	} break;
+	case AST_BINDING:
+		// The name is visible after the initializer, so "x := x + 1" uses the
+		// outer x.
+		resolve_node(r, ast->extra[n->rhs]);
+		resolve_node(r, ast->extra[n->rhs + 1]);
+		declare(r, n->lhs, node);
+		break;
+	case AST_FN_DECL:
+		symtab_enter(&r->syms);
+		resolve_prototype(r, ast->extra[n->rhs], true);
+		resolve_node(r, ast->extra[n->rhs + 1]);
+		symtab_exit(&r->syms);
+		break;
+	case AST_GLOBAL:
+		for (u32 i = n->lhs; i < n->rhs; i += 1) {
+			const AstNode *binding = &ast->nodes[ast->extra[i]];
+			resolve_node(r, ast->extra[binding->rhs]);
+			resolve_node(r, ast->extra[binding->rhs + 1]);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+bool resolve_unit(const Ast *ast, const char *path, NodeIndex *decls) {
+	ResolveState r = { .ast = ast, .path = path, .decls = decls, .ok = true };
+	symtab_init(&r.syms);
+	memset(decls, 0, ast->nodelen * sizeof(NodeIndex));
+
+	// Package-level declarations are visible before they're declared
+	symtab_enter(&r.syms);
+	const AstNode *root = &ast->nodes[0];
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		NodeIndex decl = ast->extra[i];
+		const AstNode *n = &ast->nodes[decl];
+
+		if (n->kind == AST_FN_DECL) {
+			declare(&r, n->lhs, decl);
+		} else if (n->kind == AST_GLOBAL) {
+			for (u32 j = n->lhs; j < n->rhs; j += 1) {
+				declare(&r, ast->nodes[ast->extra[j]].lhs, ast->extra[j]);
+			}
+		}
+	}
+
+	for (u32 i = root->lhs; i < root->rhs; i += 1) {
+		resolve_node(&r, ast->extra[i]);
+	}
+	symtab_exit(&r.syms);
+
+	symtab_free(&r.syms);
+	return r.ok;
+}
@@ -0,0 +1,420 @@
+#include "server.h"
+
+#include "cache.h"
+#include "deps.h"
+#include "lex.h"
+#include "util.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVER_CACHE_MAX   1024    // Files kept in memory, least recently used go first
+#define SERVER_CLIENTS_MAX 64      // Connections served at the same time
+#define SERVER_LINE_MAX    1048576 // Longest request, longer ones close the connection
+
+typedef struct Client {
+	int fd;
+	char *buf; // Bytes received and not yet handled
+	usize len;
+	usize size;
+} Client;
+
+typedef struct Server {
+	int listenfd;
+
+	SourceCache cache; // Its clock is incremented by each request
+
+	Client clients[SERVER_CLIENTS_MAX];
+	u32 clientlen;
+
+	// Temporary file receiving stderr while a request runs
+	FILE *capture;
+	int stderrfd;
+
+	bool stop;
+} Server;
+
+static volatile sig_atomic_t stop_signal = 0;
+
+static void on_signal(int sig) {
+	(void)sig;
+	stop_signal = 1;
+}
+
+// Bytes written to stderr since the start of the request
+static usize capture_offset(Server *s) {
+	fflush(stderr);
+	off_t offset = lseek(fileno(s->capture), 0, SEEK_END);
+	return offset < 0 ? 0 : (usize)offset;
+}
+
+static char *capture_read(Server *s, usize from, usize to) {
+	char *buf = xcalloc(MEM_SERVER, to - from + 1, sizeof(char));
+	usize done = 0;
+	while (done < to - from) {
+		ssize_t n = pread(
+			fileno(s->capture), buf + done, to - from - done, (off_t)(from + done)
+		);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			break;
+		}
+		done += (usize)n;
+	}
+	return buf;
+}
+
+static void print_token(SourceManager *sources, Token *tok, FILE *out) {
+	Location loc = source_decode(sources, tok->loc, NULL);
+	fprintf(out, "%d:%d ", loc.lineno, loc.colno);
+
+	if (tok->kind <= TK_LAST_OPERATOR) {
+		fprintf(out, "%s\n", lex_tok2str(tok->kind));
+	} else if (tok->kind == TK_IDENTIFIER) {
+		fprintf(out, "%s\n", tok->ident);
+	} else if (tok->kind == TK_EOF) {
+		fprintf(out, "<eof>\n");
+	} else if (tok->storage == TYPE_STRING) {
+		// The cache scans with the default allocator
+		usize len;
+		const char *str = tok_string_value(tok, &default_allocator, &len);
+		if (str != NULL) {
+			fprintf(out, "\"%.*s\"\n", (int)len, str);
+		} else {
+			fprintf(out, "%.*s\n", (int)tok->len, tok->text);
+		}
+	} else if (tok->storage == TYPE_RUNE) {
+		fprintf(out, "U+%04X\n", tok->rune);
+	} else if (tok->storage == TYPE_FLOAT) {
+		f64 value;
+		if (tok_float_value(tok, &default_allocator, &value)) {
+			fprintf(out, "%g\n", value);
+		} else {
+			fprintf(out, "%.*s\n", (int)tok->len, tok->text);
+		}
+	} else {
+		u64 value;
+		if (tok_int_value(tok, &value)) {
+			fprintf(out, "%llu\n", (unsigned long long)value);
+		} else {
+			fprintf(out, "%.*s\n", (int)tok->len, tok->text);
+		}
+	}
+}
+
+static bool cmd_tokens(Server *s, const char *path, FILE *out) {
+	CacheEntry *e = cache_get(&s->cache, path);
+	if (e == NULL) {
+		log_error("Failed to open file: %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	cache_lex(&s->cache, e);
+	for (u32 i = 0; i < e->tokenlen; i += 1) {
+		print_token(&s->cache.sources, &e->tokens[i], out);
+	}
+
+	if (e->lexerror != NULL) {
+		fprintf(stderr, "%s:%s\n", e->path, e->lexerror);
+		return false;
+	}
+	return true;
+}
+
+static bool cmd_check(Server *s, const char *path) {
+	CacheEntry *e = cache_get(&s->cache, path);
+	if (e == NULL) {
+		log_error("Failed to open file: %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	if (e->checked) {
+		fwrite(e->diag, 1, e->diaglen, stderr);
+		return e->checkok;
+	}
+
+	usize from = capture_offset(s);
+	e->checkok = cache_check(&s->cache, e);
+	usize to = capture_offset(s);
+
+	e->diag = capture_read(s, from, to);
+	e->diaglen = to - from;
+	e->checked = true;
+	return e->checkok;
+}
+
+static bool cmd_deps(Server *s, char **paths, u32 count, FILE *out) {
+	DepsGraph graph;
+	deps_init(&graph);
+
+	bool ok = true;
+	for (u32 i = 0; i < count; i += 1) {
+		CacheEntry *e = cache_get(&s->cache, paths[i]);
+		if (e == NULL) {
+			log_error("Failed to open file: %s: %s", paths[i], strerror(errno));
+			ok = false;
+		} else {
+			ok = deps_scan_source(&graph, &s->cache.sources, e->file) && ok;
+		}
+	}
+
+	u32 *order = xcalloc(MEM_DEPS, graph.nodelen + 1, sizeof(u32));
+	ok = ok && deps_sort(&graph, order);
+	if (ok) {
+		deps_print(&graph, order, out);
+	}
+
+	xfree(order);
+	deps_free(&graph);
+	return ok;
+}
+
+static bool write_all(int fd, const char *buf, usize len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			return false;
+		}
+		buf += n;
+		len -= (usize)n;
+	}
+	return true;
+}
+
+// Split the request on spaces in place, returns the number of words
+static u32 split_words(char *line, char ***words) {
+	u32 size = 8;
+	u32 len = 0;
+	char **list = xcalloc(MEM_SERVER, size, sizeof(char *));
+
+	for (char *word = strtok(line, " \t\r"); word != NULL; word = strtok(NULL, " \t\r")) {
+		if (len == size) {
+			size *= 2;
+			list = xrealloc(MEM_SERVER, list, size * sizeof(char *));
+		}
+		list[len] = word;
+		len += 1;
+	}
+
+	*words = list;
+	return len;
+}
+
+// Handle a request line and send the response, false if the client is gone
+static bool handle_request(Server *s, int fd, char *line) {
+	s->cache.clock += 1;
+
+	char **words;
+	u32 count = split_words(line, &words);
+	if (count == 0) {
+		xfree(words);
+		return true;
+	}
+
+	char *outbuf = NULL;
+	size_t outlen = 0;
+	FILE *out = open_memstream(&outbuf, &outlen);
+
+	// Diagnostics are written to stderr by every phase, so it's redirected
+	fflush(stderr);
+	rewind(s->capture);
+	if (ftruncate(fileno(s->capture), 0) != 0 || out == NULL) {
+		log_fatal("Failed to set up the request buffers: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	dup2(fileno(s->capture), STDERR_FILENO);
+
+	bool ok;
+	const char *cmd = words[0];
+	if (strcmp(cmd, "tokens") == 0 && count == 2) {
+		ok = cmd_tokens(s, words[1], out);
+	} else if (strcmp(cmd, "check") == 0 && count == 2) {
+		ok = cmd_check(s, words[1]);
+	} else if (strcmp(cmd, "deps") == 0 && count >= 2) {
+		ok = cmd_deps(s, words + 1, count - 1, out);
+	} else if (strcmp(cmd, "stats") == 0 && count == 1) {
+		fprintf(
+			out, "files %u\nhits %llu\nreloads %llu\nmisses %llu\n", s->cache.cached,
+			(unsigned long long)s->cache.hits, (unsigned long long)s->cache.reloads,
+			(unsigned long long)s->cache.misses
+		);
+		ok = true;
+	} else if (strcmp(cmd, "quit") == 0 && count == 1) {
+		s->stop = true;
+		ok = true;
+	} else {
+		fprintf(stderr, "Unknown request: %s\n", cmd);
+		ok = false;
+	}
+
+	usize errlen = capture_offset(s);
+	char *errbuf = capture_read(s, 0, errlen);
+	dup2(s->stderrfd, STDERR_FILENO);
+	fclose(out);
+
+	char header[64];
+	int len = snprintf(
+		header, sizeof(header), "%s %zu %zu\n", ok ? "ok" : "fail", outlen, errlen
+	);
+	bool sent = write_all(fd, header, (usize)len) && write_all(fd, outbuf, outlen)
+	         && write_all(fd, errbuf, errlen);
+
+	free(outbuf); // From open_memstream()
+	xfree(errbuf);
+	xfree(words);
+
+	cache_evict(&s->cache, SERVER_CACHE_MAX);
+	return sent;
+}
+
+static void client_close(Server *s, u32 index) {
+	close(s->clients[index].fd);
+	xfree(s->clients[index].buf);
+
+	s->clientlen -= 1;
+	s->clients[index] = s->clients[s->clientlen];
+}
+
+// Read what the client sent and handle the complete lines, false to close it
+static bool client_read(Server *s, Client *c) {
+	if (c->size - c->len < 4096) {
+		if (c->size >= SERVER_LINE_MAX) {
+			return false;
+		}
+		c->size *= 2;
+		c->buf = xrealloc(MEM_SERVER, c->buf, c->size);
+	}
+
+	ssize_t n = read(c->fd, c->buf + c->len, c->size - c->len - 1);
+	if (n < 0 && errno == EINTR) {
+		return true;
+	} else if (n <= 0) {
+		return false;
+	}
+	c->len += (usize)n;
+
+	usize start = 0;
+	for (usize i = c->len - (usize)n; i < c->len && !s->stop; i += 1) {
+		if (c->buf[i] == '\n') {
+			c->buf[i] = '\0';
+			if (!handle_request(s, c->fd, c->buf + start)) {
+				return false;
+			}
+			start = i + 1;
+		}
+	}
+
+	memmove(c->buf, c->buf + start, c->len - start);
+	c->len -= start;
+	return true;
+}
+
+static bool server_listen(Server *s, const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_fatal("Socket path too long: %s", path);
+		return false;
+	}
+	memcpy(addr.sun_path, path, strlen(path) + 1);
+
+	s->listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s->listenfd < 0) {
+		log_fatal("Failed to create socket: %s", strerror(errno));
+		return false;
+	}
+
+	unlink(path);
+	if (bind(s->listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || listen(s->listenfd, SERVER_CLIENTS_MAX) != 0) {
+		log_fatal("Failed to listen on %s: %s", path, strerror(errno));
+		close(s->listenfd);
+		return false;
+	}
+
+	return true;
+}
+
+int server_run(const char *path) {
+	Server s = { 0 };
+	if (!server_listen(&s, path)) {
+		return EXIT_FAILURE;
+	}
+
+	s.capture = tmpfile();
+	s.stderrfd = dup(STDERR_FILENO);
+	if (s.capture == NULL || s.stderrfd < 0) {
+		log_fatal("Failed to create the diagnostics buffer: %s", strerror(errno));
+		close(s.listenfd);
+		unlink(path);
+		return EXIT_FAILURE;
+	}
+
+	cache_init(&s.cache);
+
+	// Interrupt poll() to clean up, and survive clients closing early
+	struct sigaction action = { .sa_handler = on_signal };
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	log_info("Listening on %s", path);
+
+	struct pollfd fds[SERVER_CLIENTS_MAX + 1];
+	while (!s.stop && !stop_signal) {
+		fds[0] = (struct pollfd) { .fd = s.listenfd, .events = POLLIN };
+		for (u32 i = 0; i < s.clientlen; i += 1) {
+			fds[i + 1] = (struct pollfd) { .fd = s.clients[i].fd, .events = POLLIN };
+		}
+
+		u32 count = s.clientlen;
+		if (poll(fds, count + 1, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_fatal("poll() failed: %s", strerror(errno));
+			break;
+		}
+
+		// Backwards since closing a client moves the last one in its place
+		for (u32 i = count; i > 0 && !s.stop; i -= 1) {
+			if (fds[i].revents != 0 && !client_read(&s, &s.clients[i - 1])) {
+				client_close(&s, i - 1);
+			}
+		}
+
+		if ((fds[0].revents & POLLIN) != 0) {
+			int fd = accept(s.listenfd, NULL, NULL);
+			if (fd >= 0 && s.clientlen == SERVER_CLIENTS_MAX) {
+				close(fd);
+			} else if (fd >= 0) {
+				Client *c = &s.clients[s.clientlen];
+				*c = (Client) { .fd = fd, .size = 4096 };
+				c->buf = xcalloc(MEM_SERVER, c->size, sizeof(char));
+				s.clientlen += 1;
+			}
+		}
+	}
+
+	while (s.clientlen > 0) {
+		client_close(&s, s.clientlen - 1);
+	}
+	cache_free(&s.cache);
+
+	fclose(s.capture);
+	close(s.stderrfd);
+	close(s.listenfd);
+	unlink(path);
+
+	log_info("Server stopped");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,352 @@
+#include "source.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct SourceBuffer {
+	char *path; // NULL once removed, the range is free then
+	char *data;
+	usize len;
+	usize size; // Bytes allocated for data if owned
+	bool owned;
+
+	SourceLoc base; // Location of the first byte
+	u32 span;       // Locations of the range, 0 once merged into the one before
+
+	u32 *lines; // Offsets of the line starts, built on the first decode
+	u32 linelen;
+	u32 linesize;
+} SourceBuffer;
+
+void source_init(SourceManager *sm, const Allocator *alloc) {
+	*sm = (SourceManager) {
+		.alloc = alloc != NULL ? *alloc : default_allocator,
+		.next = 1,
+	};
+	pthread_mutex_init(&sm->lock, NULL);
+}
+
+static void buffer_clear(SourceManager *sm, SourceBuffer *buf) {
+	if (buf->owned) {
+		sm->alloc.free(sm->alloc.ctx, buf->data, buf->size);
+	}
+	if (buf->lines != NULL) {
+		sm->alloc.free(sm->alloc.ctx, buf->lines, buf->linesize * sizeof(u32));
+	}
+	sm->alloc.free(sm->alloc.ctx, buf->path, strlen(buf->path) + 1);
+
+	buf->path = NULL;
+	buf->data = NULL;
+	buf->owned = false;
+	buf->lines = NULL;
+	buf->linelen = 0;
+	buf->linesize = 0;
+}
+
+void source_free(SourceManager *sm) {
+	for (u32 i = 0; i < sm->filelen; i += 1) {
+		if (sm->files[i].path != NULL) {
+			buffer_clear(sm, &sm->files[i]);
+		}
+	}
+	if (sm->files != NULL) {
+		sm->alloc.free(sm->alloc.ctx, sm->files, sm->filesize * sizeof(SourceBuffer));
+	}
+	pthread_mutex_destroy(&sm->lock);
+}
+
+// First free range of at least span locations, or filelen
+static u32 find_range(const SourceManager *sm, u64 span) {
+	for (u32 i = 0; i < sm->filelen && sm->holes > 0; i += 1) {
+		if (sm->files[i].path == NULL && sm->files[i].span >= span) {
+			return i;
+		}
+	}
+	return sm->filelen;
+}
+
+static bool grow_files(SourceManager *sm) {
+	u32 size = sm->filesize == 0 ? 64 : sm->filesize * 2;
+	SourceBuffer *files;
+	if (sm->files == NULL) {
+		files = sm->alloc.alloc(sm->alloc.ctx, size * sizeof(SourceBuffer), MEM_SOURCE);
+	} else {
+		files = sm->alloc.realloc(
+			sm->alloc.ctx, sm->files, sm->filesize * sizeof(SourceBuffer),
+			size * sizeof(SourceBuffer)
+		);
+	}
+	if (files == NULL) {
+		return false;
+	}
+
+	sm->files = files;
+	sm->filesize = size;
+	return true;
+}
+
+// Register a buffer of size bytes if owned, which is freed on failure
+static u32 add_buffer(
+	SourceManager *sm, const char *path, char *data, usize len, usize size, bool owned
+) {
+	pthread_mutex_lock(&sm->lock);
+
+	u64 span = (u64)len + 1; // The end of the file has a location too
+	u32 index = find_range(sm, span);
+	int error = 0;
+	if (index == sm->filelen && span > UINT32_MAX - sm->next) {
+		error = EOVERFLOW;
+	} else if (index == sm->filelen && sm->filelen == sm->filesize && !grow_files(sm)) {
+		error = ENOMEM;
+	}
+
+	usize pathlen = strlen(path);
+	char *copy = NULL;
+	if (error == 0) {
+		copy = sm->alloc.alloc(sm->alloc.ctx, pathlen + 1, MEM_SOURCE);
+		error = copy == NULL ? ENOMEM : 0;
+	}
+
+	if (error != 0) {
+		pthread_mutex_unlock(&sm->lock);
+		if (owned) {
+			sm->alloc.free(sm->alloc.ctx, data, size);
+		}
+		errno = error;
+		return 0;
+	}
+	memcpy(copy, path, pathlen + 1);
+
+	SourceBuffer *buf = &sm->files[index];
+	if (index == sm->filelen) {
+		*buf = (SourceBuffer) { .base = (SourceLoc)sm->next, .span = (u32)span };
+		sm->filelen += 1;
+		sm->next += span;
+	} else {
+		sm->holes -= 1;
+	}
+
+	// A reused range keeps its span, the locations past the file stay unused
+	buf->path = copy;
+	buf->data = data;
+	buf->len = len;
+	buf->size = size;
+	buf->owned = owned;
+
+	pthread_mutex_unlock(&sm->lock);
+	return index + 1;
+}
+
+u32 source_add(SourceManager *sm, const char *path, char *data, usize len, bool owned) {
+	return add_buffer(sm, path, data, len, len + 1, owned);
+}
+
+u32 source_load(SourceManager *sm, const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return 0;
+	}
+
+	usize size = (usize)st.st_size + 1;
+	char *data = sm->alloc.alloc(sm->alloc.ctx, size, MEM_SOURCE);
+	if (data == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return 0;
+	}
+
+	usize done = 0;
+	while (done < size - 1) {
+		ssize_t n = read(fd, data + done, size - 1 - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			int error = errno;
+			sm->alloc.free(sm->alloc.ctx, data, size);
+			close(fd);
+			errno = error;
+			return 0;
+		} else if (n == 0) {
+			break; // Truncated meanwhile
+		}
+		done += (usize)n;
+	}
+	close(fd);
+
+	return add_buffer(sm, path, data, done, size, true);
+}
+
+void source_remove(SourceManager *sm, u32 file) {
+	pthread_mutex_lock(&sm->lock);
+	assert(file > 0 && file <= sm->filelen && sm->files[file - 1].path != NULL);
+
+	u32 index = file - 1;
+	SourceBuffer *buf = &sm->files[index];
+	buffer_clear(sm, buf);
+	sm->holes += 1;
+
+	// Ranges merged into the one before are skipped to find the neighbors
+	u32 next = index + 1;
+	while (next < sm->filelen && sm->files[next].span == 0) {
+		next += 1;
+	}
+	if (next < sm->filelen && sm->files[next].path == NULL) {
+		buf->span += sm->files[next].span;
+		sm->files[next].span = 0;
+		sm->holes -= 1;
+	}
+
+	u32 prev = index;
+	while (prev > 0 && sm->files[prev - 1].span == 0) {
+		prev -= 1;
+	}
+	if (prev > 0 && sm->files[prev - 1].path == NULL) {
+		sm->files[prev - 1].span += buf->span;
+		buf->span = 0;
+		sm->holes -= 1;
+	}
+
+	// Free ranges at the end are given back to the space
+	while (sm->filelen > 0 && sm->files[sm->filelen - 1].path == NULL) {
+		sm->holes -= sm->files[sm->filelen - 1].span > 0 ? 1 : 0;
+		sm->filelen -= 1;
+	}
+	const SourceBuffer *last = sm->filelen > 0 ? &sm->files[sm->filelen - 1] : NULL;
+	sm->next = last != NULL ? (u64)last->base + last->span : 1;
+
+	pthread_mutex_unlock(&sm->lock);
+}
+
+const char *source_path(SourceManager *sm, u32 file) {
+	pthread_mutex_lock(&sm->lock);
+	assert(file > 0 && file <= sm->filelen);
+	const char *path = sm->files[file - 1].path;
+	pthread_mutex_unlock(&sm->lock);
+	return path;
+}
+
+const char *source_data(SourceManager *sm, u32 file, usize *len) {
+	pthread_mutex_lock(&sm->lock);
+	assert(file > 0 && file <= sm->filelen);
+	const SourceBuffer *buf = &sm->files[file - 1];
+	const char *data = buf->data;
+	*len = buf->len;
+	pthread_mutex_unlock(&sm->lock);
+	return data;
+}
+
+SourceLoc source_loc(SourceManager *sm, u32 file, usize offset) {
+	pthread_mutex_lock(&sm->lock);
+	assert(file > 0 && file <= sm->filelen);
+	assert(offset <= sm->files[file - 1].len);
+	SourceLoc loc = sm->files[file - 1].base + (SourceLoc)offset;
+	pthread_mutex_unlock(&sm->lock);
+	return loc;
+}
+
+static bool build_lines(SourceManager *sm, SourceBuffer *buf) {
+	u32 size = 64;
+	u32 *lines = sm->alloc.alloc(sm->alloc.ctx, size * sizeof(u32), MEM_SOURCE);
+	if (lines == NULL) {
+		return false;
+	}
+	u32 len = 1; // The first line starts at 0
+
+	for (usize i = 0; i < buf->len; i += 1) {
+		if (buf->data[i] != '\n') {
+			continue;
+		}
+
+		if (len == size) {
+			u32 *grown = sm->alloc.realloc(
+				sm->alloc.ctx, lines, size * sizeof(u32), size * 2 * sizeof(u32)
+			);
+			if (grown == NULL) {
+				sm->alloc.free(sm->alloc.ctx, lines, size * sizeof(u32));
+				return false;
+			}
+			lines = grown;
+			size *= 2;
+		}
+		lines[len] = (u32)i + 1;
+		len += 1;
+	}
+
+	buf->lines = lines;
+	buf->linelen = len;
+	buf->linesize = size;
+	return true;
+}
+
+Location source_decode(SourceManager *sm, SourceLoc loc, u32 *file) {
+	Location result = { 0 };
+	if (file != NULL) {
+		*file = 0;
+	}
+
+	pthread_mutex_lock(&sm->lock);
+
+	// Last range starting at or before the location
+	u32 lo = 0;
+	u32 hi = sm->filelen;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (sm->files[mid].base <= loc) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	// A range merged into the one before is part of it
+	while (lo > 0 && sm->files[lo - 1].span == 0) {
+		lo -= 1;
+	}
+
+	SourceBuffer *buf = lo > 0 ? &sm->files[lo - 1] : NULL;
+	if (buf == NULL || buf->path == NULL || loc - buf->base > buf->len
+	    || (buf->lines == NULL && !build_lines(sm, buf))) {
+		pthread_mutex_unlock(&sm->lock);
+		return result;
+	}
+
+	// Last line starting at or before the offset
+	u32 offset = loc - buf->base;
+	lo = 0;
+	hi = buf->linelen;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (buf->lines[mid] <= offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	// Continuation bytes don't start a code point
+	int colno = 1;
+	for (u32 i = buf->lines[lo - 1]; i < offset; i += 1) {
+		u8 c = (u8)buf->data[i];
+		colno += c == '\t' ? 4 : (c & 0xc0) != 0x80 ? 1 : 0;
+	}
+
+	result = (Location) { .lineno = (int)lo, .colno = colno };
+	if (file != NULL) {
+		*file = (u32)(buf - sm->files) + 1;
+	}
+
+	pthread_mutex_unlock(&sm->lock);
+	return result;
+}
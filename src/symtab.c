@@ -0,0 +1,120 @@
+#include "symtab.h"
+
+#include "intern.h"
+#include "util.h"
+
+#include <string.h>
+
+static inline u32 hash_name(u32 name) {
+	return name * 2654435761u; // Knuth's multiplicative hash
+}
+
+// Slot of the name, or the empty slot where it would be inserted
+static u32 find_slot(const u32 *keys, u32 size, u32 name) {
+	u32 slot = hash_name(name) & (size - 1);
+	while (keys[slot] != INTERN_NONE && keys[slot] != name) {
+		slot = (slot + 1) & (size - 1);
+	}
+	return slot;
+}
+
+static void table_grow(SymbolTable *tab) {
+	u32 size = tab->tablesize * 2;
+	u32 *keys = xcalloc(MEM_SYMBOLS, size, sizeof(u32));
+	u32 *values = xcalloc(MEM_SYMBOLS, size, sizeof(u32));
+
+	for (u32 i = 0; i < tab->tablesize; i += 1) {
+		if (tab->keys[i] != INTERN_NONE) {
+			u32 slot = find_slot(keys, size, tab->keys[i]);
+			keys[slot] = tab->keys[i];
+			values[slot] = tab->values[i];
+		}
+	}
+
+	xfree(tab->keys);
+	xfree(tab->values);
+	tab->keys = keys;
+	tab->values = values;
+	tab->tablesize = size;
+}
+
+void symtab_init(SymbolTable *tab) {
+	memset(tab, 0, sizeof(SymbolTable));
+
+	tab->symsize = 256;
+	tab->syms = xcalloc(MEM_SYMBOLS, tab->symsize, sizeof(Symbol));
+	tab->symlen = 1; // Index 0 is SYM_NONE
+
+	tab->scopesize = 32;
+	tab->scopes = xcalloc(MEM_SYMBOLS, tab->scopesize, sizeof(u32));
+
+	tab->tablesize = 256;
+	tab->keys = xcalloc(MEM_SYMBOLS, tab->tablesize, sizeof(u32));
+	tab->values = xcalloc(MEM_SYMBOLS, tab->tablesize, sizeof(u32));
+}
+
+void symtab_free(SymbolTable *tab) {
+	xfree(tab->syms);
+	xfree(tab->scopes);
+	xfree(tab->keys);
+	xfree(tab->values);
+	memset(tab, 0, sizeof(SymbolTable));
+}
+
+void symtab_enter(SymbolTable *tab) {
+	if (tab->scopelen == tab->scopesize) {
+		tab->scopesize *= 2;
+		tab->scopes = xrealloc(MEM_SYMBOLS, tab->scopes, tab->scopesize * sizeof(u32));
+	}
+
+	tab->scopes[tab->scopelen] = tab->symlen;
+	tab->scopelen += 1;
+}
+
+void symtab_exit(SymbolTable *tab) {
+	tab->scopelen -= 1;
+	u32 mark = tab->scopes[tab->scopelen];
+
+	// Names stay in the hash with no symbol, so slots are never deleted
+	while (tab->symlen > mark) {
+		tab->symlen -= 1;
+		const Symbol *sym = &tab->syms[tab->symlen];
+		tab->values[find_slot(tab->keys, tab->tablesize, sym->name)] = sym->shadowed;
+	}
+}
+
+u32 symtab_declare(SymbolTable *tab, u32 name, NodeIndex decl) {
+	u32 slot = find_slot(tab->keys, tab->tablesize, name);
+	u32 shadowed = tab->keys[slot] == name ? tab->values[slot] : SYM_NONE;
+
+	u32 mark = tab->scopelen > 0 ? tab->scopes[tab->scopelen - 1] : 1;
+	if (shadowed >= mark) {
+		return SYM_NONE;
+	}
+
+	if (tab->symlen == tab->symsize) {
+		tab->symsize *= 2;
+		tab->syms = xrealloc(MEM_SYMBOLS, tab->syms, tab->symsize * sizeof(Symbol));
+	}
+
+	u32 sym = tab->symlen;
+	tab->symlen += 1;
+	tab->syms[sym] = (Symbol) { .name = name, .decl = decl, .shadowed = shadowed };
+
+	if (tab->keys[slot] == INTERN_NONE) {
+		tab->keys[slot] = name;
+		tab->keylen += 1;
+	}
+	tab->values[slot] = sym;
+
+	if (tab->keylen * 2 > tab->tablesize) { // Keep load factor under 50%
+		table_grow(tab);
+	}
+
+	return sym;
+}
+
+u32 symtab_lookup(const SymbolTable *tab, u32 name) {
+	u32 slot = find_slot(tab->keys, tab->tablesize, name);
+	return tab->keys[slot] == name ? tab->values[slot] : SYM_NONE;
+}
@@ -0,0 +1,182 @@
+#include "trace.h"
+
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_CHUNK 4096 // Events per chunk
+
+typedef struct TraceEvent {
+	u64 ts; // Nanoseconds since trace_enable()
+	const char *name;
+	char *detail; // Copied, owned by the trace
+	char phase;
+} TraceEvent;
+
+typedef struct TraceChunk {
+	struct TraceChunk *next;
+	u32 len;
+	TraceEvent events[TRACE_CHUNK];
+} TraceChunk;
+
+typedef struct TraceBuffer {
+	struct TraceBuffer *next; // Next registered buffer
+	const char *name;
+	u32 tid;
+
+	TraceChunk *head;
+	TraceChunk *tail;
+} TraceBuffer;
+
+bool trace_enabled = false;
+
+static u64 trace_start;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *trace_buffers; // Protected by trace_lock
+static u32 trace_tids;             // Protected by trace_lock
+static _Thread_local TraceBuffer *trace_local;
+
+static u64 now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000u + (u64)ts.tv_nsec;
+}
+
+static TraceBuffer *local_buffer(void) {
+	if (trace_local != NULL) {
+		return trace_local;
+	}
+
+	TraceBuffer *buf = xcalloc(MEM_TRACE, 1, sizeof(TraceBuffer));
+	buf->head = xcalloc(MEM_TRACE, 1, sizeof(TraceChunk));
+	buf->tail = buf->head;
+
+	pthread_mutex_lock(&trace_lock);
+	trace_tids += 1;
+	buf->tid = trace_tids;
+	buf->next = trace_buffers;
+	trace_buffers = buf;
+	pthread_mutex_unlock(&trace_lock);
+
+	trace_local = buf;
+	return buf;
+}
+
+void trace_enable(void) {
+	trace_start = now_ns();
+	trace_enabled = true;
+}
+
+void trace_event(char phase, const char *name, const char *detail) {
+	TraceBuffer *buf = local_buffer();
+
+	if (buf->tail->len == TRACE_CHUNK) {
+		TraceChunk *chunk = xcalloc(MEM_TRACE, 1, sizeof(TraceChunk));
+		buf->tail->next = chunk;
+		buf->tail = chunk;
+	}
+
+	buf->tail->events[buf->tail->len] = (TraceEvent) {
+		.ts = now_ns() - trace_start,
+		.name = name,
+		.detail = detail != NULL ? xstrndup(MEM_TRACE, detail, strlen(detail)) : NULL,
+		.phase = phase,
+	};
+	buf->tail->len += 1;
+}
+
+void trace_thread_name(const char *name) {
+	if (trace_enabled) {
+		local_buffer()->name = name;
+	}
+}
+
+static void write_string(FILE *out, const char *str) {
+	fputc('"', out);
+	for (const char *c = str; *c != '\0'; c += 1) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(out, "\\%c", *c);
+		} else if ((u8)*c < 0x20) {
+			fprintf(out, "\\u%04x", *c);
+		} else {
+			fputc(*c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+bool trace_write(const char *path) {
+	FILE *out = fopen(path, "w");
+	if (out == NULL) {
+		log_error("Failed to open trace file: %s", path);
+	}
+
+	if (out != NULL) {
+		fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	}
+
+	pthread_mutex_lock(&trace_lock);
+
+	bool first = true;
+	for (TraceBuffer *buf = trace_buffers; buf != NULL;) {
+		if (out != NULL && buf->name != NULL) {
+			fprintf(
+				out, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,",
+				first ? "" : ",\n", buf->tid
+			);
+			fprintf(out, "\"args\":{\"name\":");
+			write_string(out, buf->name);
+			fprintf(out, "}}");
+			first = false;
+		}
+
+		for (TraceChunk *chunk = buf->head; chunk != NULL;) {
+			for (u32 i = 0; i < chunk->len; i += 1) {
+				TraceEvent *ev = &chunk->events[i];
+				if (out == NULL) {
+					xfree(ev->detail);
+					continue;
+				}
+
+				fprintf(out, "%s{\"ph\":\"%c\",\"name\":", first ? "" : ",\n", ev->phase);
+				write_string(out, ev->name);
+				fprintf(
+					out, ",\"pid\":1,\"tid\":%u,\"ts\":%llu.%03u", buf->tid,
+					(unsigned long long)(ev->ts / 1000), (unsigned)(ev->ts % 1000)
+				);
+
+				if (ev->detail != NULL) {
+					fprintf(out, ",\"args\":{\"detail\":");
+					write_string(out, ev->detail);
+					fprintf(out, "}");
+					xfree(ev->detail);
+				}
+
+				fprintf(out, "}");
+				first = false;
+			}
+
+			TraceChunk *next = chunk->next;
+			xfree(chunk);
+			chunk = next;
+		}
+
+		TraceBuffer *next = buf->next;
+		xfree(buf);
+		buf = next;
+	}
+
+	trace_buffers = NULL;
+	trace_local = NULL;
+	pthread_mutex_unlock(&trace_lock);
+
+	if (out == NULL) {
+		return false;
+	}
+
+	fprintf(out, "\n]}\n");
+	return fclose(out) == 0;
+}
@@ -0,0 +1,258 @@
+#include "typetab.h"
+
+#include "util.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define TYPE_FIRST_COMPOSITE (TYPE_STRING + 2) // First ID after the reserved ones
+
+static const char *names[] = {
+	[TYPE_BOOL] = "bool",   [TYPE_F32] = "f32",         [TYPE_F64] = "f64",
+	[TYPE_I16] = "i16",     [TYPE_I32] = "i32",         [TYPE_I64] = "i64",
+	[TYPE_I8] = "i8",       [TYPE_U16] = "u16",         [TYPE_U32] = "u32",
+	[TYPE_U64] = "u64",     [TYPE_U8] = "u8",           [TYPE_VOID] = "void",
+	[TYPE_FUNC] = "fn",     [TYPE_POINTER] = "pointer", [TYPE_ARRAY] = "array",
+	[TYPE_INT] = "{int}",   [TYPE_FLOAT] = "{float}",   [TYPE_RUNE] = "rune",
+	[TYPE_STRING] = "{string}",
+};
+
+static u32 hash_words(u32 hash, const u32 *words, usize count) {
+	for (usize i = 0; i < count; i += 1) { // FNV-1a over 32-bit words
+		hash ^= words[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static u32 hash_type(const TypeEntry *type, const u32 *params) {
+	u32 fields[] = { type->storage, type->elem, type->data, type->count };
+	u32 hash = hash_words(2166136261u, fields, type->storage == TYPE_FUNC ? 2 : 3);
+	return hash_words(hash, params, type->count);
+}
+
+static u32 hash_entry(const TypeTable *tab, TypeId id) {
+	const TypeEntry *type = &tab->types[id];
+	return hash_type(type, type->storage == TYPE_FUNC ? type_params(tab, id) : NULL);
+}
+
+static void table_grow(TypeTable *tab) {
+	u32 size = tab->tablesize * 2;
+	u32 *table = xcalloc(MEM_TYPES, size, sizeof(u32));
+
+	for (u32 i = 0; i < tab->tablesize; i += 1) {
+		u32 id = tab->table[i];
+		if (id == TYPE_ID_NONE) {
+			continue;
+		}
+
+		u32 slot = hash_entry(tab, id) & (size - 1);
+		while (table[slot] != TYPE_ID_NONE) {
+			slot = (slot + 1) & (size - 1);
+		}
+		table[slot] = id;
+	}
+
+	xfree(tab->table);
+	tab->table = table;
+	tab->tablesize = size;
+}
+
+static void add_entry(TypeTable *tab, TypeEntry type) {
+	if (tab->len == tab->size) {
+		tab->size *= 2;
+		tab->types = xrealloc(MEM_TYPES, tab->types, tab->size * sizeof(TypeEntry));
+	}
+
+	tab->types[tab->len] = type;
+	tab->len += 1;
+}
+
+// Find the type or add it, params are only used by function types
+static TypeId get_type(TypeTable *tab, TypeEntry type, const u32 *params) {
+	u32 mask = tab->tablesize - 1;
+	u32 slot = hash_type(&type, params) & mask;
+
+	while (tab->table[slot] != TYPE_ID_NONE) {
+		TypeId id = tab->table[slot];
+		const TypeEntry *other = &tab->types[id];
+
+		if (other->storage == type.storage && other->elem == type.elem
+		    && other->count == type.count) {
+			if (type.storage != TYPE_FUNC && other->data == type.data) {
+				return id;
+			}
+			if (type.storage == TYPE_FUNC
+			    && memcmp(type_params(tab, id), params, type.count * sizeof(u32)) == 0) {
+				return id;
+			}
+		}
+
+		slot = (slot + 1) & mask;
+	}
+
+	if (type.storage == TYPE_FUNC) {
+		while (tab->paramlen + type.count > tab->paramsize) {
+			tab->paramsize *= 2;
+			tab->params = xrealloc(MEM_TYPES, tab->params, tab->paramsize * sizeof(u32));
+		}
+
+		type.data = tab->paramlen;
+		memcpy(tab->params + tab->paramlen, params, type.count * sizeof(u32));
+		tab->paramlen += type.count;
+	}
+
+	TypeId id = tab->len;
+	add_entry(tab, type);
+
+	tab->table[slot] = id;
+	if ((tab->len - TYPE_FIRST_COMPOSITE) * 2 > tab->tablesize) { // Load under 50%
+		table_grow(tab);
+	}
+
+	return id;
+}
+
+void typetab_init(TypeTable *tab) {
+	memset(tab, 0, sizeof(TypeTable));
+
+	tab->size = 64;
+	tab->types = xcalloc(MEM_TYPES, tab->size, sizeof(TypeEntry));
+
+	// Reserved IDs: TYPE_ID_NONE followed by one per TypeStorage, the slots of
+	// pointers, arrays and functions are unused since those need arguments.
+	for (u32 i = 0; i < TYPE_FIRST_COMPOSITE; i += 1) {
+		add_entry(tab, (TypeEntry) { .storage = i == 0 ? TYPE_VOID : (u8)(i - 1) });
+	}
+
+	tab->paramsize = 64;
+	tab->params = xcalloc(MEM_TYPES, tab->paramsize, sizeof(u32));
+
+	tab->tablesize = 128;
+	tab->table = xcalloc(MEM_TYPES, tab->tablesize, sizeof(u32));
+}
+
+void typetab_free(TypeTable *tab) {
+	xfree(tab->types);
+	xfree(tab->params);
+	xfree(tab->table);
+	memset(tab, 0, sizeof(TypeTable));
+}
+
+TypeId type_prim(TypeStorage storage) {
+	return (TypeId)storage + 1;
+}
+
+TypeId type_pointer(TypeTable *tab, TypeId elem) {
+	return get_type(tab, (TypeEntry) { .storage = TYPE_POINTER, .elem = elem }, NULL);
+}
+
+TypeId type_array(TypeTable *tab, TypeId elem, u32 len) {
+	TypeEntry type = { .storage = TYPE_ARRAY, .elem = elem, .data = len };
+	return get_type(tab, type, NULL);
+}
+
+TypeId type_func(TypeTable *tab, TypeId ret, const TypeId *params, u32 count) {
+	TypeEntry type = { .storage = TYPE_FUNC, .elem = ret, .count = count };
+	return get_type(tab, type, params);
+}
+
+TypeId type_from_ast(TypeTable *tab, const Ast *ast, NodeIndex node) {
+	const AstNode *n = &ast->nodes[node];
+
+	switch ((AstKind)n->kind) {
+	case AST_TYPE_PRIM:
+		return type_prim((TypeStorage)n->op);
+	case AST_TYPE_PTR: {
+		TypeId elem = type_from_ast(tab, ast, n->lhs);
+		return elem == TYPE_ID_NONE ? TYPE_ID_NONE : type_pointer(tab, elem);
+	}
+	case AST_TYPE_ARRAY: {
+		u32 len = TYPE_LEN_NONE;
+		if (n->lhs != AST_NONE) {
+			const AstNode *lit = &ast->nodes[n->lhs];
+			if (lit->kind != AST_INT || lit->rhs != 0 || lit->lhs == TYPE_LEN_NONE) {
+				return TYPE_ID_NONE;
+			}
+			len = lit->lhs;
+		}
+
+		TypeId elem = type_from_ast(tab, ast, n->rhs);
+		return elem == TYPE_ID_NONE ? TYPE_ID_NONE : type_array(tab, elem, len);
+	}
+	case AST_TYPE_FN: {
+		const AstNode *proto = &ast->nodes[n->lhs];
+		u32 start = ast->extra[proto->lhs];
+		u32 count = ast->extra[proto->lhs + 1] - start;
+
+		TypeId ret = type_from_ast(tab, ast, proto->rhs);
+		if (ret == TYPE_ID_NONE) {
+			return TYPE_ID_NONE;
+		}
+
+		TypeId local[16];
+		TypeId *params = count <= 16 ? local : xcalloc(MEM_TYPES, count, sizeof(TypeId));
+
+		TypeId id = TYPE_ID_NONE;
+		u32 i = 0;
+		for (; i < count; i += 1) {
+			const AstNode *param = &ast->nodes[ast->extra[start + i]];
+			params[i] = type_from_ast(tab, ast, ast->extra[param->rhs]);
+			if (params[i] == TYPE_ID_NONE) {
+				break;
+			}
+		}
+
+		if (i == count) {
+			id = type_func(tab, ret, params, count);
+		}
+
+		if (params != local) {
+			xfree(params);
+		}
+		return id;
+	}
+	default:
+		return TYPE_ID_NONE;
+	}
+}
+
+const char *type_storage2str(TypeStorage storage) {
+	assert(storage < sizeof(names) / sizeof(const char *) && names[storage] != NULL);
+	return names[storage];
+}
+
+void type_print(const TypeTable *tab, TypeId id, FILE *out) {
+	if (id == TYPE_ID_NONE) {
+		fprintf(out, "?");
+		return;
+	}
+
+	const TypeEntry *type = type_get(tab, id);
+	switch ((TypeStorage)type->storage) {
+	case TYPE_POINTER:
+		fprintf(out, "*");
+		type_print(tab, type->elem, out);
+		break;
+	case TYPE_ARRAY:
+		if (type->data == TYPE_LEN_NONE) {
+			fprintf(out, "[]");
+		} else {
+			fprintf(out, "[%u]", type->data);
+		}
+		type_print(tab, type->elem, out);
+		break;
+	case TYPE_FUNC:
+		fprintf(out, "fn(");
+		for (u32 i = 0; i < type->count; i += 1) {
+			fprintf(out, i == 0 ? "" : ", ");
+			type_print(tab, type_params(tab, id)[i], out);
+		}
+		fprintf(out, ") -> ");
+		type_print(tab, type->elem, out);
+		break;
+	default:
+		fprintf(out, "%s", names[type->storage]);
+		break;
+	}
+}
@@ -3,6 +3,31 @@
 
 #include "utf8.h"
 
+#include "xid_tables.h"
+
+#define S  (U8_ID_START | U8_ID_CONTINUE)
+#define D  (U8_ID_CONTINUE | U8_DIGIT)
+
+const u8 u8_ascii_class[0x80] = {
+	['0'] = D, ['1'] = D, ['2'] = D, ['3'] = D, ['4'] = D,
+	['5'] = D, ['6'] = D, ['7'] = D, ['8'] = D, ['9'] = D,
+
+	['A'] = S, ['B'] = S, ['C'] = S, ['D'] = S, ['E'] = S, ['F'] = S, ['G'] = S,
+	['H'] = S, ['I'] = S, ['J'] = S, ['K'] = S, ['L'] = S, ['M'] = S, ['N'] = S,
+	['O'] = S, ['P'] = S, ['Q'] = S, ['R'] = S, ['S'] = S, ['T'] = S, ['U'] = S,
+	['V'] = S, ['W'] = S, ['X'] = S, ['Y'] = S, ['Z'] = S,
+
+	['a'] = S, ['b'] = S, ['c'] = S, ['d'] = S, ['e'] = S, ['f'] = S, ['g'] = S,
+	['h'] = S, ['i'] = S, ['j'] = S, ['k'] = S, ['l'] = S, ['m'] = S, ['n'] = S,
+	['o'] = S, ['p'] = S, ['q'] = S, ['r'] = S, ['s'] = S, ['t'] = S, ['u'] = S,
+	['v'] = S, ['w'] = S, ['x'] = S, ['y'] = S, ['z'] = S,
+
+	['_'] = S,
+};
+
+#undef S
+#undef D
+
 static i32 u8_size(u8 c) {
 	// clang-format off
 	static const struct {
@@ -130,3 +155,29 @@ usize u8_encode(char *str, u32 c) {
 	str[0] = (char)(c | first); // Store first byte
 	return len;
 }
+
+static bool xid_lookup(u32 c, usize prop) {
+	if (c < XID_LIMIT) {
+		u32 bit = c & ((1u << XID_SHIFT) - 1);
+		const u8 *bitmap = xid_blocks[xid_index[c >> XID_SHIFT]][prop];
+		return (bitmap[bit >> 3] >> (bit & 7)) & 1;
+	}
+
+	return false;
+}
+
+bool u8_xid_start(u32 c) {
+	return xid_lookup(c, 0);
+}
+
+bool u8_xid_continue(u32 c) {
+	if (c >= XID_LIMIT) {
+		for (usize i = 0; i < sizeof(xid_tail) / sizeof(xid_tail[0]); i += 1) {
+			if (c >= xid_tail[i][0] && c <= xid_tail[i][1]) {
+				return true;
+			}
+		}
+	}
+
+	return xid_lookup(c, 1);
+}
@@ -1,6 +1,7 @@
 #include "util.h"
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -25,6 +26,8 @@ void log_message(int level, const char *file, int line, const char *fmt, ...) {
 		level_names[level], file, line
 	);
 #else
+	(void)file;
+	(void)line;
 	fprintf(stderr, "%s %s[%s]\x1b[0m - ", buf, level_color[level], level_names[level]);
 #endif
 
@@ -35,9 +38,88 @@ void log_message(int level, const char *file, int line, const char *fmt, ...) {
 	va_end(args);
 }
 
-void *xcalloc(size_t count, size_t size) {
-	void *mem = calloc(count, size);
+static void *plain_alloc(void *ctx, size_t size, MemTag tag) {
+	(void)ctx;
+	(void)tag;
+	return calloc(1, size);
+}
+
+static void *plain_realloc(void *ctx, void *ptr, size_t oldsize, size_t newsize) {
+	(void)ctx;
+	(void)oldsize;
+	return realloc(ptr, newsize);
+}
+
+static void plain_free(void *ctx, void *ptr, size_t size) {
+	(void)ctx;
+	(void)size;
+	free(ptr);
+}
+
+static const Allocator plain_allocator = {
+	.alloc = plain_alloc,
+	.realloc = plain_realloc,
+	.free = plain_free,
+	.ctx = NULL,
+};
+
+// Behind mem_*(), the C library unless replaced
+static Allocator mem_allocator = {
+	.alloc = plain_alloc,
+	.realloc = plain_realloc,
+	.free = plain_free,
+	.ctx = NULL,
+};
+
+void *mem_alloc(MemTag tag, size_t size) {
+	return mem_allocator.alloc(mem_allocator.ctx, size, tag);
+}
+
+void *mem_realloc(MemTag tag, void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return mem_allocator.alloc(mem_allocator.ctx, size, tag);
+	}
+
+	return mem_allocator.realloc(mem_allocator.ctx, ptr, 0, size);
+}
+
+void mem_free(void *ptr) {
+	mem_allocator.free(mem_allocator.ctx, ptr, 0);
+}
 
+void mem_set_allocator(const Allocator *alloc) {
+	mem_allocator = alloc != NULL ? *alloc : plain_allocator;
+}
+
+static void *default_alloc(void *ctx, size_t size, MemTag tag) {
+	(void)ctx;
+	return mem_allocator.alloc(mem_allocator.ctx, size, tag);
+}
+
+static void *default_realloc(void *ctx, void *ptr, size_t oldsize, size_t newsize) {
+	(void)ctx;
+	return mem_allocator.realloc(mem_allocator.ctx, ptr, oldsize, newsize);
+}
+
+static void default_free(void *ctx, void *ptr, size_t size) {
+	(void)ctx;
+	mem_allocator.free(mem_allocator.ctx, ptr, size);
+}
+
+const Allocator default_allocator = {
+	.alloc = default_alloc,
+	.realloc = default_realloc,
+	.free = default_free,
+	.ctx = NULL,
+};
+
+void *xcalloc(MemTag tag, size_t count, size_t size) {
+	if (size != 0 && count > SIZE_MAX / size) {
+		log_fatal("xcalloc(): size overflow!");
+		abort();
+	}
+
+	void *mem = mem_alloc(tag, count * size);
 	if (mem == NULL) {
 		log_fatal("xcalloc(): failed!");
 		abort();
@@ -46,9 +128,9 @@ void *xcalloc(size_t count, size_t size) {
 	return mem;
 }
 
-void *xrealloc(void *ptr, size_t size) {
-	void *new = realloc(ptr, size);
-	if (new == NULL && size != 0) {
+void *xrealloc(MemTag tag, void *ptr, size_t size) {
+	void *new = mem_realloc(tag, ptr, size);
+	if (new == NULL) {
 		log_fatal("xrealloc(): failed!");
 		abort();
 	}
@@ -56,16 +138,18 @@ void *xrealloc(void *ptr, size_t size) {
 	return new;
 }
 
-char *xstrndup(const char *str, size_t len) {
-	char *dup = strndup(str, len);
-	if (dup == NULL) {
-		log_fatal("xstrndup failed!");
-		abort();
-	}
+char *xstrndup(MemTag tag, const char *str, size_t len) {
+	len = strnlen(str, len);
 
+	char *dup = xcalloc(tag, len + 1, sizeof(char));
+	memcpy(dup, str, len);
 	return dup;
 }
 
+void xfree(void *ptr) {
+	mem_free(ptr);
+}
+
 FILE *xfopen(const char *filename, const char *modes) {
 	FILE *file = fopen(filename, modes);
 	if (file == NULL) {
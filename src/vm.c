@@ -0,0 +1,603 @@
+#include "vm.h"
+
+#include "jit.h"
+#include "utf8.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+
+#define VM_STACK_SIZE  (1 << 16) // Registers of all active calls
+#define VM_MAX_FRAMES  4096
+#define VM_OUTPUT_SIZE 8192
+
+// Dispatch with a jump table of label addresses when the compiler supports it,
+// each handler then has its own indirect branch instead of sharing the switch.
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+typedef struct Frame {
+	const u32 *ret; // Instruction to resume in the caller
+	Value *base;    // Registers of the caller
+	u32 func;       // Function of the caller, unused for calls from compiled code
+} Frame;
+
+typedef struct Vm {
+	const Program *prog;
+	FILE *out;
+
+	Value *stack;
+	Frame *frames;
+	u32 framelen;
+	Value *globals;
+
+	Jit *jit; // NULL if everything is interpreted
+
+	char output[VM_OUTPUT_SIZE];
+	usize outputlen;
+} Vm;
+
+static void flush_output(Vm *vm) {
+	fwrite(vm->output, 1, vm->outputlen, vm->out);
+	vm->outputlen = 0;
+}
+
+static void write_output(Vm *vm, const char *data, usize len) {
+	if (vm->outputlen + len > VM_OUTPUT_SIZE) {
+		flush_output(vm);
+		if (len > VM_OUTPUT_SIZE) {
+			fwrite(data, 1, len, vm->out);
+			return;
+		}
+	}
+
+	memcpy(vm->output + vm->outputlen, data, len);
+	vm->outputlen += len;
+}
+
+static void write_rune(Vm *vm, u32 rune) {
+	char buf[4];
+	write_output(vm, buf, u8_encode(buf, rune));
+}
+
+static u64 int_mask(TypeStorage storage) {
+	switch (storage) {
+	case TYPE_I8:
+	case TYPE_U8:
+		return UINT8_MAX;
+	case TYPE_I16:
+	case TYPE_U16:
+		return UINT16_MAX;
+	case TYPE_I32:
+	case TYPE_U32:
+		return UINT32_MAX;
+	default:
+		return UINT64_MAX;
+	}
+}
+
+// Digits are written backwards from the end of the buffer, two at a time
+static char *format_uint(char *end, u64 value) {
+	static const char pairs[] = "00010203040506070809101112131415161718192021222324"
+	                            "25262728293031323334353637383940414243444546474849"
+	                            "50515253545556575859606162636465666768697071727374"
+	                            "75767778798081828384858687888990919293949596979899";
+
+	while (value >= 100) {
+		end -= 2;
+		memcpy(end, pairs + value % 100 * 2, 2);
+		value /= 100;
+	}
+
+	if (value >= 10) {
+		end -= 2;
+		memcpy(end, pairs + value * 2, 2);
+	} else {
+		end -= 1;
+		*end = (char)('0' + value);
+	}
+	return end;
+}
+
+static char *format_hex(char *end, u64 value, bool upper) {
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	do {
+		end -= 1;
+		*end = digits[value & 0xF];
+		value >>= 4;
+	} while (value != 0);
+	return end;
+}
+
+static void write_conv(Vm *vm, Value value, VmFmtConv conv, TypeStorage storage) {
+	char buf[32];
+	char *end = buf + sizeof(buf);
+	char *start = end;
+
+	switch (conv) {
+	case FMT_BOOL:
+		write_output(vm, value.u ? "true" : "false", value.u ? 4 : 5);
+		return;
+	case FMT_STRING: {
+		const Interner *strings = &vm->prog->strings;
+		write_output(
+			vm, intern_str(strings, (u32)value.u), intern_len(strings, (u32)value.u)
+		);
+		return;
+	}
+	case FMT_RUNE:
+		write_rune(vm, (u32)value.u);
+		return;
+	case FMT_F32:
+		write_output(vm, buf, (usize)snprintf(buf, sizeof(buf), "%g", value.f));
+		return;
+	case FMT_F64:
+		write_output(vm, buf, (usize)snprintf(buf, sizeof(buf), "%g", value.d));
+		return;
+	case FMT_INT:
+		start = format_uint(end, value.i < 0 ? 0 - value.u : value.u);
+		if (value.i < 0) {
+			start -= 1;
+			*start = '-';
+		}
+		break;
+	case FMT_UINT:
+		start = format_uint(end, value.u);
+		break;
+	default: // FMT_HEX and FMT_HEX_UPPER
+		start = format_hex(end, value.u & int_mask(storage), conv == FMT_HEX_UPPER);
+		break;
+	}
+
+	write_output(vm, start, (usize)(end - start));
+}
+
+static const char *format_value(Vm *vm, Value value, TypeStorage storage, char spec) {
+	VmFmtConv conv = vm_fmt_conv(storage, spec);
+	if (conv == FMT_END) {
+		return "Hexadecimal format of a non-integer";
+	}
+
+	write_conv(vm, value, conv, storage);
+	return NULL;
+}
+
+// Print the format string with each "{}", "{x}" or "{X}" replaced by the next
+// argument, "{{" and "}}" are escaped braces
+static const char *native_println(Vm *vm, const Value *args, const u8 *sig) {
+	const Interner *strings = &vm->prog->strings;
+	const char *fmt = intern_str(strings, (u32)args[0].u);
+	usize len = intern_len(strings, (u32)args[0].u);
+	u32 count = sig[0];
+	u32 arg = 1;
+
+	usize start = 0;
+	for (usize i = 0; i < len; i += 1) {
+		if (fmt[i] != '{' && fmt[i] != '}') {
+			continue;
+		}
+
+		write_output(vm, fmt + start, i - start);
+		if (i + 1 < len && fmt[i + 1] == fmt[i]) {
+			write_output(vm, fmt + i, 1);
+			i += 1;
+			start = i + 1;
+			continue;
+		} else if (fmt[i] == '}') {
+			return "Unmatched '}' in format string";
+		}
+
+		char spec = '\0';
+		bool hex = i + 1 < len && (fmt[i + 1] == 'x' || fmt[i + 1] == 'X');
+		if (hex && i + 2 < len && fmt[i + 2] == '}') {
+			spec = fmt[i + 1];
+			i += 2;
+		} else if (i + 1 < len && fmt[i + 1] == '}') {
+			i += 1;
+		} else {
+			return "Invalid format specifier";
+		}
+
+		if (arg == count) {
+			return "Missing format argument";
+		}
+
+		const char *error = format_value(vm, args[arg], (TypeStorage)sig[arg + 1], spec);
+		if (error != NULL) {
+			return error;
+		}
+
+		arg += 1;
+		start = i + 1;
+	}
+
+	if (arg != count) {
+		return "Too many format arguments";
+	}
+
+	write_output(vm, fmt + start, len - start);
+	write_output(vm, "\n", 1);
+	return NULL;
+}
+
+// Print a format checked and split by the compiler, the arguments only hold
+// the values of the placeholders
+static const char *native_println_fmt(
+	Vm *vm, const Value *args, const VmFmtSegment *seg
+) {
+	const Interner *strings = &vm->prog->strings;
+	for (;; seg += 1) {
+		write_output(vm, intern_str(strings, seg->text), intern_len(strings, seg->text));
+		if (seg->conv == FMT_END) {
+			return NULL;
+		}
+
+		write_conv(vm, *args, (VmFmtConv)seg->conv, (TypeStorage)seg->storage);
+		args += 1;
+	}
+}
+
+// Run CALLN, index is the word after the instruction
+static const char *call_native(Vm *vm, const Value *args, u32 native, u32 index) {
+	return native == NATIVE_PRINTLN_FMT
+	         ? native_println_fmt(vm, args, vm->prog->fmts + index)
+	         : native_println(vm, args, vm->prog->sigs + index);
+}
+
+static int runtime_error(const Vm *vm, const u32 *pc, const char *fmt, ...) {
+	const Program *prog = vm->prog;
+	u32 at = (u32)(pc - prog->code) - 1;
+
+	const char *name = "?";
+	for (u32 i = 0; i < prog->funclen; i += 1) {
+		const VmFunc *func = &prog->funcs[i];
+		if (at >= func->start && at < func->start + func->len) {
+			name = intern_str(&prog->strings, func->name);
+			break;
+		}
+	}
+
+	fprintf(stderr, "runtime error in '%s': ", name);
+
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+#define NORM_I8(x)  ((i64)(i8)(x))
+#define NORM_I16(x) ((i64)(i16)(x))
+#define NORM_I32(x) ((i64)(i32)(x))
+#define NORM_I64(x) ((i64)(x))
+#define NORM_U8(x)  ((u64)(u8)(x))
+#define NORM_U16(x) ((u64)(u16)(x))
+#define NORM_U32(x) ((u64)(u32)(x))
+#define NORM_U64(x) ((u64)(x))
+
+#define R (base)
+#define A INS_A(ins)
+#define B INS_B(ins)
+#define C INS_C(ins)
+
+// Operations that don't depend on the signedness, F is the field of the result
+#define VM_COMMON_HANDLERS(T, F, BITS)                                                   \
+	CASE(ADD_##T) R[A].F = NORM_##T(R[B].u + R[C].u);                                    \
+	NEXT;                                                                                \
+	CASE(SUB_##T) R[A].F = NORM_##T(R[B].u - R[C].u);                                    \
+	NEXT;                                                                                \
+	CASE(MUL_##T) R[A].F = NORM_##T(R[B].u * R[C].u);                                    \
+	NEXT;                                                                                \
+	CASE(NEG_##T) R[A].F = NORM_##T(0 - R[B].u);                                         \
+	NEXT;                                                                                \
+	CASE(EQ_##T) R[A].u = R[B].u == R[C].u;                                              \
+	NEXT;                                                                                \
+	CASE(NE_##T) R[A].u = R[B].u != R[C].u;                                              \
+	NEXT;                                                                                \
+	CASE(AND_##T) R[A].u = R[B].u & R[C].u;                                              \
+	NEXT;                                                                                \
+	CASE(OR_##T) R[A].u = R[B].u | R[C].u;                                               \
+	NEXT;                                                                                \
+	CASE(XOR_##T) R[A].u = R[B].u ^ R[C].u;                                              \
+	NEXT;                                                                                \
+	CASE(SHL_##T) R[A].F = NORM_##T(R[B].u << (R[C].u & (BITS - 1)));                    \
+	NEXT;                                                                                \
+	CASE(BNOT_##T) R[A].F = NORM_##T(~R[B].u);                                           \
+	NEXT;
+
+#define VM_SIGNED_HANDLERS(T, BITS)                                                      \
+	VM_COMMON_HANDLERS(T, i, BITS)                                                       \
+	CASE(DIV_##T) if (R[C].i == 0) {                                                     \
+		goto division_by_zero;                                                           \
+	}                                                                                    \
+	R[A].i = R[C].i == -1 ? NORM_##T(0 - R[B].u) : NORM_##T(R[B].i / R[C].i);            \
+	NEXT;                                                                                \
+	CASE(MOD_##T) if (R[C].i == 0) {                                                     \
+		goto division_by_zero;                                                           \
+	}                                                                                    \
+	R[A].i = R[C].i == -1 ? 0 : R[B].i % R[C].i;                                         \
+	NEXT;                                                                                \
+	CASE(LT_##T) R[A].u = R[B].i < R[C].i;                                               \
+	NEXT;                                                                                \
+	CASE(LE_##T) R[A].u = R[B].i <= R[C].i;                                              \
+	NEXT;                                                                                \
+	CASE(SHR_##T) R[A].i = R[B].i >> (R[C].u & (BITS - 1));                              \
+	NEXT;
+
+#define VM_UNSIGNED_HANDLERS(T, BITS)                                                    \
+	VM_COMMON_HANDLERS(T, u, BITS)                                                       \
+	CASE(DIV_##T) if (R[C].u == 0) {                                                     \
+		goto division_by_zero;                                                           \
+	}                                                                                    \
+	R[A].u = R[B].u / R[C].u;                                                            \
+	NEXT;                                                                                \
+	CASE(MOD_##T) if (R[C].u == 0) {                                                     \
+		goto division_by_zero;                                                           \
+	}                                                                                    \
+	R[A].u = R[B].u % R[C].u;                                                            \
+	NEXT;                                                                                \
+	CASE(LT_##T) R[A].u = R[B].u < R[C].u;                                               \
+	NEXT;                                                                                \
+	CASE(LE_##T) R[A].u = R[B].u <= R[C].u;                                              \
+	NEXT;                                                                                \
+	CASE(SHR_##T) R[A].u = R[B].u >> (R[C].u & (BITS - 1));                              \
+	NEXT;
+
+#define VM_FLOAT_HANDLERS(T, F, MOD)                                                     \
+	CASE(ADD_##T) R[A].F = R[B].F + R[C].F;                                              \
+	NEXT;                                                                                \
+	CASE(SUB_##T) R[A].F = R[B].F - R[C].F;                                              \
+	NEXT;                                                                                \
+	CASE(MUL_##T) R[A].F = R[B].F * R[C].F;                                              \
+	NEXT;                                                                                \
+	CASE(DIV_##T) R[A].F = R[B].F / R[C].F;                                              \
+	NEXT;                                                                                \
+	CASE(MOD_##T) R[A].F = MOD(R[B].F, R[C].F);                                          \
+	NEXT;                                                                                \
+	CASE(NEG_##T) R[A].F = -R[B].F;                                                      \
+	NEXT;                                                                                \
+	CASE(EQ_##T) R[A].u = R[B].F == R[C].F;                                              \
+	NEXT;                                                                                \
+	CASE(NE_##T) R[A].u = R[B].F != R[C].F;                                              \
+	NEXT;                                                                                \
+	CASE(LT_##T) R[A].u = R[B].F < R[C].F;                                               \
+	NEXT;                                                                                \
+	CASE(LE_##T) R[A].u = R[B].F <= R[C].F;                                              \
+	NEXT;
+
+#ifdef VM_COMPUTED_GOTO
+#define VM_LABEL(name) &&L_##name,
+#define VM_START       NEXT;
+#define VM_END
+#define CASE(name)     L_##name:
+#define NEXT                                                                             \
+	do {                                                                                 \
+		ins = *pc++;                                                                     \
+		goto *labels[INS_OP(ins)];                                                       \
+	} while (0)
+#else
+#define VM_START                                                                         \
+	for (;;) {                                                                           \
+		ins = *pc++;                                                                     \
+		switch ((Opcode)INS_OP(ins)) {
+#define VM_END                                                                           \
+	default:                                                                             \
+		return runtime_error(vm, pc, "Invalid opcode %u", INS_OP(ins));                  \
+		}                                                                                \
+		}
+#define CASE(name) case OP_##name:
+#define NEXT       continue
+#endif
+
+// Interpret a function until it returns, calls made by compiled code start a
+// new one so it stops when the frames are back to their depth at the start
+static int execute(Vm *vm, u32 func, Value *base) {
+#ifdef VM_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+	static const void *labels[] = { VM_OPCODES(VM_LABEL) };
+#endif
+
+	const Program *prog = vm->prog;
+	const Value *consts = prog->consts;
+	Value *globals = vm->globals;
+	u32 floor = vm->framelen;
+
+	const u32 *pc = prog->code + prog->funcs[func].start;
+	u32 ins;
+	int status = 0;
+
+	VM_START
+
+	CASE(NOP) NEXT;
+	CASE(MOV) R[A] = R[B];
+	NEXT;
+	CASE(LOADI) R[A].i = INS_SBX(ins);
+	NEXT;
+	CASE(LOADK) R[A] = consts[INS_BX(ins)];
+	NEXT;
+	CASE(LOADKX) R[A] = consts[*pc++];
+	NEXT;
+	CASE(GGET) R[A] = globals[INS_BX(ins)];
+	NEXT;
+	CASE(GSET) globals[INS_BX(ins)] = R[A];
+	NEXT;
+	CASE(JMP) pc += INS_SAX(ins);
+	if (INS_SAX(ins) < 0 && vm->jit != NULL && jit_tick(vm->jit, func)) {
+		// Finish the hot loop in machine code from its header, which returns
+		// from the function like RET
+		status = jit_run(vm->jit, func, base, pc);
+		if (status != 0) {
+			goto done;
+		}
+		goto leave;
+	}
+	NEXT;
+	CASE(JMPF) if (R[A].u == 0) {
+		pc += INS_SBX(ins);
+	}
+	NEXT;
+	CASE(JMPT) if (R[A].u != 0) {
+		pc += INS_SBX(ins);
+	}
+	NEXT;
+	CASE(CALL) {
+		u32 callee = INS_BX(ins);
+		usize top = (usize)(base - vm->stack) + A + prog->funcs[callee].regs;
+		if (vm->framelen == VM_MAX_FRAMES || top > VM_STACK_SIZE) {
+			status = runtime_error(vm, pc, "Stack overflow");
+			goto done;
+		}
+
+		vm->frames[vm->framelen] = (Frame) { .ret = pc, .base = base, .func = func };
+		vm->framelen += 1;
+
+		if (vm->jit != NULL && jit_tick(vm->jit, callee)) {
+			status = jit_run(vm->jit, callee, base + A, NULL);
+			vm->framelen -= 1;
+			if (status != 0) {
+				goto done;
+			}
+			NEXT;
+		}
+
+		base += A;
+		func = callee;
+		pc = prog->code + prog->funcs[callee].start;
+	}
+	NEXT;
+	CASE(CALLN) {
+		u32 index = *pc++;
+		const char *error = call_native(vm, &R[A], B, index);
+		if (error != NULL) {
+			status = runtime_error(vm, pc - 1, "%s", error);
+			goto done;
+		}
+	}
+	NEXT;
+	CASE(RET) {
+		// The caller reads the result from the register of the first argument
+		base[0] = R[A];
+		goto leave;
+	}
+	CASE(RET0)
+	leave: {
+		if (vm->framelen == floor) {
+			goto done;
+		}
+
+		vm->framelen -= 1;
+		pc = vm->frames[vm->framelen].ret;
+		base = vm->frames[vm->framelen].base;
+		func = vm->frames[vm->framelen].func;
+	}
+	NEXT;
+	CASE(NOT) R[A].u = R[B].u == 0;
+	NEXT;
+	CASE(CAST) R[A] = vm_cast(R[B], C / VM_TYPE_COUNT, C % VM_TYPE_COUNT);
+	NEXT;
+
+	VM_SIGNED_HANDLERS(I8, 8)
+	VM_SIGNED_HANDLERS(I16, 16)
+	VM_SIGNED_HANDLERS(I32, 32)
+	VM_SIGNED_HANDLERS(I64, 64)
+	VM_UNSIGNED_HANDLERS(U8, 8)
+	VM_UNSIGNED_HANDLERS(U16, 16)
+	VM_UNSIGNED_HANDLERS(U32, 32)
+	VM_UNSIGNED_HANDLERS(U64, 64)
+	VM_FLOAT_HANDLERS(F32, f, fmodf)
+	VM_FLOAT_HANDLERS(F64, d, fmod)
+
+	VM_END
+
+division_by_zero:
+	status = runtime_error(vm, pc, "Division by zero");
+
+done:
+	return status;
+
+#ifdef VM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+}
+
+static int hook_call(void *ctx, Value *base, const u32 *pc) {
+	Vm *vm = ctx;
+	u32 ins = pc[-1];
+	u32 callee = INS_BX(ins);
+
+	usize top = (usize)(base - vm->stack) + A + vm->prog->funcs[callee].regs;
+	if (vm->framelen == VM_MAX_FRAMES || top > VM_STACK_SIZE) {
+		return runtime_error(vm, pc, "Stack overflow");
+	}
+
+	// Only counts the depth, compiled code returns by itself
+	vm->frames[vm->framelen] = (Frame) { .ret = pc, .base = base };
+	vm->framelen += 1;
+
+	int status = jit_tick(vm->jit, callee) ? jit_run(vm->jit, callee, base + A, NULL)
+	                                       : execute(vm, callee, base + A);
+	vm->framelen -= 1;
+	return status;
+}
+
+static int hook_native(void *ctx, Value *base, const u32 *pc) {
+	Vm *vm = ctx;
+	u32 ins = pc[-1];
+	const char *error = call_native(vm, &R[A], B, *pc);
+	return error != NULL ? runtime_error(vm, pc, "%s", error) : 0;
+}
+
+static int hook_div_zero(void *ctx, Value *base, const u32 *pc) {
+	(void)base;
+	return runtime_error(ctx, pc, "Division by zero");
+}
+
+static const JitHooks hooks = {
+	.call = hook_call,
+	.native = hook_native,
+	.div_zero = hook_div_zero,
+};
+
+int vm_run(const Program *prog, FILE *out, u32 jit) {
+	Vm *vm = xcalloc(MEM_VM, 1, sizeof(Vm));
+	vm->prog = prog;
+	vm->out = out;
+	vm->stack = xcalloc(MEM_VM, VM_STACK_SIZE, sizeof(Value));
+	vm->frames = xcalloc(MEM_VM, VM_MAX_FRAMES, sizeof(Frame));
+	vm->globals = xcalloc(MEM_VM, prog->globallen + 1, sizeof(Value));
+	memcpy(vm->globals, prog->globals, prog->globallen * sizeof(Value));
+
+	Jit compiler;
+	if (jit != VM_JIT_OFF) {
+		jit_init(&compiler, prog, vm->globals, jit, &hooks, vm);
+		vm->jit = &compiler;
+	}
+
+	// The registers of a single function always fit, VmFunc.regs is a u16
+	int status = vm->jit != NULL && jit_tick(vm->jit, prog->main)
+	             ? jit_run(vm->jit, prog->main, vm->stack, NULL)
+	             : execute(vm, prog->main, vm->stack);
+
+	flush_output(vm);
+	fflush(out);
+
+	if (vm->jit != NULL) {
+		log_debug(
+			"%u functions compiled to %zu bytes of machine code", compiler.compiled,
+			compiler.codesize
+		);
+		jit_free(&compiler);
+	}
+
+	xfree(vm->globals);
+	xfree(vm->stack);
+	xfree(vm->frames);
+	xfree(vm);
+	return status;
+}
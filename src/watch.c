@@ -0,0 +1,277 @@
+#include "watch.h"
+
+#include "cache.h"
+#include "intern.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WATCH_EVENTS \
+	(IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR)
+#define WATCH_BUF_SIZE 65536 // Bytes of events read at once
+
+typedef struct Watcher {
+	const char *root;
+	int fd; // inotify instance
+	SourceCache cache;
+
+	char **dirs; // Watch descriptor -> Path of the directory, NULL if unused
+	u32 dirsize;
+
+	Interner pending; // Files to check once the events settle
+} Watcher;
+
+static volatile sig_atomic_t stop_signal = 0;
+
+static void on_signal(int sig) {
+	(void)sig;
+	stop_signal = 1;
+}
+
+static u64 now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000u + (u64)ts.tv_nsec;
+}
+
+static bool has_extension(const char *name) {
+	usize len = strlen(name);
+	return len > 3
+	    && (strcmp(name + len - 3, ".ax") == 0 || strcmp(name + len - 3, ".AX") == 0);
+}
+
+static char *join_path(const char *dir, const char *name) {
+	usize dirlen = strlen(dir);
+	usize namelen = strlen(name);
+	char *path = xcalloc(MEM_CACHE, dirlen + namelen + 2, sizeof(char));
+	memcpy(path, dir, dirlen);
+	path[dirlen] = '/';
+	memcpy(path + dirlen + 1, name, namelen);
+	return path;
+}
+
+static bool under_dir(const char *path, const char *dir, usize dirlen) {
+	return strncmp(path, dir, dirlen) == 0
+	    && (path[dirlen] == '/' || path[dirlen] == '\0');
+}
+
+static void queue_file(Watcher *w, const char *path) {
+	intern(&w->pending, path, strlen(path));
+}
+
+// Watch a directory and the ones under it, queueing their files
+static bool watch_dir(Watcher *w, const char *path) {
+	int wd = inotify_add_watch(w->fd, path, WATCH_EVENTS);
+	if (wd < 0) {
+		log_error("Failed to watch directory: %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	if ((u32)wd >= w->dirsize) {
+		u32 size = w->dirsize * 2 > (u32)wd ? w->dirsize * 2 : (u32)wd + 1;
+		w->dirs = xrealloc(MEM_CACHE, w->dirs, size * sizeof(char *));
+		memset(&w->dirs[w->dirsize], 0, (size - w->dirsize) * sizeof(char *));
+		w->dirsize = size;
+	}
+	xfree(w->dirs[wd]); // Watched again after a rename or an overflow
+	w->dirs[wd] = xstrndup(MEM_CACHE, path, strlen(path));
+
+	// Listed after the watch is added, so files created meanwhile aren't missed
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		log_error("Failed to open directory: %s: %s", path, strerror(errno));
+		return true;
+	}
+
+	for (struct dirent *ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
+		if (ent->d_name[0] == '.') {
+			continue; // Also "." and ".."
+		}
+
+		char *child = join_path(path, ent->d_name);
+		bool isdir = ent->d_type == DT_DIR;
+		if (ent->d_type == DT_UNKNOWN) {
+			struct stat st;
+			isdir = lstat(child, &st) == 0 && S_ISDIR(st.st_mode);
+		}
+
+		if (isdir) {
+			watch_dir(w, child);
+		} else if (has_extension(ent->d_name)) {
+			queue_file(w, child);
+		}
+		xfree(child);
+	}
+
+	closedir(dir);
+	return true;
+}
+
+// A directory was moved away or deleted, its cached files are checked to drop
+// them and the watches under it are removed
+static void unwatch_dir(Watcher *w, const char *path) {
+	usize len = strlen(path);
+	for (u32 i = 0; i < w->dirsize; i += 1) {
+		if (w->dirs[i] != NULL && under_dir(w->dirs[i], path, len)) {
+			inotify_rm_watch(w->fd, (int)i); // Freed on IN_IGNORED
+		}
+	}
+
+	for (u32 i = 0; i < w->cache.entrysize; i += 1) {
+		const char *file = w->cache.entries[i].path;
+		if (file != NULL && under_dir(file, path, len)) {
+			queue_file(w, file);
+		}
+	}
+}
+
+static void handle_event(Watcher *w, const struct inotify_event *ev) {
+	if ((ev->mask & IN_Q_OVERFLOW) != 0) {
+		// Events were lost, every file is checked for changes
+		log_warn("Too many events, scanning %s again", w->root);
+		for (u32 i = 0; i < w->cache.entrysize; i += 1) {
+			if (w->cache.entries[i].path != NULL) {
+				queue_file(w, w->cache.entries[i].path);
+			}
+		}
+		watch_dir(w, w->root);
+		return;
+	}
+
+	if (ev->wd < 0 || (u32)ev->wd >= w->dirsize || w->dirs[ev->wd] == NULL) {
+		return;
+	} else if ((ev->mask & IN_IGNORED) != 0) {
+		xfree(w->dirs[ev->wd]);
+		w->dirs[ev->wd] = NULL;
+		return;
+	} else if (ev->len == 0 || ev->name[0] == '.') {
+		return;
+	}
+
+	char *path = join_path(w->dirs[ev->wd], ev->name);
+	if ((ev->mask & IN_ISDIR) == 0) {
+		if (has_extension(ev->name)) {
+			queue_file(w, path);
+		}
+	} else if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) != 0) {
+		watch_dir(w, path);
+	} else if ((ev->mask & (IN_DELETE | IN_MOVED_FROM)) != 0) {
+		unwatch_dir(w, path);
+	}
+	xfree(path);
+}
+
+static void read_events(Watcher *w) {
+	_Alignas(struct inotify_event) char buf[WATCH_BUF_SIZE];
+	for (;;) {
+		ssize_t n = read(w->fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR && !stop_signal) {
+			continue;
+		} else if (n <= 0) {
+			break; // EAGAIN once they're all read
+		}
+
+		for (ssize_t i = 0; i < n;) {
+			const struct inotify_event *ev = (const struct inotify_event *)(buf + i);
+			handle_event(w, ev);
+			i += (ssize_t)(sizeof(struct inotify_event) + ev->len);
+		}
+	}
+}
+
+// Check the queued files whose contents changed since they were last checked
+static void check_pending(Watcher *w) {
+	u64 start = now_ns();
+	u32 checked = 0;
+	for (u32 id = 1; id < w->pending.count; id += 1) {
+		const char *path = intern_str(&w->pending, id);
+		CacheEntry *e = cache_get(&w->cache, path);
+		if (e == NULL) {
+			if (errno != ENOENT) {
+				log_error("Failed to open file: %s: %s", path, strerror(errno));
+			}
+			continue; // Removed, it's no longer cached
+		} else if (e->checked) {
+			continue; // Saved without changes
+		}
+
+		e->checkok = cache_check(&w->cache, e);
+		e->checked = true;
+		checked += 1;
+	}
+
+	intern_free(&w->pending);
+	intern_init(&w->pending);
+
+	u32 failed = 0;
+	for (u32 i = 0; i < w->cache.entrysize; i += 1) {
+		const CacheEntry *e = &w->cache.entries[i];
+		failed += e->path != NULL && !e->checkok ? 1 : 0;
+	}
+
+	log_info(
+		"Checked %u of %u files in %.2f ms, %u with errors", checked, w->cache.cached,
+		(double)(now_ns() - start) / 1e6, failed
+	);
+}
+
+int watch_run(const char *root) {
+	Watcher w = { .root = root };
+	w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w.fd < 0) {
+		log_fatal("Failed to initialize inotify: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	cache_init(&w.cache);
+	intern_init(&w.pending);
+	w.dirsize = 64;
+	w.dirs = xcalloc(MEM_CACHE, w.dirsize, sizeof(char *));
+
+	bool ok = watch_dir(&w, root);
+	if (ok) {
+		check_pending(&w);
+		log_info("Watching %s", root);
+	}
+
+	// Interrupt poll() to clean up
+	struct sigaction action = { .sa_handler = on_signal };
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	struct pollfd fds = { .fd = w.fd, .events = POLLIN };
+	while (ok && !stop_signal) {
+		// Files are checked once no event came for a while
+		bool waiting = w.pending.count > 1;
+		int ready = poll(&fds, 1, waiting ? WATCH_SETTLE_MS : -1);
+		if (ready < 0 && errno == EINTR) {
+			continue;
+		} else if (ready < 0) {
+			log_fatal("poll() failed: %s", strerror(errno));
+			ok = false;
+		} else if (ready == 0) {
+			check_pending(&w);
+		} else {
+			read_events(&w);
+		}
+	}
+
+	for (u32 i = 0; i < w.dirsize; i += 1) {
+		xfree(w.dirs[i]);
+	}
+	xfree(w.dirs);
+	intern_free(&w.pending);
+	cache_free(&w.cache);
+	close(w.fd);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+"""Generate the UAX #31 XID_Start/XID_Continue lookup tables used by the lexer.
+
+The properties are read from a DerivedCoreProperties.txt file when one is given,
+otherwise they are taken from the Unicode database bundled with Python (whose
+identifiers are defined in terms of XID_Start and XID_Continue).
+
+Codepoints are split in blocks of 2^SHIFT entries, the first level maps each
+block to a deduplicated pair of bitmaps (XID_Start, XID_Continue), so a lookup
+is two loads. Sparse ranges past the last dense block are emitted as a list.
+
+Usage: gen_xid.py <output.h> [DerivedCoreProperties.txt]
+"""
+
+import sys
+import unicodedata
+
+MAX_CODEPOINT = 0x110000
+TAIL_GAP = 0x10000  # Ranges after a gap this big go to the tail list
+
+
+def load_ucd(path):
+    props = {"XID_Start": set(), "XID_Continue": set()}
+
+    with open(path, encoding="utf-8") as file:
+        for line in file:
+            line = line.split("#", 1)[0].strip()
+            if not line:
+                continue
+
+            cps, prop = (field.strip() for field in line.split(";")[:2])
+            if prop not in props:
+                continue
+
+            first, _, last = cps.partition("..")
+            first = int(first, 16)
+            last = int(last, 16) if last else first
+            props[prop].update(range(first, last + 1))
+
+    start = [c in props["XID_Start"] for c in range(MAX_CODEPOINT)]
+    cont = [c in props["XID_Continue"] for c in range(MAX_CODEPOINT)]
+    return start, cont, "from " + path
+
+
+def load_python():
+    start = [chr(c).isidentifier() and c != 0x5F for c in range(MAX_CODEPOINT)]
+    cont = [("a" + chr(c)).isidentifier() for c in range(MAX_CODEPOINT)]
+    return start, cont, "Unicode " + unicodedata.unidata_version
+
+
+def split_tail(cont):
+    # Find the end of the dense part, everything after a big gap is a range
+    used = [c for c in range(MAX_CODEPOINT) if cont[c]]
+    limit = used[0]
+    for prev, cur in zip(used, used[1:]):
+        if cur - prev > TAIL_GAP:
+            break
+        limit = cur
+    limit += 1
+
+    ranges = []
+    for c in used:
+        if c < limit:
+            continue
+        if ranges and ranges[-1][1] == c - 1:
+            ranges[-1][1] = c
+        else:
+            ranges.append([c, c])
+
+    return limit, ranges
+
+
+def bitmap(values):
+    out = bytearray((len(values) + 7) // 8)
+    for i, value in enumerate(values):
+        if value:
+            out[i >> 3] |= 1 << (i & 7)
+    return bytes(out)
+
+
+def build(start, cont, limit, shift):
+    size = 1 << shift
+    count = (limit + size - 1) >> shift
+
+    blocks = {}
+    index = []
+    for b in range(count):
+        lo, hi = b * size, (b + 1) * size
+        key = (bitmap(start[lo:hi]), bitmap(cont[lo:hi]))
+        index.append(blocks.setdefault(key, len(blocks)))
+
+    return index, list(blocks)
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit(__doc__.strip().splitlines()[-1])
+
+    if len(sys.argv) == 3:
+        start, cont, source = load_ucd(sys.argv[2])
+    else:
+        start, cont, source = load_python()
+
+    assert not any(start[c] and not cont[c] for c in range(MAX_CODEPOINT))
+
+    limit, tail = split_tail(cont)
+    assert not any(start[c] for c in range(limit, MAX_CODEPOINT))
+
+    # Choose the block size producing the smallest tables
+    best = None
+    for shift in range(4, 11):
+        index, blocks = build(start, cont, limit, shift)
+        if len(blocks) > 256:
+            continue
+
+        size = len(index) + len(blocks) * 2 * (1 << shift) // 8
+        if best is None or size < best[0]:
+            best = (size, shift, index, blocks)
+
+    size, shift, index, blocks = best
+    width = (1 << shift) // 8
+
+    out = []
+    out.append("// Generated by tools/gen_xid.py (%s), DO NOT EDIT." % source)
+    out.append("// %d bytes of tables, %d blocks." % (size, len(blocks)))
+    out.append("")
+    out.append("#define XID_SHIFT %d" % shift)
+    out.append("#define XID_LIMIT 0x%x" % limit)
+    out.append("")
+    out.append("static const u8 xid_index[%d] = {" % len(index))
+    for i in range(0, len(index), 16):
+        out.append("\t" + ", ".join("%d" % v for v in index[i:i + 16]) + ",")
+    out.append("};")
+    out.append("")
+    out.append("// [Block][0: XID_Start, 1: XID_Continue][Bitmap]")
+    out.append("static const u8 xid_blocks[%d][2][%d] = {" % (len(blocks), width))
+    for pair in blocks:
+        out.append("\t{")
+        for bits in pair:
+            out.append("\t\t{ " + ", ".join("0x%02x" % v for v in bits) + " },")
+        out.append("\t},")
+    out.append("};")
+    out.append("")
+    out.append("// XID_Continue ranges past XID_LIMIT")
+    out.append("static const u32 xid_tail[%d][2] = {" % len(tail))
+    for lo, hi in tail:
+        out.append("\t{ 0x%x, 0x%x }," % (lo, hi))
+    out.append("};")
+
+    with open(sys.argv[1], "w", encoding="utf-8") as file:
+        file.write("\n".join(out) + "\n")
+
+
+if __name__ == "__main__":
+    main()